@@ -108,6 +108,23 @@ void setup() {
   */
   fz.handle_ota_form(&server, ota_url);
 
+  /*
+    Optional '/update/stats' GET handler
+
+    It replies with JSON stats of the current (or the last) update:
+    time spent on waiting for data, inflating and writing flash, chunk sizes, heap usage.
+    Could be scraped to find out what is the bottleneck for the update
+  */
+  fz.provide_stats(&server, "/update/stats");
+
+  /*
+    Optional '/update/events' Server-Sent Events stream
+
+    It pushes 'progress' events with compressed/inflated bytes, throughput and ETA
+    while compressed image is being flashed, i.e. for a browser's EventSource
+  */
+  fz.provide_events(&server, "/update/events");
+
 
   /*
     If you implement you own handlers for the page/form data parsing
@@ -0,0 +1,65 @@
+#!/usr/bin/python
+
+# Prepare compressed images for FlashZ decoders benchmark
+#
+# takes all files from 'images' directory (or files given as arguments)
+# and compresses each one with a set of zlib levels, LZ4 and heatshrink into 'data' directory,
+# so it could be uploaded to LittleFS with 'pio run -t uploadfs'
+#
+# zlib image file names are suffixed with compression level and window bits if it's not 15, i.e. firmware.bin.l9.zz, firmware.bin.l9.w12.zz
+# LZ4 and heatshrink images with format name, i.e. firmware.bin.lz4, firmware.bin.w11.hs
+# segmented zlib containers for parallel decoder with segment size, i.e. firmware.bin.b32k.fzc
+#
+# original image size and CRC32 for each compressed file are written to 'images.crc', benchmark checks
+# inflated data against it
+
+import os, sys, zlib
+from os.path import basename, getsize, isfile, join
+
+sys.path.insert(0, join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'tools'))
+import fzcompress, fzpack
+
+levels = (1, 6, 9)
+zz_windows = (12, 13)       # zlib window bits for level 9 images, Inflator dictionary is 2^w bytes
+hs_windows = (8, 11)        # heatshrink window bits, decoder RAM is 2^w bytes
+seg_sizes = (16384, 32768)  # parallel decoder segment size, decoder RAM is about 2 * (2 * segment + 11k)
+src_dir = 'images'
+dst_dir = 'data'
+crc_file = 'images.crc'
+crcs = []                   # (compressed file name, image size, image crc32)
+
+def compress(imgfile, fmt, suffix, segment = 0, **kwargs):
+    dst = join(dst_dir, "%s.%s" % (basename(imgfile), suffix))
+    with open(imgfile, 'rb') as img:
+        data = img.read()
+    with open(dst, 'wb') as packed:
+        if segment:
+            packed.write(fzpack.pack(data, fmt, kwargs.get('level', 9), segment)[0])
+        else:
+            packed.write(fzcompress.compress(data, fmt, **kwargs))
+    crcs.append((basename(dst), len(data), zlib.crc32(data) & 0xffffffff))
+    print("%s: %s, %d -> %d bytes, ratio %.1f%%" % (basename(imgfile), suffix, getsize(imgfile), getsize(dst), (1 - float(getsize(dst)) / getsize(imgfile)) * 100))
+
+files = sys.argv[1:]
+if not files and os.path.isdir(src_dir):
+    files = [join(src_dir, f) for f in sorted(os.listdir(src_dir)) if isfile(join(src_dir, f))]
+
+if not files:
+    print("No images found, pls put your firmware/fs images into '%s' directory" % src_dir)
+    sys.exit(1)
+
+os.makedirs(dst_dir, exist_ok=True)
+for f in files:
+    for l in levels:
+        compress(f, 'zz', "l%d.zz" % l, level = l)
+    for w in zz_windows:
+        compress(f, 'zz', "l9.w%d.zz" % w, level = 9, window_bits = w)
+    compress(f, 'lz4', 'lz4')
+    for w in hs_windows:
+        compress(f, 'hs', "w%d.hs" % w, window_bits = w, lookahead_bits = 4)
+    for b in seg_sizes:
+        compress(f, 'zz', "b%dk.fzc" % (b // 1024), segment = b, level = 9)
+
+with open(join(dst_dir, crc_file), 'w') as f:
+    for c in crcs:
+        f.write("%s %d %08x\n" % c)
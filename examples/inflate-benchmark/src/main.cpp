@@ -0,0 +1,382 @@
+/*
+    ESP32-FlashZ library
+
+    This code implements a library for ESP32-xx family chips and provides an
+    ability to upload zlib compressed firmware images during OTA updates.
+
+    It derives from Arduino's UpdaterClass and uses in-ROM miniz decompressor to inflate
+    libz compressed data during firmware flashing process
+
+    Copyright (C) Emil Muratov, 2022
+    GitHub: https://github.com/vortigont/esp32-flashz
+
+    Lib code based on esptool's implementation https://github.com/espressif/esptool/
+    so it inherits it's GPL-2.0 license
+
+ *  This program or library is free software; you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License version 2 for more details.
+ *
+ *  You should have received a copy of the GNU General Public License version 2
+ *  along with this library; if not, get one at
+ *  https://opensource.org/licenses/GPL-2.0
+ */
+
+
+
+/*
+ Inflator benchmark
+
+ Measures decompression throughput of FlashZ's decoders (zlib, LZ4, heatshrink) for a set of compressed images
+ stored on LittleFS. No flash writes are made, callback only computes CRC32 of inflated data to check it against
+ the original image, time spent in callback is not accounted. So the numbers reflect decoder performance only
+ and could be tracked from release to release.
+
+ - put your firmware/fs images into 'images' directory of this project
+ - run 'python mkimages.py' to compress it with different formats/levels into 'data' directory
+ - upload FS image 'pio run -t uploadfs'
+ - build and upload the benchmark 'pio run -t upload -t monitor'
+
+ Results are printed in CSV format, one line per image/mode/chunk combination
+*/
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include <utility>
+#include <vector>
+#include "flashz.hpp"
+
+
+#define BAUD_RATE       115200  // serial port baud rate
+#define BENCH_RUNS      5       // number of runs for each test, median value is reported
+#define BENCH_MAX_RUNS  9
+#define BENCH_OTA_RUNS  3       // number of runs for OTA test, each run writes the whole image to flash
+#define BENCH_CRC_FILE  "/images.crc"   // CRC32 of original images, made by mkimages.py
+
+
+/**
+ * @brief Stream wrapper that mimics a tcp socket
+ * it never reports more than 'segment' bytes available, same as a socket
+ * that receives data in MSS-sized packets
+ */
+class SegmentedStream : public Stream {
+    Stream &src;
+    size_t segment;
+    size_t left;
+
+public:
+    SegmentedStream(Stream &s, size_t segment_size) : src(s), segment(segment_size), left(segment_size) {}
+
+    int available() override {
+        int a = src.available();
+        if (a <= 0) return a;
+        if (!left) left = segment;          // next "packet" has arrived
+        return (size_t)a < left ? a : left;
+    }
+    using Stream::readBytes;
+    int read() override { if (left) --left; return src.read(); }
+    int peek() override { return src.peek(); }
+    size_t readBytes(uint8_t *buffer, size_t length) override {
+        size_t len = src.readBytes(buffer, length);
+        left = len < left ? left - len : 0;
+        return len;
+    }
+    size_t write(uint8_t) override { return 0; }
+    void flush() override {}
+};
+
+struct bench_result_t {
+    uint32_t time_us;           // time spent in inflator calls, w/o callback
+    uint32_t callbacks;         // number of callback calls
+    size_t in_bytes;
+    size_t out_bytes;
+    size_t heap_peak;           // max heap consumed during inflate
+    uint32_t crc;               // CRC32 of inflated data
+    size_t delivered;           // inflated bytes passed to callback
+    bool contiguous;            // callback got data in order w/o gaps
+    int err;
+};
+
+static size_t heap_base, heap_min;
+
+// callback accounts inflated data and it's CRC32, tracking min free heap
+static uint32_t cb_count, cb_crc, cb_us;
+static size_t cb_bytes;
+static bool cb_contiguous;
+
+static void cb_reset(){
+    cb_count = cb_crc = cb_us = 0;
+    cb_bytes = 0;
+    cb_contiguous = true;
+}
+
+static int bench_cb(size_t index, const uint8_t* data, size_t size, bool final){
+    int64_t t = esp_timer_get_time();
+    ++cb_count;
+    if (index != cb_bytes) cb_contiguous = false;
+    cb_crc = fz_crc32_le(cb_crc, data, size);
+    cb_bytes += size;
+    size_t f = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    if (f < heap_min) heap_min = f;
+    cb_us += esp_timer_get_time() - t;
+    return size;
+}
+
+static void cb_result(bench_result_t &r, uint32_t elapsed){
+    r.time_us = elapsed - cb_us;
+    r.callbacks = cb_count;
+    r.crc = cb_crc;
+    r.delivered = cb_bytes;
+    r.contiguous = cb_contiguous;
+}
+
+// original image size and CRC32 for each compressed file
+struct image_crc_t {
+    String name;
+    size_t size;
+    uint32_t crc;
+};
+
+static std::vector<image_crc_t> crcs;
+
+// read "name size crc32" lines made by mkimages.py
+static void load_crcs(){
+    File f = LittleFS.open(BENCH_CRC_FILE);
+    if (!f){
+        Serial.println("no " BENCH_CRC_FILE " found, inflated data is not verified, pls re-run mkimages.py");
+        return;
+    }
+    while (f.available()){
+        String line = f.readStringUntil('\n');
+        int s1 = line.indexOf(' '), s2 = line.lastIndexOf(' ');
+        if (s1 <= 0 || s2 <= s1) continue;
+        crcs.push_back({ line.substring(0, s1), strtoul(line.substring(s1 + 1, s2).c_str(), NULL, 10), strtoul(line.substring(s2 + 1).c_str(), NULL, 16) });
+    }
+    f.close();
+}
+
+static const image_crc_t* find_crc(const String &name){
+    for (const auto &c : crcs)
+        if (c.name == name) return &c;
+    return nullptr;
+}
+
+/**
+ * @brief inflate file by feeding decoder with blocks of 'blksize' bytes,
+ * same way as web server upload handlers do
+ * if 'tpl' is set, callback is passed via templated inflate_block_to() instead of std::function
+ * if 'par' is set, containers with segment index are inflated by parallel decoder
+ */
+static bench_result_t bench_block(File &f, size_t blksize, size_t chunk_size, bool tpl = false, bool par = false){
+    bench_result_t r{};
+    uint8_t *buff = (uint8_t*)malloc(blksize);
+    if (!buff){ r.err = MZ_MEM_ERROR; return r; }
+
+    Unpacker deco;      // picks a decoder by image magic
+    deco.parallel(par);
+    cb_reset();
+    f.seek(0);
+    heap_base = heap_min = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    if (!deco.init()){ free(buff); r.err = MZ_MEM_ERROR; return r; }
+
+    size_t left = f.size();
+    uint64_t elapsed = 0;
+    while (left){
+        size_t len = f.read(buff, left < blksize ? left : blksize);
+        if (!len){ r.err = MZ_STREAM_ERROR; break; }
+        left -= len;
+        int64_t t = esp_timer_get_time();
+        r.err = tpl ? deco.inflate_block_to(buff, len, [](size_t i, const uint8_t* d, size_t s, bool fin) -> int { return bench_cb(i, d, s, fin); }, !left, chunk_size)
+                    : deco.inflate_block_to_cb(buff, len, bench_cb, !left, chunk_size);
+        elapsed += esp_timer_get_time() - t;
+        if (r.err < 0) break;
+    }
+
+    deco_stat_t s;
+    deco.getstat(s);
+    deco.end();
+    free(buff);
+
+    cb_result(r, elapsed);
+    r.in_bytes = s.in_bytes;
+    r.out_bytes = s.out_bytes;
+    r.heap_peak = heap_base - heap_min;
+    return r;
+}
+
+/**
+ * @brief inflate file via decoder's stream interface, file is read in MSS-sized segments
+ * NOTE: FS read time is included into results
+ */
+static bench_result_t bench_stream(File &f, size_t segment, size_t chunk_size){
+    bench_result_t r{};
+    Unpacker deco;      // picks a decoder by image magic
+    cb_reset();
+    f.seek(0);
+    heap_base = heap_min = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    if (!deco.init()){ r.err = MZ_MEM_ERROR; return r; }
+
+    SegmentedStream s(f, segment);
+    int64_t t = esp_timer_get_time();
+    r.err = deco.inflate_stream_to_cb(s, f.size(), bench_cb, chunk_size);
+    cb_result(r, esp_timer_get_time() - t);
+
+    deco_stat_t st;
+    deco.getstat(st);
+    deco.end();
+
+    r.in_bytes = st.in_bytes;
+    r.out_bytes = st.out_bytes;
+    r.heap_peak = heap_base - heap_min;
+    return r;
+}
+
+/**
+ * @brief run the real OTA process with image from file, flashing it to the next OTA partition
+ * the update is aborted in the end, so the boot partition stays untouched
+ * NOTE: FS read time is included into results
+ */
+static bench_result_t bench_ota(File &f, size_t blksize, bool pipelined, bool direct = false, bool flashwin = false){
+    bench_result_t r{};
+    uint8_t *buff = (uint8_t*)malloc(blksize);
+    if (!buff){ r.err = MZ_MEM_ERROR; return r; }
+
+    FlashZ &fz = FlashZ::getInstance();
+    fz.pipeline(pipelined);
+    fz.directwrite(direct);
+    fz.flashwindow(flashwin);
+    f.seek(0);
+    heap_base = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+    int64_t t = esp_timer_get_time();
+    if (!fz.beginz(UPDATE_SIZE_UNKNOWN, U_FLASH)){ free(buff); r.err = MZ_MEM_ERROR; return r; }
+    heap_min = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+    size_t left = f.size();
+    r.err = MZ_STREAM_END;
+    while (left){
+        size_t len = f.read(buff, left < blksize ? left : blksize);
+        left -= len;
+        if (!len || fz.writez(buff, len, !left) != len){ r.err = MZ_ERRNO; break; }
+    }
+
+    deco_stat_t s;
+    fz.getstat(s);
+    fz.abortz();                // flushes pipelined writer, if any
+    r.time_us = esp_timer_get_time() - t;
+    free(buff);
+
+    r.in_bytes = s.in_bytes;
+    r.out_bytes = s.out_bytes;
+    r.heap_peak = heap_base - heap_min;
+    fz.pipeline(false);
+    fz.directwrite(false);
+    fz.flashwindow(false);
+    return r;
+}
+
+/**
+ * @brief print median run
+ * 'ref' is original image size/CRC32 to check inflated data of each run against, nullptr if not known
+ */
+static void report(const char *img, const char *mode, size_t blksize, size_t chunk_size, bench_result_t *runs, int n, const image_crc_t *ref = nullptr){
+    // every run must deliver an intact image, a broken inflate could be faster than a correct one
+    const char *crc = "-";
+    if (ref){
+        crc = "ok";
+        for (int i = 0; i != n; ++i)
+            if (!runs[i].contiguous || runs[i].delivered != ref->size || runs[i].crc != ref->crc) crc = "FAIL";
+    }
+
+    // pick the median run by time
+    for (int i = 1; i < n; ++i)
+        for (int j = i; j && runs[j].time_us < runs[j-1].time_us; --j)
+            std::swap(runs[j], runs[j-1]);
+
+    bench_result_t &r = runs[n/2];
+    float mbps = r.time_us ? (float)r.out_bytes / r.time_us : 0;       // bytes per us == MB/s
+    Serial.printf("%s,%s,%u,%u,%u,%u,%u,%.3f,%u,%u,%d,%s\n", img, mode, blksize, chunk_size, r.in_bytes, r.out_bytes, r.time_us, mbps, r.callbacks, r.heap_peak, r.err, crc);
+}
+
+static const size_t blk_sizes[] = { 1436, 4096 };                           // HTTPUpload buffer and a sector-sized block
+static const size_t chunk_sizes[] = { 1024, SPI_FLASH_SEC_SIZE, FLASH_CHUNK_SIZE, 4*SPI_FLASH_SEC_SIZE, TINFL_LZ_DICT_SIZE };
+
+void setup() {
+  Serial.begin(BAUD_RATE);
+  delay(1000);
+  Serial.printf("\nFlashZ Inflator benchmark, build: %s %s, CPU: %u MHz\n", __DATE__, __TIME__, getCpuFrequencyMhz());
+
+  if (!LittleFS.begin()){
+    Serial.println("LittleFS mount failed, pls upload FS image with compressed files");
+    return;
+  }
+
+  load_crcs();
+  Serial.println("image,mode,block,chunk,in_bytes,out_bytes,time_us,MB/s,callbacks,heap_peak,err,crc");
+
+  File root = LittleFS.open("/");
+  File f;
+  while ((f = root.openNextFile())){
+    String name(f.name());
+    if (!name.endsWith(".zz") && !name.endsWith(".lz4") && !name.endsWith(".hs") && !name.endsWith(".fzc")) continue;
+
+    const image_crc_t *ref = find_crc(name);
+    bench_result_t runs[BENCH_MAX_RUNS];
+    for (auto chunk : chunk_sizes){
+      for (auto blk : blk_sizes){
+        for (int i = 0; i != BENCH_RUNS; ++i)
+          runs[i] = bench_block(f, blk, chunk);
+        report(name.c_str(), "block", blk, chunk, runs, BENCH_RUNS, ref);
+
+        for (int i = 0; i != BENCH_RUNS; ++i)
+          runs[i] = bench_block(f, blk, chunk, true);
+        report(name.c_str(), "block-tpl", blk, chunk, runs, BENCH_RUNS, ref);
+
+        // segmented containers, same stream is inflated by parallel decoder
+        if (name.endsWith(".fzc")){
+          for (int i = 0; i != BENCH_RUNS; ++i)
+            runs[i] = bench_block(f, blk, chunk, false, true);
+          report(name.c_str(), "block-par", blk, chunk, runs, BENCH_RUNS, ref);
+        }
+      }
+
+      for (int i = 0; i != BENCH_RUNS; ++i)
+        runs[i] = bench_stream(f, 1436, chunk);
+      report(name.c_str(), "stream", 1436, chunk, runs, BENCH_RUNS, ref);
+    }
+
+    // end-to-end OTA time, only for fw images
+    if (name.startsWith("firmware")){
+      for (int i = 0; i != BENCH_OTA_RUNS; ++i)
+        runs[i] = bench_ota(f, 4096, false);
+      report(name.c_str(), "ota", 4096, 0, runs, BENCH_OTA_RUNS);
+
+      for (int i = 0; i != BENCH_OTA_RUNS; ++i)
+        runs[i] = bench_ota(f, 4096, true);
+      report(name.c_str(), "ota-pipe", 4096, FZ_PIPE_BUFF_SIZE, runs, BENCH_OTA_RUNS);
+
+      // RAM dictionary vs history read back from flash, both with direct partition writer
+      for (int i = 0; i != BENCH_OTA_RUNS; ++i)
+        runs[i] = bench_ota(f, 4096, false, true);
+      report(name.c_str(), "ota-direct", 4096, 0, runs, BENCH_OTA_RUNS);
+
+      for (int i = 0; i != BENCH_OTA_RUNS; ++i)
+        runs[i] = bench_ota(f, 4096, false, true, true);
+      report(name.c_str(), "ota-fwin", 4096, 0, runs, BENCH_OTA_RUNS);
+    }
+    f.close();
+  }
+
+  Serial.println("Benchmark done");
+}
+
+void loop() {
+  delay(1000);
+}
@@ -0,0 +1,223 @@
+/*
+    ESP32-FlashZ library
+
+    This code implements a library for ESP32-xx family chips and provides an
+    ability to upload zlib compressed firmware images during OTA updates.
+
+    multi-image bundle parser, bundles are generated with tools/fzbundle.py
+
+    Copyright (C) Emil Muratov, 2022
+    GitHub: https://github.com/vortigont/esp32-flashz
+
+ *  This program or library is free software; you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License version 2 for more details.
+ *
+ *  You should have received a copy of the GNU General Public License version 2
+ *  along with this library; if not, get one at
+ *  https://opensource.org/licenses/GPL-2.0
+ */
+
+#include "flashz.hpp"
+
+#ifdef ARDUINO
+#include "esp32-hal-log.h"
+#else
+#include "esp_log.h"
+#endif
+
+// ESP32 log tag
+static const char *TAG __attribute__((unused)) = "FZ-BUNDLE";
+
+#define FZ_BUNDLE_BUFF_SIZE     (FZ_BUNDLE_HDR_SIZE + FZ_BUNDLE_MAX_IMAGES * FZ_BUNDLE_ENTRY_SIZE + FZ_SIG_MAX_LEN)
+
+
+// Bundle class implementation
+bool Bundle::init(){
+    if (!hdr)
+        hdr = (uint8_t*)malloc(FZ_BUNDLE_BUFF_SIZE);
+    reset();
+    return hdr;
+}
+
+void Bundle::reset(){
+    deco.end();
+    state = state_t::header;
+    hdr_len = 0;
+    hdr_need = FZ_BUNDLE_HDR_SIZE;
+    sig_len = count = idx = left = img_out = 0;
+    img_feeds = 0;
+    total_in = total_out = 0;
+    wait_us = wdt_feeds = 0;
+}
+
+void Bundle::end(){
+    reset();
+    free(hdr);
+    hdr = nullptr;
+}
+
+void Bundle::getstat(deco_stat_t &stat){
+    deco_stat_t d;
+    deco.getstat(d);        // current image decoder
+
+    stat.in_bytes = total_in;
+    stat.out_bytes = total_out + (state == state_t::image && (img[idx].flags & FZ_BUNDLE_COMPRESSED) ? d.out_bytes : img_out);
+    stat.wait_us = wait_us;
+    stat.wdt_feeds = img_feeds + d.wdt_feeds;
+}
+
+int Bundle::header(){
+    switch (state){
+        case state_t::header : {
+            if (memcmp(hdr, FZ_BUNDLE_MAGIC, sizeof(FZ_BUNDLE_MAGIC) - 1)){
+                ESP_LOGE(TAG, "not a bundle");
+                return MZ_DATA_ERROR;
+            }
+            count = hdr[4];
+            sig_len = fz_get_le16(hdr + 6);
+            if (!count || count > FZ_BUNDLE_MAX_IMAGES || sig_len > FZ_SIG_MAX_LEN){
+                ESP_LOGE(TAG, "unsupported bundle, images:%u, sig len:%u", count, sig_len);
+                return MZ_DATA_ERROR;
+            }
+            state = state_t::manifest;
+            hdr_need += count * FZ_BUNDLE_ENTRY_SIZE;
+            return MZ_OK;
+        }
+
+        case state_t::manifest : {
+            const uint8_t *e = hdr + FZ_BUNDLE_HDR_SIZE;
+            if (fz_crc32_le(0, e, count * FZ_BUNDLE_ENTRY_SIZE) != fz_get_le32(hdr + 8)){
+                ESP_LOGE(TAG, "bundle manifest crc mismatch");
+                return MZ_DATA_ERROR;
+            }
+
+            for (size_t i = 0; i != count; ++i, e += FZ_BUNDLE_ENTRY_SIZE){
+                img[i].target = e[0];
+                img[i].flags = e[1];
+                memcpy(img[i].label, e + 4, FZ_BUNDLE_LABEL_LEN);
+                img[i].label[FZ_BUNDLE_LABEL_LEN] = 0;
+                img[i].size = fz_get_le32(e + 20);
+                img[i].img_size = fz_get_le32(e + 24);
+                memcpy(img[i].sha256, e + 28, FZ_SHA256_SIZE);
+                if (img[i].target > FZ_BUNDLE_DATA || !img[i].size){
+                    ESP_LOGE(TAG, "bad bundle image %u", i);
+                    return MZ_DATA_ERROR;
+                }
+                ESP_LOGI(TAG, "image %u: target:%u, label:'%s', flags:%02x, size:%u/%u", i, img[i].target, img[i].label, img[i].flags, img[i].size, img[i].img_size);
+            }
+            state = state_t::signature;
+            hdr_need += sig_len;
+            if (sig_len)
+                return MZ_OK;
+        }
+        // fall through, nothing to collect for unsigned bundle
+
+        case state_t::signature :
+            if (hook && !hook(fz_bundle_evt_t::manifest, nullptr))
+                return MZ_DATA_ERROR;
+            idx = 0;
+            state = state_t::image;
+            left = img[0].size;
+            return (hook && !hook(fz_bundle_evt_t::begin, &img[0])) ? MZ_DATA_ERROR : MZ_OK;
+
+        default:
+            return MZ_STREAM_ERROR;
+    }
+}
+
+int Bundle::next(){
+    deco_stat_t d;
+    deco.getstat(d);
+    if (img[idx].flags & FZ_BUNDLE_COMPRESSED){
+        img_out = d.out_bytes;
+        img_feeds += d.wdt_feeds;
+    }
+    deco.end();
+
+    if (img_out != img[idx].img_size){
+        ESP_LOGE(TAG, "image %u size mismatch: %u/%u", idx, img_out, img[idx].img_size);
+        return MZ_DATA_ERROR;
+    }
+    total_out += img_out;
+    img_out = 0;
+
+    if (hook && !hook(fz_bundle_evt_t::end, &img[idx]))
+        return MZ_DATA_ERROR;
+
+    if (++idx == count){
+        state = state_t::done;
+        return MZ_STREAM_END;
+    }
+
+    left = img[idx].size;
+    return (hook && !hook(fz_bundle_evt_t::begin, &img[idx])) ? MZ_DATA_ERROR : MZ_OK;
+}
+
+int Bundle::raw(const uint8_t *data, size_t len, inflate_cb_t &callback, bool last){
+    // stored images are passed in chunks as they arrive, output alignment does not apply here.
+    // callback is allowed to consume only a part of data
+    while (len){
+        int consumed = callback(img_out, data, len, last);
+        if (consumed <= 0 || (size_t)consumed > len)
+            return MZ_STREAM_ERROR;
+        data += consumed;
+        len -= consumed;
+        img_out += consumed;
+    }
+    return MZ_OK;
+}
+
+int Bundle::inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final, size_t chunk_size){
+    int err = MZ_OK;
+    while (len && state != state_t::done){
+        if (state != state_t::image){
+            // collect header, manifest and signature
+            size_t n = (hdr_need - hdr_len < len) ? hdr_need - hdr_len : len;
+            memcpy(hdr + hdr_len, inBuff, n);
+            hdr_len += n;
+            inBuff += n;
+            len -= n;
+            total_in += n;
+            if (hdr_len == hdr_need && (err = header()) < 0)
+                return err;
+            continue;
+        }
+
+        size_t n = (left < len) ? left : len;
+        bool last = (n == left);
+        if (img[idx].flags & FZ_BUNDLE_COMPRESSED){
+            if (left == img[idx].size)
+                deco.init();            // the first block of image
+            err = deco.inflate_block_to_cb(inBuff, n, callback, last, chunk_size);
+            if (err >= 0 && last && err != MZ_STREAM_END){
+                ESP_LOGE(TAG, "image %u compressed data is truncated", idx);
+                err = MZ_DATA_ERROR;
+            }
+        } else {
+            err = raw(inBuff, n, callback, last);
+        }
+        if (err < 0)
+            return err;
+
+        inBuff += n;
+        len -= n;
+        total_in += n;
+        left -= n;
+        if (!left && (err = next()) < 0)
+            return err;
+    }
+
+    // anything past the last image is ignored
+    total_in += len;
+
+    if (state == state_t::done)
+        return MZ_STREAM_END;
+
+    return final ? MZ_DATA_ERROR : MZ_OK;
+}
@@ -0,0 +1,177 @@
+/*
+    ESP32-FlashZ library
+
+    This code implements a library for ESP32-xx family chips and provides an
+    ability to upload zlib compressed firmware images during OTA updates.
+
+    heatshrink stream decoder, compatible with https://github.com/atomicobject/heatshrink encoder
+
+    Copyright (C) Emil Muratov, 2022
+    GitHub: https://github.com/vortigont/esp32-flashz
+
+ *  This program or library is free software; you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License version 2 for more details.
+ *
+ *  You should have received a copy of the GNU General Public License version 2
+ *  along with this library; if not, get one at
+ *  https://opensource.org/licenses/GPL-2.0
+ */
+
+#ifndef FZ_NO_HEATSHRINK
+
+#include "flashz.hpp"
+
+#ifdef ARDUINO
+#include "esp32-hal-log.h"
+#else
+#include "esp_log.h"
+#endif
+
+// ESP32 log tag
+static const char *TAG __attribute__((unused)) = "FZ-HS";
+
+
+// HsDecoder class implementation
+bool HsDecoder::init(){
+    reset();        // window is allocated once stream header is parsed
+    return true;
+}
+
+void HsDecoder::reset(){
+    state = state_t::header;
+    hdr_cnt = 0;
+    bits = 0;
+    nbits = 0;
+    total_in = total_out = 0;
+    win_reset();
+}
+
+void HsDecoder::end(){
+    win_free();
+}
+
+bool HsDecoder::header(){
+    if (memcmp(hdr, HS_HEADER, sizeof(HS_HEADER) - 1)){
+        ESP_LOGE(TAG, "bad heatshrink header");
+        return false;
+    }
+
+    window_bits = hdr[3] >> 4;
+    lookahead_bits = hdr[3] & 0x0F;
+    out_size = fz_get_le32(hdr + 4);
+
+    if (window_bits < HS_MIN_WINDOW_BITS || window_bits > HS_MAX_WINDOW_BITS || lookahead_bits < HS_MIN_LOOKAHEAD_BITS || lookahead_bits >= window_bits){
+        ESP_LOGE(TAG, "bad heatshrink params, w:%u, l:%u", window_bits, lookahead_bits);
+        return false;
+    }
+
+    if (!win_alloc(1 << window_bits)){
+        ESP_LOGE(TAG, "Can't allocate window");
+        return false;
+    }
+
+    ESP_LOGD(TAG, "heatshrink stream, w:%u, l:%u, size:%u", window_bits, lookahead_bits, out_size);
+    return true;
+}
+
+int HsDecoder::inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final, size_t chunk_size){
+    const uint8_t *data = inBuff;
+    size_t left = len;
+
+    if (state == state_t::header){
+        size_t n = (HS_HEADER_SIZE - hdr_cnt < left) ? HS_HEADER_SIZE - hdr_cnt : left;
+        memcpy(hdr + hdr_cnt, data, n);
+        hdr_cnt += n;
+        data += n;
+        left -= n;
+        total_in += n;
+        if (hdr_cnt < HS_HEADER_SIZE)
+            return final ? MZ_STREAM_ERROR : MZ_OK;
+
+        if (!header())
+            return MZ_DATA_ERROR;
+
+        state = out_size ? state_t::tag : state_t::done;
+    }
+
+    if (state == state_t::done)
+        return MZ_STREAM_END;
+
+    win_cb(&callback, chunk_size);
+
+    const uint8_t *body = data;
+    int err = MZ_OK;
+    while (state != state_t::done){
+        uint8_t need;
+        switch (state){
+            case state_t::tag :     need = 1; break;
+            case state_t::literal : need = 8; break;
+            case state_t::index :   need = window_bits; break;
+            default :               need = lookahead_bits;
+        }
+
+        // bits are packed MSB first
+        while (nbits < need && left){
+            bits = (bits << 8) | *data++;
+            nbits += 8;
+            --left;
+        }
+        if (nbits < need)
+            break;      // need more input
+
+        nbits -= need;
+        uint32_t v = (bits >> nbits) & ((1U << need) - 1);
+
+        switch (state){
+            case state_t::tag :
+                state = v ? state_t::literal : state_t::index;
+                break;
+            case state_t::literal :
+                if (!win_put(v))
+                    err = MZ_ERRNO;
+                state = state_t::tag;
+                break;
+            case state_t::index :
+                index = v + 1;
+                state = state_t::count;
+                break;
+            default : {
+                size_t count = v + 1;
+                if (index > total_out || count > out_size - total_out){
+                    ESP_LOGE(TAG, "bad backref, index:%u, count:%u", index, count);
+                    err = MZ_DATA_ERROR;
+                    break;
+                }
+                if (!win_copy(index, count))
+                    err = MZ_ERRNO;
+                state = state_t::tag;
+            }
+        }
+        if (err != MZ_OK)
+            break;
+
+        if (total_out == out_size)
+            state = state_t::done;      // the rest of the last byte is padding
+    }
+
+    total_in += data - body;
+
+    if (err < 0){
+        ESP_LOGW(TAG, "decode failure - MZ_ERR: %d, tin:%u, tout:%u", err, total_in, total_out);
+        return err;
+    }
+
+    if (state == state_t::done)
+        return win_flush(true) ? MZ_STREAM_END : MZ_ERRNO;
+
+    // if we demand it's a final call, than something must be wrong with a stream
+    return final ? MZ_STREAM_ERROR : MZ_OK;
+}
+
+#endif  // FZ_NO_HEATSHRINK
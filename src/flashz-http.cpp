@@ -29,6 +29,7 @@
 
 #include "flashz-http.hpp"
 #include "flashz.hpp"
+#include "esp_task_wdt.h"
 
 #ifdef CONFIG_IDF_TARGET_ESP32C3
 #define FZ_NOHTTPCLIENT
@@ -47,6 +48,11 @@
 #include <HTTPClient.h>
 #endif  // FZ_NOHTTPCLIENT
 
+#ifdef FZ_WITH_ASYNCSRV
+#include "lwip/tcpip.h"
+#include "lwip/priv/tcp_priv.h"         // tcp_active_pcbs
+#endif  // FZ_WITH_ASYNCSRV
+
 #ifdef ARDUINO
 #include "esp32-hal-log.h"
 #else
@@ -56,6 +62,10 @@
 // ESP32 log tag
 static const char *TAG __attribute__((unused)) = "FZ-HTTP";
 
+#if FZ_UPLOAD_RING_SIZE & (FZ_UPLOAD_RING_SIZE - 1)
+#error "FZ_UPLOAD_RING_SIZE must be a power of 2"
+#endif
+
 static const char PGotaform[]  = R"===(
 <!DOCTYPE html><html lang='en'>
 <head>
@@ -67,8 +77,10 @@ static const char PGotaform[]  = R"===(
     <input type="radio" id="imgtype1" name="img" value="fw" checked>
     <label for="imgtype1">Firmware</label>
     <input type="radio" id="imgtype2" name="img" value="fs">
-    <label for="imgtype2">FileSystem</label><br>
-    <input type='file' accept='.bin, .zz' name="file">
+    <label for="imgtype2">FileSystem</label>
+    <input type="radio" id="imgtype3" name="img" value="patch">
+    <label for="imgtype3">Delta patch</label><br>
+    <input type='file' accept='.bin, .zz, .gz' name="file">
     <button type='submit'>Upload</button>
 </form><hr>
 <form method="post" action="#" enctype='multipart/form-data'>
@@ -84,6 +96,15 @@ static const char PGotaform[]  = R"===(
 
 static const char PGimg[]  = "img";
 static const char PGurl[]  = "url";
+static const char PGpatch[]  = "patch";
+static const char PGgzip[]  = "gzip";
+static const char PGacceptenc[]  = "Accept-Encoding";
+static const char PGcontentenc[] = "Content-Encoding";
+static const char PGtransferenc[] = "Transfer-Encoding";
+static const char PGchunked[] = "chunked";
+static const char PGrange[] = "Range";
+static const char PGcontentrange[] = "Content-Range";
+static const char PGbytes[] = "bytes";
 
 #ifndef  FZ_NOHTTPCLIENT
 void FlashZhttp::_fz_http_trigger(FlashZhttp *fz){
@@ -96,10 +117,46 @@ void FlashZhttp::_fz_http_trigger(FlashZhttp *fz){
 #endif
 
 #ifdef FZ_WITH_ASYNCSRV
+// request's own poll handler is replaced by upload hook and AsyncClient can't return it, so the hook calls it itself.
+// AsyncWebServerRequest::_onPoll() is private, explicit template instantiation is allowed to name private members
+static void fz_req_onpoll(AsyncWebServerRequest *request);
+
+template <void (AsyncWebServerRequest::*onpoll)()>
+struct fz_req_poll_t {
+    friend void fz_req_onpoll(AsyncWebServerRequest *request){ (request->*onpoll)(); }
+};
+template struct fz_req_poll_t<&AsyncWebServerRequest::_onPoll>;
+
+/**
+ * @brief fire AsyncTCP poll event of a connection, runs in lwip tcpip task
+ * pcb's poll callback is AsyncTCP's own one, it queues the event to async_tcp task, same as lwip's periodic poll does.
+ * Client pointer is only matched against pcbs' callback args, so a closed connection is just not found
+ */
+static void fz_tcp_kick(void *arg){
+    for (tcp_pcb *pcb = tcp_active_pcbs; pcb; pcb = pcb->next){
+        if (pcb->callback_arg == arg && pcb->poll){
+            pcb->poll(pcb->callback_arg, pcb);
+            return;
+        }
+    }
+}
+
 void FlashZhttp::provide_ota_form(AsyncWebServer *srv, const char* url){
     srv->on(url, HTTP_GET, [](AsyncWebServerRequest *request){ request->send(200, PGmimehtml, PGotaform); });
 }
 
+void FlashZhttp::provide_stats(AsyncWebServer *srv, const char* url){
+    srv->on(url, HTTP_GET, [](AsyncWebServerRequest *request){ request->send(200, PGmimejson, statjson()); });
+}
+
+void FlashZhttp::provide_events(AsyncWebServer *srv, const char* url, uint32_t interval){
+    if (!events){
+        events = new AsyncEventSource(url);
+        srv->addHandler(events);
+    }
+    FlashZ::getInstance().onprogress([this](const fz_progress_t &p){ _push_progress(p); }, interval);
+}
+
 void FlashZhttp::handle_ota_form(AsyncWebServer *srv, const char* url){
     srv->on(url, HTTP_POST,
         // handle form data
@@ -114,17 +171,15 @@ void FlashZhttp::handle_ota_form(AsyncWebServer *srv, const char* url){
                 return request->send(200, PGmimetxt, "Attempting OTA from URL in background");
 #endif  // FZ_NOHTTPCLIENT
             } else {
-                if (FlashZ::getInstance().hasError()) {
-                    request->send(503, PGmimetxt, "Update FAILED");
-                } else {
-                    if (rst_timeout){
-                        if (!t)
-                            t = new Ticker;
-
-                        t->once_ms(rst_timeout, [](){ ESP.restart(); });
-                    }
-                    request->send(200, PGmimetxt, "OTA complete, autoreboot in 5 sec...");
+                // upload worker could still be flashing the tail of upload, async_tcp must not wait for it,
+                // reply is sent from upload connection's poll hook then
+                if (!_up_stop(0)){
+                    up_req = request;
+                    up_req_t = millis();
+                    return;
                 }
+                _up_progress();         // worker's final report
+                _up_reply(request);
             }
         },
         // handle file upload
@@ -136,7 +191,12 @@ void FlashZhttp::file_upload(AsyncWebServerRequest *request, String filename, si
 
     // first chunk of body data
     if (!index) {
-        bool mode_z = (data[0] == ZLIB_HEADER);    // check if we have a compressed image
+        // previous upload is still being flashed or it's reply is pending
+        if (up_req || !_up_stop(0))
+            return request->send(503, PGmimetxt, "Update is in progress");
+
+        bool mode_z = FlashZ::iscompressed(data, len);     // check if we have a compressed image
+        bool bundle = FlashZ::isbundle(data, len);          // multi-image bundle carries it's own targets
 
         int type;
 
@@ -155,14 +215,52 @@ void FlashZhttp::file_upload(AsyncWebServerRequest *request, String filename, si
         // can rely on upload's size only if img is uncompressed
         // request->contentLength() return size of the whole post body, it is larger than uploaded file size
         //size_t size = (data[0] == ESP_IMAGE_HEADER_MAGIC) ? request->contentLength() : UPDATE_SIZE_UNKNOWN;
-	size_t size = UPDATE_SIZE_UNKNOWN;
+        // compressed image with a container header has it's inflated size known
+        size_t size = FlashZ::imagesize(data, len);
+
 
+        // delta patch against running firmware, it is always compressed
+        bool patch = request->hasParam(PGimg, true) && request->getParam(PGimg, true)->value() == PGpatch;
 
-        ESP_LOGI(TAG, "Updating %s, input size:%u, mode_z:%u, magic: %02X", (type == U_FLASH)? "Firmware" : "Filesystem", request->contentLength(), mode_z, data[0]);
+        ESP_LOGI(TAG, "Updating %s, input size:%u, mode_z:%u, magic: %02X", bundle ? "Bundle" : patch ? "Firmware patch" : (type == U_FLASH)? "Firmware" : "Filesystem", request->contentLength(), mode_z, data[0]);
 
-        if (!(mode_z ? FlashZ::getInstance().beginz(size, type) : FlashZ::getInstance().begin(size, type))){
+        if (bundle){
+            if (!FlashZ::getInstance().beginbundle())
+                return request->send(503, PGmimetxt, FlashZ::getInstance().errorString());
+        } else if (patch){
+            if (!mode_z || !FlashZ::getInstance().beginpatch())
+                return request->send(503, PGmimetxt, FlashZ::getInstance().errorString());
+        } else if (!(mode_z ? FlashZ::getInstance().beginz(size, type) : FlashZ::getInstance().begin(size, type))){
             return request->send(503, PGmimetxt, FlashZ::getInstance().errorString());
         }
+
+        // for progress ETA estimation, post body is a bit larger than the file, so it's approximate
+        FlashZ::getInstance().inputsize(request->contentLength());
+
+        if (up_async && !_up_start(request))
+            ESP_LOGW(TAG, "can't start upload worker, flashing from callback");
+    }
+
+    if (up_task){
+        // if worker has failed and aborted the update, the rest of upload is dropped, form handler will report an error.
+        // TCP window is throttled so that the ring never fills up, see _up_ack()
+        if (!up_err && up_ring.put(data, len) != len){
+            ESP_LOGE(TAG, "upload ring overflow, TCP receive window is larger than FZ_UPLOAD_TCP_WND");
+            up_err = true;
+        }
+
+        if (final)
+            up_final = true;
+        xSemaphoreGive(up_data);
+
+        // held ACKs are sent along with this packet's one if the ring has room, otherwise it is held too
+        // till the next upload callback or poll hook fired by worker. Nothing follows the last packet, it is acked right away
+        AsyncClient *c = request->client();
+        if (final)
+            c->ack(SIZE_MAX);
+        else if (!_up_ack(c))
+            c->ackLater();
+        return;
     }
 
     // file content data
@@ -186,71 +284,498 @@ void FlashZhttp::file_upload(AsyncWebServerRequest *request, String filename, si
     }
 }
 
+bool FlashZhttp::_up_start(AsyncWebServerRequest *request){
+    if (!up_lock)
+        up_lock = xSemaphoreCreateMutex();
+    if (!up_data)
+        up_data = xSemaphoreCreateBinary();
+    if (!up_done)
+        up_done = xSemaphoreCreateBinary();
+
+    if (!up_lock || !up_data || !up_done || !up_ring.begin(FZ_UPLOAD_RING_SIZE))
+        return false;
+
+    // drop stale signals of the previous upload
+    xSemaphoreTake(up_data, 0);
+    xSemaphoreTake(up_done, 0);
+    up_final = false;
+    up_abort = false;
+    up_err = false;
+
+    up_prg_new = false;
+
+    if (xTaskCreatePinnedToCore(FlashZhttp::_up_worker, FZ_UPLOAD_TASK_NAME, FZ_UPLOAD_TASK_STACK, this, FZ_UPLOAD_TASK_PRIO, &up_task, tskNO_AFFINITY) != pdPASS){
+        up_task = nullptr;
+        up_ring.end();
+        return false;
+    }
+
+    AsyncClient *c = request->client();
+    up_client = c;
+
+    // client object is gone after disconnect, as well as the request
+    request->onDisconnect([this, c, request](){
+        if (up_client == c){
+            up_client = nullptr;
+            up_abort = true;
+        }
+        if (up_req == request)
+            up_req = nullptr;
+        xSemaphoreGive(up_data);
+    });
+
+    // poll hook is the only call in async_tcp task for the connection once sender is throttled, worker fires it
+    // when it has drained the ring. It replaces request's own one, that pushes response data which could not be sent at once
+    c->onPoll([this, request](void *, AsyncClient *c){ _up_poll(c); fz_req_onpoll(request); }, nullptr);
+
+    return true;
+}
+
+bool FlashZhttp::_up_stop(uint32_t timeout){
+    if (!up_task)
+        return true;
+
+    // async_tcp task only checks the worker w/o waiting, destructor waits for it feeding the watchdog
+    uint32_t t = millis();
+    while (xSemaphoreTake(up_done, pdMS_TO_TICKS(timeout < 100 ? timeout : 100)) != pdTRUE){
+        if (millis() - t >= timeout)
+            return false;
+        esp_task_wdt_reset();
+    }
+
+    up_client = nullptr;
+    up_task = nullptr;
+    up_ring.end();
+    return true;
+}
+
+bool FlashZhttp::_up_ack(AsyncClient *c){
+    // sender could not have more than a TCP window of data in flight after the ACK, and the ring has room for it
+    if (!up_err && up_ring.hold(FZ_UPLOAD_TCP_WND))
+        return false;
+
+    c->ack(SIZE_MAX);           // AsyncClient clamps it to the number of bytes pending ack, multipart framing included
+    return true;
+}
+
+void FlashZhttp::_up_poll(AsyncClient *c){
+    if (c != up_client)
+        return;
+
+    _up_progress();
+    _up_ack(c);
+
+    if (!up_req)
+        return;
+
+    if (_up_stop(0)){
+        _up_progress();     // final report
+        _up_reply(up_req);
+        up_req = nullptr;
+    } else if (millis() - up_req_t > FZ_UPLOAD_END_TIMEOUT){
+        up_req->send(503, PGmimetxt, "Update is still running");
+        up_req = nullptr;
+    }
+}
+
+void FlashZhttp::_up_kick(AsyncClient *c){
+    // if lwip's message pool is exhausted, held ACKs wait for the regular poll
+    if (c && tcpip_callback(fz_tcp_kick, c) != ERR_OK)
+        ESP_LOGD(TAG, "can't fire upload poll hook");
+}
+
+void FlashZhttp::_up_progress(){
+    if (!up_lock)
+        return;         // worker has never been started
+
+    xSemaphoreTake(up_lock, portMAX_DELAY);
+    bool pending = up_prg_new;
+    fz_progress_t p = up_prg;
+    up_prg_new = false;
+    xSemaphoreGive(up_lock);
+
+    if (pending)
+        _push_progress(p);
+}
+
+void FlashZhttp::_up_reply(AsyncWebServerRequest *request){
+    if (FlashZ::getInstance().hasError() || up_err)
+        return request->send(503, PGmimetxt, "Update FAILED");
+
+    if (rst_timeout){
+        if (!t)
+            t = new Ticker;
+
+        t->once_ms(rst_timeout, [](){ ESP.restart(); });
+    }
+    request->send(200, PGmimetxt, "OTA complete, autoreboot in 5 sec...");
+}
+
+void FlashZhttp::_up_worker(void *arg){
+    FlashZhttp *fz = static_cast<FlashZhttp*>(arg);
+    FlashZ &upd = FlashZ::getInstance();
+
+    for (;;){
+        // upload data has been dropped
+        if (fz->up_err)
+            break;
+
+        // final flag is loaded before ring counters, once it's set all the data is in the ring
+        bool final = fz->up_final;
+        const uint8_t *data;
+        size_t len = fz->up_ring.peek(data);
+        bool last = final && len == fz->up_ring.used();
+
+        if (!len && !final){
+            if (fz->up_abort){
+                ESP_LOGW(TAG, "upload connection dropped");
+                fz->up_err = true;
+                break;
+            }
+            if (xSemaphoreTake(fz->up_data, pdMS_TO_TICKS(INFLATOR_STREAM_TIMEOUT_MS)) != pdTRUE && !fz->up_ring.used() && !fz->up_final){
+                ESP_LOGW(TAG, "upload stalled");
+                fz->up_err = true;
+                break;
+            }
+            continue;
+        }
+
+        if (len && upd.writez(data, len, last) != len){
+            ESP_LOGW(TAG, "OTA failed in progress: %s", upd.errorString());
+            fz->up_err = true;
+            break;
+        }
+
+        fz->up_ring.consume(len);
+
+        // upload callback has held ACKs and the ring has room for a TCP window now
+        if (fz->up_ring.release(FZ_UPLOAD_TCP_WND))
+            _up_kick(fz->up_client);
+
+        if (last){
+            if (upd.endz()){
+                ESP_LOGI(TAG, "Update Success: %u bytes", upd.progress());
+            } else {
+                ESP_LOGW(TAG, "Update failed to complete");
+                fz->up_err = true;
+            }
+            break;
+        }
+    }
+
+    if (fz->up_err && upd.isRunning())
+        upd.abortz();
+
+    // poll hook sends the deferred reply, or acks the rest of failed upload. Client is loaded before worker is reaped
+    AsyncClient *c = fz->up_client;
+    xSemaphoreGive(fz->up_done);
+    _up_kick(c);
+    vTaskDelete(NULL);
+}
+
 #endif // #ifdef FZ_WITH_ASYNC
 
 #ifndef  FZ_NOHTTPCLIENT
+/**
+ * @brief block on client's socket until it has some data to read
+ * used as a stream wait callback for FlashZ::writezStream()
+ */
+static bool fz_client_wait(WiFiClient *client, uint32_t timeout){
+    return client->connected() && FlashZ::fdwait(client->fd(), timeout);
+}
+
+/**
+ * @brief decoder for HTTP chunked transfer-encoding
+ * strips chunk-size lines and trailers from the underlying stream,
+ * only chunks payload data is available for reading
+ */
+class FzChunkedStream : public Stream {
+    enum class state_t : uint8_t {
+        size = 0,       // chunk-size hex digits
+        ext,            // chunk extension, ignored
+        size_lf,
+        data,           // chunk payload
+        data_cr,
+        data_lf,
+        trailer,        // trailer fields after the last chunk, ignored
+        trailer_lf,
+        done,
+        error
+    };
+
+    Stream &src;
+    state_t state = state_t::size;
+    size_t chunk_left = 0;          // payload bytes left in current chunk
+    bool line_empty = true;         // trailer line is empty
+
+    // parse chunk framing as long as source stream has some data
+    void parse();
+
+public:
+    FzChunkedStream(Stream &s) : src(s) {}
+
+    // last chunk and trailer has been read
+    bool done() const { return state == state_t::done; }
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    using Stream::readBytes;
+    size_t readBytes(uint8_t *buffer, size_t length) override;
+    size_t write(uint8_t) override { return 0; }
+};
+
+void FzChunkedStream::parse(){
+    while (state != state_t::data && state != state_t::done && state != state_t::error && src.available() > 0){
+        int c = src.read();
+        if (c < 0)
+            return;
+
+        switch (state){
+            case state_t::size :
+                if (isxdigit(c))
+                    chunk_left = (chunk_left << 4) | (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+                else if (c == ';' || c == ' ' || c == '\t')
+                    state = state_t::ext;
+                else if (c == '\r')
+                    state = state_t::size_lf;
+                else
+                    state = state_t::error;
+                break;
+            case state_t::ext :
+                if (c == '\r')
+                    state = state_t::size_lf;
+                break;
+            case state_t::size_lf :
+                if (c != '\n')
+                    state = state_t::error;
+                else
+                    state = chunk_left ? state_t::data : state_t::trailer;     // zero-sized chunk is the last one
+                break;
+            case state_t::data_cr :
+                state = (c == '\r') ? state_t::data_lf : state_t::error;
+                break;
+            case state_t::data_lf :
+                state = (c == '\n') ? state_t::size : state_t::error;
+                break;
+            case state_t::trailer :
+                if (c == '\r')
+                    state = state_t::trailer_lf;
+                else
+                    line_empty = false;
+                break;
+            case state_t::trailer_lf :
+                if (c != '\n')
+                    state = state_t::error;
+                else if (line_empty)
+                    state = state_t::done;      // empty line terminates the message
+                else {
+                    line_empty = true;
+                    state = state_t::trailer;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (state == state_t::error)
+        ESP_LOGW(TAG, "bad chunked encoding");
+}
+
+int FzChunkedStream::available(){
+    parse();
+    if (state != state_t::data)
+        return 0;
+
+    int a = src.available();
+    return (a > 0 && (size_t)a > chunk_left) ? chunk_left : a;
+}
+
+int FzChunkedStream::read(){
+    if (available() <= 0)
+        return -1;
+
+    int c = src.read();
+    if (c >= 0 && !--chunk_left)
+        state = state_t::data_cr;
+    return c;
+}
+
+int FzChunkedStream::peek(){
+    return available() > 0 ? src.peek() : -1;
+}
+
+size_t FzChunkedStream::readBytes(uint8_t *buffer, size_t length){
+    size_t total = 0;
+    while (total < length){
+        int a = available();
+        if (a <= 0)
+            break;
+
+        size_t len = src.readBytes(buffer + total, ((size_t)a < length - total) ? a : length - total);
+        if (!len)
+            break;
+
+        chunk_left -= len;
+        if (!chunk_left)
+            state = state_t::data_cr;
+        total += len;
+    }
+    return total;
+}
+
 fz_http_err_t FlashZhttp::_http_get(const char* url, int imgtype){
     if (!url)
         return fz_http_err_t::bad_param;
 
     ESP_LOGI(TAG, "Update from URL:%s", url);
 
+    fz_http_err_t err = _http_fetch(url, imgtype, 0);
+
+    // connection has dropped in the middle of compressed stream, try to continue from where it has stalled
+    for (unsigned i = 0; err == fz_http_err_t::stalled && i < resume_retry; ++i){
+        size_t offset = FlashZ::getInstance().resumeoffset();
+        if (!offset)
+            break;
+
+        ESP_LOGW(TAG, "stream stalled at %u, resume attempt %u of %u", offset, i+1, resume_retry);
+        delay(FZ_HTTP_RESUME_DELAY);
+        err = _http_fetch(url, imgtype, offset);
+    }
+
+    if (err != fz_http_err_t::ok){
+        if (FlashZ::getInstance().isRunning())
+            FlashZ::getInstance().abortz();
+        return err == fz_http_err_t::stalled ? fz_http_err_t::write_err : err;
+    }
+
+    if(FlashZ::getInstance().endz()){
+        ESP_LOGI(TAG, "Update Success: %u bytes", FlashZ::getInstance().progress());
+    } else {
+        ESP_LOGW(TAG, "Update failed to complete");
+    }
+
+    if (rst_timeout){
+        if (!t)
+            t = new Ticker;
+
+        t->once_ms(rst_timeout, [](){ ESP.restart(); });
+    }
+
+    return fz_http_err_t::ok;
+}
+
+fz_http_err_t FlashZhttp::_http_fetch(const char* url, int imgtype, size_t offset){
     HTTPClient http;
     http.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
 
     http.begin(url);
+    // let the server send gzip encoded content, it will be inflated on the fly,
+    // an already compressed image must not be encoded once more, that is checked on the first inflated bytes
+    http.addHeader(PGacceptenc, PGgzip);
+    if (offset)
+        http.addHeader(PGrange, String(PGbytes) + '=' + offset + '-');
+    const char *hdrs[] = { PGcontentenc, PGtransferenc, PGcontentrange };
+    http.collectHeaders(hdrs, 3);
     int httpCode = http.GET();
 
-    if(httpCode != HTTP_CODE_OK){
+    if(httpCode != (offset ? HTTP_CODE_PARTIAL_CONTENT : HTTP_CODE_OK)){
         ESP_LOGW(TAG, "http err, reply code:%d", httpCode);
         return fz_http_err_t::httpcode_err;
     }
 
-    int len = http.getSize();
-    if ( len <= 0){
-        ESP_LOGW(TAG, "http bad file size:%d", len);      // -1 for chunked reply is not supported
+    // server must resume from exactly the same offset
+    if (offset && !http.header(PGcontentrange).startsWith(String(PGbytes) + ' ' + offset + '-')){
+        ESP_LOGW(TAG, "http bad range:%s", http.header(PGcontentrange).c_str());
         return fz_http_err_t::bad_size;
     }
 
-    WiFiClient *stream = http.getStreamPtr();
-    if (!stream){
+    int len = http.getSize();       // -1 for chunked or close-delimited reply
+    if (!len){
+        ESP_LOGW(TAG, "http bad file size:%d", len);
+        return fz_http_err_t::bad_size;
+    }
+
+    WiFiClient *client = http.getStreamPtr();
+    if (!client){
         http.end();
         ESP_LOGW(TAG, "bad http stream");
         return fz_http_err_t::bad_stream;
     }
 
-    bool mode_z = (stream->peek() == ZLIB_HEADER);          // check if we get a zlib compressed image
+    bool chunked = http.header(PGtransferenc).equalsIgnoreCase(PGchunked);
+    FzChunkedStream chunks(*client);
+    Stream *stream = chunked ? static_cast<Stream*>(&chunks) : client;
+    // block on socket while waiting for more data, there is nothing to wait for once last chunk has been received
+    stream_wait_cb_t wait = [client, &chunks, chunked](Stream &, uint32_t timeout){ return !(chunked && chunks.done()) && fz_client_wait(client, timeout); };
+
+    // read the first bytes of body to detect image format, container header is read completely to get image size
+    uint8_t magic[FZ_CNT_HDR_SIZE];
+    size_t mlen = 0, mneed = FZ_MAGIC_LEN;
+    while (mlen < mneed && (len < 0 || mlen < (size_t)len)){
+        if (stream->available() <= 0){
+            if (!wait(*stream, INFLATOR_STREAM_TIMEOUT_MS))
+                break;
+            continue;
+        }
+        int c = stream->read();
+        if (c < 0)
+            break;
+        magic[mlen++] = c;
+        if (!offset && mlen == FZ_MAGIC_LEN && !memcmp(magic, FZ_CNT_MAGIC, FZ_MAGIC_LEN))
+            mneed = FZ_CNT_HDR_SIZE;
+    }
+
+    if (!mlen){
+        http.end();
+        ESP_LOGW(TAG, "bad http stream");
+        return offset ? fz_http_err_t::stalled : fz_http_err_t::bad_stream;
+    }
 
-    size_t fwsize = mode_z ? UPDATE_SIZE_UNKNOWN : len;     // fw_size is unknown if we have a compressed image
-    ESP_LOGI(TAG, "Updating %s, input size:%u, mode_z:%u, magic: %02X", (imgtype == U_FLASH)? "FW" : "FS", len, mode_z, stream->peek());
+    // check if we get a compressed image or gzip encoded content, resumed reply is the tail of compressed stream
+    bool bundle = !offset && FlashZ::isbundle(magic, mlen);
+    bool encoded = http.header(PGcontentenc).equalsIgnoreCase(PGgzip);
+    bool mode_z = offset || bundle || encoded || FlashZ::iscompressed(magic, mlen);
 
-    if (!(mode_z ? FlashZ::getInstance().beginz(fwsize, imgtype) : FlashZ::getInstance().begin(fwsize, imgtype))){
-        FlashZ::getInstance().abortz();
-        ESP_LOGW(TAG, "Failed to start Update");
-        return fz_http_err_t::bad_start;
+    // end of compressed image is detected from a stream itself, but raw image size must be known
+    if (len < 0 && !mode_z){
+        http.end();
+        ESP_LOGW(TAG, "raw image of unknown size is not supported");
+        return fz_http_err_t::bad_size;
     }
 
-    size_t wrt = mode_z ? FlashZ::getInstance().writezStream(*stream, len) : FlashZ::getInstance().writeStream(*stream);
-    http.end();
-    stream = nullptr;
+    if (!offset){
+        FlashZ::getInstance().rawonly(encoded);
+        size_t fwsize = mode_z ? FlashZ::imagesize(magic, mlen) : len;     // fw_size is unknown if we have a compressed image w/o container header
+        ESP_LOGI(TAG, "Updating %s, input size:%d, chunked:%u, mode_z:%u, magic: %02X", bundle ? "bundle" : (imgtype == U_FLASH)? "FW" : "FS", len, chunked, mode_z, magic[0]);
 
-    if (wrt != len){
-        FlashZ::getInstance().abortz();
-        ESP_LOGE(TAG, "UPD failed, wrt:%d of %d\n", wrt, len);
-        return fz_http_err_t::write_err;
-    } else {
-        if(FlashZ::getInstance().endz()){
-            ESP_LOGI(TAG, "Update Success: %u bytes", wrt);
-        } else {
-            ESP_LOGW(TAG, "Update failed to complete");
+        bool started = bundle ? FlashZ::getInstance().beginbundle() :
+                        mode_z ? FlashZ::getInstance().beginz(fwsize, imgtype) : FlashZ::getInstance().begin(fwsize, imgtype);
+        if (!started){
+            FlashZ::getInstance().abortz();
+            http.end();
+            ESP_LOGW(TAG, "Failed to start Update");
+            return fz_http_err_t::bad_start;
         }
     }
 
-    if (rst_timeout){
-        if (!t)
-            t = new Ticker;
+    // feed the bytes read for format detection first, than the rest of the stream
+    size_t wrt;
+    if (mode_z)
+        wrt = (FlashZ::getInstance().writez(magic, mlen, false) == mlen) ? FlashZ::getInstance().writezStream(*stream, len < 0 ? UPDATE_SIZE_UNKNOWN : len - mlen, wait) : 0;
+    else
+        wrt = (FlashZ::getInstance().write(magic, mlen) == mlen) ? mlen + FlashZ::getInstance().writeStream(*stream) : 0;
+    http.end();
+    stream = nullptr;
 
-        t->once_ms(rst_timeout, [](){ ESP.restart(); });
+    if (!wrt && FlashZ::getInstance().resumeoffset())
+        return fz_http_err_t::stalled;
+
+    // writezStream() returns total compressed bytes processed including resumed part
+    if (!wrt || (len > 0 && wrt != (size_t)len + offset)){
+        ESP_LOGE(TAG, "UPD failed, wrt:%u of %d\n", wrt, len);
+        return fz_http_err_t::write_err;
     }
 
     return fz_http_err_t::ok;
@@ -263,6 +788,24 @@ void FlashZhttp::provide_ota_form(WebServer *server, const char* url){
     server->on(url, HTTP_GET, [server](){ server->send(200, PGmimehtml, PGotaform ); });
 }
 
+void FlashZhttp::provide_stats(WebServer *server, const char* url){
+    server->on(url, HTTP_GET, [server](){ server->send(200, PGmimejson, statjson()); });
+}
+
+void FlashZhttp::provide_events(WebServer *server, const char* url, uint32_t interval){
+    server->on(url, HTTP_GET, [server, this](){
+        // keep a copy of client's connection to push events, WebServer will drop it's own one
+        delete sse;
+        sse = new fz_webclient_t(server->client());
+        sse->setNoDelay(true);
+        String hdr("HTTP/1.1 200 OK\r\nContent-Type: ");
+        hdr += PGmimesse;
+        hdr += "\r\nCache-Control: no-cache\r\nConnection: keep-alive\r\n\r\n";
+        sse->write((const uint8_t*)hdr.c_str(), hdr.length());
+    });
+    FlashZ::getInstance().onprogress([this](const fz_progress_t &p){ _push_progress(p); }, interval);
+}
+
 void FlashZhttp::handle_ota_form(WebServer *server, const char* url){
     // handler for the /update form POST (once file upload finishes or http-client form)
     server->on(url, HTTP_POST, [server, this](){
@@ -307,7 +850,8 @@ void FlashZhttp::file_upload(WebServer *server){
         case HTTPUploadStatus::UPLOAD_FILE_WRITE : {
              // if first chunk
             if (!upload.totalSize){
-                bool mode_z = (upload.buf[0] == ZLIB_HEADER);    // check if we have a compressed image
+                bool mode_z = FlashZ::iscompressed(upload.buf, upload.currentSize);    // check if we have a compressed image
+                bool bundle = FlashZ::isbundle(upload.buf, upload.currentSize);         // multi-image bundle carries it's own targets
                 int type;
 
                 if (server->hasArg(PGimg)){
@@ -321,9 +865,18 @@ void FlashZhttp::file_upload(WebServer *server){
                         type = U_SPIFFS;
                 }
 
-                ESP_LOGI(TAG, "Begin updating %s, mode_z:%u, magic: %02X", (type == U_FLASH)? "Firmware" : "Filesystem", mode_z, upload.buf[0]);
+                // delta patch against running firmware, it is always compressed
+                bool patch = server->arg(PGimg) == PGpatch;
 
-                if (!(mode_z ? FlashZ::getInstance().beginz(UPDATE_SIZE_UNKNOWN, type) : FlashZ::getInstance().begin(UPDATE_SIZE_UNKNOWN, type))){
+                ESP_LOGI(TAG, "Begin updating %s, mode_z:%u, magic: %02X", bundle ? "Bundle" : patch ? "Firmware patch" : (type == U_FLASH)? "Firmware" : "Filesystem", mode_z, upload.buf[0]);
+
+                if (bundle){
+                    if (!FlashZ::getInstance().beginbundle())
+                        return server->send(503, PGmimetxt, FlashZ::getInstance().errorString());
+                } else if (patch){
+                    if (!mode_z || !FlashZ::getInstance().beginpatch())
+                        return server->send(503, PGmimetxt, FlashZ::getInstance().errorString());
+                } else if (!(mode_z ? FlashZ::getInstance().beginz(FlashZ::imagesize(upload.buf, upload.currentSize), type) : FlashZ::getInstance().begin(UPDATE_SIZE_UNKNOWN, type))){
                     return server->send(503, PGmimetxt, FlashZ::getInstance().errorString());
                 }
             }
@@ -366,6 +919,58 @@ void FlashZhttp::file_upload(WebServer *server){
 }
 #endif // #ifndef FZ_NO_WEBSRV
 
+String FlashZhttp::statjson(){
+    deco_stat_t s;
+    FlashZ::getInstance().getstat(s);
+
+    char buff[448];
+    snprintf(buff, sizeof(buff),
+        "{\"running\":%s,\"in_bytes\":%u,\"out_bytes\":%u,\"wait_us\":%u,\"inflate_us\":%u,\"flash_us\":%u,"
+        "\"chunks\":%u,\"chunk_min\":%u,\"chunk_max\":%u,\"chunk_avg\":%u,\"heap_peak\":%u,\"wdt_feeds\":%u,"
+        "\"sec_skipped\":%u,\"sec_blank\":%u,\"alloc_us\":%u,\"heap_largest\":%u,\"heap_frag\":%u}",
+        FlashZ::getInstance().isRunning() ? "true" : "false", (unsigned)s.in_bytes, (unsigned)s.out_bytes,
+        s.wait_us, s.inflate_us, s.flash_us, s.cb_count, s.chunk_min, s.chunk_max, s.chunk_avg,
+        (unsigned)s.heap_peak, s.wdt_feeds, s.sec_skipped, s.sec_blank, s.alloc_us, (unsigned)s.heap_largest, s.heap_frag);
+    return String(buff);
+}
+
+String FlashZhttp::progressjson(const fz_progress_t &p){
+    char buff[192];
+    snprintf(buff, sizeof(buff),
+        "{\"status\":%d,\"in_bytes\":%u,\"out_bytes\":%u,\"total\":%u,\"rate\":%u,\"rate_avg\":%u,\"eta\":%u}",
+        p.status, (unsigned)p.in_bytes, (unsigned)p.out_bytes, (unsigned)p.total, p.rate, p.rate_avg, p.eta);
+    return String(buff);
+}
+
+void FlashZhttp::_push_progress(const fz_progress_t &p){
+#ifdef FZ_WITH_ASYNCSRV
+    // worker must not touch event stream clients, it's reports are sent by upload connection's poll hook
+    if (up_task && xTaskGetCurrentTaskHandle() == up_task){
+        xSemaphoreTake(up_lock, portMAX_DELAY);
+        up_prg = p;
+        up_prg_new = true;
+        xSemaphoreGive(up_lock);
+        return;
+    }
+#endif
+    String json = progressjson(p);
+#ifdef FZ_WITH_ASYNCSRV
+    if (events)
+        events->send(json.c_str(), "progress");
+#endif
+#ifndef FZ_NO_WEBSRV
+    if (sse){
+        if (!sse->connected()){
+            delete sse;
+            sse = nullptr;
+            return;
+        }
+        String msg = String("event: progress\ndata: ") + json + "\n\n";
+        sse->write((const uint8_t*)msg.c_str(), msg.length());
+    }
+#endif
+}
+
 unsigned FlashZhttp::autoreboot(unsigned t){
     t = rst_timeout;
     return t;
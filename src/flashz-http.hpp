@@ -37,14 +37,54 @@
 #endif  // #ifdef FZ_WITH_ASYNCSRV
 
 #include <Ticker.h>
+#include <atomic>
+#include "flashz.hpp"
+#include "freertos/task.h"
 
 #define FZ_REBOOT_TIMEOUT  5000
 #define FZ_HTTP_CLIENT_DELAY    1000
+#ifndef FZ_HTTP_RESUME_RETRY
+#define FZ_HTTP_RESUME_RETRY    3       // number of attempts to resume stalled download via http Range request
+#endif
+#ifndef FZ_HTTP_RESUME_DELAY
+#define FZ_HTTP_RESUME_DELAY    2000    // pause before resume attempt, ms
+#endif
+
+// AsyncWebServer upload worker, see FlashZhttp::upload_worker()
+#ifndef FZ_UPLOAD_RING_SIZE
+#define FZ_UPLOAD_RING_SIZE     16384   // upload data ring, power of 2, must be at least twice the TCP receive window
+#endif
+#if defined(FZ_WITH_ASYNCSRV) && defined(CONFIG_LWIP_TCP_WND_DEFAULT) && FZ_UPLOAD_RING_SIZE < 2 * CONFIG_LWIP_TCP_WND_DEFAULT
+#error "FZ_UPLOAD_RING_SIZE must be at least twice the TCP receive window"
+#endif
+#ifdef CONFIG_LWIP_TCP_WND_DEFAULT
+#define FZ_UPLOAD_TCP_WND       CONFIG_LWIP_TCP_WND_DEFAULT     // ACKs are held while the ring has no room for a window of data
+#else
+#define FZ_UPLOAD_TCP_WND       (FZ_UPLOAD_RING_SIZE / 2)
+#endif
+#ifndef FZ_UPLOAD_TASK_STACK
+#define FZ_UPLOAD_TASK_STACK    8192
+#endif
+#ifndef FZ_UPLOAD_TASK_PRIO
+#define FZ_UPLOAD_TASK_PRIO     2       // below async_tcp task, so that network is served first
+#endif
+#define FZ_UPLOAD_TASK_NAME     "fz_upload"
+#ifndef FZ_UPLOAD_END_TIMEOUT
+#define FZ_UPLOAD_END_TIMEOUT   30000   // max time upload reply is deferred while worker flashes the rest of upload, ms
+#endif
 
 static const char PGmimehtml[] = "text/html; charset=utf-8";
 static const char PGmimetxt[]  = "text/plain";
+static const char PGmimejson[] = "application/json";
+static const char PGmimesse[]  = "text/event-stream";
+
+#ifndef FZ_NO_WEBSRV
+// WebServer's client type, it's WiFiClient or NetworkClient depending on arduino core version
+using fz_webclient_t = std::remove_reference<decltype(std::declval<WebServer&>().client())>::type;
+#endif
 
 enum class fz_http_err_t:int {
+    stalled = -7,
     write_err = -6,
     bad_start = -5,
     bad_stream = -4,
@@ -67,8 +107,83 @@ enum class fz_http_err_t:int {
  */
 class FlashZhttp {
     unsigned rst_timeout = FZ_REBOOT_TIMEOUT;
+    unsigned resume_retry = FZ_HTTP_RESUME_RETRY;
     Ticker *t = nullptr;
 
+#ifdef FZ_WITH_ASYNCSRV
+    AsyncEventSource *events = nullptr;     // progress event stream
+
+    // upload worker, file_upload() callback queues data to the ring, worker task inflates and flashes it.
+    // AsyncClient and AsyncEventSource are not thread safe, so everything that touches connections runs in
+    // async_tcp task: upload callback, form handler and upload connection's poll hook. Worker only consumes the ring
+    bool up_async = false;                  // worker is requested by user
+    FzRing up_ring;
+    TaskHandle_t up_task = nullptr;         // worker task, it is set until worker is reaped by _up_stop()
+    SemaphoreHandle_t up_lock = nullptr;    // guards progress report passed from worker to async_tcp task
+    SemaphoreHandle_t up_data = nullptr;    // new data or upload end has been signaled to worker
+    SemaphoreHandle_t up_done = nullptr;    // worker has quit
+    std::atomic<AsyncClient*> up_client{nullptr};   // upload connection, it's ACKs are held while the ring has no room for a TCP window
+    AsyncWebServerRequest *up_req = nullptr;    // upload form request, reply is deferred until worker has finished
+    uint32_t up_req_t = 0;                  // time reply has been deferred at, ms
+    fz_progress_t up_prg;                   // worker's progress report, pending delivery to event stream
+    bool up_prg_new = false;
+    std::atomic<bool> up_final{false};      // the last chunk of upload is in the ring
+    std::atomic<bool> up_abort{false};      // upload connection has dropped
+    std::atomic<bool> up_err{false};        // worker has failed or upload data has been dropped
+
+    /**
+     * @brief start upload worker task
+     * 
+     * @return false if there is not enough memory
+     */
+    bool _up_start(AsyncWebServerRequest *request);
+
+    /**
+     * @brief wait for upload worker to finish and release it's resources
+     * 
+     * @param timeout - ms
+     * @return false if worker is still running
+     */
+    bool _up_stop(uint32_t timeout);
+
+    /**
+     * @brief reopen TCP window of upload connection, runs in async_tcp task
+     * ACKs held by AsyncClient are sent once the ring has room for another TCP window of data,
+     * so that sender could not overflow the ring. Everything is acked if upload has failed.
+     * If ACKs are held, worker wakes up the poll hook with _up_kick() as soon as it drains the ring
+     * 
+     * @return false if ACKs are still held
+     */
+    bool _up_ack(AsyncClient *c);
+
+    /**
+     * @brief upload connection's poll hook, runs in async_tcp task
+     * sends held ACKs and progress reports of the worker, replies to the deferred form request once worker has finished
+     */
+    void _up_poll(AsyncClient *c);
+
+    /**
+     * @brief run connection's poll hook now instead of waiting for the next AsyncTCP poll (500 ms)
+     * could be called from any task, client pointer is never dereferenced, so it could be already gone
+     */
+    static void _up_kick(AsyncClient *c);
+
+    // pass worker's progress report to event stream, runs in async_tcp task
+    void _up_progress();
+
+    // reply to upload form request with update result
+    void _up_reply(AsyncWebServerRequest *request);
+
+    // upload worker task
+    static void _up_worker(void *arg);
+#endif
+#ifndef FZ_NO_WEBSRV
+    fz_webclient_t *sse = nullptr;          // progress event stream client
+#endif
+
+    // push progress report to event stream clients
+    void _push_progress(const fz_progress_t &p);
+
 #ifndef  FZ_NOHTTPCLIENT
     struct callback_arg_t {
         int type;
@@ -91,11 +206,31 @@ class FlashZhttp {
      * @return fz_http_err_t - returns error code
      */
     fz_http_err_t _http_get(const char* url, int imgtype = 0);
+
+    /**
+     * @brief request URL and write reply body to flash
+     * on success Update is left running, caller must call endz() or abortz()
+     * 
+     * @param url - source URL for firmware file
+     * @param imgtype - image file type U_FLASH (0 - default) or U_SPIFFS
+     * @param offset - compressed stream offset to resume stalled update from via Range request, 0 to start a new update
+     * @return fz_http_err_t - returns error code, fz_http_err_t::stalled if stream has ended prematurely but could be resumed
+     */
+    fz_http_err_t _http_fetch(const char* url, int imgtype, size_t offset);
 #endif
 
 public:
     ~FlashZhttp(){
         delete t; t = nullptr;
+#ifdef FZ_WITH_ASYNCSRV
+        _up_stop(UINT32_MAX);
+        if (up_lock){ vSemaphoreDelete(up_lock); up_lock = nullptr; }
+        if (up_data){ vSemaphoreDelete(up_data); up_data = nullptr; }
+        if (up_done){ vSemaphoreDelete(up_done); up_done = nullptr; }
+#endif
+#ifndef FZ_NO_WEBSRV
+        delete sse; sse = nullptr;
+#endif
 #ifndef  FZ_NOHTTPCLIENT
         delete cb;
         cb = nullptr;
@@ -117,6 +252,38 @@ public:
      */
     unsigned autoreboot(){ return rst_timeout; };
 
+    /**
+     * @brief current (or the last) update stats in JSON format
+     * byte counters, time spent on waiting for data, inflating and writing flash (us),
+     * inflated chunk sizes, peak heap usage and watchdog feeds, see deco_stat_t
+     * 
+     * @return String - JSON object
+     */
+    static String statjson();
+
+    /**
+     * @brief update progress report in JSON format
+     * 
+     * @return String - JSON object
+     */
+    static String progressjson(const fz_progress_t &p);
+
+#ifndef  FZ_NOHTTPCLIENT
+    /**
+     * @brief set number of attempts to resume stalled compressed image download
+     * if connection drops, download is continued with an http Range request from the point it has stalled,
+     * server must support byte ranges for the file. Zero disables resume
+     * 
+     * @param n - number of attempts
+     */
+    void resume(unsigned n){ resume_retry = n; };
+
+    /**
+     * @brief get number of attempts to resume stalled download
+     */
+    unsigned resume() const { return resume_retry; };
+#endif
+
 #ifndef  FZ_NOHTTPCLIENT
     /**
      * @brief fetch and flash firmware from remote URL
@@ -153,7 +320,8 @@ public:
 
     /**
      * @brief callback for file upload data
-     * it decompresses file chunk (if needed) and writes data to flash
+     * it decompresses file chunk (if needed) and writes data to flash, with upload worker enabled
+     * it only queues the data to worker task
      * MCU will autoreboot on success if autoreboot() is > 0 ms
      * 
      * @param request 
@@ -163,6 +331,47 @@ public:
      * @param len 
      */
     void file_upload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final);
+
+    /**
+     * @brief enable/disable upload worker task for AsyncWebServer uploads
+     * file_upload() callback runs in async_tcp task, inflating and flashing data there stalls every other
+     * connection and delays TCP ACKs. With the worker upload data is copied to a FZ_UPLOAD_RING_SIZE lock-free
+     * ring and callback returns at once, worker task inflates and flashes the data. Backpressure is done
+     * via TCP receive window: while the ring has no room for a window of data (FZ_UPLOAD_TCP_WND) ACKs are held
+     * with AsyncClient::ackLater(), so sender could not outrun flash writes. Held ACKs are sent from async_tcp task by
+     * the next upload callback or connection's poll hook, worker fires the poll hook as soon as it has drained the ring
+     * instead of waiting for AsyncTCP's 500 ms poll. Form handler does not wait for the worker, reply with update result
+     * is sent from the poll hook once worker has finished, worker fires it on exit too. See tools/fzuploadsim.py.
+     * Disabled by default, if worker can't be started data is flashed from the callback
+     * 
+     * @param enable 
+     */
+    void upload_worker(bool enable){ up_async = enable; };
+
+    /**
+     * @brief get upload worker mode
+     */
+    bool upload_worker() const { return up_async; };
+
+    /**
+     * @brief register update stats URL within AsyncServer, handles HTTP GET requests
+     * replies with statjson()
+     * 
+     * @param srv - AsyncWebServer object
+     * @param url - i.e. "/update/stats"
+     */
+    void provide_stats(AsyncWebServer *srv, const char* url);
+
+    /**
+     * @brief register Server-Sent Events URL within AsyncServer
+     * update progress reports are pushed to connected clients as 'progress' events with progressjson() data.
+     * It sets FlashZ progress callback, so it can't be used along with a user's one
+     * 
+     * @param srv - AsyncWebServer object
+     * @param url - i.e. "/update/events"
+     * @param interval - progress report interval, ms
+     */
+    void provide_events(AsyncWebServer *srv, const char* url, uint32_t interval = FZ_PROGRESS_INTERVAL);
 #endif // #ifdef FZ_WITH_ASYNC
 
 #ifndef FZ_NO_WEBSRV
@@ -199,6 +408,27 @@ public:
      * @param len 
      */
     void file_upload(WebServer *server);
+
+    /**
+     * @brief register update stats URL within WebServer, handles HTTP GET requests
+     * replies with statjson()
+     * 
+     * @param srv - WebServer object
+     * @param url - i.e. "/update/stats"
+     */
+    void provide_stats(WebServer *server, const char* url);
+
+    /**
+     * @brief register Server-Sent Events URL within WebServer
+     * update progress reports are pushed as 'progress' events with progressjson() data.
+     * WebServer is single-threaded, so only one event stream client is served, the last one connected.
+     * It sets FlashZ progress callback, so it can't be used along with a user's one
+     * 
+     * @param srv - WebServer object
+     * @param url - i.e. "/update/events"
+     * @param interval - progress report interval, ms
+     */
+    void provide_events(WebServer *server, const char* url, uint32_t interval = FZ_PROGRESS_INTERVAL);
 #endif // #ifndef FZ_NO_WEBSRV
 
 };
@@ -0,0 +1,395 @@
+/*
+    ESP32-FlashZ library
+
+    This code implements a library for ESP32-xx family chips and provides an
+    ability to upload zlib compressed firmware images during OTA updates.
+
+    LZ4 frame format decoder, see https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
+
+    Copyright (C) Emil Muratov, 2022
+    GitHub: https://github.com/vortigont/esp32-flashz
+
+ *  This program or library is free software; you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License version 2 for more details.
+ *
+ *  You should have received a copy of the GNU General Public License version 2
+ *  along with this library; if not, get one at
+ *  https://opensource.org/licenses/GPL-2.0
+ */
+
+#ifndef FZ_NO_LZ4
+
+#include "flashz.hpp"
+
+#ifdef ARDUINO
+#include "esp32-hal-log.h"
+#else
+#include "esp_log.h"
+#endif
+
+// ESP32 log tag
+static const char *TAG __attribute__((unused)) = "FZ-LZ4";
+
+#define XXH_PRIME32_1   0x9E3779B1U
+#define XXH_PRIME32_2   0x85EBCA77U
+#define XXH_PRIME32_3   0xC2B2AE3DU
+#define XXH_PRIME32_4   0x27D4EB2FU
+#define XXH_PRIME32_5   0x165667B1U
+
+static inline uint32_t xxh_rotl(uint32_t x, int r){ return (x << r) | (x >> (32 - r)); }
+
+static inline uint32_t xxh_round(uint32_t acc, uint32_t input){
+    acc += input * XXH_PRIME32_2;
+    return xxh_rotl(acc, 13) * XXH_PRIME32_1;
+}
+
+static void xxh32_init(fz_xxh32_t &h){
+    h.v[0] = XXH_PRIME32_1 + XXH_PRIME32_2;
+    h.v[1] = XXH_PRIME32_2;
+    h.v[2] = 0;
+    h.v[3] = 0 - XXH_PRIME32_1;
+    h.total = 0;
+    h.buf_len = 0;
+}
+
+static void xxh32_update(fz_xxh32_t &h, const uint8_t *data, size_t len){
+    h.total += len;
+
+    // complete buffered stripe
+    if (h.buf_len){
+        size_t n = (16u - h.buf_len < len) ? 16u - h.buf_len : len;
+        memcpy(h.buf + h.buf_len, data, n);
+        h.buf_len += n;
+        data += n;
+        len -= n;
+        if (h.buf_len < 16)
+            return;
+        for (int i = 0; i != 4; ++i)
+            h.v[i] = xxh_round(h.v[i], fz_get_le32(h.buf + 4*i));
+        h.buf_len = 0;
+    }
+
+    for (; len >= 16; data += 16, len -= 16){
+        for (int i = 0; i != 4; ++i)
+            h.v[i] = xxh_round(h.v[i], fz_get_le32(data + 4*i));
+    }
+
+    memcpy(h.buf, data, len);
+    h.buf_len = len;
+}
+
+static uint32_t xxh32_digest(const fz_xxh32_t &h){
+    uint32_t r;
+    if (h.total >= 16)
+        r = xxh_rotl(h.v[0], 1) + xxh_rotl(h.v[1], 7) + xxh_rotl(h.v[2], 12) + xxh_rotl(h.v[3], 18);
+    else
+        r = h.v[2] + XXH_PRIME32_5;
+
+    r += h.total;
+
+    const uint8_t *p = h.buf;
+    size_t len = h.buf_len;
+    for (; len >= 4; p += 4, len -= 4)
+        r = xxh_rotl(r + fz_get_le32(p) * XXH_PRIME32_3, 17) * XXH_PRIME32_4;
+    for (; len; ++p, --len)
+        r = xxh_rotl(r + *p * XXH_PRIME32_5, 11) * XXH_PRIME32_1;
+
+    r ^= r >> 15;
+    r *= XXH_PRIME32_2;
+    r ^= r >> 13;
+    r *= XXH_PRIME32_3;
+    r ^= r >> 16;
+    return r;
+}
+
+
+// Lz4Decoder class implementation
+bool Lz4Decoder::init(){
+    if (!win_alloc(LZ4_WINDOW_SIZE))
+        return false;   // OOM
+
+    reset();
+    return true;
+}
+
+void Lz4Decoder::reset(){
+    state = state_t::magic;
+    hdr_cnt = 0;
+    hdr_len = 4;
+    total_in = total_out = 0;
+    win_reset();
+}
+
+void Lz4Decoder::end(){
+    win_free();
+}
+
+bool Lz4Decoder::collect(const uint8_t* &data, size_t &len){
+    size_t n = (hdr_len - hdr_cnt < len) ? hdr_len - hdr_cnt : len;
+    memcpy(hdr + hdr_cnt, data, n);
+    hdr_cnt += n;
+    data += n;
+    len -= n;
+    if (hdr_cnt < hdr_len)
+        return false;
+
+    hdr_cnt = 0;
+    return true;
+}
+
+bool Lz4Decoder::descriptor(){
+    flg = hdr[0];
+    if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION){
+        ESP_LOGE(TAG, "unsupported frame version");
+        return false;
+    }
+    if (flg & LZ4_FLG_DICTID){
+        ESP_LOGE(TAG, "dictionary frames are not supported");
+        return false;
+    }
+
+    // header checksum is the second byte of xxh32 of the descriptor
+    fz_xxh32_t h;
+    xxh32_init(h);
+    xxh32_update(h, hdr, hdr_len - 1);
+    if (((xxh32_digest(h) >> 8) & 0xff) != hdr[hdr_len - 1]){
+        ESP_LOGE(TAG, "frame descriptor checksum mismatch");
+        return false;
+    }
+
+    csize = (flg & LZ4_FLG_CSIZE) ? fz_get_le32(hdr + 2) : 0;
+    if (flg & LZ4_FLG_CCHECKSUM)
+        xxh32_init(chash);
+
+    ESP_LOGD(TAG, "LZ4 frame, flg:%02X, bd:%02X, size:%u", flg, hdr[1], csize);
+    return true;
+}
+
+void Lz4Decoder::win_out(const uint8_t *data, size_t len){
+    if (flg & LZ4_FLG_CCHECKSUM)
+        xxh32_update(chash, data, len);
+}
+
+int Lz4Decoder::inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final, size_t chunk_size){
+    if (!win)
+        return MZ_BUF_ERROR;    // decoder not initialized
+
+    if (state == state_t::done)
+        return MZ_STREAM_END;
+
+    win_cb(&callback, chunk_size);
+
+    const uint8_t *data = inBuff;
+    size_t left = len;
+    int err = MZ_OK;
+
+    while (left && err == MZ_OK && state != state_t::done){
+        const uint8_t *p = data;
+        bool in_block = state >= state_t::token && state <= state_t::raw;
+
+        switch (state){
+            case state_t::magic : {
+                if (!collect(data, left))
+                    break;
+                uint32_t m = fz_get_le32(hdr);
+                if (m == LZ4_FRAME_MAGIC){
+                    state = state_t::descr;
+                    hdr_len = 2;            // FLG and BD, the rest of descriptor length depends on FLG
+                } else if ((m & 0xFFFFFFF0) == LZ4_SKIP_MAGIC){
+                    state = state_t::skip_size;
+                } else {
+                    ESP_LOGE(TAG, "bad frame magic: %08X", m);
+                    err = MZ_DATA_ERROR;
+                }
+                break;
+            }
+            case state_t::skip_size :
+                if (!collect(data, left))
+                    break;
+                block_left = fz_get_le32(hdr);
+                state = block_left ? state_t::skip : state_t::magic;
+                break;
+            case state_t::skip : {
+                size_t n = (block_left < left) ? block_left : left;
+                data += n;
+                left -= n;
+                block_left -= n;
+                if (!block_left)
+                    state = state_t::magic;
+                break;
+            }
+            case state_t::descr :
+                if (!collect(data, left))
+                    break;
+                if (hdr_len == 2){
+                    hdr_len = 3 + ((hdr[0] & LZ4_FLG_CSIZE) ? 8 : 0) + ((hdr[0] & LZ4_FLG_DICTID) ? 4 : 0);
+                    hdr_cnt = 2;
+                    break;
+                }
+                if (!descriptor()){
+                    err = MZ_DATA_ERROR;
+                    break;
+                }
+                state = state_t::bsize;
+                hdr_len = 4;
+                break;
+            case state_t::bsize : {
+                if (!collect(data, left))
+                    break;
+                uint32_t b = fz_get_le32(hdr);
+                if (!b){
+                    // EndMark
+                    state = (flg & LZ4_FLG_CCHECKSUM) ? state_t::cchecksum : state_t::done;
+                    break;
+                }
+                block_left = b & ~LZ4_BLOCK_UNCOMPRESSED;
+                if (flg & LZ4_FLG_BCHECKSUM)
+                    xxh32_init(bhash);
+                state = (b & LZ4_BLOCK_UNCOMPRESSED) ? state_t::raw : state_t::token;
+                break;
+            }
+            case state_t::raw : {
+                size_t n = (block_left < left) ? block_left : left;
+                if (!win_write(data, n))
+                    err = MZ_ERRNO;
+                data += n;
+                left -= n;
+                block_left -= n;
+                break;
+            }
+            case state_t::token :
+                lit_len = *data >> 4;
+                match_len = *data & 0x0F;
+                ++data;
+                --left;
+                --block_left;
+                state = (lit_len == 15) ? state_t::lit_len : (lit_len ? state_t::literals : state_t::offset);
+                break;
+            case state_t::lit_len :
+                lit_len += *data;
+                if (*data != 255)
+                    state = state_t::literals;
+                ++data;
+                --left;
+                --block_left;
+                break;
+            case state_t::literals : {
+                size_t n = (lit_len < left) ? lit_len : left;
+                if (n > block_left)
+                    n = block_left;
+                if (!win_write(data, n))
+                    err = MZ_ERRNO;
+                data += n;
+                left -= n;
+                block_left -= n;
+                lit_len -= n;
+                if (!lit_len)
+                    state = state_t::offset;
+                break;
+            }
+            case state_t::offset : {
+                hdr_len = 2;
+                size_t l = left;
+                bool complete = collect(data, left);
+                block_left -= l - left;
+                if (!complete)
+                    break;
+                offset = hdr[0] | (hdr[1] << 8);
+                if (!offset || offset > total_out){
+                    ESP_LOGE(TAG, "bad match offset: %u", offset);
+                    err = MZ_DATA_ERROR;
+                    break;
+                }
+                match_len += 4;         // minmatch
+                if (match_len == 15 + 4){
+                    state = state_t::match_len;
+                    break;
+                }
+                if (!win_copy(offset, match_len))
+                    err = MZ_ERRNO;
+                state = state_t::token;
+                break;
+            }
+            case state_t::match_len :
+                match_len += *data;
+                if (*data != 255){
+                    if (!win_copy(offset, match_len))
+                        err = MZ_ERRNO;
+                    state = state_t::token;
+                }
+                ++data;
+                --left;
+                --block_left;
+                break;
+            case state_t::bchecksum :
+                if (!collect(data, left))
+                    break;
+                if (fz_get_le32(hdr) != xxh32_digest(bhash)){
+                    ESP_LOGE(TAG, "block checksum mismatch");
+                    err = MZ_DATA_ERROR;
+                    break;
+                }
+                state = state_t::bsize;
+                break;
+            case state_t::cchecksum :
+                if (!collect(data, left))
+                    break;
+                // content hash is calculated on data passed to callback, so flush it all first
+                if (!win_flush(true)){
+                    err = MZ_ERRNO;
+                    break;
+                }
+                if (fz_get_le32(hdr) != xxh32_digest(chash)){
+                    ESP_LOGE(TAG, "content checksum mismatch");
+                    err = MZ_DATA_ERROR;
+                    break;
+                }
+                state = state_t::done;
+                break;
+            default:
+                break;
+        }
+
+        if (in_block){
+            if (flg & LZ4_FLG_BCHECKSUM)
+                xxh32_update(bhash, p, data - p);
+
+            // block must end on a sequence boundary, after the literals
+            if (!block_left && err == MZ_OK){
+                if (state != state_t::raw && !(state == state_t::offset && !hdr_cnt)){
+                    ESP_LOGE(TAG, "block ends in the middle of a sequence");
+                    err = MZ_DATA_ERROR;
+                    break;
+                }
+                state = (flg & LZ4_FLG_BCHECKSUM) ? state_t::bchecksum : state_t::bsize;
+                hdr_len = 4;
+            }
+        }
+    }
+
+    total_in += len - left;
+
+    if (err < 0){
+        ESP_LOGW(TAG, "decode failure - MZ_ERR: %d, tin:%u, tout:%u", err, total_in, total_out);
+        return err;
+    }
+
+    if (state == state_t::done){
+        if ((flg & LZ4_FLG_CSIZE) && csize != (uint32_t)total_out){
+            ESP_LOGE(TAG, "content size mismatch: %u/%u", total_out, csize);
+            return MZ_DATA_ERROR;
+        }
+        return win_flush(true) ? MZ_STREAM_END : MZ_ERRNO;
+    }
+
+    // if we demand it's a final call, than something must be wrong with a stream
+    return final ? MZ_STREAM_ERROR : MZ_OK;
+}
+
+#endif  // FZ_NO_LZ4
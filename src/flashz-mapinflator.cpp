@@ -0,0 +1,625 @@
+/*
+    ESP32-FlashZ library
+
+    This code implements a library for ESP32-xx family chips and provides an
+    ability to upload zlib compressed firmware images during OTA updates.
+
+    zlib/gzip decoder that reads LZ77 history back from target flash partition
+
+    Copyright (C) Emil Muratov, 2022
+    GitHub: https://github.com/vortigont/esp32-flashz
+
+ *  This program or library is free software; you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License version 2 for more details.
+ *
+ *  You should have received a copy of the GNU General Public License version 2
+ *  along with this library; if not, get one at
+ *  https://opensource.org/licenses/GPL-2.0
+ */
+
+#ifndef FZ_NO_MAPINFLATOR
+
+#include "flashz.hpp"
+
+#ifdef ARDUINO
+#include "esp32-hal-log.h"
+#else
+#include "esp_log.h"
+#endif
+
+// ESP32 log tag
+static const char *TAG __attribute__((unused)) = "FZ-MAP";
+
+#define ZLIB_TRAILER_SIZE   4           // adler32, big-endian
+#define DEFLATE_MAX_BITS    15          // max Huffman code length
+#define DEFLATE_END_BLOCK   256
+#define DEFLATE_CLEN_CODES  19
+
+// RFC1951 length and distance codes
+static const uint16_t len_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t clen_order[DEFLATE_CLEN_CODES] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+
+// MapInflator class implementation
+bool MapInflator::init(){
+    end();
+    if (!map)
+        return false;
+    tbl = (tables_t*)malloc(sizeof(tables_t));
+    if (!tbl)
+        return false;
+    reset();            // write-combining buffer is allocated on the first input, once output alignment is known
+    return true;
+}
+
+void MapInflator::reset(){
+    state = state_t::header;
+    bitbuf = bitcnt = 0;
+    last = false;
+    cnt = need = 0;
+    ra_len = 0;
+    out_len = out_base = 0;
+    total_in = total_out = 0;
+    map_bytes = 0;
+}
+
+void MapInflator::end(){
+    if (tbl || out)
+        ESP_LOGD(TAG, "history read from flash: %u of %u bytes", map_bytes, total_out);
+    free(tbl);
+    tbl = nullptr;
+    free(out);
+    out = nullptr;
+    out_size = 0;
+}
+
+int MapInflator::byte_get(){
+    if (bitcnt >= 8)
+        return bits_get(8);
+    if (!avail_in)
+        return -1;
+    --avail_in;
+    ++total_in;
+    return *next_in++;
+}
+
+bool MapInflator::huff_build(fz_huff_t &h, const uint8_t *lens, size_t n){
+    uint16_t offs[DEFLATE_MAX_BITS + 1];
+    uint16_t next[DEFLATE_MAX_BITS + 1];
+
+    memset(h.count, 0, sizeof(h.count));
+    for (size_t i = 0; i != n; ++i)
+        ++h.count[lens[i]];
+    h.count[0] = 0;
+
+    // incomplete codes are fine (i.e. a single distance code), oversubscribed are not
+    int left = 1;
+    for (unsigned l = 1; l <= DEFLATE_MAX_BITS; ++l){
+        left = (left << 1) - h.count[l];
+        if (left < 0)
+            return false;
+    }
+
+    offs[1] = next[1] = 0;
+    for (unsigned l = 1; l < DEFLATE_MAX_BITS; ++l){
+        offs[l + 1] = offs[l] + h.count[l];
+        next[l + 1] = (next[l] + h.count[l]) << 1;
+    }
+
+    memset(h.lut, 0, sizeof(h.lut));
+    for (size_t sym = 0; sym != n; ++sym){
+        unsigned l = lens[sym];
+        if (!l)
+            continue;
+        h.symbol[offs[l]++] = sym;
+        uint16_t code = next[l]++;
+        if (l > FZ_MAP_LUT_BITS)
+            continue;
+
+        // deflate packs codes starting from MSB, while bit reader takes bits from LSB
+        unsigned rev = 0;
+        for (unsigned i = 0; i != l; ++i)
+            rev |= ((code >> i) & 1) << (l - 1 - i);
+        for (unsigned i = rev; i < (1U << FZ_MAP_LUT_BITS); i += 1U << l)
+            h.lut[i] = sym | (l << 12);
+    }
+    return true;
+}
+
+int MapInflator::huff_peek(const fz_huff_t &h, unsigned &len) const {
+    uint16_t e = h.lut[bitbuf & ((1U << FZ_MAP_LUT_BITS) - 1)];
+    if (e){
+        len = e >> 12;
+        return len > bitcnt ? -1 : e & 0x1FF;
+    }
+
+    // long code, canonical decoding bit by bit
+    int code = 0, first = 0, index = 0;
+    for (len = 1; len <= DEFLATE_MAX_BITS; ++len){
+        if (len > bitcnt)
+            return -1;
+        code |= (bitbuf >> (len - 1)) & 1;
+        int count = h.count[len];
+        if (code - first < count)
+            return h.symbol[index + code - first];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -2;
+}
+
+int MapInflator::header_put(uint8_t c){
+    if (state == state_t::header && !cnt){
+        gzip = c == GZ_HEADER;
+        check = 0;
+    }
+    if (state != state_t::gz_hcrc && gzip)
+        check = fz_crc32_le(check, &c, 1);     // header crc16 covers all the header bytes before it
+
+    bool field_done = false;
+    switch (state){
+        case state_t::header :
+            if (!gzip){
+                // zlib CMF/FLG, window size does not matter here
+                trl[cnt] = c;
+                if (++cnt < 2)
+                    return 0;
+                if ((trl[0] & 0x0F) != 8 || (trl[0] >> 4) > 7 || (trl[1] & 0x20) || ((trl[0] << 8) | trl[1]) % 31){
+                    ESP_LOGW(TAG, "bad zlib header");
+                    return MZ_DATA_ERROR;
+                }
+                check = 1;
+                return 1;
+            }
+            if ((cnt == 1 && c != GZ_HEADER2) || (cnt == 2 && c != 8) || (cnt == 3 && (c & GZ_FLG_RESERVED))){
+                ESP_LOGW(TAG, "bad gzip header");
+                return MZ_DATA_ERROR;
+            }
+            if (cnt == 3)
+                gz_flags = c;
+            field_done = (++cnt == GZ_HEADER_SIZE);
+            break;
+        case state_t::gz_xlen :
+            need |= c << (8 * cnt);
+            field_done = (++cnt == 2);
+            break;
+        case state_t::gz_extra :
+            field_done = (++cnt == need);
+            break;
+        case state_t::gz_name :
+        case state_t::gz_comment :
+            field_done = !c;
+            break;
+        case state_t::gz_hcrc :
+            need = cnt ? need | (c << 8) : c;
+            if (++cnt == 2){
+                if (need != (check & 0xffff)){
+                    ESP_LOGW(TAG, "gzip header crc mismatch");
+                    return MZ_DATA_ERROR;
+                }
+                field_done = true;
+            }
+            break;
+        default :
+            break;
+    }
+
+    // advance to the next field present in header
+    while (field_done){
+        state = static_cast<state_t>(static_cast<uint8_t>(state) + 1);
+        cnt = 0;
+        switch (state){
+            case state_t::gz_xlen :     need = 0; field_done = !(gz_flags & GZ_FLG_FEXTRA); break;
+            case state_t::gz_extra :    field_done = !(gz_flags & GZ_FLG_FEXTRA) || !need; break;
+            case state_t::gz_name :     field_done = !(gz_flags & GZ_FLG_FNAME); break;
+            case state_t::gz_comment :  field_done = !(gz_flags & GZ_FLG_FCOMMENT); break;
+            case state_t::gz_hcrc :     field_done = !(gz_flags & GZ_FLG_FHCRC); break;
+            default :                   field_done = false;
+        }
+    }
+
+    if (state != state_t::block)
+        return 0;
+
+    check = 0;          // crc32 of inflated data starts here
+    return 1;
+}
+
+bool MapInflator::out_flush(bool final){
+    size_t done = 0;
+    while (done < out_len){
+        size_t len = out_len - done;
+        int consumed = (*cb)(out_base, out + done, len, final);
+        if (consumed <= 0 || (size_t)consumed > len)
+            return false;       // it's an error not to consume or consume too much
+
+        // image head is not on flash yet
+        if (out_base < head_len)
+            memcpy(head + out_base, out + done, ((size_t)consumed < head_len - out_base) ? consumed : head_len - out_base);
+
+        check = gzip ? fz_crc32_le(check, out + done, consumed) : fz_adler32(check, out + done, consumed);
+        out_base += consumed;
+        done += consumed;
+        if (!final)
+            break;              // leftover stays in buffer
+    }
+
+    out_len -= done;
+    if (out_len)
+        memmove(out, out + done, out_len);
+    wdt_feed();
+    return true;
+}
+
+bool MapInflator::out_copy(size_t dist, size_t len){
+    while (len){
+        if (out_len == out_size && !out_flush(false))
+            return false;
+
+        size_t n = out_size - out_len;
+        if (n > len)
+            n = len;
+
+        uint8_t *dst = out + out_len;
+        size_t from = total_out - dist;
+        if (from >= out_base){
+            const uint8_t *src = out + (from - out_base);
+            if (dist >= n){
+                memcpy(dst, src, n);
+            } else {
+                // overlapping match, i.e. repeated pattern
+                for (size_t i = 0; i != n; ++i)
+                    dst[i] = src[i];
+            }
+        } else {
+            // history is on flash, the part up to buffer start is read via flash cache
+            if (n > out_base - from)
+                n = out_base - from;
+            if (from < head_len){
+                if (n > head_len - from)
+                    n = head_len - from;
+                memcpy(dst, head + from, n);
+            } else {
+                memcpy(dst, map + from, n);
+                map_bytes += n;
+            }
+        }
+
+        out_len += n;
+        total_out += n;
+        len -= n;
+    }
+    return true;
+}
+
+int MapInflator::inflate(){
+    for (;;){
+        switch (state){
+            case state_t::header :
+            case state_t::gz_xlen :
+            case state_t::gz_extra :
+            case state_t::gz_name :
+            case state_t::gz_comment :
+            case state_t::gz_hcrc : {
+                int c = byte_get();
+                if (c < 0)
+                    return MZ_OK;
+                int r = header_put(c);
+                if (r < 0)
+                    return r;
+                if (r){
+                    state = state_t::block;
+                    cnt = 0;
+                }
+                break;
+            }
+
+            case state_t::block : {
+                if (last){
+                    bits_get(bitcnt & 7);       // trailer is byte aligned
+                    state = state_t::trailer;
+                    cnt = 0;
+                    break;
+                }
+                if (!bits_need(3))
+                    return MZ_OK;
+                last = bits_get(1);
+                switch (bits_get(2)){
+                    case 0 :
+                        bits_get(bitcnt & 7);
+                        cnt = 0;                // dynamic block leaves code lengths count here
+                        state = state_t::stored_len;
+                        break;
+                    case 1 : {
+                        // fixed Huffman codes
+                        uint8_t *l = tbl->lens;
+                        memset(l, 8, 144);
+                        memset(l + 144, 9, 112);
+                        memset(l + 256, 7, 24);
+                        memset(l + 280, 8, 8);
+                        memset(l + 288, 5, 30);
+                        huff_build(tbl->lit, l, 288);
+                        huff_build(tbl->dist, l + 288, 30);
+                        state = state_t::data;
+                        break;
+                    }
+                    case 2 :
+                        state = state_t::table;
+                        break;
+                    default :
+                        ESP_LOGW(TAG, "invalid block type");
+                        return MZ_DATA_ERROR;
+                }
+                break;
+            }
+
+            case state_t::stored_len : {
+                if (!bits_need(16))
+                    return MZ_OK;
+                if (!cnt){
+                    need = bits_get(16);
+                    cnt = 1;
+                    break;
+                }
+                if ((uint16_t)~bits_get(16) != need){
+                    ESP_LOGW(TAG, "stored block length mismatch");
+                    return MZ_DATA_ERROR;
+                }
+                cnt = 0;
+                state = need ? state_t::stored : state_t::block;
+                break;
+            }
+
+            case state_t::stored : {
+                // bit buffer is byte aligned here, drain it first, then copy straight from input
+                while (need && bitcnt){
+                    if (!out_put(bits_get(8)))
+                        return MZ_ERRNO;
+                    --need;
+                }
+                while (need && avail_in){
+                    if (out_len == out_size && !out_flush(false))
+                        return MZ_ERRNO;
+                    size_t n = out_size - out_len;
+                    if (n > need)
+                        n = need;
+                    if (n > avail_in)
+                        n = avail_in;
+                    memcpy(out + out_len, next_in, n);
+                    out_len += n;
+                    total_out += n;
+                    next_in += n;
+                    avail_in -= n;
+                    total_in += n;
+                    need -= n;
+                }
+                if (need)
+                    return MZ_OK;
+                state = state_t::block;
+                break;
+            }
+
+            case state_t::table : {
+                if (!bits_need(14))
+                    return MZ_OK;
+                nlit = bits_get(5) + 257;
+                ndist = bits_get(5) + 1;
+                need = bits_get(4) + 4;
+                if (nlit > 286 || ndist > 30){
+                    ESP_LOGW(TAG, "bad dynamic block header");
+                    return MZ_DATA_ERROR;
+                }
+                memset(tbl->lens, 0, DEFLATE_CLEN_CODES);
+                cnt = 0;
+                state = state_t::codelens;
+                break;
+            }
+
+            case state_t::codelens : {
+                while (cnt < need){
+                    if (!bits_need(3))
+                        return MZ_OK;
+                    tbl->lens[clen_order[cnt++]] = bits_get(3);
+                }
+                // distance table is rebuilt later, so it holds code length code for a while
+                if (!huff_build(tbl->dist, tbl->lens, DEFLATE_CLEN_CODES)){
+                    ESP_LOGW(TAG, "bad code length code");
+                    return MZ_DATA_ERROR;
+                }
+                cnt = 0;
+                state = state_t::lens;
+                break;
+            }
+
+            case state_t::lens : {
+                while (cnt < nlit + ndist){
+                    bits_need(DEFLATE_MAX_BITS);
+                    unsigned len;
+                    int sym = huff_peek(tbl->dist, len);
+                    if (sym == -1)
+                        return MZ_OK;
+                    if (sym < 0){
+                        ESP_LOGW(TAG, "bad code length");
+                        return MZ_DATA_ERROR;
+                    }
+
+                    if (sym < 16){
+                        bits_get(len);
+                        tbl->lens[cnt++] = sym;
+                        continue;
+                    }
+
+                    // repeat codes, symbol and it's extra bits are taken at once
+                    unsigned extra = (sym == 16) ? 2 : (sym == 17) ? 3 : 7;
+                    if (!bits_need(len + extra))
+                        return MZ_OK;
+                    bits_get(len);
+                    unsigned rep = bits_get(extra) + ((sym == 16) ? 3 : (sym == 17) ? 3 : 11);
+                    if ((sym == 16 && !cnt) || cnt + rep > nlit + ndist){
+                        ESP_LOGW(TAG, "bad code length repeat");
+                        return MZ_DATA_ERROR;
+                    }
+                    uint8_t v = (sym == 16) ? tbl->lens[cnt - 1] : 0;
+                    memset(tbl->lens + cnt, v, rep);
+                    cnt += rep;
+                }
+                if (!tbl->lens[DEFLATE_END_BLOCK] || !huff_build(tbl->lit, tbl->lens, nlit) || !huff_build(tbl->dist, tbl->lens + nlit, ndist)){
+                    ESP_LOGW(TAG, "bad dynamic Huffman code");
+                    return MZ_DATA_ERROR;
+                }
+                state = state_t::data;
+                break;
+            }
+
+            case state_t::data : {
+                // hot loop, literals and lengths
+                for (;;){
+                    bits_need(DEFLATE_MAX_BITS);
+                    unsigned len;
+                    int sym = huff_peek(tbl->lit, len);
+                    if (sym < 256){
+                        if (sym == -1)
+                            return MZ_OK;
+                        if (sym < 0)
+                            break;
+                        bits_get(len);
+                        if (!out_put(sym))
+                            return MZ_ERRNO;
+                        continue;
+                    }
+                    if (sym == DEFLATE_END_BLOCK){
+                        bits_get(len);
+                        state = state_t::block;
+                        break;
+                    }
+                    sym -= 257;
+                    if (sym >= 29)
+                        break;
+                    // length symbol and it's extra bits are taken at once
+                    if (!bits_need(len + len_extra[sym]))
+                        return MZ_OK;
+                    bits_get(len);
+                    length = len_base[sym] + bits_get(len_extra[sym]);
+                    state = state_t::dist;
+                    break;
+                }
+                if (state == state_t::data){
+                    ESP_LOGW(TAG, "bad literal/length code");
+                    return MZ_DATA_ERROR;
+                }
+                break;
+            }
+
+            case state_t::dist : {
+                bits_need(DEFLATE_MAX_BITS);
+                unsigned len;
+                int sym = huff_peek(tbl->dist, len);
+                if (sym == -1)
+                    return MZ_OK;
+                if (sym < 0 || sym >= 30){
+                    ESP_LOGW(TAG, "bad distance code");
+                    return MZ_DATA_ERROR;
+                }
+                bits_get(len);
+                dsym = sym;
+                state = state_t::dist_extra;
+                break;
+            }
+
+            case state_t::dist_extra : {
+                if (!bits_need(dist_extra[dsym]))
+                    return MZ_OK;
+                size_t d = dist_base[dsym] + bits_get(dist_extra[dsym]);
+                if (d > total_out){
+                    ESP_LOGW(TAG, "bad distance %u at %u", d, total_out);
+                    return MZ_DATA_ERROR;
+                }
+                if (!out_copy(d, length))
+                    return MZ_ERRNO;
+                state = state_t::data;
+                break;
+            }
+
+            case state_t::trailer : {
+                size_t size = gzip ? GZ_TRAILER_SIZE : ZLIB_TRAILER_SIZE;
+                while (cnt < size){
+                    int c = byte_get();
+                    if (c < 0)
+                        return MZ_OK;
+                    trl[cnt++] = c;
+                }
+
+                // whatever is left in bit buffer belongs to the data that follows compressed stream
+                while (bitcnt >= 8 && ra_len < sizeof(ra_buff))
+                    ra_buff[ra_len++] = bits_get(8);
+                bitbuf = bitcnt = 0;
+
+                // trailer covers all the data, flush it first
+                if (!out_flush(true))
+                    return MZ_ERRNO;
+
+                if (gzip){
+                    uint32_t crc = fz_get_le32(trl), isize = fz_get_le32(trl + 4);
+                    if (crc != check || isize != total_out){
+                        ESP_LOGW(TAG, "gzip trailer mismatch, crc:%08x/%08x, size:%u/%u", crc, check, isize, total_out);
+                        return MZ_DATA_ERROR;
+                    }
+                } else {
+                    uint32_t adler = (uint32_t)trl[0] << 24 | trl[1] << 16 | trl[2] << 8 | trl[3];
+                    if (adler != check){
+                        ESP_LOGW(TAG, "adler32 mismatch: %08x/%08x", adler, check);
+                        return MZ_DATA_ERROR;
+                    }
+                }
+                state = state_t::done;
+                return MZ_STREAM_END;
+            }
+
+            default :
+                return MZ_STREAM_END;
+        }
+    }
+}
+
+int MapInflator::inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final, size_t chunk_size){
+    if (!tbl)
+        return MZ_BUF_ERROR;    // not initialized
+
+    if (state == state_t::done)
+        return MZ_STREAM_END;
+
+    if (!out){
+        out_size = (FZ_MAP_BUFF_SIZE + out_align - 1) & ~(out_align - 1);
+        out = (uint8_t*)malloc(out_size);
+        if (!out)
+            return MZ_MEM_ERROR;
+    }
+
+    next_in = inBuff;
+    avail_in = len;
+    cb = &callback;
+    int err = inflate();
+    cb = nullptr;
+
+    if (err < 0){
+        ESP_LOGW(TAG, "decode failure - MZ_ERR: %d, tin:%u, tout:%u", err, total_in, total_out);
+        return err;
+    }
+
+    // if we demand it's a final call, than something must be wrong with a stream
+    if (err == MZ_OK && final)
+        return MZ_STREAM_ERROR;
+    return err;
+}
+
+#endif  // FZ_NO_MAPINFLATOR
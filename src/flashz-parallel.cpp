@@ -0,0 +1,339 @@
+/*
+    ESP32-FlashZ library
+
+    This code implements a library for ESP32-xx family chips and provides an
+    ability to upload zlib compressed firmware images during OTA updates.
+
+    parallel decoder for zlib/gzip streams built of independently decodable segments, see tools/fzpack.py
+
+    Copyright (C) Emil Muratov, 2022
+    GitHub: https://github.com/vortigont/esp32-flashz
+
+ *  This program or library is free software; you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License version 2 for more details.
+ *
+ *  You should have received a copy of the GNU General Public License version 2
+ *  along with this library; if not, get one at
+ *  https://opensource.org/licenses/GPL-2.0
+ */
+
+#include <new>
+#include "flashz.hpp"
+#include "freertos/task.h"
+
+#ifdef ARDUINO
+#include "esp32-hal-log.h"
+#else
+#include "esp_log.h"
+#endif
+
+// ESP32 log tag
+static const char *TAG __attribute__((unused)) = "FZ-PAR";
+
+#define ZLIB_TRAILER_SIZE   4           // adler32, big-endian
+#define ADLER_BASE          65521
+#define ADLER_NMAX          5552        // max number of bytes before modulo, so that sums do not overflow 32 bits
+#define CRC32_POLY          0xEDB88320  // reflected crc32 polynomial
+
+uint32_t fz_adler32(uint32_t adler, const uint8_t *data, size_t len){
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (len){
+        size_t n = len < ADLER_NMAX ? len : ADLER_NMAX;
+        len -= n;
+        while (n--){
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+    return (b << 16) | a;
+}
+
+// adler32 of concatenated data from adler32 of both parts, same as zlib's adler32_combine()
+static uint32_t fz_adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2){
+    uint32_t rem = len2 % ADLER_BASE;
+    uint32_t a = (adler1 & 0xffff) + (adler2 & 0xffff) + ADLER_BASE - 1;
+    uint32_t b = (rem * (adler1 & 0xffff)) % ADLER_BASE + (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+    a %= ADLER_BASE;
+    b %= ADLER_BASE;
+    return (b << 16) | a;
+}
+
+// a * b modulo crc32 polynomial, reflected bit order
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b){
+    uint32_t p = 0;
+    for (uint32_t m = 1u << 31; m; m >>= 1){
+        if (a & m)
+            p ^= b;
+        b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+    return p;
+}
+
+// crc32 of concatenated data from crc32 of both parts, same as zlib's crc32_combine()
+static uint32_t fz_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2){
+    // crc1 is shifted by len2 zero bytes, i.e. multiplied by x^(8 * len2)
+    uint32_t xp = 1u << 23;             // x^8
+    uint32_t p = 1u << 31;              // x^0
+    for (; len2; len2 >>= 1){
+        if (len2 & 1)
+            p = crc32_multmodp(xp, p);
+        xp = crc32_multmodp(xp, xp);
+    }
+    return crc32_multmodp(p, crc1) ^ crc2;
+}
+
+
+// SegInflator class implementation
+bool SegInflator::suitable(const fz_container_t &c){
+    if ((c.codec != FZ_CODEC_ZLIB && c.codec != FZ_CODEC_GZIP) || c.blocks < 2 || !c.block_size || c.block_size > FZ_PAR_MAX_SEGMENT)
+        return false;
+
+    // index is known to be ordered, it's last segment must leave room for stream trailer and each segment must inflate to some data
+    size_t trl = c.codec == FZ_CODEC_GZIP ? GZ_TRAILER_SIZE : ZLIB_TRAILER_SIZE;
+    return fz_get_le32(c.index + (c.blocks - 1) * FZ_CNT_ENTRY_SIZE) < c.size - trl && (uint64_t)(c.blocks - 1) * c.block_size < c.img_size;
+}
+
+size_t SegInflator::seg_begin(size_t i) const {
+    return fz_get_le32(cnt.index + i * FZ_CNT_ENTRY_SIZE);
+}
+
+size_t SegInflator::seg_end(size_t i) const {
+    return (i + 1 < cnt.blocks) ? seg_begin(i + 1) : cnt.size - trl_size;
+}
+
+size_t SegInflator::seg_size(size_t i) const {
+    size_t left = cnt.img_size - i * cnt.block_size;
+    return left < cnt.block_size ? left : cnt.block_size;
+}
+
+bool SegInflator::init(){
+    end();
+    trl_size = cnt.codec == FZ_CODEC_GZIP ? GZ_TRAILER_SIZE : ZLIB_TRAILER_SIZE;
+
+    size_t in_max = 0;
+    for (size_t i = 0; i != cnt.blocks; ++i)
+        if (seg_end(i) - seg_begin(i) > in_max)
+            in_max = seg_end(i) - seg_begin(i);
+
+    quit = false;
+    for (auto &s : slots){
+        s.owner = this;
+        s.tinfl = new(std::nothrow) tinfl_decompressor;
+        s.in = (uint8_t*)malloc(in_max);
+        s.out = (uint8_t*)malloc(cnt.block_size + 1);   // a spare byte to catch segments that inflate past block size
+        s.go = xSemaphoreCreateBinary();
+        s.done = xSemaphoreCreateBinary();
+        if (!s.tinfl || !s.in || !s.out || !s.go || !s.done){
+            end();
+            return false;   // OOM
+        }
+    }
+
+    // spread decoder tasks over cores, caller's core is shared with one of them
+    for (size_t i = 0; i != FZ_PAR_TASKS; ++i){
+#if portNUM_PROCESSORS > 1
+        BaseType_t core = i % portNUM_PROCESSORS;
+#else
+        BaseType_t core = tskNO_AFFINITY;
+#endif
+        if (xTaskCreatePinnedToCore(SegInflator::seg_task, FZ_PAR_TASK_NAME, FZ_PAR_TASK_STACK, &slots[i], uxTaskPriorityGet(NULL), NULL, core) != pdPASS){
+            end();
+            return false;
+        }
+        slots[i].task = true;
+    }
+
+    reset();
+    rdy = true;
+    ESP_LOGI(TAG, "%u decoder tasks, %u segments of %u bytes", FZ_PAR_TASKS, cnt.blocks, cnt.block_size);
+    return rdy;
+}
+
+void SegInflator::reset(){
+    // decoders must be done with pending segments, their data is dropped
+    for (auto &s : slots){
+        if (s.queued){
+            xSemaphoreTake(s.done, portMAX_DELAY);
+            s.queued = false;
+        }
+        s.busy = false;
+        s.in_len = s.out_len = 0;
+    }
+
+    total_in = total_out = 0;
+    seg_in = seg_out = 0;
+    trl_len = 0;
+    check = cnt.codec == FZ_CODEC_GZIP ? 0 : 1;
+}
+
+void SegInflator::end(){
+    rdy = false;
+    reset();
+
+    quit = true;
+    for (auto &s : slots){
+        if (s.task){
+            xSemaphoreGive(s.go);
+            xSemaphoreTake(s.done, portMAX_DELAY);      // task has quit
+            s.task = false;
+        }
+        if (s.go){ vSemaphoreDelete(s.go); s.go = nullptr; }
+        if (s.done){ vSemaphoreDelete(s.done); s.done = nullptr; }
+        delete s.tinfl;
+        s.tinfl = nullptr;
+        free(s.in);
+        s.in = nullptr;
+        free(s.out);
+        s.out = nullptr;
+    }
+}
+
+int SegInflator::inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final, size_t chunk_size){
+    if (!rdy)
+        return MZ_BUF_ERROR;    // decoder not initialized
+
+    while (len && trl_len < trl_size){
+        size_t n;
+        if (total_in < seg_begin(0)){
+            // stream header, it's format has been checked by Unpacker against container codec
+            n = seg_begin(0) - total_in;
+            if (n > len)
+                n = len;
+        } else if (seg_in < cnt.blocks){
+            seg_slot_t &s = slots[seg_in % FZ_PAR_TASKS];
+            if (s.busy){
+                // slot is still taken by the oldest pending segment, it must be passed to callback first
+                int err = seg_flush(slots[seg_out % FZ_PAR_TASKS], callback, chunk_size, true);
+                if (err < 0)
+                    return err;
+                continue;
+            }
+
+            n = seg_end(seg_in) - total_in;
+            if (n > len)
+                n = len;
+            memcpy(s.in + s.in_len, inBuff, n);
+            s.in_len += n;
+
+            if (total_in + n == seg_end(seg_in)){
+                // segment is complete, hand it over to decoder task
+                s.seg = seg_in++;
+                s.busy = s.queued = true;
+                s.out_len = 0;
+                xSemaphoreGive(s.go);
+            }
+        } else {
+            n = trl_size - trl_len;
+            if (n > len)
+                n = len;
+            memcpy(trl + trl_len, inBuff, n);
+            trl_len += n;
+        }
+
+        inBuff += n;
+        len -= n;
+        total_in += n;
+    }
+
+    // pass inflated segments to callback in order, the last one goes once stream trailer is complete
+    bool done = trl_len == trl_size;
+    size_t ready = done ? cnt.blocks : (seg_in < cnt.blocks ? seg_in : cnt.blocks - 1);
+    while (seg_out < ready){
+        int err = seg_flush(slots[seg_out % FZ_PAR_TASKS], callback, chunk_size, done);
+        if (err < 0)
+            return err;
+        if (!err)
+            break;          // decoder is still busy with it, will pass it on next call
+    }
+
+    if (done)
+        return MZ_STREAM_END;
+
+    return final ? MZ_STREAM_ERROR : MZ_OK;
+}
+
+int SegInflator::seg_flush(seg_slot_t &s, inflate_cb_t &callback, size_t chunk_size, bool wait){
+    if (s.queued){
+        if (xSemaphoreTake(s.done, wait ? portMAX_DELAY : 0) != pdTRUE)
+            return 0;
+        s.queued = false;
+    }
+    wdt_feed();
+
+    if (s.err){
+        ESP_LOGW(TAG, "segment %u is corrupted", s.seg);
+        return MZ_DATA_ERROR;
+    }
+
+    size_t size = seg_size(s.seg);
+    bool last = s.seg == cnt.blocks - 1;
+
+    // segment checksum is calculated by decoder task, so that the last segment is checked before it goes to callback
+    if (!s.out_len)
+        check = (cnt.codec == FZ_CODEC_GZIP) ? fz_crc32_combine(check, s.check, size) : fz_adler32_combine(check, s.check, size);
+
+    if (last && !trailer_check()){
+        ESP_LOGW(TAG, "stream checksum mismatch");
+        return MZ_DATA_ERROR;
+    }
+
+    // segments are multiples of sector size, so aligned chunks stay aligned
+    chunk_size &= ~(out_align - 1);
+    if (!chunk_size)
+        chunk_size = size;
+
+    // callback can consume only a part of data
+    while (s.out_len < size){
+        size_t n = (size - s.out_len < chunk_size) ? size - s.out_len : chunk_size;
+        size_t consumed = callback(total_out, s.out + s.out_len, n, last && s.out_len + n == size);
+        if (!consumed || consumed > n)
+            return MZ_ERRNO;
+        s.out_len += consumed;
+        total_out += consumed;
+    }
+
+    s.busy = false;
+    s.in_len = 0;
+    ++seg_out;
+    return 1;
+}
+
+bool SegInflator::trailer_check() const {
+    if (cnt.codec == FZ_CODEC_GZIP)
+        return fz_get_le32(trl) == check && fz_get_le32(trl + 4) == cnt.img_size;
+
+    return (uint32_t)(trl[0] << 24 | trl[1] << 16 | trl[2] << 8 | trl[3]) == check;
+}
+
+void SegInflator::seg_task(void *arg){
+    seg_slot_t *s = static_cast<seg_slot_t*>(arg);
+    SegInflator *d = s->owner;
+
+    while (xSemaphoreTake(s->go, portMAX_DELAY) == pdTRUE && !d->quit){
+        size_t size = d->seg_size(s->seg);
+        bool last = s->seg == d->cnt.blocks - 1;
+
+        // each segment is a raw deflate data that ends with a full flush or with the final block,
+        // it is inflated at once into a linear buffer, there are no references to earlier segments
+        size_t in_bytes = s->in_len, out_bytes = size + 1;
+        tinfl_init(s->tinfl);
+        tinfl_status st = tinfl_decompress(s->tinfl, s->in, &in_bytes, s->out, s->out, &out_bytes,
+                                           TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF | (last ? 0 : TINFL_FLAG_HAS_MORE_INPUT));
+
+        s->err = out_bytes != size || st != (last ? TINFL_STATUS_DONE : TINFL_STATUS_NEEDS_MORE_INPUT);
+        if (!s->err)
+            s->check = (d->cnt.codec == FZ_CODEC_GZIP) ? fz_crc32_le(0, s->out, size) : fz_adler32(1, s->out, size);
+        xSemaphoreGive(s->done);
+    }
+
+    xSemaphoreGive(s->done);
+    vTaskDelete(NULL);
+}
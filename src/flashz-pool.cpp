@@ -0,0 +1,217 @@
+/*
+    ESP32-FlashZ library
+
+    This code implements a library for ESP32-xx family chips and provides an
+    ability to upload zlib compressed firmware images during OTA updates.
+
+    decoder buffer pool, keeps dictionaries in arena/PSRAM/warm heap buffers across update sessions
+
+    Copyright (C) Emil Muratov, 2022
+    GitHub: https://github.com/vortigont/esp32-flashz
+
+ *  This program or library is free software; you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License version 2 for more details.
+ *
+ *  You should have received a copy of the GNU General Public License version 2
+ *  along with this library; if not, get one at
+ *  https://opensource.org/licenses/GPL-2.0
+ */
+
+#include "flashz.hpp"
+#include "esp_heap_caps.h"
+
+#ifdef ARDUINO
+#include "esp32-hal-log.h"
+#else
+#include "esp_log.h"
+#endif
+
+// ESP32 log tag
+static const char *TAG __attribute__((unused)) = "FZ-POOL";
+
+#define FZ_POOL_CAPS_INTERNAL   (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#define FZ_POOL_CAPS_PSRAM      (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#define FZ_POOL_CAPS_DEFAULT    (MALLOC_CAP_DEFAULT | MALLOC_CAP_8BIT)
+
+// FzPool class implementation
+void* FzPool::alloc(size_t size, bool fast){
+    ++stat.allocs;
+
+    // smallest idle buffer that fits, speed-critical data is not put into PSRAM buffers
+    buff_t *b = nullptr;
+    for (size_t i = 0; i != cnt; ++i){
+        buff_t &c = buffs[i];
+        if (c.busy || c.size < size || (fast && !c.fast))
+            continue;
+        if (!b || c.size < b->size)
+            b = &c;
+    }
+
+    if (b){
+        if (b->arena)
+            ++stat.arena_hits;
+        else
+            ++stat.warm_hits;
+        b->busy = true;
+        return b->ptr;
+    }
+
+    // idle warm buffers do not fit, release them so that heap has a better chance for a contiguous block
+    release();
+    if (cnt == FZ_POOL_SLOTS){
+        ++stat.fails;
+        ESP_LOGW(TAG, "no free pool slots");
+        return nullptr;
+    }
+
+    size_t off = (arena_top + FZ_POOL_ALIGN - 1) & ~(FZ_POOL_ALIGN - 1);
+    if (arena_ptr && off + size <= arena_size){
+        // arena placement is up to the user, so it serves any request
+        b = &buffs[cnt++];
+        *b = { arena_ptr + off, size, true, true, true };
+        arena_top = off + size;
+        ++stat.arena_hits;
+        return b->ptr;
+    }
+
+    b = heap_alloc(size, fast);
+    if (!b){
+        ++stat.fails;
+        ESP_LOGW(TAG, "can't allocate %u bytes", size);
+        return nullptr;
+    }
+    return b->ptr;
+}
+
+FzPool::buff_t* FzPool::heap_alloc(size_t size, bool fast){
+    uint32_t t = micros();
+    uint8_t *p = nullptr;
+    bool internal = false;
+
+    auto try_alloc = [&](uint32_t caps){
+        p = (uint8_t*)heap_caps_malloc(size, caps);
+        internal = p && caps == FZ_POOL_CAPS_INTERNAL;
+        if (p && caps == FZ_POOL_CAPS_PSRAM)
+            ++stat.psram;
+    };
+
+    if (fast || mem == fz_mem_t::internal)
+        try_alloc(FZ_POOL_CAPS_INTERNAL);
+
+    if (!p && mem == fz_mem_t::psram){
+        // speed-critical state ends up here only if internal RAM is exhausted, slow update is better than failed one
+        try_alloc(FZ_POOL_CAPS_PSRAM);
+        if (!p && !fast)
+            try_alloc(FZ_POOL_CAPS_INTERNAL);       // chip has no PSRAM or it's full
+    }
+
+    // default policy places buffers wherever malloc() does
+    if (!p && mem == fz_mem_t::heap)
+        try_alloc(FZ_POOL_CAPS_DEFAULT);
+
+    t = micros() - t;
+    stat.alloc_us += t;
+    if (t > stat.alloc_us_max)
+        stat.alloc_us_max = t;
+
+    if (!p)
+        return nullptr;
+
+    ESP_LOGD(TAG, "heap buffer %u bytes, %s, %u us", size, internal ? "internal" : "external/default", t);
+    buff_t *b = &buffs[cnt++];
+    *b = { p, size, true, false, internal };
+    return b;
+}
+
+void FzPool::free(void *ptr){
+    if (!ptr)
+        return;
+
+    size_t i = 0;
+    while (i != cnt && buffs[i].ptr != ptr)
+        ++i;
+
+    if (i == cnt){
+        ESP_LOGE(TAG, "buffer %p does not belong to pool", ptr);
+        return;
+    }
+
+    buffs[i].busy = false;
+    if (!buffs[i].arena){
+        if (!warm)
+            drop(i);
+        return;
+    }
+
+    // roll arena top back over idle buffers, so that arena does not leak if decoder reallocates dictionary
+    for (size_t j = 0; j != cnt; ){
+        buff_t &b = buffs[j];
+        if (b.arena && !b.busy && b.ptr + b.size == arena_ptr + arena_top){
+            arena_top = b.ptr - arena_ptr;
+            drop(j);
+            j = 0;
+        } else
+            ++j;
+    }
+}
+
+void FzPool::drop(size_t i){
+    if (!buffs[i].arena)
+        heap_caps_free(buffs[i].ptr);
+    buffs[i] = buffs[--cnt];
+}
+
+void FzPool::release(){
+    for (size_t i = cnt; i--; ){
+        if (!buffs[i].busy && !buffs[i].arena)
+            drop(i);
+    }
+}
+
+bool FzPool::arena(void *buff, size_t size){
+    for (size_t i = 0; i != cnt; ++i){
+        if (buffs[i].arena && buffs[i].busy){
+            ESP_LOGW(TAG, "arena is in use");
+            return false;
+        }
+    }
+
+    for (size_t i = cnt; i--; ){
+        if (buffs[i].arena)
+            drop(i);
+    }
+
+    arena_top = 0;
+    arena_ptr = nullptr;
+    arena_size = 0;
+    if (!buff)
+        return true;
+
+    size_t pad = (FZ_POOL_ALIGN - (uintptr_t)buff % FZ_POOL_ALIGN) % FZ_POOL_ALIGN;
+    if (size <= pad)
+        return false;
+
+    arena_ptr = (uint8_t*)buff + pad;
+    arena_size = size - pad;
+    return true;
+}
+
+void FzPool::getstat(fz_pool_stat_t &s){
+    s = stat;
+    s.warm_bytes = 0;
+    for (size_t i = 0; i != cnt; ++i){
+        if (!buffs[i].busy && !buffs[i].arena)
+            s.warm_bytes += buffs[i].size;
+    }
+    s.arena_used = arena_top;
+
+    s.heap_free = heap_caps_get_free_size(FZ_POOL_CAPS_INTERNAL);
+    s.heap_largest = heap_caps_get_largest_free_block(FZ_POOL_CAPS_INTERNAL);
+    s.heap_frag = s.heap_free ? 100 - s.heap_largest * 100 / s.heap_free : 0;
+}
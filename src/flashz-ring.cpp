@@ -0,0 +1,97 @@
+/*
+    ESP32-FlashZ library
+
+    This code implements a library for ESP32-xx family chips and provides an
+    ability to upload zlib compressed firmware images during OTA updates.
+
+    lock-free SPSC byte ring, passes upload data from network callback to the task that flashes it
+
+    Copyright (C) Emil Muratov, 2022
+    GitHub: https://github.com/vortigont/esp32-flashz
+
+ *  This program or library is free software; you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License version 2 for more details.
+ *
+ *  You should have received a copy of the GNU General Public License version 2
+ *  along with this library; if not, get one at
+ *  https://opensource.org/licenses/GPL-2.0
+ */
+
+#include "flashz.hpp"
+
+// FzRing class implementation
+bool FzRing::begin(size_t sz){
+    if (!sz || (sz & (sz - 1)))
+        return false;       // counters wrap correctly only for power of 2 sizes
+
+    if (size != sz){
+        end();
+        buff = (uint8_t*)malloc(sz);
+        if (!buff)
+            return false;   // OOM
+        size = sz;
+    }
+
+    head = 0;
+    tail = 0;
+    held = false;
+    return true;
+}
+
+void FzRing::end(){
+    free(buff);
+    buff = nullptr;
+    size = 0;
+    head = 0;
+    tail = 0;
+    held = false;
+}
+
+size_t FzRing::put(const uint8_t *data, size_t len){
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    if (len > size - (h - t))
+        len = size - (h - t);
+
+    // copy up to the wrap point, then the rest to the ring start
+    size_t off = h & (size - 1);
+    size_t n = (len < size - off) ? len : size - off;
+    memcpy(buff + off, data, n);
+    memcpy(buff, data + n, len - n);
+
+    head.store(h + len, std::memory_order_release);
+    return len;
+}
+
+size_t FzRing::peek(const uint8_t* &data) const {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    size_t off = t & (size - 1);
+    data = buff + off;
+    return (h - t < size - off) ? h - t : size - off;
+}
+
+bool FzRing::hold(size_t wnd){
+    if (space() >= wnd)
+        return false;
+
+    held = true;
+    // consumer could have made room before the mark was set and won't release producer then.
+    // The fence orders mark store before counters load, release() does the same in reverse
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (space() >= wnd && held.exchange(false))
+        return false;
+
+    return true;
+}
+
+bool FzRing::release(size_t wnd){
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return held.load() && space() >= wnd && held.exchange(false);
+}
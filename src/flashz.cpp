@@ -27,8 +27,24 @@
  *  https://opensource.org/licenses/GPL-2.0
  */
 
+#include <new>
 #include "flashz.hpp"
 #include "esp_task_wdt.h"
+#include "esp_heap_caps.h"
+#include "esp_ota_ops.h"
+#include "mbedtls/version.h"
+#include "lwip/sockets.h"
+
+// mbedtls 2.x has *_ret() variants of sha256 functions, plain ones are deprecated
+#if MBEDTLS_VERSION_NUMBER < 0x03000000
+#define fz_sha256_starts(ctx)           mbedtls_sha256_starts_ret(ctx, 0)
+#define fz_sha256_update(ctx, d, len)   mbedtls_sha256_update_ret(ctx, d, len)
+#define fz_sha256_finish(ctx, out)      mbedtls_sha256_finish_ret(ctx, out)
+#else
+#define fz_sha256_starts(ctx)           mbedtls_sha256_starts(ctx, 0)
+#define fz_sha256_update(ctx, d, len)   mbedtls_sha256_update(ctx, d, len)
+#define fz_sha256_finish(ctx, out)      mbedtls_sha256_finish(ctx, out)
+#endif
 
 #ifdef ARDUINO
 #include "esp32-hal-log.h"
@@ -39,60 +55,131 @@
 // ESP32 log tag
 static const char *TAG __attribute__((unused)) = "FLASHZ";
 
-#define INFLATOR_STREAM_BUFF_SIZE   128
-#define INFLATOR_STREAM_DELAY_MS    5
-#define INFLATOR_STREAM_TIMEOUT_MS  10000
+
+
+// FzSha256 class implementation
+FzSha256::FzSha256(){
+    mbedtls_sha256_init(&ctx);
+    fz_sha256_starts(&ctx);
+}
+
+FzSha256::~FzSha256(){
+    mbedtls_sha256_free(&ctx);
+}
+
+void FzSha256::update(const uint8_t *data, size_t len){
+    fz_sha256_update(&ctx, data, len);
+}
+
+void FzSha256::finish(uint8_t *digest){
+    fz_sha256_finish(&ctx, digest);
+}
 
 
 // Inflator class implementation
 bool Inflator::init(){
     rdy = false;
 
-    if (!dictBuff)
-        dictBuff = (uint8_t *)malloc(sizeof(uint8_t) * TINFL_LZ_DICT_SIZE);
-
-    if (!dictBuff)
-        return false;   // OOM
-
+    // dict is allocated once stream's window size is known
     if (!m_decomp)
-        m_decomp = new tinfl_decompressor;
+        m_decomp = (tinfl_decompressor*)FzPool::getInstance().alloc(sizeof(tinfl_decompressor), true);
 
-    if (!m_decomp){
-        delete dictBuff;
-        dictBuff = nullptr;
+    if (!m_decomp)
         return false;   // OOM
-    }
 
     reset();
     rdy = true;
     return rdy;
 }
 
+bool Inflator::dict_alloc(size_t size){
+    if (size < out_align)
+        size = out_align;
+
+    if (dictBuff && dict_size == size)
+        return true;
+
+    FzPool::getInstance().free(dictBuff);
+    dictBuff = (uint8_t *)FzPool::getInstance().alloc(size);
+    dict_size = dictBuff ? size : 0;
+    dict_free = dict_size;
+    if (!dictBuff)
+        return false;   // OOM
+
+    ESP_LOGD(TAG, "dictionary size %u", size);
+    return true;
+}
+
 void Inflator::reset(){
     if (m_decomp)
         tinfl_init(m_decomp);
 
-    dict_free = TINFL_LZ_DICT_SIZE;
+    dict_free = dict_size;
     dict_begin = dict_offset = 0;
 
     avail_in = total_in = total_out = 0;
 
     decomp_status = TINFL_STATUS_NEEDS_MORE_INPUT;
-    decomp_flags = TINFL_FLAG_PARSE_ZLIB_HEADER;          // compressed stream MUST have a proper zlib header
+    decomp_flags = 0;                   // zlib header parsing flag is set once container format is detected
+
+    container = container_t::detect;
+    gz_state = gz_state_t::fixed;
+    gz_flags = 0;
+    gz_cnt = gz_xlen = 0;
+    gz_crc = 0;
+    ra_len = 0;
 }
 
 void Inflator::end(){
     rdy = false;
-    delete m_decomp;
+    // buffers go back to the pool, they are kept for the next session in keep-warm mode
+    FzPool::getInstance().free(m_decomp);
     m_decomp = nullptr;
-    delete dictBuff;
+    FzPool::getInstance().free(dictBuff);
     dictBuff = nullptr;
+    dict_size = 0;
 }
 
 int Inflator::inflate(bool final){
     if (!next_in)
         return MZ_STREAM_ERROR;
 
+    // detect container format by the first byte of input
+    if (container == container_t::detect){
+        if (!avail_in)
+            return final ? MZ_STREAM_ERROR : MZ_OK;
+
+        // zlib CMF byte carries window size, tinfl checks that dict is not smaller than that
+        // 0x1F is never a valid zlib CMF byte, with a single byte of input second gzip magic byte is checked by gz_header()
+        size_t window = TINFL_LZ_DICT_SIZE;
+        if (next_in[0] == GZ_HEADER && (avail_in < 2 || next_in[1] == GZ_HEADER2)){
+            container = container_t::gzip;
+        } else {
+            container = container_t::zlib;
+            decomp_flags |= TINFL_FLAG_PARSE_ZLIB_HEADER;   // compressed stream MUST have a proper zlib header
+            if ((next_in[0] >> 4) < 8)
+                window = 1 << ((next_in[0] >> 4) + 8);
+        }
+
+        if (!dict_alloc(window))
+            return MZ_MEM_ERROR;
+    }
+
+    // gzip member header/trailer is handled here, tinfl gets only raw deflate data
+    if (container == container_t::gzip && gz_state != gz_state_t::body){
+        if (gz_state == gz_state_t::done)
+            return MZ_STREAM_END;
+
+        int r = (gz_state < gz_state_t::body) ? gz_header() : gz_trailer_check();
+        if (r < 0)
+            return r;
+        if (!r)
+            return final ? MZ_STREAM_ERROR : MZ_OK;         // need more input
+        if (gz_state == gz_state_t::done)
+            return MZ_STREAM_END;
+        // header is complete, go on with deflate data
+    }
+
     if (!dict_free)
         return MZ_NEED_DICT;
 
@@ -102,160 +189,1105 @@ int Inflator::inflate(bool final){
         decomp_flags |= TINFL_FLAG_HAS_MORE_INPUT;
 
     size_t in_bytes = avail_in, out_bytes = dict_free;
+    tinfl_status prev_status = decomp_status;
 
     // decompress as may input as available or as long as free dict space is available
     decomp_status = tinfl_decompress(m_decomp, next_in, &in_bytes, dictBuff, dictBuff + dict_offset, &out_bytes, decomp_flags);
 
+    if (container == container_t::gzip)
+        gz_crc = fz_crc32_le(gz_crc, dictBuff + dict_offset, out_bytes);
+
     next_in += in_bytes;    // advance the input buffer pointer to the number of consumed bytes
     avail_in -= in_bytes;   // decrement input buffer counter
     total_in += in_bytes;   // increment total input cntr
     total_out += out_bytes; // increment total output cntr
 
-    dict_offset = (dict_offset + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+    dict_offset = (dict_offset + out_bytes) & (dict_size - 1);
     dict_free -= out_bytes;
 
     if (decomp_status < 0)
         return MZ_DATA_ERROR; /* Stream is corrupted (there could be some uncompressed data left in the output dictionary - oh well). */
 
+    if (decomp_status == TINFL_STATUS_DONE && prev_status != TINFL_STATUS_DONE){
+        // deflate data is over, tinfl might have read ahead a few bytes past it into it's bit buffer, get it back
+        // gzip trailer goes first, the rest belongs to whatever follows compressed stream
+        uint32_t nbits = m_decomp->m_num_bits;
+        tinfl_bit_buf_t bits = m_decomp->m_bit_buf >> (nbits & 7);    // drop the bits up to a byte boundary
+        for (nbits &= ~7; nbits; nbits -= 8, bits >>= 8){
+            if (container == container_t::gzip && gz_cnt < GZ_TRAILER_SIZE)
+                gz_trailer[gz_cnt++] = bits & 0xff;
+            else if (ra_len < sizeof(ra_buff))
+                ra_buff[ra_len++] = bits & 0xff;
+        }
+    }
+
+    if (container == container_t::gzip && decomp_status == TINFL_STATUS_DONE){
+        gz_state = gz_state_t::trailer;
+        int r = gz_trailer_check();
+        if (r < 0)
+            return r;
+        if (!r)
+            return final ? MZ_STREAM_ERROR : MZ_OK;         // need more input for trailer
+        return MZ_STREAM_END;
+    }
+
     if ((decomp_status == TINFL_STATUS_NEEDS_MORE_INPUT) && final )    /* if deflator need more input and we demand it's a final call, than something must be wrong with a stream */
         return MZ_STREAM_ERROR;
 
     if (decomp_status == TINFL_STATUS_HAS_MORE_OUTPUT)    /* if deflator can't fit more data to the output buf, than need to flush a buff */
         return MZ_NEED_DICT;
 
-    //return MZ_OK;       // this should be the only
-    return ((decomp_status == TINFL_STATUS_DONE) && (final)) ? MZ_STREAM_END : MZ_OK;
+    // end of stream is signaled by the compressed stream itself, no matter if caller knows it's the final input chunk
+    return (decomp_status == TINFL_STATUS_DONE) ? MZ_STREAM_END : MZ_OK;
 };
 
-int Inflator::inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final, size_t chunk_size){
-    if (!rdy)
-        return MZ_BUF_ERROR;    // inflator not initialized
+int Inflator::gz_header(){
+    while (avail_in && gz_state < gz_state_t::body){
+        uint8_t c = *next_in;
+        if (gz_state != gz_state_t::hcrc)
+            gz_crc = fz_crc32_le(gz_crc, next_in, 1);   // header crc16 covers all the header bytes before it
+        ++next_in;
+        --avail_in;
+        ++total_in;
+
+        bool field_done = false;
+        switch (gz_state){
+            case gz_state_t::fixed :
+                if ((gz_cnt == 0 && c != GZ_HEADER) || (gz_cnt == 1 && c != GZ_HEADER2) || (gz_cnt == 2 && c != 8) || (gz_cnt == 3 && (c & GZ_FLG_RESERVED))){
+                    ESP_LOGW(TAG, "bad gzip header");
+                    return MZ_DATA_ERROR;                   // not a gzip, not a deflate method or unknown flags
+                }
+                if (gz_cnt == 3)
+                    gz_flags = c;
+                field_done = (++gz_cnt == GZ_HEADER_SIZE);
+                break;
+            case gz_state_t::xlen :
+                gz_xlen |= c << (8 * gz_cnt);
+                field_done = (++gz_cnt == 2);
+                break;
+            case gz_state_t::extra :
+                field_done = (++gz_cnt == gz_xlen);
+                break;
+            case gz_state_t::name :
+            case gz_state_t::comment :
+                field_done = !c;                            // zero-terminated string
+                break;
+            case gz_state_t::hcrc :
+                gz_xlen = gz_cnt ? gz_xlen | (c << 8) : c;  // reuse xlen to collect header crc
+                if (++gz_cnt == 2){
+                    if (gz_xlen != (gz_crc & 0xffff)){
+                        ESP_LOGW(TAG, "gzip header crc mismatch");
+                        return MZ_DATA_ERROR;
+                    }
+                    field_done = true;
+                }
+                break;
+            default:
+                break;
+        }
 
-    next_in = inBuff;
-    avail_in = len;
+        // advance to the next field present in header
+        while (field_done){
+            gz_state = static_cast<gz_state_t>(static_cast<uint8_t>(gz_state) + 1);
+            gz_cnt = 0;
+            switch (gz_state){
+                case gz_state_t::xlen :     field_done = !(gz_flags & GZ_FLG_FEXTRA); break;
+                case gz_state_t::extra :    field_done = !(gz_flags & GZ_FLG_FEXTRA) || !gz_xlen; break;
+                case gz_state_t::name :     field_done = !(gz_flags & GZ_FLG_FNAME); break;
+                case gz_state_t::comment :  field_done = !(gz_flags & GZ_FLG_FCOMMENT); break;
+                case gz_state_t::hcrc :     field_done = !(gz_flags & GZ_FLG_FHCRC); break;
+                default :                   field_done = false;
+            }
+        }
+    }
 
-    decomp_flags &= ~( TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF );  // use internal ring buffer for decompression
+    if (gz_state != gz_state_t::body)
+        return 0;
 
-    for (;;){
-        unsigned int _to = total_out;
-        int err = inflate(final);                                   // inflate as much in-data as possible
+    gz_crc = 0;         // crc32 of inflated data starts here
+    return 1;
+}
 
-        if (err < 0){
-            ESP_LOGW(TAG, "inflate failure - MZ_ERR: %d, inflate status: %d", err, decomp_status);
-            return err;                                             // exit on any error
-        }
-
-        size_t deco_data_len = (dict_offset - dict_begin) & (TINFL_LZ_DICT_SIZE - 1);
-        //ESP_LOGD(TAG, "+inflate chunk - mz_err:%d, ddl:%d, dfree:%u, tin:%u, tout:%u", err, deco_data_len, dict_free, total_in, total_out);
-
-        if (!dict_offset && !dict_begin && total_out > _to)
-            deco_data_len = TINFL_LZ_DICT_SIZE;     // jackpot - a full dict worth of data
-
-        /**
-         * call the callback if:
-         * - no free space in dict
-         * - accumulated data in dict is >= prefered chunk size
-         * - it's a final input chunk
-         */
-        if (!dict_free || deco_data_len >= chunk_size || final){
-            //ESP_LOGD(TAG, "dict stat: dfree:%u, ddl:%u, end:%u, tin:%d, tout:%d", dict_free, deco_data_len, final, total_in, total_out);
-
-            /**
-             * iterate the callback while:
-             * - no space in dict
-             * - have data in dict and it's a final chunk
-             * - have data in dict >= prefered chunk size
-             *
-             */
-            while (!dict_free || (final && (bool)deco_data_len) || (deco_data_len >= chunk_size)){
-                ESP_LOGD(TAG, "CB - idx:%u, head:%u, dbgn:%u, dend:%u, ddatalen:%u, avin:%u, tin:%u, tout:%u, fin:%d", total_out, (uint32_t)dictBuff, dict_begin, dict_offset, deco_data_len, avail_in, total_in, total_out, final);  //  && (err == MZ_STREAM_END)
-
-                // callback can consume only a portion of data from dict
-                size_t consumed = callback(total_out - deco_data_len, dictBuff + dict_begin, deco_data_len, final && err == MZ_STREAM_END);
-
-                if (!consumed || consumed > deco_data_len)      // it's an error not to consume or consume too much of dict data
-                    return MZ_ERRNO;
-
-                // clear the dict if all the data has been consumed so far
-                if (consumed == deco_data_len){
-                    dict_free = TINFL_LZ_DICT_SIZE;
-                    dict_offset = 0;
-                    dict_begin = 0;
-                } else {
-                    dict_begin = (dict_begin+consumed) & (TINFL_LZ_DICT_SIZE - 1);     // offset deco data pointer in dict
-                }
+int Inflator::gz_trailer_check(){
+    while (avail_in && gz_cnt < GZ_TRAILER_SIZE){
+        gz_trailer[gz_cnt++] = *next_in++;
+        --avail_in;
+        ++total_in;
+    }
 
-                deco_data_len -= consumed;
-            }
-        }
+    if (gz_cnt < GZ_TRAILER_SIZE)
+        return 0;
 
-        // if we are done with this chunk of input, than quit
-        if (!avail_in || err == MZ_STREAM_END)
-            return err;
+    uint32_t crc = gz_trailer[0] | gz_trailer[1] << 8 | gz_trailer[2] << 16 | gz_trailer[3] << 24;
+    uint32_t isize = gz_trailer[4] | gz_trailer[5] << 8 | gz_trailer[6] << 16 | gz_trailer[7] << 24;
 
-        esp_task_wdt_reset();           // feed the dog, flashing highly compressed data (like almost empty FS image) could trigger WDT
+    if (crc != gz_crc || isize != total_out){
+        ESP_LOGW(TAG, "gzip trailer mismatch, crc:%08x/%08x, size:%u/%u", crc, gz_crc, isize, total_out);
+        return MZ_DATA_ERROR;
+    }
 
-        // go another inflate round
+    gz_state = gz_state_t::done;
+    return 1;
+}
+
+int Inflator::dict_inflate(bool final, size_t &deco_data_len){
+    wdt_feed();
+
+    decomp_flags &= ~( TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF );  // use internal ring buffer for decompression
+
+    int err = inflate(final);                                       // inflate as much in-data as possible
+
+    if (err < 0){
+        ESP_LOGW(TAG, "inflate failure - MZ_ERR: %d, inflate status: %d", err, decomp_status);
+        deco_data_len = 0;
+        return err;
     }
+
+    // dict is filled up to it's end before it wraps, full dict has dict_offset back at 0
+    deco_data_len = (dict_free ? dict_offset : dict_size) - dict_begin;
+
+    ESP_LOGD(TAG, "inflate round - mz_err:%d, ddl:%u, dfree:%u, avin:%u, tin:%u, tout:%u, fin:%d", err, deco_data_len, dict_free, avail_in, total_in, total_out, final);
+    return err;
+}
+
+int Inflator::inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final, size_t chunk_size){
+    return inflate_block_to(inBuff, len, callback, final, chunk_size);
 }
 
 
-int Inflator::inflate_stream_to_cb(Stream &data, int size, inflate_cb_t callback, size_t chunk_size){
-    uint8_t buff[INFLATOR_STREAM_BUFF_SIZE];    // stream buffer
+int Decompressor::inflate_stream_to_cb(Stream &data, int size, inflate_cb_t callback, size_t chunk_size, stream_wait_cb_t wait){
+    uint8_t *buff = (uint8_t*)malloc(INFLATOR_STREAM_BUFF_SIZE);    // stream buffer
+    if (!buff)
+        return MZ_MEM_ERROR;
 
+    bool unknown = size < 0;        // read till the end of compressed stream
+    int err = MZ_OK;
+    in_stalled = false;
     do {
-        // check stream readiness
-        uint32_t now = millis();
-        uint32_t timeout = now+INFLATOR_STREAM_TIMEOUT_MS;
-        while(!data.available() ) {
-          if( millis() > timeout ) {
-            // timeout on stream, giving up
-            return MZ_STREAM_ERROR;
-          }
-          vTaskDelay(1); // let the stream breathe
+        uint32_t t = micros();
+        int available = data.available();
+
+        // wait for stream data
+        if (available <= 0){
+            if (wait){
+                bool ok = wait(data, INFLATOR_STREAM_TIMEOUT_MS);
+                wait_us += micros() - t;
+                if (!ok){
+                    in_stalled = (err == MZ_OK);  // inflater waits for more input
+                    err = MZ_STREAM_ERROR;      // stream closed or timeout, giving up
+                    break;
+                }
+            } else {
+                uint32_t start = millis();
+                while(!data.available()){
+                    if (millis() - start > INFLATOR_STREAM_TIMEOUT_MS)
+                        break;
+                    vTaskDelay(1); // let the stream breathe
+                }
+                wait_us += micros() - t;
+                if (!data.available()){
+                    in_stalled = (err == MZ_OK);
+                    err = MZ_STREAM_ERROR;      // timeout on stream, giving up
+                    break;
+                }
+            }
+            continue;
         }
 
-        size_t available = data.available();
-
-        // fill the buff from a stream
-        int len = data.readBytes(buff, (available > sizeof(buff)) ? sizeof(buff) : available);
+        // drain all available data from the stream, but do not read past compressed data end
+        if (!unknown && available > size)
+            available = size;
+        int len = data.readBytes(buff, (available > INFLATOR_STREAM_BUFF_SIZE) ? INFLATOR_STREAM_BUFF_SIZE : available);
+        wait_us += micros() - t;
+        if (len <= 0){
+            in_stalled = (err == MZ_OK);
+            err = MZ_STREAM_ERROR;
+            break;
+        }
+        if (!unknown)
+            size -= len;
 
         // inflate buff
-        int err = inflate_block_to_cb(buff, len, callback, (len == size), chunk_size);
+        err = inflate_block_to_cb(buff, len, callback, !unknown && !size, chunk_size);
         if (err < 0){
             //ESP_LOGI(TAG, "compressed buff: %02X%02X%02X%02X%02X%02X", buff[0], buff[1], buff[2], buff[3], buff[4], buff[5]);
-            return err;
+            break;
         }
+    } while(unknown ? err != MZ_STREAM_END : size > 0);   // data of known size is read to the end, even past compressed stream
+
+    free(buff);
 
-        size -= len;
-    } while(size > 0);
+    if (err < 0)
+        return err;
 
     //ESP_LOGW(TAG, "inflate stream %d bytes left", size);
-    return size ? MZ_STREAM_ERROR : MZ_STREAM_END;
+    return (err == MZ_STREAM_END && (unknown || !size)) ? MZ_STREAM_END : MZ_STREAM_ERROR;
 }
 
-void Inflator::getstat(deco_stat_t &stat){
+void Decompressor::getstat(deco_stat_t &stat){
     stat.in_bytes = total_in;
     stat.out_bytes = total_out;
+    stat.wait_us = wait_us;
+    stat.wdt_feeds = wdt_feeds;
+}
+
+void Decompressor::wdt_feed(){
+    esp_task_wdt_reset();
+    ++wdt_feeds;
+}
+
+// check if buffer consists of 0xFF bytes only, i.e. erased flash
+static bool fz_isblank(const uint8_t *data, size_t len){
+    return len && data[0] == 0xff && !memcmp(data, data + 1, len - 1);
 }
 
+// check for a valid zlib stream header (RFC1950), any window size
+static bool fz_iszlib(const uint8_t *data, size_t len){
+    if (len < 2)
+        return len && data[0] == ZLIB_HEADER;
+    return (data[0] & 0x0F) == 8 && (data[0] >> 4) <= 7 && !(((data[0] << 8) | data[1]) % 31);
+}
+
+// detect compressed stream format, only formats that are built in are recognized
+static uint8_t fz_codec(const uint8_t *magic, size_t len){
+    if (!len)
+        return FZ_CODEC_NONE;
+    if (fz_iszlib(magic, len))
+        return FZ_CODEC_ZLIB;
+    if (len >= 2 && magic[0] == GZ_HEADER && magic[1] == GZ_HEADER2)
+        return FZ_CODEC_GZIP;
+    if (len < FZ_MAGIC_LEN)
+        return FZ_CODEC_NONE;
+
+    uint32_t m = fz_get_le32(magic);
+#ifndef FZ_NO_LZ4
+    if (m == LZ4_FRAME_MAGIC || (m & 0xFFFFFFF0) == LZ4_SKIP_MAGIC)
+        return FZ_CODEC_LZ4;
+#endif
+#ifndef FZ_NO_HEATSHRINK
+    if (!memcmp(magic, HS_HEADER, sizeof(HS_HEADER) - 1))
+        return FZ_CODEC_HS;
+#endif
+    return FZ_CODEC_NONE;
+}
+
+Decompressor* Decompressor::create(const uint8_t *magic, size_t len){
+    if (!len)
+        return nullptr;
+
+    Decompressor *d;
+
+    switch (fz_codec(magic, len)){
+        case FZ_CODEC_ZLIB :
+        case FZ_CODEC_GZIP :
+            d = new(std::nothrow) Inflator;
+            break;
+#ifndef FZ_NO_LZ4
+        case FZ_CODEC_LZ4 :
+            d = new(std::nothrow) Lz4Decoder;
+            break;
+#endif
+#ifndef FZ_NO_HEATSHRINK
+        case FZ_CODEC_HS :
+            d = new(std::nothrow) HsDecoder;
+            break;
+#endif
+        default :
+            ESP_LOGE(TAG, "unknown compressed stream format, magic: %02X", magic[0]);
+            return nullptr;
+    }
+
+    if (d && !d->init()){
+        delete d;
+        d = nullptr;
+    }
+    if (!d)
+        ESP_LOGE(TAG, "Can't allocate decompressor");
+
+    return d;
+}
+
+
+
+// WindowDecoder class implementation
+bool WindowDecoder::win_alloc(size_t size){
+    // ring wraps at aligned offset only if it's not smaller than alignment
+    if (size < out_align)
+        size = out_align;
 
+    if (win && win_size == size)
+        return true;
+
+    win_free();
+    win = (uint8_t*)malloc(size);
+    if (!win)
+        return false;   // OOM
+
+    win_size = size;
+    win_reset();
+    return true;
+}
+
+void WindowDecoder::win_free(){
+    free(win);
+    win = nullptr;
+    win_size = 0;
+}
+
+void WindowDecoder::win_reset(){
+    win_pos = win_pending = 0;
+    flush_at = win_size;
+}
+
+void WindowDecoder::win_cb(inflate_cb_t *callback, size_t chunk_size){
+    cb = callback;
+    flush_at = (chunk_size && chunk_size < win_size) ? chunk_size : win_size;
+    if (out_align <= win_size){
+        flush_at &= ~(out_align - 1);
+        if (flush_at < out_align)
+            flush_at = out_align;
+    }
+}
+
+bool WindowDecoder::win_flush(bool final){
+    while (win_pending && (final || win_pending >= flush_at)){
+        size_t start = (win_pos - win_pending) & (win_size - 1);
+        size_t len = (win_size - start < win_pending) ? win_size - start : win_pending;     // contiguous part of pending data
+
+        int consumed = (*cb)(total_out - win_pending, win + start, len, final && len == win_pending);
+        if (consumed <= 0 || (size_t)consumed > len)
+            return false;       // it's an error not to consume or consume too much
+
+        win_out(win + start, consumed);
+        win_pending -= consumed;
+        wdt_feed();
+    }
+    return true;
+}
+
+bool WindowDecoder::win_write(const uint8_t *src, size_t len){
+    while (len){
+        if (win_pending >= flush_at && !win_flush(false))
+            return false;
+
+        size_t n = win_size - win_pos;
+        if (n > flush_at - win_pending)
+            n = flush_at - win_pending;
+        if (n > len)
+            n = len;
+
+        memcpy(win + win_pos, src, n);
+        win_pos = (win_pos + n) & (win_size - 1);
+        win_pending += n;
+        total_out += n;
+        src += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool WindowDecoder::win_copy(size_t dist, size_t len){
+    while (len){
+        if (win_pending >= flush_at && !win_flush(false))
+            return false;
+
+        size_t from = (win_pos - dist) & (win_size - 1);
+        size_t n = win_size - win_pos;
+        if (n > win_size - from)
+            n = win_size - from;
+        if (n > flush_at - win_pending)
+            n = flush_at - win_pending;
+        if (n > len)
+            n = len;
+
+        if (dist >= n){
+            memmove(win + win_pos, win + from, n);
+        } else {
+            // overlapping match, i.e. repeated pattern
+            for (size_t i = 0; i != n; ++i)
+                win[win_pos + i] = win[from + i];
+        }
+        win_pos = (win_pos + n) & (win_size - 1);
+        win_pending += n;
+        total_out += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+
+// Unpacker class implementation
+void Unpacker::end(){
+    delete codec;
+    codec = nullptr;
+    magic_len = 0;
+    hash = nullptr;
+    codec_end = false;
+    free(trl);
+    trl = nullptr;
+    trl_len = trl_in = 0;
+    free(cnt);
+    cnt = nullptr;
+    cnt_len = cnt_need = 0;
+    hist = nullptr;
+    wait_us = 0;
+}
+
+void Unpacker::getstat(deco_stat_t &stat){
+    if (codec){
+        codec->getstat(stat);
+        stat.in_bytes += trl_in + cnt_len;
+    } else {
+        stat.in_bytes = magic_len + cnt_len;
+        stat.out_bytes = 0;
+        stat.wdt_feeds = 0;
+    }
+    stat.wait_us = wait_us;     // stream is read by unpacker, not by the codec
+}
+
+int Unpacker::inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final, size_t chunk_size){
+    if (hash)
+        hash->update(inBuff, len);
+
+    if (codec_end){
+        trl_in += len;
+        return trailer_put(inBuff, len, final);
+    }
+
+    while (!codec){
+        // container header precedes compressed stream
+        if (cnt_len < cnt_need){
+            int err = container_put(inBuff, len);
+            if (err < 0)
+                return err;
+            if (cnt_len < cnt_need)
+                return final ? MZ_DATA_ERROR : MZ_OK;
+        }
+
+        // collect the first bytes of input to detect stream format
+        size_t n = (FZ_MAGIC_LEN - magic_len < len) ? FZ_MAGIC_LEN - magic_len : len;
+        memcpy(magic + magic_len, inBuff, n);
+        magic_len += n;
+        inBuff += n;
+        len -= n;
+
+        if (magic_len < FZ_MAGIC_LEN && !final)
+            return MZ_OK;       // need more input
+
+        if (!cnt && magic_len == FZ_MAGIC_LEN && !memcmp(magic, FZ_CNT_MAGIC, FZ_MAGIC_LEN)){
+            cnt = (uint8_t*)malloc(FZ_CNT_HDR_SIZE);
+            if (!cnt)
+                return MZ_MEM_ERROR;
+            memcpy(cnt, magic, FZ_MAGIC_LEN);
+            cnt_len = FZ_MAGIC_LEN;
+            cnt_need = FZ_CNT_HDR_SIZE;
+            magic_len = 0;
+            continue;
+        }
+
+        if (cnt && cnt_info.codec && cnt_info.codec != fz_codec(magic, magic_len)){
+            ESP_LOGE(TAG, "compressed stream format does not match container header");
+            return MZ_DATA_ERROR;
+        }
+
+#ifndef FZ_NO_MAPINFLATOR
+        uint8_t codec_id = fz_codec(magic, magic_len);
+        if (hist && (codec_id == FZ_CODEC_ZLIB || codec_id == FZ_CODEC_GZIP)){
+            codec = new(std::nothrow) MapInflator(hist, hist_head);
+            if (codec && !codec->init()){
+                ESP_LOGW(TAG, "not enough memory for flash window inflator");
+                delete codec;
+                codec = nullptr;
+            }
+        }
+#endif
+
+        // segments are passed to callback as a whole, so they must keep output alignment
+        if (!codec && cnt && par && SegInflator::suitable(cnt_info) && !(cnt_info.block_size & (out_align - 1))){
+            codec = new(std::nothrow) SegInflator(cnt_info);
+            if (codec && !codec->init()){
+                ESP_LOGW(TAG, "not enough memory for parallel decoder, inflating sequentially");
+                delete codec;
+                codec = nullptr;
+            }
+        }
+
+        if (!codec)
+            codec = Decompressor::create(magic, magic_len);
+        if (!codec)
+            return MZ_DATA_ERROR;
+        codec->aligned(out_align);
+
+        int err = stream_end(codec->inflate_block_to_cb(magic, magic_len, callback, final && !len, chunk_size), magic, magic_len, 0, final && !len);
+        if (codec_end && len){
+            trl_in += len;
+            return trailer_put(inBuff, len, final);
+        }
+        if (err < 0 || err == MZ_STREAM_END || !len)
+            return err;
+    }
+
+    size_t tin = codec->totalin();
+    return stream_end(codec->inflate_block_to_cb(inBuff, len, callback, final, chunk_size), inBuff, len, tin, final);
+}
+
+void Unpacker::aligned(size_t align){
+    Decompressor::aligned(align);
+    if (codec)
+        codec->aligned(out_align);
+}
+
+int Unpacker::stream_end(int err, const uint8_t *data, size_t len, size_t tin, bool final){
+    if (err != MZ_STREAM_END || codec_end)
+        return err;
+
+    codec_end = true;
+
+    // decoder might have read ahead a few bytes past the end of compressed data, those go first
+    const uint8_t *ra;
+    size_t n = codec->readahead(ra);
+    if (n && (err = trailer_put(ra, n, false)) < 0)
+        return err;
+
+    // the rest of input block
+    size_t used = codec->totalin() - tin;
+    if (used > len)
+        used = len;
+    trl_in += len - used;
+    return trailer_put(data + used, len - used, final);
+}
+
+int Unpacker::trailer_put(const uint8_t *data, size_t len, bool final){
+    if (!hash)
+        return MZ_STREAM_END;       // no verification requested, data past the end of compressed stream is ignored
+
+    size_t need = FZ_TRAILER_HDR_SIZE;
+    while (true){
+        if (trl_len >= FZ_TRAILER_HDR_SIZE)
+            need = FZ_TRAILER_MIN_SIZE + fz_get_le16(trl + 4);
+
+        if (trl_len == need && need > FZ_TRAILER_HDR_SIZE)
+            return MZ_STREAM_END;   // trailer is complete, anything beyond it is ignored
+
+        if (!len)
+            return final ? MZ_DATA_ERROR : MZ_OK;       // image has no complete trailer
+
+        if (!trl){
+            trl = (uint8_t*)malloc(FZ_TRAILER_MIN_SIZE + FZ_SIG_MAX_LEN);
+            if (!trl)
+                return MZ_MEM_ERROR;
+        }
+
+        size_t n = (need - trl_len < len) ? need - trl_len : len;
+        memcpy(trl + trl_len, data, n);
+        trl_len += n;
+        data += n;
+        len -= n;
+
+        if (trl_len == FZ_TRAILER_HDR_SIZE && (memcmp(trl, FZ_TRAILER_MAGIC, sizeof(FZ_TRAILER_MAGIC) - 1) || fz_get_le16(trl + 4) > FZ_SIG_MAX_LEN)){
+            ESP_LOGE(TAG, "bad signature trailer");
+            return MZ_DATA_ERROR;
+        }
+    }
+}
+
+int Unpacker::container_put(const uint8_t *&data, size_t &len){
+    while (len && cnt_len < cnt_need){
+        size_t n = (cnt_need - cnt_len < len) ? cnt_need - cnt_len : len;
+        memcpy(cnt + cnt_len, data, n);
+        cnt_len += n;
+        data += n;
+        len -= n;
+
+        if (cnt_len < cnt_need)
+            break;
+
+        // fixed part of header is complete, check it before collecting the index
+        if (cnt_len == FZ_CNT_HDR_SIZE){
+            if (fz_crc32_le(0, cnt, FZ_CNT_HDR_SIZE - 4) != fz_get_le32(cnt + FZ_CNT_HDR_SIZE - 4)){
+                ESP_LOGE(TAG, "container header crc mismatch");
+                return MZ_DATA_ERROR;
+            }
+            size_t blocks = fz_get_le16(cnt + 6);
+            if (blocks > FZ_CNT_MAX_BLOCKS){
+                ESP_LOGE(TAG, "container index is too large: %u", blocks);
+                return MZ_DATA_ERROR;
+            }
+            if (blocks){
+                uint8_t *p = (uint8_t*)realloc(cnt, FZ_CNT_HDR_SIZE + blocks * FZ_CNT_ENTRY_SIZE);
+                if (!p)
+                    return MZ_MEM_ERROR;
+                cnt = p;
+                cnt_need += blocks * FZ_CNT_ENTRY_SIZE;
+                continue;
+            }
+        }
+
+        return container_parse();
+    }
+    return MZ_OK;
+}
+
+int Unpacker::container_parse(){
+    cnt_info.codec = cnt[4];
+    cnt_info.blocks = fz_get_le16(cnt + 6);
+    cnt_info.img_size = fz_get_le32(cnt + 8);
+    cnt_info.size = fz_get_le32(cnt + 12);
+    cnt_info.block_size = fz_get_le32(cnt + 16);
+    memcpy(cnt_info.sha256, cnt + 24, FZ_SHA256_SIZE);
+    cnt_info.index = cnt_info.blocks ? cnt + FZ_CNT_HDR_SIZE : nullptr;
+
+    if (cnt_info.blocks){
+        if (fz_crc32_le(0, cnt_info.index, cnt_info.blocks * FZ_CNT_ENTRY_SIZE) != fz_get_le32(cnt + 20)){
+            ESP_LOGE(TAG, "container index crc mismatch");
+            return MZ_DATA_ERROR;
+        }
+        // segments must be in order and cover the image
+        for (size_t i = 0; i != cnt_info.blocks; ++i){
+            uint32_t off = fz_get_le32(cnt_info.index + i * FZ_CNT_ENTRY_SIZE);
+            if (off >= cnt_info.size || (i && off <= fz_get_le32(cnt_info.index + (i - 1) * FZ_CNT_ENTRY_SIZE))){
+                ESP_LOGE(TAG, "bad container index entry %u", i);
+                return MZ_DATA_ERROR;
+            }
+        }
+        if (!cnt_info.block_size || (uint64_t)cnt_info.blocks * cnt_info.block_size < cnt_info.img_size){
+            ESP_LOGE(TAG, "container index does not cover image");
+            return MZ_DATA_ERROR;
+        }
+    }
+
+    ESP_LOGI(TAG, "container: codec:%u, image size:%u, payload size:%u, segments:%u", cnt_info.codec, cnt_info.img_size, cnt_info.size, cnt_info.blocks);
+    return (cnt_hook && !cnt_hook(cnt_info)) ? MZ_DATA_ERROR : MZ_OK;
+}
+
+const uint8_t* Unpacker::trailer() const {
+    if (trl_len < FZ_TRAILER_MIN_SIZE || trl_len != (size_t)FZ_TRAILER_MIN_SIZE + fz_get_le16(trl + 4))
+        return nullptr;
+    return trl;
+}
+
+
+
+/**    Patcher Class implementation    **/
+
+bool Patcher::begin(inflate_cb_t cb){
+    end();
+    buff = (uint8_t*)malloc(FZ_PATCH_BUFF_SIZE);
+    if (!buff)
+        return false;
+
+    sink = cb;
+    state = state_t::header;
+    hdr_cnt = 0;
+    buff_len = 0;
+    flushed = 0;
+    new_pos = 0;
+    old_pos = 0;
+    return true;
+}
+
+void Patcher::end(){
+    if (old){
+        fz_partition_munmap(mmap_handle);
+        old = nullptr;
+    }
+    free(buff);
+    buff = nullptr;
+    sink = nullptr;
+}
+
+bool Patcher::header(){
+    if (fz_get_le32(hdr) != FZ_PATCH_MAGIC){
+        ESP_LOGE(TAG, "not a delta patch");
+        return false;
+    }
+    new_size = fz_get_le32(hdr + 4);
+    old_size = fz_get_le32(hdr + 8);
+    uint32_t old_crc = fz_get_le32(hdr + 12);
+
+    const esp_partition_t *src = esp_ota_get_running_partition();
+    if (!src || !old_size || old_size > src->size){
+        ESP_LOGE(TAG, "patch source image size mismatch: %u", old_size);
+        return false;
+    }
+
+    // map the running firmware image
+    if (esp_partition_mmap(src, 0, old_size, FZ_PARTITION_MMAP_DATA, (const void**)&old, &mmap_handle) != ESP_OK){
+        old = nullptr;
+        ESP_LOGE(TAG, "Can't mmap running partition");
+        return false;
+    }
+
+    // patch must be made against exactly this image
+    if (fz_crc32_le(0, old, old_size) != old_crc){
+        ESP_LOGE(TAG, "patch source image crc mismatch");
+        return false;
+    }
+
+    ESP_LOGI(TAG, "delta patch, old image:%u, new image:%u", old_size, new_size);
+    return true;
+}
+
+bool Patcher::ctrl(){
+    diff_left = fz_get_le32(hdr);
+    extra_left = fz_get_le32(hdr + 4);
+    seek = (int32_t)fz_get_le32(hdr + 8);
+
+    if (diff_left > new_size - new_pos || extra_left > new_size - new_pos - diff_left || diff_left > old_size - old_pos){
+        ESP_LOGE(TAG, "bad patch control record");
+        return false;
+    }
+    return true;
+}
+
+bool Patcher::flush(bool final){
+    size_t offset = 0;
+    do {
+        int len = sink(flushed, buff + offset, buff_len - offset, final);
+        if (len <= 0)
+            return false;
+        offset += len;
+        flushed += len;
+    } while (final && offset < buff_len);
+
+    buff_len -= offset;
+    if (buff_len)
+        memmove(buff, buff + offset, buff_len);
+    return true;
+}
+
+int Patcher::apply(size_t index, const uint8_t* data, size_t size, bool final){
+    if (!buff || state == state_t::error)
+        return 0;
+
+    size_t len = size;
+    while (len){
+        size_t n;
+        switch (state){
+            case state_t::header :
+            case state_t::ctrl : {
+                size_t hlen = (state == state_t::header) ? FZ_PATCH_HDR_SIZE : FZ_PATCH_CTRL_SIZE;
+                n = (hlen - hdr_cnt < len) ? hlen - hdr_cnt : len;
+                memcpy(hdr + hdr_cnt, data, n);
+                hdr_cnt += n;
+                if (hdr_cnt < hlen)
+                    break;
+
+                hdr_cnt = 0;
+                if (state == state_t::header){
+                    if (!header()){
+                        state = state_t::error;
+                        return 0;
+                    }
+                    state = new_size ? state_t::ctrl : state_t::done;
+                } else {
+                    if (!ctrl()){
+                        state = state_t::error;
+                        return 0;
+                    }
+                    state = state_t::diff;
+                }
+                break;
+            }
+            case state_t::diff : {
+                n = (diff_left < len) ? diff_left : len;
+                if (n > FZ_PATCH_BUFF_SIZE - buff_len)
+                    n = FZ_PATCH_BUFF_SIZE - buff_len;
+                const uint8_t *o = old + old_pos;
+                uint8_t *b = buff + buff_len;
+                for (size_t i = 0; i != n; ++i)
+                    b[i] = o[i] + data[i];
+                buff_len += n;
+                new_pos += n;
+                old_pos += n;
+                diff_left -= n;
+                break;
+            }
+            case state_t::extra :
+                n = (extra_left < len) ? extra_left : len;
+                if (n > FZ_PATCH_BUFF_SIZE - buff_len)
+                    n = FZ_PATCH_BUFF_SIZE - buff_len;
+                memcpy(buff + buff_len, data, n);
+                buff_len += n;
+                new_pos += n;
+                extra_left -= n;
+                break;
+            default :
+                ESP_LOGE(TAG, "excess patch data");
+                state = state_t::error;
+                return 0;
+        }
+        data += n;
+        len -= n;
+
+        if (state == state_t::diff && !diff_left)
+            state = state_t::extra;
+
+        // record is complete, move old image pointer
+        if (state == state_t::extra && !extra_left){
+            int64_t pos = (int64_t)old_pos + seek;
+            if (pos < 0 || pos > (int64_t)old_size){
+                ESP_LOGE(TAG, "bad patch seek");
+                state = state_t::error;
+                return 0;
+            }
+            old_pos = pos;
+            state = (new_pos == new_size) ? state_t::done : state_t::ctrl;
+        }
+
+        // pass the rebuilt image further when buffer is full or new image is complete
+        if (buff_len == FZ_PATCH_BUFF_SIZE || (state == state_t::done && buff_len)){
+            if (!flush(state == state_t::done)){
+                state = state_t::error;
+                return 0;
+            }
+        }
+    }
+    return size;
+}
 
 /**    FlashZ Class implementation    **/
 
 bool FlashZ::beginz(size_t size, int command, int ledPin, uint8_t ledOn, const char *label){
+    prof_reset();
+
+    deco.aligned(SPI_FLASH_SEC_SIZE);   // inflated data goes to flash in whole sectors
     if (!deco.init())       // allocate Inflator memory
         return false;
+    deco.oncontainer([this](const fz_container_t &c) -> bool { return cnt_check(c); });
+
+    verify_free();
+    digest_rdy = false;
+    if (vrf){
+        sha_in = new(std::nothrow) FzSha256();
+        sha_out = new(std::nothrow) FzSha256();
+        if (!sha_in || !sha_out){
+            verify_free();
+            return false;
+        }
+        deco.verify(sha_in);
+    }
+
+    mode_z = true;
+    z_stalled = false;
+
+    // in compare-before-write, sparse, direct write, flash window and pre-erase modes UpdateClass handles only the first sector of image
+    cmp_stop();
+    bool ers = ers_mode && !cmp_mode && size != UPDATE_SIZE_UNKNOWN;
+    bool cmp = (cmp_mode || sparse_mode || direct_mode || fwin_mode || ers) && cmp_start(cmp_find(command, label), size);
+    if (!begin(cmp ? SPI_FLASH_SEC_SIZE : size, command, ledPin, ledOn, label)){
+        cmp_stop();
+        return false;
+    }
+
+    if (cmp && ers && !ers_start(size))
+        ESP_LOGW(TAG, "Can't start pre-eraser, sectors will be erased inline");
+
+    // inflator reads history back from partition, UpdateClass writes image header only on end()
+    bool fwin = cmp && fwin_mode;
+    if (fwin)
+        deco.history(cmp_map, ENCRYPTED_BLOCK_SIZE);
+
+    if (pipe_mode && !fwin && !pipe_start()){
+        ESP_LOGE(TAG, "Can't start pipelined writer");
+        abortz();
+        return false;
+    }
+
+    return true;
+}
+
+bool FlashZ::beginpatch(int ledPin, uint8_t ledOn){
+    if (!beginz(UPDATE_SIZE_UNKNOWN, U_FLASH, ledPin, ledOn))
+        return false;
+    deco.history(nullptr, 0);       // inflated patch stream is not what goes to flash
+
+    bool ok;
+    if (pipe_run)
+        ok = patch.begin([this](size_t i, const uint8_t* d, size_t s, bool f) -> int { return pipe_cb(i, d, s, f); });
+    else
+        ok = patch.begin([this](size_t i, const uint8_t* d, size_t s, bool f) -> int { return flash_cb(i, d, s, f); });
+
+    if (!ok){
+        ESP_LOGE(TAG, "Can't allocate patch buffer");
+        abortz();
+    }
+    return ok;
+}
+
+bool FlashZ::beginbundle(){
+    if (mode_z || isRunning())
+        return false;
+
+    prof_reset();
+
+    bundle.aligned(SPI_FLASH_SEC_SIZE);
+    if (!bundle.init()){
+        bundle.end();
+        return false;
+    }
+    bundle.onevent([this](fz_bundle_evt_t evt, const fz_bundle_image_t *img) -> bool { return bdl_event(evt, img); });
 
+    verify_free();
+    digest_rdy = false;
+    bdl_boot = nullptr;
+    z_stalled = false;
     mode_z = true;
-    return begin(size, command, ledPin, ledOn, label);
+    bdl_run = true;
+    return true;
+}
+
+bool FlashZ::cnt_check(const fz_container_t &c){
+    // size and digest in container header are of inflated data, while patcher flashes a rebuilt image
+    if (patch.active()){
+        ESP_LOGE(TAG, "container header is not supported for delta patches");
+        return false;
+    }
+
+    size_t room = size();
+    if (c.img_size > room){
+        ESP_LOGE(TAG, "image size %u exceeds update size %u", c.img_size, room);
+        return false;
+    }
+
+    // inflated data is digested to check it against container header
+    if (!sha_out && !(sha_out = new(std::nothrow) FzSha256()))
+        return false;
+
+    return true;
+}
+
+bool FlashZ::bdl_event(fz_bundle_evt_t evt, const fz_bundle_image_t *img){
+    if (evt == fz_bundle_evt_t::manifest)
+        return bdl_verify();
+
+    if (evt == fz_bundle_evt_t::begin){
+        const char *label = img->label[0] ? img->label : NULL;
+        const esp_partition_t *part;
+        if (img->target == FZ_BUNDLE_APP)
+            part = label ? esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, label) : esp_ota_get_next_update_partition(NULL);
+        else
+            part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, label ? ESP_PARTITION_SUBTYPE_ANY : ESP_PARTITION_SUBTYPE_DATA_SPIFFS, label);
+
+        if (!part || part == esp_ota_get_running_partition() || (img->target == FZ_BUNDLE_APP && bdl_boot)){
+            ESP_LOGE(TAG, "no suitable partition for bundle image '%s'", img->label);
+            return false;
+        }
+
+        if (img->img_size > part->size){
+            ESP_LOGE(TAG, "bundle image does not fit into partition '%s'", part->label);
+            return false;
+        }
+
+        sha_out = new(std::nothrow) FzSha256();
+        if (!sha_out || !cmp_start(part, img->img_size))
+            return false;
+        cmp_all = true;             // UpdateClass is not used for bundle images
+        if (ers_mode && !cmp_mode && !ers_start(img->img_size))
+            ESP_LOGW(TAG, "Can't start pre-eraser, sectors will be erased inline");
+        ESP_LOGI(TAG, "flashing bundle image to '%s'", part->label);
+        return true;
+    }
+
+    // end of image
+    bool ok = cmp_flush();
+    const esp_partition_t *part = cmp_part;
+    cmp_stop();
+
+    uint8_t digest[FZ_SHA256_SIZE];
+    sha_out->finish(digest);
+    delete sha_out;
+    sha_out = nullptr;
+
+    if (!ok)
+        return false;
+
+    if (memcmp(digest, img->sha256, FZ_SHA256_SIZE)){
+        ESP_LOGE(TAG, "bundle image '%s' digest mismatch", part->label);
+        return false;
+    }
+
+    if (img->target == FZ_BUNDLE_APP){
+        if (cmp_magic != ESP_IMAGE_HEADER_MAGIC){
+            ESP_LOGE(TAG, "bundle image '%s' is not an app image", part->label);
+            return false;
+        }
+        bdl_boot = part;
+    }
+
+    ESP_LOGI(TAG, "bundle image '%s' verified", part->label);
+    return true;
+}
+
+bool FlashZ::bdl_verify(){
+    if (!vrf_key)
+        return true;        // manifest is crc protected and carries image digests
+
+    size_t len, sig_len;
+    const uint8_t *m = bundle.manifest(len);
+    const uint8_t *sig = bundle.signature(sig_len);
+    if (!sig){
+        ESP_LOGE(TAG, "bundle is not signed");
+        return false;
+    }
+
+    uint8_t digest[FZ_SHA256_SIZE];
+    FzSha256 sha;
+    sha.update(m, len);
+    sha.finish(digest);
+
+    int err = mbedtls_pk_verify(vrf_key, MBEDTLS_MD_SHA256, digest, FZ_SHA256_SIZE, sig, sig_len);
+    if (err){
+        ESP_LOGE(TAG, "bundle signature verification failed, err: -0x%04x", -err);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "bundle signature verified");
+    return true;
+}
+
+bool FlashZ::bdl_end(){
+    bool ok = bundle.done();
+    if (!ok)
+        ESP_LOGE(TAG, "bundle is incomplete");
+
+    getstat(prof);                  // keep stats of the last update
+    verify_free();
+    cmp_stop();
+    bundle.end();
+    bdl_run = false;
+    mode_z = false;
+
+    // all the images have been verified, it's safe to boot from the new app
+    if (ok && bdl_boot && esp_ota_set_boot_partition(bdl_boot) != ESP_OK){
+        ESP_LOGE(TAG, "can't set boot partition '%s'", bdl_boot->label);
+        ok = false;
+    }
+
+    prg_report(ok ? 1 : -1);
+    return ok;
 }
 
 size_t FlashZ::writez(const uint8_t *data, size_t len, bool final){
     if (!mode_z)
         return write((uint8_t*)data, len);   // this cast to (uint8_t*) is a very dirty hack, but Arduino's Updater lib is missing constness on data pointer
 
-    int err = deco.inflate_block_to_cb(data, len, [this](size_t i, const uint8_t* d, size_t s, bool f) -> int { return flash_cb(i, d, s, f); }, final);
+    uint32_t t = prof_begin();
+
+    // sinks are passed as plain lambdas, so zlib inflator could inline them w/o std::function dispatch
+    int err;
+    if (bdl_run)
+        err = bundle.inflate_block_to_cb(data, len, [this](size_t i, const uint8_t* d, size_t s, bool f) -> int { return flash_cb(i, d, s, f); }, final);
+    else if (patch.active())
+        err = deco.inflate_block_to(data, len, [this](size_t i, const uint8_t* d, size_t s, bool f) -> int { return patch.apply(i, d, s, f); }, final);
+    else if (pipe_run)
+        err = deco.inflate_block_to(data, len, [this](size_t i, const uint8_t* d, size_t s, bool f) -> int { return pipe_cb(i, d, s, f); }, final);
+    else
+        err = deco.inflate_block_to(data, len, [this](size_t i, const uint8_t* d, size_t s, bool f) -> int { return flash_cb(i, d, s, f); }, final);
+
+    prof_end(t);
+    prg_report();
 
     if (err >= MZ_OK)                       // intermediate or last chunk, ok
         return len;
@@ -266,29 +1298,73 @@ size_t FlashZ::writez(const uint8_t *data, size_t len, bool final){
 }
 
 void FlashZ::abortz(){
+    z_stalled = false;
+    patch.end();
+    pipe_stop();
+    verify_free();      // writer task digests flashed data, so it must be stopped first
+    cmp_stop();
     abort();
+    if (mode_z){
+        getstat(prof);  // keep stats of the last update
+        prg_report(-1);
+    }
     deco.end();
+    bundle.end();
+    bdl_run = false;
     mode_z = false;
 }
 
 bool FlashZ::endz(bool evenIfRemaining){
+    if (bdl_run)
+        return bdl_end();
+
+    bool patch_ok = !patch.active() || patch.done();    // new image must be rebuilt completely
+    if (!patch_ok)
+        ESP_LOGE(TAG, "delta patch is incomplete");
+    patch.end();
+    bool pipe_ok = pipe_stop();     // flush pending chunks, if any
+    bool cmp_ok = cmp_flush();      // the last partial sector of direct writer
+    bool vrf_ok = verify_end();     // all the data must be flashed and digested by now
+    getstat(prof);                  // keep stats of the last update
+    const fz_container_t *c = deco.container();
+    bool cnt_ok = !c || prof.out_bytes == c->img_size;
+    if (!cnt_ok)
+        ESP_LOGE(TAG, "image size mismatch: %u/%u", prof.out_bytes, c->img_size);
     deco.end();
     mode_z = false;
-    return end(evenIfRemaining);
+    bool cmp = cmp_run;
+    bool size_ok = !cmp || evenIfRemaining || isFinished();     // UpdateClass can't tell, it's aware of the first sector only
+    if (!size_ok)
+        ESP_LOGE(TAG, "premature end: %u of %u bytes", cmp_total, cmp_size);
+    cmp_stop();
+    if (!pipe_ok || !patch_ok || !cmp_ok || !vrf_ok || !cnt_ok || !size_ok){
+        abort();
+        prg_report(-1);
+        return false;
+    }
+    // UpdateClass is aware only of the first sector with direct writer, so it's always 'remaining', size is checked above
+    bool ok = end(cmp || evenIfRemaining);
+    prg_report(ok ? 1 : -1);
+    return ok;
+}
+
+bool FlashZ::setMD5(const char *expected_md5){
+    if (cmp_run){
+        ESP_LOGE(TAG, "MD5 check is not available with direct partition writer, use verify()");
+        return false;
+    }
+    return UpdateClass::setMD5(expected_md5);
 }
 
 int FlashZ::flash_cb(size_t index, const uint8_t* data, size_t size, bool final){
-    if (!size)
+    if (!size || !raw_check(index, data, size))
         return 0;
 
-    size_t len;
-    if (final){
-        len = size;
-    } else {
-        // try to align writes to flash sector size
-        len = size <= SPI_FLASH_SEC_SIZE ? size : size - (size % SPI_FLASH_SEC_SIZE);
-    }
-    size_t _w = write((uint8_t*)data, len);     // this cast to (uint8_t*) is a very dirty hack, but Arduino's Updater lib is missing constness on data pointer
+    // decoders are set to pass inflated data in whole sectors, only the tail of image could be shorter
+    size_t len = size;
+    uint32_t t = micros();
+    size_t _w = flash_write(data, len, prof, prof_bytes);
+    prof_sink += micros() - t;
     if (_w != len){
         //ESP_LOGI(TAG, "magic: %02X%02X%02X%02X%02X%02X", data[0], data[1], data[2], data[3], data[4], data[5]);
         ESP_LOGE(TAG, "ERROR, flashed %d of %d bytes chunk, err: %s!", _w, len, errorString());
@@ -297,18 +1373,621 @@ int FlashZ::flash_cb(size_t index, const uint8_t* data, size_t size, bool final)
 
     ESP_LOGI(TAG, "flashed %u bytes", _w);
 
+    prg_report();
+    return _w;
+}
+
+size_t FlashZ::flash_write(const uint8_t *data, size_t len, deco_stat_t &st, size_t &bytes){
+    uint32_t t = micros();
+    // this cast to (uint8_t*) is a very dirty hack, but Arduino's Updater lib is missing constness on data pointer
+    size_t _w = cmp_run ? cmp_write(data, len) : write((uint8_t*)data, len);
+
+    st.flash_us += micros() - t;
+    ++st.cb_count;
+    if (!st.chunk_min || len < st.chunk_min)
+        st.chunk_min = len;
+    if (len > st.chunk_max)
+        st.chunk_max = len;
+    bytes += _w;
+    prof_heap(st);
+
+    if (sha_out)
+        sha_out->update(data, _w);
+
     return _w;
 }
 
-size_t FlashZ::writezStream(Stream &data, size_t len){
+const esp_partition_t *FlashZ::cmp_find(int command, const char *label){
+    if (command == U_FLASH)
+        return esp_ota_get_next_update_partition(NULL);
+    if (command == U_SPIFFS)
+        return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, label);
+    return nullptr;
+}
+
+bool FlashZ::cmp_start(const esp_partition_t *part, size_t size){
+    if (!part){
+        ESP_LOGW(TAG, "direct write: target partition not found, using regular write");
+        return false;
+    }
+
+    if (size != UPDATE_SIZE_UNKNOWN && size > part->size)
+        return false;       // let UpdateClass report an error
+
+    cmp_buff = (uint8_t*)malloc(SPI_FLASH_SEC_SIZE);
+    if (!cmp_buff)
+        return false;
+
+    if (esp_partition_mmap(part, 0, part->size, FZ_PARTITION_MMAP_DATA, (const void**)&cmp_map, &cmp_handle) != ESP_OK){
+        ESP_LOGW(TAG, "direct write: can't mmap target partition, using regular write");
+        cmp_map = nullptr;
+        cmp_stop();
+        return false;
+    }
+
+    cmp_part = part;
+    cmp_all = false;
+    cmp_len = cmp_off = cmp_erased = cmp_total = 0;
+    cmp_size = size == UPDATE_SIZE_UNKNOWN ? part->size : size;
+    cmp_run = true;
+    return true;
+}
+
+void FlashZ::cmp_stop(){
+    ers_stop();
+    if (cmp_map){
+        fz_partition_munmap(cmp_handle);
+        cmp_map = nullptr;
+    }
+    free(cmp_buff);
+    cmp_buff = nullptr;
+    cmp_len = 0;
+    cmp_run = false;
+}
+
+size_t FlashZ::cmp_write(const uint8_t *data, size_t len){
+    if (len > cmp_size - cmp_total){
+        ESP_LOGE(TAG, "image exceeds update size %u", cmp_size);
+        return 0;
+    }
+
+    size_t done = 0;
+
+    while (done < len){
+        // whole sectors are written right from the input, the rest is collected in sector buffer
+        if (!cmp_len && len - done >= SPI_FLASH_SEC_SIZE && (cmp_all || cmp_off)){
+            if (!cmp_sector(data + done, SPI_FLASH_SEC_SIZE))
+                return 0;
+            done += SPI_FLASH_SEC_SIZE;
+            continue;
+        }
+
+        size_t n = (SPI_FLASH_SEC_SIZE - cmp_len < len - done) ? SPI_FLASH_SEC_SIZE - cmp_len : len - done;
+        memcpy(cmp_buff + cmp_len, data + done, n);
+        cmp_len += n;
+        done += n;
+        if (cmp_len == SPI_FLASH_SEC_SIZE && !cmp_flush())
+            return 0;
+    }
+
+    cmp_total += done;
+    return done;
+}
+
+bool FlashZ::cmp_flush(){
+    if (!cmp_len)
+        return true;
+
+    size_t len = cmp_len;
+    cmp_len = 0;
+    if (cmp_all || cmp_off)
+        return cmp_sector(cmp_buff, len);
+
+    // the first sector goes via UpdateClass, pre-eraser erases the whole first block, so it must be done with it first
+    if (ers_run)
+        ers_wait(SPI_FLASH_SEC_SIZE);
+    if (write(cmp_buff, len) != len)
+        return false;
+    cmp_off = SPI_FLASH_SEC_SIZE;
+    return true;
+}
+
+bool FlashZ::cmp_sector(const uint8_t *data, size_t len){
+    if (cmp_off + len > cmp_part->size){
+        ESP_LOGE(TAG, "image does not fit into partition");
+        return false;
+    }
+
+    if (!cmp_off)
+        cmp_magic = data[0];
+
+    if (cmp_mode && !memcmp(cmp_map + cmp_off, data, len)){
+        ++cmp_skipped;
+        cmp_off += SPI_FLASH_SEC_SIZE;
+        return true;
+    }
+
+    // no need to erase NOR sector twice, pre-erased sectors are known to be blank. Otherwise target is probed for
+    // a blank sector only in modes that leave sectors untouched, reading it through flash cache is a waste when it's erased anyway
+    bool erased = cmp_off < cmp_erased || (ers_run && ers_wait(cmp_off + SPI_FLASH_SEC_SIZE))
+                    || ((cmp_mode || sparse_mode) && fz_isblank(cmp_map + cmp_off, SPI_FLASH_SEC_SIZE));
+    bool blank = sparse_mode && fz_isblank(data, len);                  // erased sector is already all 0xFF
+
+    if (erased && blank)
+        ++cmp_skipped;
+
+    // block erase is ~3 times faster than erasing it's sectors one by one, but it would wipe sectors that
+    // compare-before-write and sparse modes leave untouched
+    size_t erase = SPI_FLASH_SEC_SIZE;
+    if (!cmp_mode && !sparse_mode && !ers_run && !((cmp_part->address + cmp_off) % FZ_ERASE_BLOCK_SIZE) && cmp_off + FZ_ERASE_BLOCK_SIZE <= cmp_part->size)
+        erase = FZ_ERASE_BLOCK_SIZE;
+
+    if (!erased){
+        if (esp_partition_erase_range(cmp_part, cmp_off, erase) != ESP_OK){
+            ESP_LOGE(TAG, "flash erase failed at 0x%x", cmp_off);
+            return false;
+        }
+        cmp_erased = cmp_off + erase;
+    }
+
+    if (blank){
+        ++cmp_blank;
+    } else if (esp_partition_write(cmp_part, cmp_off, data, len) != ESP_OK){
+        ESP_LOGE(TAG, "flash write failed at 0x%x", cmp_off);
+        return false;
+    }
+
+    cmp_off += SPI_FLASH_SEC_SIZE;
+    return true;
+}
+
+bool FlashZ::ers_start(size_t size){
+    ers_stop();
+
+    ers_off = ers_need = 0;
+    ers_end = (size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    if (ers_end > cmp_part->size)
+        ers_end = cmp_part->size;
+    ers_quit = ers_err = false;
+    ers_sem = xSemaphoreCreateBinary();
+    ers_go = xSemaphoreCreateBinary();
+    ers_done = xSemaphoreCreateBinary();
+    if (!ers_sem || !ers_go || !ers_done){
+        ers_stop();
+        return false;
+    }
+
+    if (xTaskCreatePinnedToCore(FlashZ::ers_task, FZ_ERASE_TASK_NAME, FZ_ERASE_TASK_STACK, this, FZ_ERASE_TASK_PRIO, NULL, tskNO_AFFINITY) != pdPASS){
+        ers_stop();
+        return false;
+    }
+
+    ers_run = true;
+    ESP_LOGI(TAG, "pre-erasing '%s' 0x%x-0x%x", cmp_part->label, ers_off, ers_end);
+    return true;
+}
+
+void FlashZ::ers_stop(){
+    if (ers_run){
+        ers_quit = true;
+        xSemaphoreGive(ers_go);
+        xSemaphoreTake(ers_done, portMAX_DELAY);
+        ers_run = false;
+    }
+
+    if (ers_sem){ vSemaphoreDelete(ers_sem); ers_sem = nullptr; }
+    if (ers_go){ vSemaphoreDelete(ers_go); ers_go = nullptr; }
+    if (ers_done){ vSemaphoreDelete(ers_done); ers_done = nullptr; }
+}
+
+bool FlashZ::ers_wait(size_t off){
+    ers_need = off;
+    xSemaphoreGive(ers_go);
+    // eraser gives semaphore on each block and once it quits, so writer never waits in vain
+    while (ers_off < off && ers_off < ers_end && !ers_err)
+        xSemaphoreTake(ers_sem, pdMS_TO_TICKS(100));
+    return !ers_err && ers_off >= off;
+}
+
+void FlashZ::ers_task(void *arg){
+    FlashZ *fz = static_cast<FlashZ*>(arg);
+
+    while (!fz->ers_quit && fz->ers_off < fz->ers_end){
+        // block erase stalls flash writes, no need to erase far ahead of the writer
+        size_t off = fz->ers_off;
+        if (off >= fz->ers_need + FZ_ERASE_LEAD){
+            xSemaphoreTake(fz->ers_go, pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        // blocks are aligned to flash address, so that flash driver could use block erase command
+        size_t n = FZ_ERASE_BLOCK_SIZE - (fz->cmp_part->address + off) % FZ_ERASE_BLOCK_SIZE;
+        if (n > fz->ers_end - off)
+            n = fz->ers_end - off;
+
+        if (esp_partition_erase_range(fz->cmp_part, off, n) != ESP_OK){
+            ESP_LOGE(TAG, "pre-erase failed at 0x%x", off);
+            fz->ers_err = true;
+            break;
+        }
+        fz->ers_off = off + n;
+        xSemaphoreGive(fz->ers_sem);
+    }
+
+    xSemaphoreGive(fz->ers_sem);
+    xSemaphoreGive(fz->ers_done);
+    vTaskDelete(NULL);
+}
+
+bool FlashZ::fdwait(int fd, uint32_t timeout){
+    if (fd < 0)
+        return false;
+
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    struct timeval tv = { (time_t)(timeout / 1000), (suseconds_t)((timeout % 1000) * 1000) };
+
+    return select(fd + 1, &rfds, NULL, NULL, &tv) > 0;
+}
+
+size_t FlashZ::writezStream(Stream &data, size_t len, stream_wait_cb_t wait){
     if (!mode_z)
         return writeStream(data);
 
-    int err __attribute__((unused)) = deco.inflate_stream_to_cb(data, len, [this](size_t i, const uint8_t* d, size_t s, bool f) -> int { return flash_cb(i, d, s, f); });
+    uint32_t t = prof_begin();
+    deco_stat_t s;
+    decoder().getstat(s);
+    uint32_t wait_us = s.wait_us;
+    if (len != UPDATE_SIZE_UNKNOWN)
+        prg_total = s.in_bytes + len;
+
+    int size = (len == UPDATE_SIZE_UNKNOWN) ? -1 : len;
+    int err;
+    if (bdl_run)
+        err = bundle.inflate_stream_to_cb(data, size, [this](size_t i, const uint8_t* d, size_t s, bool f) -> int { return flash_cb(i, d, s, f); }, TINFL_LZ_DICT_SIZE, wait);
+    else if (patch.active())
+        err = deco.inflate_stream_to_cb(data, size, [this](size_t i, const uint8_t* d, size_t s, bool f) -> int { return patch.apply(i, d, s, f); }, TINFL_LZ_DICT_SIZE, wait);
+    else if (pipe_run)
+        err = deco.inflate_stream_to_cb(data, size, [this](size_t i, const uint8_t* d, size_t s, bool f) -> int { return pipe_cb(i, d, s, f); }, TINFL_LZ_DICT_SIZE, wait);
+    else
+        err = deco.inflate_stream_to_cb(data, size, [this](size_t i, const uint8_t* d, size_t s, bool f) -> int { return flash_cb(i, d, s, f); }, TINFL_LZ_DICT_SIZE, wait);
+
+    decoder().getstat(s);
+    prof_end(t, s.wait_us - wait_us);
 
     ESP_LOGI(TAG, "inflate stream err status: %d", err);
 
+    // stream has stalled, but all the data read so far has been inflated and flashed, decode errors are final
+    z_stalled = decoder().stalled();
+    if (err != MZ_STREAM_END)
+        return 0;
+
+    return s.in_bytes;
+}
+
+void FlashZ::prof_reset(){
+    prof = deco_stat_t();
+    prof_bytes = 0;
+    heap_start = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    fz_pool_stat_t ps;
+    FzPool::getInstance().getstat(ps);
+    prof.heap_largest = ps.heap_largest;
+    prof.heap_frag = ps.heap_frag;
+    pool_us = ps.alloc_us;
+    prof_mark = micros();
+    prg_start = prg_last = millis();
+    prg_in = prg_total = 0;
+    cmp_skipped = cmp_blank = 0;
+}
+
+uint32_t FlashZ::prof_begin(){
+    uint32_t t = micros();
+    prof.wait_us += t - prof_mark;      // time between writez() calls is spent on waiting for input data
+    prof_sink = 0;
+    return t;
+}
+
+void FlashZ::prof_end(uint32_t t, uint32_t wait){
+    prof_mark = micros();
+    prof.inflate_us += prof_mark - t - prof_sink - wait;
+    prof_heap();
+}
+
+void FlashZ::prof_heap(deco_stat_t &st){
+    size_t h = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    if (h < heap_start && heap_start - h > st.heap_peak)
+        st.heap_peak = heap_start - h;
+}
+
+void FlashZ::prg_report(int status){
+    if (!prg_cb)
+        return;
+
+    uint32_t now = millis();
+    if (!status && now - prg_last < prg_interval)
+        return;
+
+    deco_stat_t s;
+    getstat(s);
+
+    fz_progress_t p;
+    p.in_bytes = s.in_bytes;
+    p.out_bytes = s.out_bytes;
+    p.total = prg_total;
+    p.rate = (now != prg_last) ? (uint64_t)(s.in_bytes - prg_in) * 1000 / (now - prg_last) : 0;
+    p.rate_avg = (now != prg_start) ? (uint64_t)s.in_bytes * 1000 / (now - prg_start) : 0;
+    p.eta = (prg_total > s.in_bytes && p.rate_avg) ? (prg_total - s.in_bytes + p.rate_avg - 1) / p.rate_avg : 0;     // rounded up, 0 is for unknown
+    p.status = status;
+
+    prg_last = now;
+    prg_in = s.in_bytes;
+    prg_cb(p);
+}
+
+void FlashZ::getstat(deco_stat_t &stat){
+    stat = prof;
+    if (mode_z){
+        // merge live decompressor counters
+        deco_stat_t d;
+        decoder().getstat(d);
+        stat.in_bytes = d.in_bytes;
+        stat.out_bytes = d.out_bytes;
+        stat.wait_us += d.wait_us;
+        stat.wdt_feeds = d.wdt_feeds;
+    }
+    stat.sec_skipped = cmp_skipped;
+    stat.sec_blank = cmp_blank;
+    stat.alloc_us = FzPool::getInstance().alloctime() - pool_us;
+    stat.chunk_avg = stat.cb_count ? prof_bytes / stat.cb_count : 0;
+}
+
+size_t FlashZ::resumeoffset(){
+    if (!mode_z || !z_stalled || pipe_err || hasError())
+        return 0;
+
     deco_stat_t s;
-    deco.getstat(s);
+    decoder().getstat(s);
     return s.in_bytes;
 }
+
+bool FlashZ::verifykey(const uint8_t *key, size_t len){
+    if (vrf_key){
+        mbedtls_pk_free(vrf_key);
+        delete vrf_key;
+        vrf_key = nullptr;
+    }
+
+    if (!key)
+        return true;
+
+    vrf_key = new(std::nothrow) mbedtls_pk_context;
+    if (!vrf_key)
+        return false;
+
+    mbedtls_pk_init(vrf_key);
+    int err = mbedtls_pk_parse_public_key(vrf_key, key, len);
+    if (err){
+        ESP_LOGE(TAG, "can't parse public key, err: -0x%04x", -err);
+        mbedtls_pk_free(vrf_key);
+        delete vrf_key;
+        vrf_key = nullptr;
+        return false;
+    }
+
+    vrf = true;
+    return true;
+}
+
+bool FlashZ::getdigest(uint8_t *in, uint8_t *out) const {
+    if (!digest_rdy)
+        return false;
+    if (in)
+        memcpy(in, digest_in, FZ_SHA256_SIZE);
+    if (out)
+        memcpy(out, digest_out, FZ_SHA256_SIZE);
+    return true;
+}
+
+void FlashZ::verify_free(){
+    deco.verify(nullptr);
+    delete sha_in;
+    sha_in = nullptr;
+    delete sha_out;
+    sha_out = nullptr;
+}
+
+bool FlashZ::verify_end(){
+    if (!sha_out){
+        if (vrf)
+            ESP_LOGE(TAG, "image verification is required, but image has not been digested");
+        return !vrf;
+    }
+
+    sha_out->finish(digest_out);
+    if (sha_in)
+        sha_in->finish(digest_in);
+    digest_rdy = sha_in != nullptr;
+    verify_free();
+
+    // container header carries a digest of inflated image
+    const fz_container_t *c = deco.container();
+    if (c && memcmp(c->sha256, digest_out, FZ_SHA256_SIZE)){
+        ESP_LOGE(TAG, "image digest does not match container header");
+        return false;
+    }
+
+    if (!vrf)
+        return true;
+
+    const uint8_t *t = deco.trailer();
+    if (!t){
+        ESP_LOGE(TAG, "image has no signature trailer");
+        return false;
+    }
+
+    if (memcmp(t + FZ_TRAILER_HDR_SIZE, digest_out, FZ_SHA256_SIZE)){
+        ESP_LOGE(TAG, "image digest mismatch");
+        return false;
+    }
+
+    if (!vrf_key){
+        ESP_LOGI(TAG, "image digest verified");
+        return true;
+    }
+
+    size_t sig_len = fz_get_le16(t + 4);
+    if (!sig_len){
+        ESP_LOGE(TAG, "image is not signed");
+        return false;
+    }
+
+    int err = mbedtls_pk_verify(vrf_key, MBEDTLS_MD_SHA256, digest_out, FZ_SHA256_SIZE, t + FZ_TRAILER_MIN_SIZE, sig_len);
+    if (err){
+        ESP_LOGE(TAG, "image signature verification failed, err: -0x%04x", -err);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "image signature verified");
+    return true;
+}
+
+bool FlashZ::iscompressed(const uint8_t *data, size_t len){
+    if (len >= FZ_MAGIC_LEN && !memcmp(data, FZ_CNT_MAGIC, FZ_MAGIC_LEN))
+        return true;
+    return fz_codec(data, len) != FZ_CODEC_NONE;
+}
+
+bool FlashZ::raw_check(size_t index, const uint8_t *data, size_t size) const {
+    if (!raw_mode || index || !iscompressed(data, size))
+        return true;
+
+    ESP_LOGE(TAG, "inflated data is compressed once more, magic: %02X%02X, double encoded image is rejected", data[0], size > 1 ? data[1] : 0);
+    return false;
+}
+
+size_t FlashZ::imagesize(const uint8_t *data, size_t len){
+    if (len < FZ_CNT_HDR_SIZE || memcmp(data, FZ_CNT_MAGIC, FZ_MAGIC_LEN) || fz_crc32_le(0, data, FZ_CNT_HDR_SIZE - 4) != fz_get_le32(data + FZ_CNT_HDR_SIZE - 4))
+        return UPDATE_SIZE_UNKNOWN;
+    return fz_get_le32(data + 8);
+}
+
+int FlashZ::pipe_cb(size_t index, const uint8_t* data, size_t size, bool final){
+    if (!size || pipe_err)
+        return 0;                               // writer task has failed, abort inflator
+    if (!raw_check(index, data, size))
+        return 0;
+
+    uint32_t t = micros();
+    pipe_chunk_t c;
+    // wait for the writer to release a buffer
+    if (xQueueReceive(pipe_q_free, &c.data, portMAX_DELAY) != pdTRUE)
+        return 0;
+
+    // callback is allowed to consume only a part of inflated data, the rest will be fed on next call
+    c.len = size < FZ_PIPE_BUFF_SIZE ? size : FZ_PIPE_BUFF_SIZE;
+    memcpy(c.data, data, c.len);
+    xQueueSend(pipe_q_data, &c, portMAX_DELAY);
+    prof_sink += micros() - t;
+    prg_report();
+
+    ESP_LOGD(TAG, "queued %u bytes", c.len);
+    return c.len;
+}
+
+bool FlashZ::pipe_start(){
+    if (pipe_run)
+        pipe_stop();
+
+    pipe_err = false;
+    pipe_prof = deco_stat_t();
+    pipe_bytes = 0;
+    pipe_q_data = xQueueCreate(FZ_PIPE_BUFF_NUM + 1, sizeof(pipe_chunk_t));     // one more slot for the stop marker
+    pipe_q_free = xQueueCreate(FZ_PIPE_BUFF_NUM, sizeof(uint8_t*));
+    pipe_done = xSemaphoreCreateBinary();
+
+    if (!pipe_q_data || !pipe_q_free || !pipe_done){
+        pipe_stop();
+        return false;
+    }
+
+    for (auto &b : pipe_buffs){
+        b = (uint8_t*)malloc(FZ_PIPE_BUFF_SIZE);
+        if (!b){
+            pipe_stop();
+            return false;       // OOM
+        }
+        xQueueSend(pipe_q_free, &b, 0);
+    }
+
+    // on dual-core chips run the writer on the core other than the inflator's one
+#if portNUM_PROCESSORS > 1
+    BaseType_t core = xPortGetCoreID() ? 0 : 1;
+#else
+    BaseType_t core = tskNO_AFFINITY;
+#endif
+
+    if (xTaskCreatePinnedToCore(FlashZ::pipe_writer, FZ_PIPE_TASK_NAME, FZ_PIPE_TASK_STACK, this, uxTaskPriorityGet(NULL), NULL, core) != pdPASS){
+        pipe_stop();
+        return false;
+    }
+
+    pipe_run = true;
+    ESP_LOGI(TAG, "pipelined writer started on core %d", core);
+    return true;
+}
+
+bool FlashZ::pipe_stop(){
+    if (pipe_run){
+        pipe_chunk_t stop = { nullptr, 0 };
+        xQueueSend(pipe_q_data, &stop, portMAX_DELAY);      // writer task will quit once all pending chunks are done
+        xSemaphoreTake(pipe_done, portMAX_DELAY);
+        pipe_run = false;
+
+        // writer task has quit, it's counters could be merged now
+        prof.flash_us += pipe_prof.flash_us;
+        prof.cb_count += pipe_prof.cb_count;
+        if (pipe_prof.chunk_min && (!prof.chunk_min || pipe_prof.chunk_min < prof.chunk_min))
+            prof.chunk_min = pipe_prof.chunk_min;
+        if (pipe_prof.chunk_max > prof.chunk_max)
+            prof.chunk_max = pipe_prof.chunk_max;
+        if (pipe_prof.heap_peak > prof.heap_peak)
+            prof.heap_peak = pipe_prof.heap_peak;
+        prof_bytes += pipe_bytes;
+    }
+
+    for (auto &b : pipe_buffs){
+        free(b);
+        b = nullptr;
+    }
+
+    if (pipe_q_data){ vQueueDelete(pipe_q_data); pipe_q_data = nullptr; }
+    if (pipe_q_free){ vQueueDelete(pipe_q_free); pipe_q_free = nullptr; }
+    if (pipe_done){ vSemaphoreDelete(pipe_done); pipe_done = nullptr; }
+
+    bool ok = !pipe_err;
+    pipe_err = false;
+    return ok;
+}
+
+void FlashZ::pipe_writer(void *arg){
+    FlashZ *fz = static_cast<FlashZ*>(arg);
+    pipe_chunk_t c;
+
+    // null data pointer is a stop marker
+    while (xQueueReceive(fz->pipe_q_data, &c, portMAX_DELAY) == pdTRUE && c.data){
+        if (!fz->pipe_err){
+            size_t _w = fz->flash_write(c.data, c.len, fz->pipe_prof, fz->pipe_bytes);
+            if (_w != c.len){
+                ESP_LOGE(TAG, "ERROR, flashed %d of %d bytes chunk, err: %s!", _w, c.len, fz->errorString());
+                fz->pipe_err = true;            // inflator will be aborted on next callback
+            } else {
+                ESP_LOGI(TAG, "flashed %u bytes", _w);
+            }
+        }
+        xQueueSend(fz->pipe_q_free, &c.data, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(fz->pipe_done);
+    vTaskDelete(NULL);
+}
@@ -39,6 +39,23 @@
 
 #include <Update.h>
 #include <functional>
+#include <atomic>
+#include "esp_partition.h"
+#include "esp_idf_version.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/pk.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+// ROM crc32, arduino-esp32 core 2.x => 3.x migration
+#if __has_include("esp_rom_crc.h")
+    #include "esp_rom_crc.h"
+    #define fz_crc32_le(crc, buf, len)  esp_rom_crc32_le(crc, buf, len)
+#else
+    #include <rom/crc.h>
+    #define fz_crc32_le(crc, buf, len)  crc32_le(crc, buf, len)
+#endif
 
 // arduino-esp32 core 2.x => 3.x migration
 #if !defined SPI_FLASH_SEC_SIZE
@@ -50,10 +67,181 @@
 #define ESP_IMAGE_HEADER_MAGIC  0xE9
 #endif
 #define GZ_HEADER               0x1F
+#define GZ_HEADER2              0x8B
 #define ZLIB_HEADER             0x78
+#define LZ4_FRAME_MAGIC         0x184D2204          // LZ4 frame format, little-endian
+#define LZ4_SKIP_MAGIC          0x184D2A50          // LZ4 skippable frame, low nibble is any
+#define HS_HEADER               "HSZ"               // heatshrink stream header
+#define FZ_MAGIC_LEN            4                   // number of bytes required to detect compressed stream format
 
 #define FLASH_CHUNK_SIZE 2*SPI_FLASH_SEC_SIZE        // SPI NOR erase sector size is 4096 bytes, so let's take 2 sectors
 
+// stream ingestion buffer, it's allocated on heap for the time of inflate_stream_to_cb() call
+// should be large enough to drain the whole TCP receive window at once
+#ifndef INFLATOR_STREAM_BUFF_SIZE
+  #ifdef CONFIG_LWIP_TCP_WND_DEFAULT
+    #define INFLATOR_STREAM_BUFF_SIZE   CONFIG_LWIP_TCP_WND_DEFAULT
+  #else
+    #define INFLATOR_STREAM_BUFF_SIZE   5744        // 4 x TCP MSS
+  #endif
+#endif
+#ifndef INFLATOR_STREAM_TIMEOUT_MS
+#define INFLATOR_STREAM_TIMEOUT_MS  10000
+#endif
+
+// pipelined writer options
+#ifndef FZ_PIPE_BUFF_NUM
+#define FZ_PIPE_BUFF_NUM        3                   // number of inflated data buffers queued to writer task
+#endif
+#ifndef FZ_PIPE_BUFF_SIZE
+#define FZ_PIPE_BUFF_SIZE       FLASH_CHUNK_SIZE    // size of each buffer, should be a multiple of SPI_FLASH_SEC_SIZE
+#endif
+#ifndef FZ_PIPE_TASK_STACK
+#define FZ_PIPE_TASK_STACK      4096
+#endif
+#define FZ_PIPE_TASK_NAME       "fz_writer"
+
+// background pre-erase options
+#ifndef FZ_ERASE_BLOCK_SIZE
+#define FZ_ERASE_BLOCK_SIZE     65536               // SPI NOR block erase size, much faster than 16 sector erases
+#endif
+#ifndef FZ_ERASE_LEAD
+#define FZ_ERASE_LEAD           65536               // max distance eraser could run ahead of writer, keeps flash bus free for writes
+#endif
+#ifndef FZ_ERASE_TASK_STACK
+#define FZ_ERASE_TASK_STACK     2048
+#endif
+#ifndef FZ_ERASE_TASK_PRIO
+#define FZ_ERASE_TASK_PRIO      1                   // just above idle, network and inflator tasks take precedence
+#endif
+#define FZ_ERASE_TASK_NAME      "fz_eraser"
+
+// parallel segment decoder options
+#ifndef FZ_PAR_TASKS
+#define FZ_PAR_TASKS            2                   // number of decoder tasks, each one inflates a segment into it's own buffer
+#endif
+#ifndef FZ_PAR_MAX_SEGMENT
+#define FZ_PAR_MAX_SEGMENT      65536               // streams with larger segments are inflated sequentially
+#endif
+#ifndef FZ_PAR_TASK_STACK
+#define FZ_PAR_TASK_STACK       3072
+#endif
+#define FZ_PAR_TASK_NAME        "fz_inflate"
+
+// flash window inflator options
+#ifndef FZ_MAP_BUFF_SIZE
+#define FZ_MAP_BUFF_SIZE        SPI_FLASH_SEC_SIZE  // write-combining buffer, history older than that is read from flash
+#endif
+#ifndef FZ_MAP_LUT_BITS
+#define FZ_MAP_LUT_BITS         9                   // Huffman codes up to that long are decoded with a single table lookup
+#endif
+#define FZ_MAP_MAX_SYMBOLS      288                 // deflate literal/length alphabet size
+
+// decoder buffer pool, see FzPool
+#ifndef FZ_POOL_SLOTS
+#define FZ_POOL_SLOTS           4                   // max number of buffers tracked by pool, Inflator takes 2
+#endif
+#define FZ_POOL_ALIGN           8                   // arena allocation alignment
+// arena size that fits Inflator state with 32k dictionary, including padding for unaligned arena buffer
+#define FZ_POOL_INFLATOR_SIZE   (((sizeof(tinfl_decompressor) + FZ_POOL_ALIGN - 1) & ~(FZ_POOL_ALIGN - 1)) + TINFL_LZ_DICT_SIZE + FZ_POOL_ALIGN - 1)
+
+#ifndef FZ_PROGRESS_INTERVAL
+#define FZ_PROGRESS_INTERVAL    1000                // default progress callback interval, ms
+#endif
+
+// LZ4 decoder options
+#define LZ4_WINDOW_SIZE         65536               // max match offset is 65535
+#define LZ4_FLG_VERSION_MASK    0xC0
+#define LZ4_FLG_VERSION         0x40
+#define LZ4_FLG_BCHECKSUM       0x10
+#define LZ4_FLG_CSIZE           0x08
+#define LZ4_FLG_CCHECKSUM       0x04
+#define LZ4_FLG_DICTID          0x01
+#define LZ4_BLOCK_UNCOMPRESSED  0x80000000
+
+// heatshrink stream header: "HSZ", window/lookahead size bits (W << 4 | L), u32 decompressed size
+#define HS_HEADER_SIZE          8
+#define HS_MIN_WINDOW_BITS      4
+#define HS_MAX_WINDOW_BITS      15
+#define HS_MIN_LOOKAHEAD_BITS   3
+
+// gzip header flags, RFC1952
+#define GZ_FLG_FHCRC            0x02
+#define GZ_FLG_FEXTRA           0x04
+#define GZ_FLG_FNAME            0x08
+#define GZ_FLG_FCOMMENT         0x10
+#define GZ_FLG_RESERVED         0xE0
+#define GZ_HEADER_SIZE          10
+#define GZ_TRAILER_SIZE         8
+
+// arduino-esp32 core 2.x => 3.x migration, partition mmap API
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    typedef esp_partition_mmap_handle_t fz_mmap_handle_t;
+    #define FZ_PARTITION_MMAP_DATA  ESP_PARTITION_MMAP_DATA
+    #define fz_partition_munmap(h)  esp_partition_munmap(h)
+#else
+    typedef spi_flash_mmap_handle_t fz_mmap_handle_t;
+    #define FZ_PARTITION_MMAP_DATA  SPI_FLASH_MMAP_DATA
+    #define fz_partition_munmap(h)  spi_flash_munmap(h)
+#endif
+
+// delta patch format, all fields are little-endian
+#define FZ_PATCH_MAGIC          0x31445A46          // "FZD1"
+#define FZ_PATCH_HDR_SIZE       16                  // magic, new image size, old image size, old image crc32
+#define FZ_PATCH_CTRL_SIZE      12                  // diff length, extra length, old image seek (signed)
+#ifndef FZ_PATCH_BUFF_SIZE
+#define FZ_PATCH_BUFF_SIZE      FLASH_CHUNK_SIZE    // rebuilt image output buffer
+#endif
+
+// signature trailer that follows compressed data, see tools/fzsign.py
+#define FZ_TRAILER_MAGIC        "FZS1"
+#define FZ_TRAILER_HDR_SIZE     8                   // magic, u16 signature length, u16 flags
+#define FZ_SHA256_SIZE          32
+#define FZ_TRAILER_MIN_SIZE     (FZ_TRAILER_HDR_SIZE + FZ_SHA256_SIZE)
+#ifndef FZ_SIG_MAX_LEN
+#define FZ_SIG_MAX_LEN          512                 // fits RSA-4096 signature
+#endif
+
+// container header that optionally precedes compressed data, all fields are little-endian, see tools/fzpack.py
+#define FZ_CNT_MAGIC            "FZC1"
+#define FZ_CNT_HDR_SIZE         60                  // magic, u8 codec, u8 flags, u16 index entries, u32 image size, u32 payload size, u32 index block size, u32 index crc32, sha256, u32 header crc32
+#define FZ_CNT_ENTRY_SIZE       4                   // index entry: u32 payload offset of a segment
+#ifndef FZ_CNT_MAX_BLOCKS
+#define FZ_CNT_MAX_BLOCKS       512
+#endif
+
+// compressed stream formats
+#define FZ_CODEC_NONE           0                   // unknown format, or not specified in container header
+#define FZ_CODEC_ZLIB           1
+#define FZ_CODEC_GZIP           2
+#define FZ_CODEC_LZ4            3
+#define FZ_CODEC_HS             4
+
+// multi-image bundle format, all fields are little-endian, see tools/fzbundle.py
+#define FZ_BUNDLE_MAGIC         "FZB1"
+#define FZ_BUNDLE_HDR_SIZE      16                  // magic, u8 number of images, u8 flags, u16 signature length, u32 manifest crc32, u32 reserved
+#define FZ_BUNDLE_ENTRY_SIZE    64                  // u8 target, u8 flags, u16 reserved, label[16], u32 payload size, u32 image size, sha256, u32 reserved
+#define FZ_BUNDLE_LABEL_LEN     16
+#ifndef FZ_BUNDLE_MAX_IMAGES
+#define FZ_BUNDLE_MAX_IMAGES    4
+#endif
+#define FZ_BUNDLE_APP           0                   // image target: OTA app partition
+#define FZ_BUNDLE_DATA          1                   // image target: data partition
+#define FZ_BUNDLE_COMPRESSED    0x01                // image flag: payload is compressed
+
+// read little-endian u16 from a byte buffer
+static inline uint16_t fz_get_le16(const uint8_t *b){
+    return b[0] | (b[1] << 8);
+}
+
+// read little-endian u32 from a byte buffer
+static inline uint32_t fz_get_le32(const uint8_t *b){
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+// adler32 checksum of zlib stream data, initial value is 1
+uint32_t fz_adler32(uint32_t adler, const uint8_t *data, size_t len);
+
 // same defines as in miniz.h, excluded in Arduino (todo: add some guards here)
 /* Return status codes. MZ_PARAM_ERROR is non-standard. */
 enum
@@ -70,83 +258,1271 @@ enum
     MZ_PARAM_ERROR = -10000
 };
 
-struct deco_stat_t {
-    size_t in_bytes;
-    size_t out_bytes;
+struct deco_stat_t {
+    size_t in_bytes = 0;
+    size_t out_bytes = 0;
+    uint32_t sec_skipped = 0;       // flash sectors left untouched as identical or already blank in compare-before-write/sparse modes
+    uint32_t sec_blank = 0;         // all-0xFF sectors that were not programmed in sparse mode
+    // cumulative time spent in each phase of update, us
+    uint32_t wait_us = 0;           // waiting for input data, i.e. network
+    uint32_t inflate_us = 0;        // decompressing data
+    uint32_t flash_us = 0;          // erasing/writing flash, in pipelined mode it runs in parallel with the other phases,
+                                    // writer task counters (flash time, chunks, heap peak) are added on update end
+    uint32_t cb_count = 0;          // number of inflated chunks written to flash
+    uint32_t chunk_min = 0;         // inflated chunk size, bytes
+    uint32_t chunk_max = 0;
+    uint32_t chunk_avg = 0;
+    uint32_t wdt_feeds = 0;         // number of watchdog resets by decompressor
+    size_t heap_peak = 0;           // peak heap usage during update, bytes
+    uint32_t alloc_us = 0;          // time spent allocating decoder buffers, us
+    size_t heap_largest = 0;        // largest free internal heap block at update start, bytes
+    uint8_t heap_frag = 0;          // internal heap fragmentation at update start, %
+};
+
+// decoder buffer placement policy, see FzPool
+enum class fz_mem_t : uint8_t {
+    heap = 0,       // wherever malloc() places it, speed-critical decoder state is kept in internal RAM
+    internal,       // internal RAM only
+    psram           // dictionaries go to PSRAM if available, speed-critical decoder state stays in internal RAM
+};
+
+// decoder buffer pool counters
+struct fz_pool_stat_t {
+    uint32_t allocs = 0;            // number of buffer requests
+    uint32_t warm_hits = 0;         // requests served with a buffer kept from previous session
+    uint32_t arena_hits = 0;        // requests served from preallocated arena
+    uint32_t psram = 0;             // buffers placed in PSRAM
+    uint32_t fails = 0;             // requests that could not be satisfied
+    uint32_t alloc_us = 0;          // total time spent in heap allocations, us
+    uint32_t alloc_us_max = 0;      // the slowest heap allocation, us
+    size_t warm_bytes = 0;          // heap held by idle warm buffers
+    size_t arena_used = 0;          // arena bytes in use
+    size_t heap_free = 0;           // free internal heap, bytes
+    size_t heap_largest = 0;        // largest free internal heap block, bytes
+    uint8_t heap_frag = 0;          // internal heap fragmentation, %, 100 - largest block * 100 / free heap
+};
+
+
+// update progress report
+struct fz_progress_t {
+    size_t in_bytes;        // compressed bytes consumed
+    size_t out_bytes;       // inflated bytes
+    size_t total;           // expected compressed input size, 0 if unknown
+    uint32_t rate;          // input throughput over the last interval, bytes/s
+    uint32_t rate_avg;      // average input throughput since update start, bytes/s
+    uint32_t eta;           // estimated time left, s, 0 if unknown
+    int status;             // 0 - update is running, 1 - finished, -1 - failed/aborted
+};
+
+// inflator callback type
+typedef std::function<int (size_t index, const uint8_t* data, size_t size, bool final)> inflate_cb_t;
+
+// container header, parsed from the data that precedes compressed stream
+struct fz_container_t {
+    uint8_t codec;                          // FZ_CODEC_* format of compressed payload, FZ_CODEC_NONE if not specified
+    uint32_t img_size;                      // inflated image size
+    uint32_t size;                          // compressed payload size
+    uint8_t sha256[FZ_SHA256_SIZE];         // inflated image digest
+    uint32_t block_size;                    // inflated size of indexed segment, 0 if there is no index
+    size_t blocks;                          // number of index entries
+    const uint8_t *index;                   // u32 LE payload offsets of independently decodable segments, segment i inflates to offset i * block_size
+};
+
+/**
+ * container hook type
+ * it's called once container header has been parsed, before any compressed data is decoded.
+ * Returns false to reject the image
+ */
+typedef std::function<bool (const fz_container_t &c)> container_hook_t;
+
+// bundle image descriptor, parsed from bundle manifest
+struct fz_bundle_image_t {
+    uint8_t target;                         // FZ_BUNDLE_APP or FZ_BUNDLE_DATA
+    uint8_t flags;
+    char label[FZ_BUNDLE_LABEL_LEN + 1];    // partition label, empty for default partition
+    uint32_t size;                          // payload size in bundle
+    uint32_t img_size;                      // image size
+    uint8_t sha256[FZ_SHA256_SIZE];         // image digest
+};
+
+enum class fz_bundle_evt_t { manifest, begin, end };
+
+/**
+ * bundle event hook type
+ * it's called once manifest has been parsed (img is nullptr), before the first and after the last byte of each image.
+ * Returns false to abort bundle processing
+ */
+typedef std::function<bool (fz_bundle_evt_t evt, const fz_bundle_image_t *img)> bundle_hook_t;
+
+// progress callback type
+typedef std::function<void (const fz_progress_t &p)> progress_cb_t;
+
+/**
+ * stream wait callback type
+ * it should block until stream has more data available or timeout expires,
+ * i.e. wait for socket event. Returns false if stream has been closed or timeout expired
+ */
+typedef std::function<bool (Stream &data, uint32_t timeout)> stream_wait_cb_t;
+
+
+
+/**
+ * @brief streaming SHA-256 digest
+ * mbedtls computes it on SHA hardware accelerator on target, software implementation is used elsewhere
+ */
+class FzSha256 {
+    mbedtls_sha256_context ctx;
+
+public:
+    FzSha256();
+    ~FzSha256();
+    void update(const uint8_t *data, size_t len);
+    void finish(uint8_t *digest);
+};
+
+
+/**
+ * @brief decoder buffer pool
+ * Inflator takes it's tinfl state and dictionary from the pool instead of heap, buffers are:
+ *  - carved from a preallocated arena if it is set, i.e. a static buffer of FZ_POOL_INFLATOR_SIZE bytes
+ *    reserved at boot, so that OTA never depends on heap fragmentation
+ *  - placed according to memory policy, with fz_mem_t::psram dictionary goes to PSRAM if chip has it,
+ *    tinfl state is always allocated in internal RAM first, since it's tables are hit on each decoded symbol.
+ *    PSRAM dictionary saves 32k of internal RAM at the cost of slower inflate
+ *  - kept allocated after decoder ends in keep-warm mode and reused by the next update session
+ * Pool is not thread-safe, decoders are expected to be created and destroyed from the same task
+ */
+class FzPool {
+    struct buff_t {
+        uint8_t *ptr;
+        size_t size;
+        bool busy;
+        bool arena;             // carved from arena
+        bool fast;              // placed in internal RAM
+    };
+
+    buff_t buffs[FZ_POOL_SLOTS] = {};
+    size_t cnt = 0;
+
+    fz_mem_t mem = fz_mem_t::heap;
+    bool warm = false;
+
+    uint8_t *arena_ptr = nullptr;
+    size_t arena_size = 0;
+    size_t arena_top = 0;
+
+    fz_pool_stat_t stat;
+
+    FzPool(){};
+    buff_t* heap_alloc(size_t size, bool fast);
+    void drop(size_t i);
+
+public:
+    static FzPool& getInstance(){
+        static FzPool pool;
+        return pool;
+    }
+
+    // Copy semantics not implemented (it's a singleton)
+    FzPool(const FzPool&) = delete;
+    FzPool& operator=(const FzPool&) = delete;
+
+    /**
+     * @brief get a buffer from the pool
+     * 
+     * @param size - buffer size, bytes
+     * @param fast - speed-critical data, that should be kept in internal RAM
+     * @return void* - buffer or nullptr on OOM
+     */
+    void* alloc(size_t size, bool fast = false);
+
+    /**
+     * @brief return buffer to the pool
+     * in keep-warm mode heap buffers are kept for reuse, otherwise memory is released
+     */
+    void free(void *ptr);
+
+    /**
+     * @brief free all idle warm buffers
+     */
+    void release();
+
+    /**
+     * @brief set buffer placement policy, applies to new heap allocations
+     */
+    void policy(fz_mem_t p){ mem = p; };
+    fz_mem_t policy() const { return mem; };
+
+    /**
+     * @brief enable/disable keep-warm mode
+     * decoder buffers are not freed between update sessions, so that the next update does not need
+     * to find 32k of contiguous heap. Disabling it releases idle buffers
+     */
+    void keepwarm(bool enable){ warm = enable; if (!warm) release(); };
+    bool keepwarm() const { return warm; };
+
+    /**
+     * @brief set preallocated arena buffers are carved from before heap is used
+     * buffer must outlive the pool, FZ_POOL_INFLATOR_SIZE bytes fit Inflator with any window size.
+     * Arena could not be changed while any of it's buffers are in use
+     * 
+     * @param buff - arena buffer, nullptr to drop the arena
+     * @param size - buffer size
+     * @return true on success
+     */
+    bool arena(void *buff, size_t size);
+
+    /**
+     * @brief get pool counters and heap fragmentation
+     */
+    void getstat(fz_pool_stat_t &s);
+
+    /**
+     * @brief total time spent in heap allocations, us
+     */
+    uint32_t alloctime() const { return stat.alloc_us; };
+};
+
+
+/**
+ * @brief lock-free single producer/single consumer byte ring
+ * producer and consumer run in different tasks, each one advances only it's own free-running counter.
+ * Consumer reads data in place, in contiguous spans up to the ring's wrap point.
+ * Producer could be throttled while the ring has no room for a given amount of data, see hold()/release()
+ */
+class FzRing {
+    uint8_t *buff = nullptr;
+    size_t size = 0;                        // power of 2
+    std::atomic<size_t> head{0};            // total bytes put by producer
+    std::atomic<size_t> tail{0};            // total bytes consumed
+    std::atomic<bool> held{false};          // producer is throttled, waits for release()
+
+public:
+    ~FzRing(){ end(); }
+
+    /**
+     * @brief allocate ring buffer and reset counters
+     * must not be called while producer or consumer is running
+     * 
+     * @param sz - buffer size, power of 2
+     */
+    bool begin(size_t sz);
+
+    // release ring buffer
+    void end();
+
+    // number of bytes queued
+    size_t used() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+    // free space, bytes
+    size_t space() const { return size - used(); }
+
+    /**
+     * @brief producer: copy data to the ring
+     * 
+     * @return size_t - number of bytes copied, it is less than len if ring is full
+     */
+    size_t put(const uint8_t *data, size_t len);
+
+    /**
+     * @brief consumer: get contiguous span of queued data
+     * 
+     * @param data - set to span start
+     * @return size_t - span length, 0 if ring is empty
+     */
+    size_t peek(const uint8_t* &data) const;
+
+    /**
+     * @brief consumer: release bytes of the span returned by peek()
+     */
+    void consume(size_t len){ tail.store(tail.load(std::memory_order_relaxed) + len, std::memory_order_release); }
+
+    /**
+     * @brief producer: check if the ring has room for another wnd bytes of data
+     * if it has not, ring is marked as throttled and producer must wait till consumer's release()
+     * 
+     * @return true if producer must wait
+     */
+    bool hold(size_t wnd);
+
+    /**
+     * @brief consumer: check if throttled producer could go on, call it after consume()
+     * returns true only once per hold(), when the ring has room for wnd bytes of data.
+     * If consumer drains the ring while producer is marking it, the one that clears the mark wins,
+     * so that producer is never left waiting for a release that would not come
+     * 
+     * @return true if producer has been throttled and must be woken up
+     */
+    bool release(size_t wnd);
+};
+
+
+class Inflator;
+
+/**
+ * @brief base class for stream decompressors
+ * decompressor unpacks blocks of compressed data and passes decompressed data to a callback
+ * format specific decoders are derived from this class
+ */
+class Decompressor {
+protected:
+    size_t total_in = 0;            /* total number of input bytes consumed so far */
+    size_t total_out = 0;           /* total number of inflated output bytes */
+    uint32_t wait_us = 0;           /* time spent waiting for stream data */
+    uint32_t wdt_feeds = 0;         /* number of watchdog resets */
+    size_t out_align = 1;           /* output is passed to callback in multiples of this size */
+    bool in_stalled = false;        /* stream has timed out or closed with all read data decoded */
+
+    // feed the dog, flashing highly compressed data (like almost empty FS image) could trigger WDT
+    void wdt_feed();
+
+public:
+    virtual ~Decompressor(){}
+
+    /**
+     * @brief Intialize decompressor
+     * allocate mem structs and buffers
+     * 
+     * @return true 
+     * @return false 
+     */
+    virtual bool init() = 0;
+
+    /**
+     * @brief reset decompressor to initial state
+     */
+    virtual void reset() = 0;
+
+    /**
+     * @brief end up decompressor and dealloc all memory
+     */
+    virtual void end() = 0;
+
+    virtual void getstat(deco_stat_t &stat);
+
+    /**
+     * @brief total number of input bytes consumed so far
+     */
+    size_t totalin() const { return total_in; }
+
+    /**
+     * @brief deliver decompressed data to callback in contiguous spans of a multiple of 'align' bytes
+     * only the tail of stream could be shorter. Span offsets are aligned too as long as callback consumes
+     * all the data it is given (or a multiple of 'align'). Preferred chunk size is rounded down to alignment.
+     * It is kept over init()/reset()
+     * 
+     * @param align - power of 2, 1 disables alignment
+     */
+    virtual void aligned(size_t align){ out_align = align ? align : 1; }
+    size_t aligned() const { return out_align; }
+
+    /**
+     * @brief bytes past the end of compressed data, that decoder has read ahead from input
+     * those bytes are counted as consumed input, but belong to whatever follows compressed data
+     * 
+     * @param data - set to read ahead bytes
+     * @return size_t - number of bytes
+     */
+    virtual size_t readahead(const uint8_t* &data){ return 0; }
+
+    /**
+     * @brief decompress input buffer and call the callback function on decompressed data
+     * It's OK to consume any amount of bytes via callback except 0. If callback returns 0 than it means an error state
+     * for callback and signal to abort the decompressor.
+     * End of compressed stream is detected from the stream itself, once it's reached all the remaining data is passed
+     * to callback with 'final' flag set and MZ_STREAM_END is returned, even if 'final' param is false.
+     * 
+     * @param inBuff - pointer to block of compressed data
+     * @param len - buffer length
+     * @param callback - callback function
+     * @param chunk_size - prefered chunk size for callback
+     * @return int - MZ_* exit code
+     */
+    virtual int inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final = false, size_t chunk_size = TINFL_LZ_DICT_SIZE) = 0;
+
+    /**
+     * @brief read compressed data from stream, decompress it and call the callback function on decompressed data
+     * all available stream data is read at once into a heap buffer of INFLATOR_STREAM_BUFF_SIZE bytes
+     * and decompressed straight from there.
+     * If stream has no data available, than wait callback is called to wait for stream events,
+     * w/o wait callback stream is polled for available data each RTOS tick, that is the only way for streams
+     * that are not backed by a socket. For sockets see FlashZ::fdwait()
+     * 
+     * @param data - stream object
+     * @param size - total size of compressed data to read from stream, if negative, than stream is read until end of compressed data
+     * @param callback - callback function
+     * @param chunk_size - prefered chunk size for callback
+     * @param wait - optional stream wait function
+     * @return int - MZ_* exit code
+     */
+    int inflate_stream_to_cb(Stream &data, int size, inflate_cb_t callback, size_t chunk_size = TINFL_LZ_DICT_SIZE, stream_wait_cb_t wait = nullptr);
+
+    /**
+     * @brief check if last inflate_stream_to_cb() call has failed due to a stream stall
+     * stream has timed out or closed before the end of compressed data, while all the data read so far
+     * has been decoded w/o errors. Decoder state is valid then and could be fed with the rest of the stream.
+     * Decode errors and truncated streams of known size are not stalls
+     */
+    bool stalled() const { return in_stalled; }
+
+    /**
+     * @brief create and initialize decompressor for a compressed stream format
+     * format is detected from the first FZ_MAGIC_LEN bytes of the stream
+     * 
+     * @param magic - first bytes of compressed stream
+     * @param len - number of bytes available, could be less than FZ_MAGIC_LEN for a very short streams
+     * @return Decompressor* - new object or nullptr if format is unknown or on mem allocation error
+     */
+    static Decompressor* create(const uint8_t *magic, size_t len);
+
+    /**
+     * @brief returns pointer to Inflator if this decompressor is the one, nullptr otherwise
+     */
+    virtual Inflator* inflator(){ return nullptr; }
+};
+
+
+/**
+ * @brief zlib/gzip decompressor, uses in-ROM miniz's tinfl
+ * dictionary is allocated on the first input byte and sized to the window of zlib stream (CMF byte),
+ * so images compressed with small windowBits take less RAM. gzip header does not tell window size,
+ * so gzip streams always take 32k dictionary.
+ * tinfl state and dictionary are taken from FzPool
+ */
+class Inflator : public Decompressor {
+    bool rdy = 0;                   /* ready flag, depends on success mem alloc */
+
+    // stream control vars
+    const uint8_t *next_in;         /* pointer to next byte to read */
+    unsigned int avail_in;          /* number of bytes available at next_in */
+    size_t dict_begin, dict_offset, dict_free;   /* output dictionary offset pointer and free space counter */
+
+    // deflator struct
+    tinfl_decompressor *m_decomp = nullptr;
+
+    // dictionary buff
+    int decomp_flags;
+    tinfl_status decomp_status;
+    uint8_t* dictBuff = nullptr;     // pool buffer for deflated dict data
+    size_t dict_size = 0;            // dict buffer size, power of 2, tinfl uses it as a ring
+
+    // compressed stream container format, detected from the first byte of input
+    enum class container_t : uint8_t {
+        detect = 0,
+        zlib,
+        gzip
+    };
+
+    // gzip member parser state
+    enum class gz_state_t : uint8_t {
+        fixed = 0,      // fixed-size header part
+        xlen,           // FEXTRA length
+        extra,          // FEXTRA data
+        name,           // FNAME string
+        comment,        // FCOMMENT string
+        hcrc,           // FHCRC header crc16
+        body,           // deflate data
+        trailer,        // CRC32 + ISIZE
+        done
+    };
+
+    container_t container;
+    gz_state_t gz_state;
+    uint8_t gz_flags;
+    uint16_t gz_cnt;                // byte counter for the current parser state
+    uint16_t gz_xlen;
+    uint32_t gz_crc;                // running crc32 of inflated data (or header data while parsing the header)
+    uint8_t gz_trailer[GZ_TRAILER_SIZE];
+
+    // bytes past the end of deflate data, left in tinfl's bit buffer
+    uint8_t ra_buff[sizeof(tinfl_bit_buf_t)];
+    uint8_t ra_len;
+
+    int inflate(bool final = false);
+
+    /**
+     * @brief (re)allocate dict buffer for the stream's window size
+     * dict is never smaller than output alignment, so that it's rewind point is aligned
+     */
+    bool dict_alloc(size_t size);
+
+    /**
+     * @brief run one inflate round into dict, a part of inflate_block_to() loop
+     * 
+     * @param final - final input block
+     * @param deco_data_len - returns the length of inflated data pending in dict
+     * @return int - MZ_* code of inflate()
+     */
+    int dict_inflate(bool final, size_t &deco_data_len);
+
+    /**
+     * @brief release dict space consumed by the callback
+     * tinfl resolves back-references relative to it's current position in the dict, so dict could be rewound
+     * only at the ring's wrap point, i.e. once it's full and all the data has been consumed
+     */
+    inline void dict_release(size_t consumed, size_t deco_data_len){
+        if (!dict_free && consumed == deco_data_len){
+            dict_free = dict_size;
+            dict_offset = 0;
+            dict_begin = 0;
+        } else {
+            dict_begin = (dict_begin+consumed) & (dict_size - 1);     // offset deco data pointer in dict
+        }
+    }
+
+    /**
+     * @brief parse gzip member header from input buffer
+     * consumes header bytes from input
+     * 
+     * @return int 1 - header is complete, 0 - need more input, <0 - MZ_* error
+     */
+    int gz_header();
+
+    /**
+     * @brief collect gzip member trailer and verify CRC32/ISIZE
+     * 
+     * @return int 1 - trailer is complete and matches, 0 - need more input, <0 - MZ_* error
+     */
+    int gz_trailer_check();
+
+
+public:
+
+    ~Inflator(){ end(); }
+
+    bool init() override;
+
+    /**
+     * @brief reset inflator to initial state
+     * Inflator must be initialized.
+     * Container format (zlib or gzip) is autodetected from the first byte of input
+     * 
+     */
+    void reset() override;
+
+    void end() override;
+
+    /**
+     * @brief dictionary size for the current stream, 0 until the first input byte
+     */
+    size_t dictsize() const { return dict_size; }
+
+    /**
+     * @brief inflate input buffer into internal dict an call the callback function on inflated data
+     * by default callback is called only when output dict is full (up to 32k), so it might skip a call if input block
+     * has not enough input data to inflate dict buffer. Param chunk_size sets _prefered_ buffer size for callback.
+     * 
+     */
+    int inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final = false, size_t chunk_size = TINFL_LZ_DICT_SIZE) override;
+
+    /**
+     * @brief same as inflate_block_to_cb(), but takes any callable with inflate_cb_t signature as a sink
+     * sink call is resolved at compile time and could be inlined, so there is no std::function
+     * construction and type-erased dispatch for each block/chunk of data
+     * 
+     */
+    template <class Sink>
+    int inflate_block_to(const uint8_t* inBuff, size_t len, Sink &&sink, bool final = false, size_t chunk_size = TINFL_LZ_DICT_SIZE){
+        if (!rdy)
+            return MZ_BUF_ERROR;    // inflator not initialized
+
+        next_in = inBuff;
+        avail_in = len;
+
+        for (;;){
+            size_t deco_data_len;
+            int err = dict_inflate(final, deco_data_len);           // inflate as much in-data as possible
+            if (err < 0)
+                return err;                                         // exit on any error
+
+            /**
+             * call the sink if:
+             * - no free space in dict
+             * - accumulated data in dict is >= prefered chunk size
+             * - it's a final input chunk or end of compressed stream
+             */
+            bool last = final || err == MZ_STREAM_END;
+            while (!dict_free || (last && (bool)deco_data_len) || (deco_data_len >= chunk_size)){
+                // dict is filled from it's start and rewinds only when it's full, so a full dict or stream tail
+                // goes to sink as is, partially filled dict is passed in whole multiples of alignment
+                size_t len = (last || !dict_free) ? deco_data_len : deco_data_len & ~(out_align - 1);
+                if (!len)
+                    break;
+
+                // sink can consume only a portion of data from dict
+                size_t consumed = sink(total_out - deco_data_len, dictBuff + dict_begin, len, err == MZ_STREAM_END);
+
+                if (!consumed || consumed > len)                // it's an error not to consume or consume too much of dict data
+                    return MZ_ERRNO;
+
+                dict_release(consumed, deco_data_len);
+                deco_data_len -= consumed;
+            }
+
+            // if we are done with this chunk of input, than quit
+            if (!avail_in || err == MZ_STREAM_END)
+                return err;
+
+            // go another inflate round
+        }
+    }
+
+    size_t readahead(const uint8_t* &data) override { data = ra_buff; return ra_len; }
+
+    // Inflator is the default and the most used decoder, this allows Unpacker to reach it's templated interface w/o RTTI
+    Inflator* inflator() override { return this; }
+};
+
+
+/**
+ * @brief base class for LZ77 decoders that keep history in a ring buffer
+ * decoded data is written to the ring and passed to the callback when it has accumulated
+ * a prefered chunk size or ring has no more free space
+ */
+class WindowDecoder : public Decompressor {
+protected:
+    uint8_t *win = nullptr;         // history ring buffer
+    size_t win_size = 0;            // ring size, power of 2
+    size_t win_pos;                 // next write position
+    size_t win_pending;             // decoded bytes not passed to callback yet
+    size_t flush_at;                // pass data to callback once that much is pending
+    inflate_cb_t *cb = nullptr;     // callback for the time of inflate_block_to_cb() call
+
+    bool win_alloc(size_t size);
+    void win_free();
+    void win_reset();
+
+    // set callback and chunk size for the time of inflate_block_to_cb() call
+    void win_cb(inflate_cb_t *callback, size_t chunk_size);
+
+    /**
+     * @brief pass pending data to callback
+     * on final call all pending data is passed to callback
+     * @return false on callback error
+     */
+    bool win_flush(bool final);
+
+    // append a byte to the ring
+    inline bool win_put(uint8_t c){
+        if (win_pending >= flush_at && !win_flush(false))
+            return false;
+        win[win_pos] = c;
+        win_pos = (win_pos + 1) & (win_size - 1);
+        ++win_pending;
+        ++total_out;
+        return true;
+    }
+
+    // append literal data to the ring
+    bool win_write(const uint8_t *src, size_t len);
+
+    // copy len bytes from 'dist' bytes back in history
+    bool win_copy(size_t dist, size_t len);
+
+    // decoded data hook, i.e. for checksum calculation
+    virtual void win_out(const uint8_t *data, size_t len){};
+
+public:
+    ~WindowDecoder(){ win_free(); }
+};
+
+
+// xxHash32 state, used for LZ4 frame checksums
+struct fz_xxh32_t {
+    uint32_t v[4];
+    uint32_t total;
+    uint8_t buf[16];
+    uint8_t buf_len;
+};
+
+
+/**
+ * @brief LZ4 frame format decoder
+ * decodes data block by block w/o buffering compressed blocks, requires LZ4_WINDOW_SIZE bytes for history
+ * block and content checksums are verified if present, dictionary ID frames are not supported
+ */
+class Lz4Decoder : public WindowDecoder {
+    enum class state_t : uint8_t {
+        magic = 0,
+        skip_size,      // skippable frame size
+        skip,           // skippable frame data
+        descr,          // frame descriptor
+        bsize,          // block size
+        token,          // sequence token
+        lit_len,        // literal length extra bytes
+        literals,
+        offset,
+        match_len,      // match length extra bytes
+        raw,            // uncompressed block data
+        bchecksum,
+        cchecksum,
+        done
+    };
+
+    state_t state;
+    uint8_t hdr[15];                // frame header/checksum bytes being collected
+    size_t hdr_cnt, hdr_len;
+    uint8_t flg;
+    uint32_t csize;                 // content size from frame descriptor (lower 32 bits), if present
+    size_t block_left;              // bytes left in current block
+    size_t lit_len, match_len;
+    size_t offset;
+    fz_xxh32_t bhash, chash;        // block and content checksums
+
+    // collect 'hdr_len' bytes into hdr buffer, returns true once complete
+    bool collect(const uint8_t* &data, size_t &len);
+
+    // parse frame descriptor
+    bool descriptor();
+
+    void win_out(const uint8_t *data, size_t len) override;
+
+public:
+    ~Lz4Decoder(){ end(); }
+
+    bool init() override;
+    void reset() override;
+    void end() override;
+    int inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final = false, size_t chunk_size = TINFL_LZ_DICT_SIZE) override;
+};
+
+
+/**
+ * @brief heatshrink stream decoder
+ * stream must be prefixed with HS_HEADER_SIZE bytes header with encoder parameters and decompressed size,
+ * see tools/fzcompress.py. Decoder requires only 2^W bytes for history window
+ */
+class HsDecoder : public WindowDecoder {
+    enum class state_t : uint8_t {
+        header = 0,
+        tag,            // literal/backref tag bit
+        literal,
+        index,          // backref distance
+        count,          // backref length
+        done
+    };
+
+    state_t state;
+    uint8_t hdr[HS_HEADER_SIZE];
+    size_t hdr_cnt;
+    uint8_t window_bits, lookahead_bits;
+    size_t out_size;                // decompressed size from header
+    uint32_t bits;                  // bit accumulator
+    uint8_t nbits;                  // number of bits in accumulator
+    size_t index;
+
+    // parse stream header and allocate window
+    bool header();
+
+public:
+    ~HsDecoder(){ end(); }
+
+    bool init() override;
+    void reset() override;
+    void end() override;
+    int inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final = false, size_t chunk_size = TINFL_LZ_DICT_SIZE) override;
+};
+
+
+/**
+ * @brief parallel zlib/gzip decoder for streams built of independently decodable segments
+ * stream must be packed into a container with segment index (tools/fzpack.py -b), deflate state is fully flushed
+ * at each segment boundary. Segments are inflated concurrently by FZ_PAR_TASKS tasks spread over CPU cores,
+ * each one with it's own tinfl_decompressor and output buffer, and passed to the callback in order
+ * from the caller's context. Takes FZ_PAR_TASKS * (block size + compressed segment size + tinfl_decompressor)
+ * bytes of heap
+ */
+class SegInflator : public Decompressor {
+    struct seg_slot_t {
+        SegInflator *owner;
+        tinfl_decompressor *tinfl;
+        uint8_t *in;                    // compressed segment
+        uint8_t *out;                   // inflated segment
+        size_t in_len;                  // compressed bytes collected
+        size_t out_len;                 // inflated bytes passed to callback
+        size_t seg;                     // segment number
+        uint32_t check;                 // adler32 or crc32 of inflated segment
+        bool busy;                      // segment is being inflated or it's data has not been passed to callback yet
+        bool queued;                    // segment is handed over to decoder task, it's done semaphore is pending
+        bool task;                      // decoder task is running
+        volatile bool err;              // segment is corrupted
+        SemaphoreHandle_t go;           // given by the caller once segment is collected
+        SemaphoreHandle_t done;         // given by decoder task once segment is inflated
+    };
+
+    fz_container_t cnt;                 // index points to Unpacker's container buffer, it outlives decoder
+    seg_slot_t slots[FZ_PAR_TASKS] = {};
+    bool rdy = false;
+    volatile bool quit = false;         // decoder tasks must stop
+    size_t trl_size;                    // zlib/gzip stream trailer size
+    size_t seg_in;                      // segment being collected
+    size_t seg_out;                     // next segment to pass to callback
+    uint32_t check;                     // adler32 or crc32 of inflated data
+    uint8_t trl[GZ_TRAILER_SIZE];
+    size_t trl_len;
+
+    // compressed segment boundaries within payload
+    size_t seg_begin(size_t i) const;
+    size_t seg_end(size_t i) const;
+
+    // inflated segment size
+    size_t seg_size(size_t i) const;
+
+    /**
+     * @brief pass inflated segment from the slot to callback
+     * 
+     * @param wait - wait for decoder task to finish the segment, otherwise return MZ_OK if it's not done yet
+     * @return int - MZ_* code
+     */
+    int seg_flush(seg_slot_t &s, inflate_cb_t &callback, size_t chunk_size, bool wait);
+
+    // verify stream trailer against inflated data checksum
+    bool trailer_check() const;
+
+    static void seg_task(void *arg);
+
+public:
+    SegInflator(const fz_container_t &c) : cnt(c) {}
+    ~SegInflator(){ end(); }
+
+    /**
+     * @brief check if stream in container could be inflated in parallel
+     * zlib/gzip payload with segment index of more than one segment no larger than FZ_PAR_MAX_SEGMENT
+     */
+    static bool suitable(const fz_container_t &c);
+
+    /**
+     * @brief allocate buffers and start decoder tasks
+     * 
+     * @return false on mem allocation error, caller could fall back to sequential Inflator
+     */
+    bool init() override;
+    void reset() override;
+    void end() override;
+    int inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final = false, size_t chunk_size = TINFL_LZ_DICT_SIZE) override;
+};
+
+
+// Huffman decoding table for MapInflator
+struct fz_huff_t {
+    uint16_t lut[1 << FZ_MAP_LUT_BITS];     // codes up to FZ_MAP_LUT_BITS long indexed by bit-reversed code: symbol | length << 12, 0 - longer code
+    uint16_t count[16];                     // number of codes of each length
+    uint16_t symbol[FZ_MAP_MAX_SYMBOLS];    // symbols in canonical code order
+};
+
+/**
+ * @brief zlib/gzip decoder that keeps no LZ77 dictionary in RAM
+ * inflated data is collected in a small write-combining buffer and passed to the callback once it's full,
+ * back-references that reach past the buffer are resolved by reading data already written to target partition
+ * via flash mmap. Callback must write out all the data it consumes before it returns, that is what direct partition
+ * writer does. The first 'head' bytes of image are kept in RAM, since UpdateClass defers writing them till the end.
+ * Takes about 4k for Huffman tables plus the buffer, instead of a 32k dictionary, but each long distance match
+ * is a read through flash cache, so it inflates slower than Inflator, see tools/fzmapsim.py
+ */
+class MapInflator : public Decompressor {
+    enum class state_t : uint8_t {
+        header = 0,     // zlib/gzip header
+        gz_xlen,        // gzip FEXTRA length
+        gz_extra,       // gzip FEXTRA data
+        gz_name,        // gzip FNAME string
+        gz_comment,     // gzip FCOMMENT string
+        gz_hcrc,        // gzip FHCRC
+        block,          // deflate block header
+        stored_len,     // stored block LEN/NLEN
+        stored,         // stored block data
+        table,          // dynamic block HLIT/HDIST/HCLEN
+        codelens,       // code length code lengths
+        lens,           // literal/length and distance code lengths
+        data,           // literal/length symbol
+        dist,           // distance symbol
+        dist_extra,     // distance extra bits
+        trailer,        // adler32 or crc32 + isize
+        done
+    };
+
+    struct tables_t {
+        fz_huff_t lit;
+        fz_huff_t dist;
+        uint8_t lens[FZ_MAP_MAX_SYMBOLS + 32];  // code lengths of dynamic block
+    };
+
+    // history source
+    const uint8_t *map;             // mmaped target partition
+    uint8_t head[ENCRYPTED_BLOCK_SIZE];
+    size_t head_len;                // number of leading image bytes read from head instead of map
+
+    tables_t *tbl = nullptr;
+    uint8_t *out = nullptr;         // write-combining buffer
+    size_t out_size = 0;
+    size_t out_len = 0;             // bytes in buffer
+    size_t out_base = 0;            // image offset of the buffer, everything below is on flash
+    inflate_cb_t *cb = nullptr;     // callback for the time of inflate_block_to_cb() call
+
+    // input and bit reader
+    const uint8_t *next_in;
+    size_t avail_in;
+    uint32_t bitbuf;
+    uint8_t bitcnt;
+
+    state_t state;
+    bool gzip;
+    bool last;                      // the last deflate block
+    uint8_t gz_flags;
+    uint16_t cnt;                   // byte/code counter for the current state
+    uint16_t need;                  // size of the current field, number of code lengths, etc.
+    uint16_t nlit, ndist;           // dynamic block literal/length and distance code counts
+    uint16_t length;                // match length
+    uint8_t dsym;                   // distance symbol
+    uint32_t check;                 // adler32/crc32 of inflated data (gzip header crc while parsing the header)
+    uint8_t trl[GZ_TRAILER_SIZE];
+    uint8_t ra_buff[4];             // bytes past the trailer, left in bit buffer
+    uint8_t ra_len;
+    size_t map_bytes;               // bytes of history read back from flash
+
+    inline bool bits_need(unsigned n){
+        while (bitcnt < n){
+            if (!avail_in)
+                return false;
+            bitbuf |= (uint32_t)*next_in++ << bitcnt;
+            --avail_in;
+            ++total_in;
+            bitcnt += 8;
+        }
+        return true;
+    }
+
+    inline uint32_t bits_get(unsigned n){
+        uint32_t v = bitbuf & ((1U << n) - 1);
+        bitbuf >>= n;
+        bitcnt -= n;
+        return v;
+    }
+
+    // get the next input byte, from bit buffer first, returns -1 if input is exhausted
+    int byte_get();
+
+    /**
+     * @brief decode a symbol w/o consuming it's bits
+     *
+     * @param len - code length
+     * @return int - symbol, -1 if there is not enough bits, -2 on invalid code
+     */
+    int huff_peek(const fz_huff_t &h, unsigned &len) const;
+
+    // build Huffman table from code lengths, false if code is oversubscribed
+    static bool huff_build(fz_huff_t &h, const uint8_t *lens, size_t n);
+
+    // parse gzip/zlib header byte, returns 1 - header is complete, 0 - need more, <0 - MZ_* error
+    int header_put(uint8_t c);
+
+    // pass buffered data to callback, everything it has consumed is expected to be on flash
+    bool out_flush(bool final);
+
+    inline bool out_put(uint8_t c){
+        if (out_len == out_size && !out_flush(false))
+            return false;
+        out[out_len++] = c;
+        ++total_out;
+        return true;
+    }
+
+    // copy len bytes from 'dist' bytes back in history, either from the buffer or from flash
+    bool out_copy(size_t dist, size_t len);
+
+    // decode deflate blocks as far as input allows, returns MZ_* code
+    int inflate();
+
+public:
+    /**
+     * @param map_ptr - mmaped target partition
+     * @param head_size - number of leading image bytes that are not written to partition till the end, up to ENCRYPTED_BLOCK_SIZE
+     */
+    MapInflator(const uint8_t *map_ptr, size_t head_size) : map(map_ptr), head_len(head_size < ENCRYPTED_BLOCK_SIZE ? head_size : ENCRYPTED_BLOCK_SIZE) {}
+    ~MapInflator(){ end(); }
+
+    bool init() override;
+    void reset() override;
+    void end() override;
+
+    /**
+     * @brief inflated data is passed to callback in buffer-sized chunks, FZ_MAP_BUFF_SIZE rounded up to alignment,
+     * chunk_size is ignored
+     */
+    int inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final = false, size_t chunk_size = TINFL_LZ_DICT_SIZE) override;
+
+    size_t readahead(const uint8_t* &data) override { data = ra_buff; return ra_len; }
+};
+
+
+/**
+ * @brief decompressor that picks a decoder by compressed stream format
+ * decoder is created on the first FZ_MAGIC_LEN bytes of input, so that only the memory
+ * required for a particular format is allocated
+ */
+class Unpacker : public Decompressor {
+    Decompressor *codec = nullptr;
+    uint8_t magic[FZ_MAGIC_LEN];
+    size_t magic_len = 0;
+
+    FzSha256 *hash = nullptr;       // input digest, signature trailer is expected if set
+    bool codec_end = false;         // end of compressed data has been reached
+    uint8_t *cnt = nullptr;         // container header buffer
+    size_t cnt_len = 0;             // container header bytes collected
+    size_t cnt_need = 0;            // container header bytes expected
+    fz_container_t cnt_info;
+    container_hook_t cnt_hook = nullptr;
+    bool par = false;               // decode indexed containers in parallel
+    const uint8_t *hist = nullptr;  // mmaped target partition for MapInflator
+    size_t hist_head = 0;
+    uint8_t *trl = nullptr;         // trailer buffer
+    size_t trl_len = 0;             // trailer bytes collected
+    size_t trl_in = 0;              // input bytes consumed past the end of compressed data
+
+    /**
+     * @brief check if decoder has reached the end of compressed data and pass the rest of input to trailer
+     * 
+     * @param err - decoder's return code
+     * @param data, len - input block given to decoder
+     * @param tin - decoder's total input counter before the call
+     * @return int - MZ_* code
+     */
+    int stream_end(int err, const uint8_t *data, size_t len, size_t tin, bool final);
+
+    /**
+     * @brief collect trailer bytes
+     * if no input digest is requested, data past compressed stream is ignored
+     * 
+     * @return int MZ_STREAM_END - trailer is complete, MZ_OK - need more input, <0 - MZ_* error
+     */
+    int trailer_put(const uint8_t *data, size_t len, bool final);
+
+    /**
+     * @brief collect container header bytes, data pointer and length are advanced by the amount consumed
+     * 
+     * @return int MZ_OK - header is complete or need more input, <0 - MZ_* error
+     */
+    int container_put(const uint8_t *&data, size_t &len);
+
+    // parse collected container header and index, returns MZ_* code
+    int container_parse();
+
+public:
+    ~Unpacker(){ end(); }
+
+    // decoder is created on first data, so this can't fail
+    bool init() override { end(); return true; };
+    void reset() override { end(); };
+    void end() override;
+    void getstat(deco_stat_t &stat) override;
+    int inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final = false, size_t chunk_size = TINFL_LZ_DICT_SIZE) override;
+
+    /**
+     * @brief decompress input buffer to a sink, any callable with inflate_cb_t signature
+     * zlib/gzip streams are inflated via Inflator::inflate_block_to() with the sink inlined,
+     * other decoders are called via inflate_block_to_cb() with a sink wrapped into std::function
+     */
+    template <class Sink>
+    int inflate_block_to(const uint8_t* inBuff, size_t len, Sink &&sink, bool final = false, size_t chunk_size = TINFL_LZ_DICT_SIZE){
+        Inflator *z = (codec && !codec_end) ? codec->inflator() : nullptr;
+        if (!z)
+            return inflate_block_to_cb(inBuff, len, sink, final, chunk_size);      // format detection, trailer and other decoders
+
+        if (hash)
+            hash->update(inBuff, len);
+
+        size_t tin = z->totalin();
+        return stream_end(z->inflate_block_to(inBuff, len, sink, final, chunk_size), inBuff, len, tin, final);
+    }
+
+    /**
+     * @brief digest all input data and expect a signature trailer past the end of compressed data
+     * must be set after init(), end() resets it
+     * 
+     * @param in_hash - input digest object, nullptr to disable
+     */
+    void verify(FzSha256 *in_hash){ hash = in_hash; };
+
+    /**
+     * @brief get collected signature trailer
+     * 
+     * @return const uint8_t* pointer to a complete trailer or nullptr if there is no one
+     */
+    const uint8_t* trailer() const;
+
+    /**
+     * @brief set container hook, it is kept over init()/end()
+     */
+    void oncontainer(container_hook_t h){ cnt_hook = h; };
+
+    /**
+     * @brief get parsed container header
+     * 
+     * @return const fz_container_t* pointer to a container descriptor or nullptr if stream has no container header
+     */
+    const fz_container_t* container() const { return (cnt && cnt_len == cnt_need) ? &cnt_info : nullptr; };
+
+    /**
+     * @brief decode containers with segment index in parallel via SegInflator, it is kept over init()/end()
+     */
+    void parallel(bool enable){ par = enable; };
+    bool parallel() const { return par; };
+
+    /**
+     * @brief inflate zlib/gzip streams with MapInflator, that reads history back from target partition
+     * instead of keeping a dictionary in RAM. Takes precedence over parallel decoding.
+     * Must be set after init(), end() resets it
+     *
+     * @param map - mmaped target partition, callback must write inflated data there synchronously, nullptr to disable
+     * @param head - number of leading image bytes that are written to partition only at the end of update
+     */
+    void history(const uint8_t *map, size_t head){ hist = map; hist_head = head; };
+
+    // alignment is passed to format decoder once it is created
+    void aligned(size_t align) override;
 };
 
 
-// inflator callback type
-typedef std::function<int (size_t index, const uint8_t* data, size_t size, bool final)> inflate_cb_t;
+/**
+ * @brief multi-image bundle parser
+ * bundle is a container with a manifest and a number of (compressed) images for different partitions.
+ * Images are decompressed in one pass and passed to the callback, the owner is notified of image boundaries
+ * via bundle hook, so it could switch target partition. Bundle files are generated with tools/fzbundle.py
+ */
+class Bundle : public Decompressor {
+    enum class state_t { header, manifest, signature, image, done };
+    state_t state = state_t::header;
+    uint8_t *hdr = nullptr;                 // header, manifest and signature buffer
+    size_t hdr_len = 0;                     // bytes collected
+    size_t hdr_need = 0;                    // bytes required to complete current state
+    size_t sig_len = 0;
+    fz_bundle_image_t img[FZ_BUNDLE_MAX_IMAGES];
+    size_t count = 0;                       // number of images
+    size_t idx = 0;                         // current image
+    size_t left = 0;                        // payload bytes left for current image
+    size_t img_out = 0;                     // output bytes of current raw image
+    uint32_t img_feeds = 0;                 // watchdog feeds of finished images
+    Unpacker deco;                          // current image decoder
+    bundle_hook_t hook = nullptr;
 
+    // parse collected header bytes, returns MZ_* code
+    int header();
 
+    // start next image or finish bundle
+    int next();
 
-class Inflator {
-    bool rdy = 0;                   /* ready flag, depends on success mem alloc */
+    // pass raw image data to callback
+    int raw(const uint8_t *data, size_t len, inflate_cb_t &callback, bool last);
 
-    // stream control vars
-    const uint8_t *next_in;         /* pointer to next byte to read */
-    unsigned int avail_in;          /* number of bytes available at next_in */
-    unsigned int total_in;          /* total number of input bytes consumed so far */
-    unsigned int total_out;         /* total number of inflated output bytes */
-    size_t dict_begin, dict_offset, dict_free;   /* output dictionary offset pointer and free space counter */
+public:
+    ~Bundle(){ end(); }
 
-    // deflator struct
-    tinfl_decompressor *m_decomp = nullptr;
+    bool init() override;
+    void reset() override;
+    void end() override;
+    void getstat(deco_stat_t &stat) override;
+    int inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final = false, size_t chunk_size = TINFL_LZ_DICT_SIZE) override;
+    void aligned(size_t align) override { Decompressor::aligned(align); deco.aligned(align); };
 
-    // dictionary buff
-    int decomp_flags;
-    tinfl_status decomp_status;
-    uint8_t* dictBuff = nullptr;     // heap buffer for deflated dict data
+    /**
+     * @brief set bundle event hook
+     */
+    void onevent(bundle_hook_t h){ hook = h; };
 
-    int inflate(bool final = false);
+    /**
+     * @brief all the images has been processed
+     */
+    bool done() const { return state == state_t::done; };
+
+    /**
+     * @brief header and manifest bytes, available once manifest has been parsed
+     */
+    const uint8_t *manifest(size_t &len) const { len = FZ_BUNDLE_HDR_SIZE + count * FZ_BUNDLE_ENTRY_SIZE; return hdr; };
 
+    /**
+     * @brief manifest signature, available once manifest has been parsed
+     */
+    const uint8_t *signature(size_t &len) const { len = sig_len; return sig_len ? hdr + FZ_BUNDLE_HDR_SIZE + count * FZ_BUNDLE_ENTRY_SIZE : nullptr; };
+};
 
-public:
 
-    ~Inflator(){ end(); }
+/**
+ * @brief Patcher rebuilds new firmware image from the running one and a delta patch
+ * Patch is a stream of control records, each one followed by it's data, bsdiff-alike:
+ *  - 'diff' bytes are added bytewise to the bytes of the old image
+ *  - 'extra' bytes are copied to the new image as-is
+ *  - old image read pointer is moved by 'seek' bytes
+ * Old image is read from the running app partition via flash mmap.
+ * Patch data is fed via apply() call that is compatible with inflate_cb_t, so it could be
+ * used straight as Inflator's callback, rebuilt image is passed further to sink callback
+ */
+class Patcher {
+    enum class state_t : uint8_t {
+        header = 0,
+        ctrl,
+        diff,
+        extra,
+        done,
+        error
+    };
+
+    state_t state = state_t::header;
+    uint8_t hdr[FZ_PATCH_HDR_SIZE];     // header or control record being collected
+    size_t hdr_cnt;
+
+    const uint8_t *old = nullptr;       // mmaped old image
+    fz_mmap_handle_t mmap_handle;
+    size_t old_size, old_pos;
+    size_t new_size, new_pos;           // total and produced bytes of new image
+    size_t diff_left, extra_left;
+    int32_t seek;
+
+    uint8_t *buff = nullptr;            // rebuilt image buffer
+    size_t buff_len;
+    size_t flushed;                     // bytes passed to sink so far
+    inflate_cb_t sink;
+
+    // parse patch header and map old image
+    bool header();
+
+    // parse control record
+    bool ctrl();
+
+    // pass buffered data to sink, on final call buffer is flushed completely
+    bool flush(bool final);
+
+public:
+    ~Patcher(){ end(); }
 
     /**
-     * @brief Intialize inflator
-     * allocate mem structs and buffers
+     * @brief initialize patcher
      * 
-     * @return true 
-     * @return false 
+     * @param cb - sink callback for rebuilt image data
+     * @return true on success
+     * @return false on mem allocation error
      */
-    bool init();
+    bool begin(inflate_cb_t cb);
 
     /**
-     * @brief reset inflator to initial state
-     * Inflator must be initialized
-     * 
+     * @brief release memory and unmap old image
      */
-    void reset();
+    void end();
 
     /**
-     * @brief end up inflator and dealloc all memory
-     * 
+     * @brief patcher is initialized and waiting for patch data
      */
-    void end();
+    bool active() const { return buff; };
 
-    void getstat(deco_stat_t &stat);
+    /**
+     * @brief new image has been rebuilt completely
+     */
+    bool done() const { return state == state_t::done; };
 
     /**
-     * @brief inflate input buffer into internal dict an call the callback function on inflated data
-     * by default callback is called only when output dict is full (32k), so it might skip a call if input block
-     * has not enough input data to inflate dict buffer. Param chunk_size sets _prefered_ buffer size for callback.
-     * It's OK to consume any amount of bytes via callback except 0. If callback returns 0 than it means an error state
-     * for callback and signal to abort the Inflator.
+     * @brief feed patch data, inflate_cb_t compatible
      * 
-     * @param inBuff - pointer to block of compressed data
-     * @param len - buffer length
-     * @param callback - callback function
-     * @param chunk_size - prefered chunk size for callback
-     * @return int - MZ_* exit code
+     * @return int - number of bytes consumed, 0 on error
      */
-    int inflate_block_to_cb(const uint8_t* inBuff, size_t len, inflate_cb_t callback, bool final = false, size_t chunk_size = TINFL_LZ_DICT_SIZE);
-
-
-    int inflate_stream_to_cb(Stream &data, int size, inflate_cb_t callback, size_t chunk_size = TINFL_LZ_DICT_SIZE);
+    int apply(size_t index, const uint8_t* data, size_t size, bool final);
 };
 
 
@@ -164,7 +1540,215 @@ class FlashZ : public UpdateClass {
 
     //deco_stat_t stat;
     bool mode_z = false;        // need to keep mode state for async writez() calls
-    Inflator deco;
+    bool z_stalled = false;     // compressed stream has stalled, inflator state is kept for resume
+    Unpacker deco;              // decompressor is picked by compressed stream format
+    Patcher patch;              // delta patch mode
+    Bundle bundle;              // multi-image bundle mode
+    bool bdl_run = false;       // bundle is being processed
+    const esp_partition_t *bdl_boot = nullptr;  // app partition to boot from once bundle is complete
+
+    // decompressor for the current update
+    Decompressor &decoder(){ return bdl_run ? static_cast<Decompressor&>(bundle) : deco; };
+
+    // bundle event hook
+    bool bdl_event(fz_bundle_evt_t evt, const fz_bundle_image_t *img);
+
+    // verify bundle manifest signature
+    bool bdl_verify();
+
+    // finish bundle update
+    bool bdl_end();
+
+    // container hook, checks image size against target partition before anything is flashed
+    bool cnt_check(const fz_container_t &c);
+
+    // update instrumentation
+    deco_stat_t prof;                       // FlashZ counters, decompressor counters are merged on update end
+    uint32_t prof_mark = 0;                 // the last time writez() has returned, us
+    uint32_t prof_sink = 0;                 // time spent in flash/pipe callbacks during current writez() call, us
+    size_t prof_bytes = 0;                  // total bytes written to flash
+    size_t heap_start = 0;                  // free heap on update start
+    uint32_t pool_us = 0;                   // FzPool allocation time on update start, us
+
+    // reset stats and progress counters on update start
+    void prof_reset();
+
+    // start timing writez() call
+    uint32_t prof_begin();
+
+    /**
+     * @brief finish timing writez() call
+     * 
+     * @param t - call start time, returned by prof_begin()
+     * @param wait - time spent on waiting for stream data inside the call
+     */
+    void prof_end(uint32_t t, uint32_t wait = 0);
+
+    // sample free heap
+    void prof_heap(deco_stat_t &st);
+    void prof_heap(){ prof_heap(prof); };
+
+    // progress reports
+    progress_cb_t prg_cb = nullptr;
+    uint32_t prg_interval = FZ_PROGRESS_INTERVAL;
+    uint32_t prg_start = 0;                 // update start time, ms
+    uint32_t prg_last = 0;                  // the last report time, ms
+    size_t prg_in = 0;                      // input bytes at the last report
+    size_t prg_total = 0;                   // expected compressed input size
+
+    /**
+     * @brief call progress callback
+     * 
+     * @param status - 0 - update is running, report is rate-limited to progress interval; 1 - finished, -1 - failed
+     */
+    void prg_report(int status = 0);
+
+    // direct partition writer for compare-before-write, sparse and direct write modes
+    bool cmp_mode = false;                  // compare-before-write mode is requested by user
+    bool sparse_mode = false;               // sparse write mode is requested by user
+    bool direct_mode = false;               // direct write mode is requested by user
+    bool fwin_mode = false;                 // flash window inflate mode is requested by user
+    bool cmp_run = false;                   // direct writer is active for the current update
+    const esp_partition_t *cmp_part = nullptr;  // target partition
+    const uint8_t *cmp_map = nullptr;       // mmaped target partition
+    fz_mmap_handle_t cmp_handle;
+    uint8_t *cmp_buff = nullptr;            // sector buffer
+    size_t cmp_len = 0;                     // data length in sector buffer
+    size_t cmp_off = 0;                     // target partition offset
+    size_t cmp_erased = 0;                  // partition is erased inline up to this offset
+    size_t cmp_size = 0;                    // declared image size, partition size if unknown
+    size_t cmp_total = 0;                   // image bytes taken by direct writer
+    bool cmp_all = false;                   // the first sector is written directly too, UpdateClass is not used
+    uint8_t cmp_magic = 0;                  // the first byte of image
+    uint32_t cmp_skipped = 0;               // number of sectors left untouched (identical or already blank)
+    uint32_t cmp_blank = 0;                 // number of blank sectors that were not programmed
+
+    /**
+     * @brief write inflated data to flash
+     * data goes to UpdateClass or to direct partition writer, inflated image digest is updated
+     * 
+     * @param st - counters of the calling task, flash time, chunk sizes and heap peak are updated
+     * @param bytes - counter of written bytes
+     * @return size_t number of bytes written
+     */
+    size_t flash_write(const uint8_t *data, size_t len, deco_stat_t &st, size_t &bytes);
+
+    /**
+     * @brief find target partition for UpdateClass command
+     */
+    const esp_partition_t *cmp_find(int command, const char *label);
+
+    /**
+     * @brief mmap target partition for direct partition writer
+     * 
+     * @param size - image size or UPDATE_SIZE_UNKNOWN
+     * @return true if direct writer could be used for the update
+     */
+    bool cmp_start(const esp_partition_t *part, size_t size);
+
+    // release direct partition writer resources
+    void cmp_stop();
+
+    /**
+     * @brief direct partition writer
+     * whole sectors are written to partition right from the data with cmp_sector(), the rest is collected
+     * in sector buffer. The first sector is always collected and goes via UpdateClass, it checks image magic,
+     * defers writing of image header till the end of update and switches boot partition
+     * 
+     * @return size_t number of bytes written, 0 on error
+     */
+    size_t cmp_write(const uint8_t *data, size_t len);
+
+    /**
+     * @brief write out sector buffer
+     * called for a full buffer and for the last partial sector of image
+     */
+    bool cmp_flush();
+
+    /**
+     * @brief write sector to target partition
+     * in compare-before-write mode sector is left untouched if it's contents is identical to the data,
+     * already blank sector is not erased, all-0xFF data is not programmed in sparse mode.
+     * Otherwise whole 64k blocks are erased inline once writer reaches block boundary, like UpdateClass does
+     * 
+     * @param len - sector data length, could be less than sector size for the last sector of image
+     */
+    bool cmp_sector(const uint8_t *data, size_t len);
+
+    // background pre-eraser for direct partition writer
+    bool ers_mode = false;                  // pre-erase is requested by user
+    bool ers_run = false;                   // eraser task is running
+    volatile bool ers_quit = false;         // eraser task must stop
+    volatile bool ers_err = false;          // eraser task has failed, writer erases sectors itself
+    volatile size_t ers_off = 0;            // target partition is erased up to this offset
+    size_t ers_end = 0;                     // end of the region to erase
+    volatile size_t ers_need = 0;           // writer needs partition erased up to this offset
+    SemaphoreHandle_t ers_sem = nullptr;    // given each time a block has been erased
+    SemaphoreHandle_t ers_go = nullptr;     // given by writer each time it requests next sector
+    SemaphoreHandle_t ers_done = nullptr;   // eraser task has quit
+
+    /**
+     * @brief start eraser task for direct partition writer
+     * target partition is erased up to image size in FZ_ERASE_BLOCK_SIZE blocks
+     * 
+     * @param size - image size
+     */
+    bool ers_start(size_t size);
+
+    // stop eraser task, waits for the current block erase to finish
+    void ers_stop();
+
+    /**
+     * @brief wait until eraser has passed the offset
+     * also lets eraser run up to FZ_ERASE_LEAD bytes ahead of the offset
+     * 
+     * @return true if target partition is erased up to the offset, false if writer must erase it itself
+     */
+    bool ers_wait(size_t off);
+
+    static void ers_task(void *arg);
+
+    bool raw_mode = false;                  // inflated data must be a raw image, nested compression is rejected
+
+    /**
+     * @brief check the first chunk of inflated image for nested compression
+     * @return false if raw image is required, but inflated data starts with a compressed stream or container magic
+     */
+    bool raw_check(size_t index, const uint8_t *data, size_t size) const;
+
+    // image verification
+    bool vrf = false;                       // compressed images must carry a trailer with a valid digest/signature
+    mbedtls_pk_context *vrf_key = nullptr;  // public key for signature verification
+    FzSha256 *sha_in = nullptr;             // digest of compressed input
+    FzSha256 *sha_out = nullptr;            // digest of inflated image
+    bool digest_rdy = false;
+    uint8_t digest_in[FZ_SHA256_SIZE];
+    uint8_t digest_out[FZ_SHA256_SIZE];
+
+    /**
+     * @brief finalize digests and check image against the signature trailer and container header
+     * 
+     * @return true if verification is disabled or image is valid
+     */
+    bool verify_end();
+
+    // release digest objects
+    void verify_free();
+
+    // pipelined writer
+    struct pipe_chunk_t {
+        uint8_t *data;
+        size_t len;
+    };
+    bool pipe_mode = false;                 // pipeline is requested by user
+    bool pipe_run = false;                  // writer task is running
+    volatile bool pipe_err = false;         // writer task failed to write a chunk
+    QueueHandle_t pipe_q_data = nullptr;    // chunks pending for flashing
+    QueueHandle_t pipe_q_free = nullptr;    // empty buffers
+    SemaphoreHandle_t pipe_done = nullptr;  // writer task has quit
+    uint8_t *pipe_buffs[FZ_PIPE_BUFF_NUM] = {};
+    deco_stat_t pipe_prof;                  // writer task counters, merged into prof by pipe_stop() once the task has quit
+    size_t pipe_bytes = 0;                  // bytes written by writer task
 
     /**
      * @brief callback for inflator
@@ -173,6 +1757,32 @@ class FlashZ : public UpdateClass {
      */
     int flash_cb(size_t index, const uint8_t* data, size_t size, bool final);    //> inflate_cb_t
 
+    /**
+     * @brief callback for inflator in pipelined mode
+     * copies inflated chunk to a free buffer and sends it to the writer task,
+     * blocks if writer task has no free buffers left
+     */
+    int pipe_cb(size_t index, const uint8_t* data, size_t size, bool final);     //> inflate_cb_t
+
+    /**
+     * @brief allocate buffers and start writer task
+     * 
+     * @return true on success
+     * @return false on mem allocation error
+     */
+    bool pipe_start();
+
+    /**
+     * @brief stop writer task and release buffers
+     * all pending chunks are flashed before writer task quits
+     * 
+     * @return true if all chunks were written w/o errors
+     */
+    bool pipe_stop();
+
+    // writer task
+    static void pipe_writer(void *arg);
+
     public:
         // this is a singleton, no copy's
         FlashZ(const FlashZ&) = delete;
@@ -185,6 +1795,25 @@ class FlashZ : public UpdateClass {
             return flashz;
         }
 
+        /**
+         * @brief check if image's first bytes denote a compressed image of any supported format
+         * zlib, gzip, LZ4 frame and heatshrink streams, and a container header are recognized
+         * 
+         * @param data - first bytes of image
+         * @param len - number of bytes, at least FZ_MAGIC_LEN bytes are required to recognize all formats
+         */
+        static bool iscompressed(const uint8_t *data, size_t len);
+
+        /**
+         * @brief get inflated image size from container header
+         * could be used to size an update exactly with beginz()
+         * 
+         * @param data - first bytes of image
+         * @param len - number of bytes, at least FZ_CNT_HDR_SIZE bytes are required
+         * @return size_t - inflated image size or UPDATE_SIZE_UNKNOWN if there is no valid container header
+         */
+        static size_t imagesize(const uint8_t *data, size_t len);
+
         /**
          * @brief initilize Inflator structs and UpdaterClass
          * 
@@ -193,6 +1822,172 @@ class FlashZ : public UpdateClass {
          */
         bool beginz(size_t size=UPDATE_SIZE_UNKNOWN, int command = U_FLASH, int ledPin = -1, uint8_t ledOn = LOW, const char *label = NULL);
 
+        /**
+         * @brief initialize delta update
+         * compressed data fed to writez()/writezStream() is a delta patch against the running firmware image,
+         * new image is rebuilt from the running app partition and the patch and written to the next OTA partition.
+         * Patch files are generated with tools/fzdelta.py
+         * 
+         * @return true on success
+         * @return false on mem allocation error or flash free space error
+         */
+        bool beginpatch(int ledPin = -1, uint8_t ledOn = LOW);
+
+        /**
+         * @brief initialize multi-image bundle update
+         * data fed to writez()/writezStream() is a bundle of (compressed) firmware and filesystem images,
+         * all of them are flashed in one pass. Each image is written directly to it's partition and checked against
+         * SHA-256 digest from bundle manifest, boot partition is switched on endz() only if all the images
+         * have been flashed and verified. If public key is set with verifykey(), manifest must be signed.
+         * Pipelined mode is not used for bundles. Bundle files are generated with tools/fzbundle.py
+         * 
+         * @return true on success
+         * @return false on mem allocation error or if update is already running
+         */
+        bool beginbundle();
+
+        /**
+         * @brief check if image's first bytes denote a multi-image bundle
+         */
+        static bool isbundle(const uint8_t *data, size_t len){ return len >= sizeof(FZ_BUNDLE_MAGIC) - 1 && !memcmp(data, FZ_BUNDLE_MAGIC, sizeof(FZ_BUNDLE_MAGIC) - 1); };
+
+        /**
+         * @brief enable/disable pipelined flashing mode
+         * in pipelined mode inflated data is queued to a dedicated writer task,
+         * so that decompression and SPI flash erase/write could run simultaneously.
+         * On dual-core chips writer task is pinned to the core other than caller's one.
+         * Pipeline requires additional FZ_PIPE_BUFF_NUM * FZ_PIPE_BUFF_SIZE bytes of heap.
+         * Mode must be set before calling beginz()
+         * 
+         * @param enable 
+         */
+        void pipeline(bool enable){ pipe_mode = enable; };
+
+        /**
+         * @brief get pipelined flashing mode
+         */
+        bool pipeline() const { return pipe_mode; };
+
+        /**
+         * @brief enable/disable parallel decoding of containers with segment index
+         * segments of zlib/gzip images packed with 'tools/fzpack.py -b' are inflated concurrently on both cores,
+         * see SegInflator. Falls back to sequential Inflator for images w/o index or if there is not enough heap.
+         * Could be combined with pipelined mode, not used for bundles
+         *
+         * @param enable
+         */
+        void parallel(bool enable){ deco.parallel(enable); };
+
+        /**
+         * @brief get parallel decoding mode
+         */
+        bool parallel() const { return deco.parallel(); };
+
+        /**
+         * @brief enable/disable compare-before-write mode
+         * each inflated sector is compared to the current contents of the target partition (read via flash mmap),
+         * identical sectors are not erased/written. This saves both time and flash wear when re-flashing
+         * an image that has changed only slightly, i.e. FS image. Number of skipped sectors is reported in stats.
+         * Differing sectors are erased one by one, so updating an image that differs completely is a bit slower
+         * than in regular mode. Size and progress are tracked by FlashZ, MD5 check is not available, see setMD5().
+         * Must be set before beginz()
+         * 
+         * @param enable 
+         */
+        void cmpwrite(bool enable){ cmp_mode = enable; };
+
+        /**
+         * @brief get compare-before-write mode
+         */
+        bool cmpwrite() const { return cmp_mode; };
+
+        /**
+         * @brief enable/disable sparse write mode
+         * inflated sectors that consist of 0xFF bytes only are erased but not programmed, sectors that are
+         * already blank on flash are not erased again. Inflated FS images are mostly empty, so most of the
+         * programming time is saved. Number of blank sectors is reported in stats.
+         * Could be combined with compare-before-write mode, same limitations apply.
+         * Must be set before beginz()
+         * 
+         * @param enable 
+         */
+        void sparse(bool enable){ sparse_mode = enable; };
+
+        /**
+         * @brief get sparse write mode
+         */
+        bool sparse() const { return sparse_mode; };
+
+        /**
+         * @brief enable/disable direct write mode
+         * inflated data is written to target partition with esp_partition_write() right from decompressor's
+         * output buffer, sector aligned spans are not copied to UpdateClass's buffer. Partial sectors are collected
+         * in a sector buffer. The first sector of image still goes through UpdateClass, it checks image magic,
+         * defers header write till endz() and switches boot partition. Size and progress are tracked by FlashZ,
+         * MD5 check is not available, see setMD5(). Falls back to regular write if target partition can't be mapped.
+         * Must be set before beginz()
+         * 
+         * @param enable 
+         */
+        void directwrite(bool enable){ direct_mode = enable; };
+
+        /**
+         * @brief get direct write mode
+         */
+        bool directwrite() const { return direct_mode; };
+
+        /**
+         * @brief enable/disable flash window inflate mode
+         * zlib/gzip images are inflated with MapInflator, that keeps no 32k dictionary in RAM: back-references
+         * are resolved by reading already written data from target partition via flash mmap. Decoder takes about 8k
+         * of heap, but inflates slower, since long distance matches are read through flash cache.
+         * Requires direct partition writer, as with directwrite() it falls back to regular Inflator if target
+         * partition can't be mapped. Pipelined mode is not used, since history must be on flash before it's referenced.
+         * Not used for delta updates and bundles. Must be set before beginz()
+         * 
+         * @param enable 
+         */
+        void flashwindow(bool enable){ fwin_mode = enable; };
+
+        /**
+         * @brief get flash window inflate mode
+         */
+        bool flashwindow() const { return fwin_mode; };
+
+        /**
+         * @brief enable/disable background pre-erase
+         * if image size is known on beginz() (given by caller or read from container header with imagesize()),
+         * image is flashed with direct partition writer and a low priority task erases target partition ahead of it
+         * with 64K block erases. Erase time overlaps with network wait and decompression, inflated data is programmed
+         * to already blank flash, writer waits for the eraser if it catches up. Bundle images are pre-erased too.
+         * Not used in compare-before-write mode, since old contents of partition is required.
+         * Must be set before beginz()
+         * 
+         * @param enable 
+         */
+        void preerase(bool enable){ ers_mode = enable; };
+
+        /**
+         * @brief get pre-erase mode
+         */
+        bool preerase() const { return ers_mode; };
+
+        /**
+         * @brief require inflated data to be a raw image
+         * update fails if the first inflated bytes are a compressed stream or container header, i.e. an already
+         * compressed image was gzip encoded once more by a web server or CDN. Such an image would otherwise be
+         * flashed still compressed, FS image has no magic to catch that. Used by http client for gzip encoded replies.
+         * Must be set before beginz()
+         * 
+         * @param enable 
+         */
+        void rawonly(bool enable){ raw_mode = enable; };
+
+        /**
+         * @brief get raw image requirement
+         */
+        bool rawonly() const { return raw_mode; };
+
         /**
          * @brief Writes a buffer to the flash and increments the address
          * Returns the amount of processed compressed bytes. Decompressed written size is usually larger
@@ -206,13 +2001,51 @@ class FlashZ : public UpdateClass {
 
         /**
          * @brief Read zlib compressed data from stream, decompress and write it to flash
-         * size of the stream must be known in order to signal zlib inflator last chunk
+         * if size of the stream is unknown (i.e. chunked or close-delimited http reply), than
+         * stream is read until compressed data end marker is found
          * 
          * @param data Stream object, usually data from a tcp socket
-         * @param len total length of compressed data to read from stream
-         * @return size_t number of bytes processed from a stream
+         * @param len total length of compressed data to read from stream or UPDATE_SIZE_UNKNOWN
+         * @param wait optional callback to wait for stream data, see stream_wait_cb_t
+         * @return size_t number of bytes processed from a stream, 0 on any error
+         * if stream has timed out or closed before the end of compressed data, update is NOT aborted,
+         * it could be continued with another stream, see resumeoffset()
+         */
+        size_t writezStream(Stream &data, size_t len, stream_wait_cb_t wait = nullptr);
+
+        /**
+         * @brief same as writezStream() above, for socket backed streams, i.e. WiFiClient/NetworkClient
+         * any stream class with fd() and connected() methods is accepted. Task blocks on the socket with select()
+         * while waiting for data instead of polling the stream each RTOS tick
+         *
+         * @param client stream object with a socket
+         * @param len total length of compressed data to read from stream or UPDATE_SIZE_UNKNOWN
+         */
+        template <class Client>
+        auto writezStream(Client &client, size_t len) -> decltype(client.fd(), client.connected(), size_t()){
+            return writezStream(client, len, [&client](Stream &, uint32_t timeout){ return client.connected() && fdwait(client.fd(), timeout); });
+        }
+
+        /**
+         * @brief block on a socket until it has some data to read, stream_wait_cb_t helper
+         *
+         * @param fd socket descriptor
+         * @param timeout ms
+         * @return false on timeout, socket error or bad descriptor
+         */
+        static bool fdwait(int fd, uint32_t timeout);
+
+        /**
+         * @brief compressed stream offset to resume interrupted update from
+         * if writezStream() has failed due to stream timeout or closed connection, inflator and
+         * flash writer states are kept intact, so update could be continued by feeding the rest of
+         * compressed data starting from this offset to writezStream() or writez()
+         * NOTE: this is resume after connection drop only, state is kept in RAM and not checkpointed
+         * to NVS, update can't be resumed after a reboot or power loss
+         *
+         * @return size_t offset of the next expected compressed byte, 0 if update can't be resumed
          */
-        size_t writezStream(Stream &data, size_t len);
+        size_t resumeoffset();
 
         /**
          * @brief abort running inflator and flash update process
@@ -230,10 +2063,98 @@ class FlashZ : public UpdateClass {
         bool endz(bool evenIfRemaining = true);
 
         /**
-         * @brief request stat data from the inflator
-         * return amount of input/inflated bytes processed so far
+         * @brief update size and progress, same as UpdateClass ones
+         * in compare-before-write, sparse, direct write, flash window and pre-erase modes UpdateClass handles only
+         * the first sector of image, then size and progress of the whole image are tracked by FlashZ. Size is
+         * the one passed to beginz(), or target partition size if it's unknown. Progress counts inflated bytes
+         * taken by flash writer.
+         * NOTE: UpdateClass methods are not virtual, so those must be called on FlashZ object
+         */
+        size_t size(){ return cmp_run ? cmp_size : UpdateClass::size(); }
+        size_t progress(){ return cmp_run ? cmp_total : UpdateClass::progress(); }
+        size_t remaining(){ return size() - progress(); }
+        bool isFinished(){ return progress() == size(); }
+
+        /**
+         * @brief set expected MD5 of inflated image, see UpdateClass::setMD5()
+         * must be called after beginz(). Direct partition writer modes bypass UpdateClass's MD5 digest,
+         * so MD5 is rejected then, use verify() to check image integrity instead
+         * 
+         * @param expected_md5 - hex string
+         * @return false if MD5 can't be checked for the current update
+         */
+        bool setMD5(const char *expected_md5);
+
+        /**
+         * @brief enable/disable image verification
+         * if enabled, SHA-256 digests of compressed input and of inflated image are computed on the fly and
+         * compressed image must be followed by a trailer carrying the digest of inflated image and, optionally,
+         * it's signature, see tools/fzsign.py. endz() fails if trailer is missing or does not match, so that boot
+         * partition is never switched to an invalid image. Uncompressed images can't be verified and are rejected.
+         * Must be set before beginz()
+         * 
+         * @param enable 
+         */
+        void verify(bool enable){ vrf = enable; };
+
+        /**
+         * @brief get image verification mode
+         */
+        bool verify() const { return vrf; };
+
+        /**
+         * @brief set public key for image signature verification, enables verification
+         * trailer must carry ECDSA or RSA (PKCS#1 v1.5) signature of inflated image's SHA-256 digest
+         * made with the matching private key
+         * 
+         * @param key - PEM (including null terminator) or DER encoded public key, nullptr to drop the key
+         * @param len - key length
+         * @return true on success
+         * @return false if key can't be parsed
+         */
+        bool verifykey(const uint8_t *key, size_t len);
+
+        /**
+         * @brief set PEM encoded public key for image signature verification, enables verification
+         */
+        bool verifykey(const char *pem){ return verifykey((const uint8_t*)pem, pem ? strlen(pem) + 1 : 0); };
+
+        /**
+         * @brief get SHA-256 digests of the last verified update
+         * digests are available after endz() if verification was enabled
+         * 
+         * @param in - buffer for FZ_SHA256_SIZE bytes digest of compressed input (all bytes fed to writez/writezStream), could be nullptr
+         * @param out - buffer for FZ_SHA256_SIZE bytes digest of inflated image, could be nullptr
+         * @return true if digests are available
+         */
+        bool getdigest(uint8_t *in, uint8_t *out) const;
+
+        /**
+         * @brief request update stats
+         * return amount of input/inflated bytes processed so far, time spent on waiting for data,
+         * decompression and flash writes, chunk sizes and peak heap usage.
+         * Stats of the last update are kept after endz()/abortz() until the next beginz()
          * 
          * @param stat stat structure to update with data
          */
-        void getstat(deco_stat_t &stat){ deco.getstat(stat); };
+        void getstat(deco_stat_t &stat);
+
+        /**
+         * @brief set progress callback
+         * callback is called from the context of writez()/writezStream() caller no more often than interval,
+         * and once with final status on endz()/abortz(). It reports compressed and inflated bytes processed,
+         * input throughput and ETA if the total input size is known.
+         * 
+         * @param cb - callback function, nullptr to disable
+         * @param interval - minimal interval between reports, ms
+         */
+        void onprogress(progress_cb_t cb, uint32_t interval = FZ_PROGRESS_INTERVAL){ prg_cb = cb; prg_interval = interval; };
+
+        /**
+         * @brief set expected compressed input size for ETA estimation
+         * writezStream() sets it from stream length if it's known, must be set after beginz()
+         * 
+         * @param len - size, bytes
+         */
+        void inputsize(size_t len){ prg_total = len; };
 };
@@ -0,0 +1,96 @@
+/*
+    ESP32-FlashZ host benchmarks
+
+    Compression formats compared: zlib/gzip, LZ4 frame and heatshrink streams made by tools/fzcompress.py
+    from the same image. Reports compression ratio, decoder history window size and decode throughput.
+    LZ4 and heatshrink decoders are the same code as on device, zlib is decoded with system zlib instead of
+    ROM tinfl (see stubs/miniz.h), so zlib speed here is an upper bound, not a device figure.
+    LZ4 rows are skipped if neither python lz4 module nor lz4 CLI is installed.
+
+    Results are printed in CSV format, one line per format, median of BENCH_RUNS runs
+ */
+
+#include "fztest.h"
+#include <chrono>
+#include <memory>
+
+#define BENCH_RUNS      5
+#define BENCH_IMAGE     (1024 * 1024)
+#define BENCH_BLOCK     1436
+
+struct codec_t {
+    std::string name;
+    std::string args;       // fzcompress.py arguments
+    size_t window;          // decoder history buffer, bytes
+};
+
+static uint32_t now_us(){
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// decode time in us, 0 on decode error or CRC mismatch
+static uint32_t bench(const std::vector<uint8_t> &z, size_t size, uint32_t crc){
+    std::unique_ptr<Decompressor> d(Decompressor::create(z.data(), z.size()));
+    if (!d)
+        return 0;
+
+    size_t out = 0;
+    uint32_t c = 0;
+    auto cb = [&](size_t index, const uint8_t *data, size_t len, bool final) -> int {
+        c = crc32(c, data, len);
+        out += len;
+        return len;
+    };
+
+    int err = MZ_OK;
+    uint32_t t = now_us();
+    for (size_t off = 0; off < z.size(); off += BENCH_BLOCK){
+        size_t len = std::min<size_t>(BENCH_BLOCK, z.size() - off);
+        err = d->inflate_block_to_cb(z.data() + off, len, cb, off + len == z.size(), SPI_FLASH_SEC_SIZE);
+        if (err < 0)
+            break;
+    }
+    t = now_us() - t;
+    return err == MZ_STREAM_END && out == size && c == crc ? std::max<uint32_t>(t, 1) : 0;
+}
+
+int main(){
+    int fails = 0;
+    auto image = fz_image(BENCH_IMAGE, 1);
+    uint32_t crc = fz_crc(image);
+
+    const codec_t codecs[] = {
+        { "zlib-w15",    "-f zz -l 9",          TINFL_LZ_DICT_SIZE },
+        { "zlib-w10",    "-f zz -l 9 -w 10",    1024 },
+        { "gzip",        "-f gz -l 9",          TINFL_LZ_DICT_SIZE },
+        { "lz4-l1",      "-f lz4 -l 1",         LZ4_WINDOW_SIZE },
+        { "lz4-l9",      "-f lz4 -l 9",         LZ4_WINDOW_SIZE },
+        { "hs-w8k4",     "-f hs -w 8 -k 4",     1 << 8 },
+        { "hs-w11k4",    "-f hs -w 11 -k 4",    1 << 11 },
+        { "hs-w13k6",    "-f hs -w 13 -k 6",    1 << 13 }
+    };
+
+    printf("format,in_bytes,out_bytes,ratio,window,time_us,MB/s,crc\n");
+    for (const auto &c : codecs){
+        auto z = fz_tool("fzcompress.py", c.args, image);
+        if (z.empty()){
+            printf("%s: encoder is not available, skipped\n", c.name.c_str());
+            continue;
+        }
+
+        uint32_t runs[BENCH_RUNS];
+        bool ok = true;
+        for (auto &t : runs){
+            t = bench(z, image.size(), crc);
+            ok = ok && t;
+        }
+        std::sort(runs, runs + BENCH_RUNS);
+        uint32_t t = runs[BENCH_RUNS / 2];
+        printf("%s,%zu,%zu,%.1f%%,%zu,%u,%.1f,%s\n", c.name.c_str(), z.size(), image.size(), 100.0 * z.size() / image.size(),
+                c.window, t, t ? (double)image.size() / t : 0, ok ? "ok" : "FAIL");
+        fails += !ok;
+    }
+
+    return fz_result("bench_codec", fails);
+}
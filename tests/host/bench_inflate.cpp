@@ -0,0 +1,92 @@
+/*
+    ESP32-FlashZ host benchmarks
+
+    Inflator throughput over zlib windowBits, compression levels, input block and callback chunk sizes.
+    Inflated data is checked against the original image CRC32, a broken run is reported and fails the benchmark.
+    tinfl is replaced with system zlib on host (see stubs/miniz.h), so absolute numbers are not those of ROM inflater,
+    but Inflator's own overhead - dictionary management, chunking and callback calls - is the same code as on device,
+    so relative differences between chunk and block sizes hold.
+
+    Results are printed in CSV format, one line per combination, median of BENCH_RUNS runs
+ */
+
+#include "fztest.h"
+#include <chrono>
+
+#define BENCH_RUNS      5
+#define BENCH_IMAGE     (1024 * 1024)
+
+struct bench_t {
+    uint32_t time_us;       // time spent in Inflator calls, w/o callback
+    uint32_t callbacks;
+    uint32_t crc;           // CRC32 of inflated data
+    size_t out;             // inflated bytes passed to callback
+    size_t dict;            // Inflator dictionary size
+    int err;
+};
+
+static uint32_t now_us(){
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static bench_t bench(const std::vector<uint8_t> &z, size_t block, size_t chunk){
+    bench_t r{};
+    uint32_t cb_us = 0;
+    Inflator deco;
+    if (!deco.init()){
+        r.err = MZ_MEM_ERROR;
+        return r;
+    }
+
+    auto cb = [&](size_t index, const uint8_t *data, size_t size, bool final) -> int {
+        uint32_t t = now_us();
+        ++r.callbacks;
+        if (index == r.out)
+            r.crc = crc32(r.crc, data, size);
+        r.out += size;
+        cb_us += now_us() - t;
+        return size;
+    };
+
+    uint32_t t = now_us();
+    for (size_t off = 0; off < z.size(); off += block){
+        size_t len = std::min(block, z.size() - off);
+        r.err = deco.inflate_block_to_cb(z.data() + off, len, cb, off + len == z.size(), chunk);
+        if (r.err < 0)
+            break;
+    }
+    r.time_us = now_us() - t - cb_us;
+    r.dict = deco.dictsize();
+    return r;
+}
+
+int main(){
+    int fails = 0;
+    auto image = fz_image(BENCH_IMAGE, 1);
+    uint32_t crc = fz_crc(image);
+
+    printf("format,level,wbits,block,chunk,in_bytes,out_bytes,dict,time_us,MB/s,callbacks,crc\n");
+    for (int wbits : { 9, 10, 12, 15, 31 }){
+        for (int level : { 1, 6, 9 }){
+            auto z = fz_deflate(image, wbits, level);
+            for (size_t block : { 1436, 4096 }){
+                for (size_t chunk : { 1024, SPI_FLASH_SEC_SIZE, FLASH_CHUNK_SIZE, TINFL_LZ_DICT_SIZE }){
+                    bench_t runs[BENCH_RUNS];
+                    bool ok = true;
+                    for (auto &r : runs){
+                        r = bench(z, block, chunk);
+                        ok = ok && r.err == MZ_STREAM_END && r.out == image.size() && r.crc == crc;
+                    }
+                    std::sort(runs, runs + BENCH_RUNS, [](const bench_t &a, const bench_t &b){ return a.time_us < b.time_us; });
+                    const bench_t &r = runs[BENCH_RUNS / 2];
+                    printf("%s,%d,%d,%zu,%zu,%zu,%zu,%zu,%u,%.1f,%u,%s\n", wbits > 15 ? "gzip" : "zlib", level, wbits & 15, block, chunk,
+                            z.size(), r.out, r.dict, r.time_us, r.time_us ? (double)r.out / r.time_us : 0, r.callbacks, ok ? "ok" : "FAIL");
+                    fails += !ok;
+                }
+            }
+        }
+    }
+
+    return fz_result("bench_inflate", fails);
+}
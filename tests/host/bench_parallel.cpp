@@ -0,0 +1,89 @@
+/*
+    ESP32-FlashZ host benchmarks
+
+    Parallel segment decoding: containers made by tools/fzpack.py -b are inflated by Unpacker sequentially and
+    with SegInflator's FZ_PAR_TASKS decoder tasks. Reports compressed size against a plain zlib stream, since
+    each segment boundary costs a full flush, sequential and parallel decode time and speedup.
+    Decoder tasks are threads on host, zlib stands in for ROM tinfl (see stubs/miniz.h), so the speedup shows
+    how well segments overlap with the caller, not the figure of a dual core ESP32. On a single core host
+    tasks can't overlap and parallel decode is slower than sequential, by the cost of task switches and segment copies.
+
+    Results are printed in CSV format, one line per container, median of BENCH_RUNS runs
+ */
+
+#include "fztest.h"
+#include <chrono>
+
+#define BENCH_RUNS      5
+#define BENCH_IMAGE     (2 * 1024 * 1024)
+#define BENCH_BLOCK     1436
+
+static uint32_t now_us(){
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// decode time in us, 0 on decode error or CRC mismatch
+static uint32_t bench(const std::vector<uint8_t> &z, bool par, size_t size, uint32_t crc){
+    Unpacker deco;
+    deco.parallel(par);
+    deco.aligned(SPI_FLASH_SEC_SIZE);
+    if (!deco.init())
+        return 0;
+
+    size_t out = 0;
+    uint32_t c = 0;
+    auto cb = [&](size_t index, const uint8_t *data, size_t len, bool final) -> int {
+        c = crc32(c, data, len);
+        out += len;
+        return len;
+    };
+
+    int err = MZ_OK;
+    uint32_t t = now_us();
+    for (size_t off = 0; off < z.size(); off += BENCH_BLOCK){
+        size_t len = std::min<size_t>(BENCH_BLOCK, z.size() - off);
+        err = deco.inflate_block_to_cb(z.data() + off, len, cb, off + len == z.size(), SPI_FLASH_SEC_SIZE);
+        if (err < 0)
+            break;
+    }
+    t = now_us() - t;
+    return err == MZ_STREAM_END && out == size && c == crc ? std::max<uint32_t>(t, 1) : 0;
+}
+
+static uint32_t median(const std::vector<uint8_t> &z, bool par, size_t size, uint32_t crc, bool &ok){
+    uint32_t runs[BENCH_RUNS];
+    for (auto &t : runs){
+        t = bench(z, par, size, crc);
+        ok = ok && t;
+    }
+    std::sort(runs, runs + BENCH_RUNS);
+    return runs[BENCH_RUNS / 2];
+}
+
+int main(){
+    int fails = 0;
+    auto image = fz_image(BENCH_IMAGE, 1);
+    uint32_t crc = fz_crc(image);
+    size_t plain = fz_deflate(image).size();
+
+    unsigned cores = std::thread::hardware_concurrency();
+    printf("container,in_bytes,vs_plain,cores,tasks,seq_us,par_us,speedup,crc\n");
+    for (const char *args : { "-f zz -b 16384", "-f zz -b 32768", "-f zz -b 65536", "-f gz -b 65536", "-f zz -l 6 -b 32768" }){
+        auto z = fz_tool("fzpack.py", args, image);
+        if (z.empty()){
+            printf("%s: fzpack.py has failed\n", args);
+            ++fails;
+            continue;
+        }
+
+        bool ok = true;
+        uint32_t t_seq = median(z, false, image.size(), crc, ok);
+        uint32_t t_par = median(z, true, image.size(), crc, ok);
+        printf("%s,%zu,%+.1f%%,%u,%d,%u,%u,%.2f,%s\n", args, z.size(), 100.0 * z.size() / plain - 100, cores, FZ_PAR_TASKS,
+                t_seq, t_par, t_par ? (double)t_seq / t_par : 0, ok ? "ok" : "FAIL");
+        fails += !ok;
+    }
+
+    return fz_result("bench_parallel", fails);
+}
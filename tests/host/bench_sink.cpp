@@ -0,0 +1,165 @@
+/*
+    ESP32-FlashZ host benchmarks
+
+    Inflator sink dispatch: templated inflate_block_to() with the sink inlined vs inflate_block_to_cb() with
+    std::function constructed from a capturing lambda for each input block, the way writez() did it before.
+    Input is fed in 1436 bytes blocks of WebServer's HTTPUpload buffer, sink copies data to an output buffer
+    like a flash write does. Small callback chunks and a highly compressible image make per-call overhead
+    stand out from inflate time.
+    On host a sink call costs a few ns against ~10us of inflate per block, so the second table measures dispatch alone:
+    the same sink called per block through a std::function argument of a non-inlined virtual call vs a template
+    argument, that is the whole difference between the two code paths.
+
+    Results are printed in CSV format, median of BENCH_RUNS runs. 'overhead_ns' is the time difference per sink call
+ */
+
+#include "fztest.h"
+#include <chrono>
+
+#define BENCH_RUNS      15
+#define BENCH_IMAGE     (1024 * 1024)
+#define BENCH_BLOCK     1436
+
+static uint32_t now_us(){
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+struct sink_t {
+    std::vector<uint8_t> &out;
+    uint32_t calls = 0;
+
+    size_t operator()(size_t index, const uint8_t *data, size_t size, bool final){
+        ++calls;
+        if (index + size > out.size())
+            return 0;
+        memcpy(out.data() + index, data, size);
+        return size;
+    }
+};
+
+// returns inflate time in us, 0 on error
+template <bool templated>
+static uint32_t bench(const std::vector<uint8_t> &z, std::vector<uint8_t> &out, size_t chunk, uint32_t &calls){
+    Inflator deco;
+    if (!deco.init())
+        return 0;
+    sink_t sink{ out };
+
+    int err = MZ_OK;
+    uint32_t t = now_us();
+    for (size_t off = 0; off < z.size(); off += BENCH_BLOCK){
+        size_t len = std::min<size_t>(BENCH_BLOCK, z.size() - off);
+        bool final = off + len == z.size();
+        if (templated)
+            err = deco.inflate_block_to(z.data() + off, len, sink, final, chunk);
+        else
+            err = deco.inflate_block_to_cb(z.data() + off, len,
+                    [&sink](size_t index, const uint8_t *data, size_t size, bool final) -> int { return sink(index, data, size, final); },
+                    final, chunk);
+        if (err < 0)
+            break;
+    }
+    t = now_us() - t;
+    calls = sink.calls;
+    return err == MZ_STREAM_END ? std::max<uint32_t>(t, 1) : 0;
+}
+
+// what inflate_block_to_cb() does with a callback, virtual call with std::function argument
+struct fn_caller_t {
+    virtual int call(const uint8_t *data, size_t size, size_t calls, inflate_cb_t callback);
+    virtual ~fn_caller_t(){}
+};
+
+__attribute__((noinline)) int fn_caller_t::call(const uint8_t *data, size_t size, size_t calls, inflate_cb_t callback){
+    int r = 0;
+    for (size_t i = 0; i != calls; ++i)
+        r += callback(i * size, data, size, false);
+    return r;
+}
+
+// what inflate_block_to() does with a sink
+template <class Sink>
+static int tpl_call(const uint8_t *data, size_t size, size_t calls, Sink &&sink){
+    int r = 0;
+    for (size_t i = 0; i != calls; ++i)
+        r += sink(i * size, data, size, false);
+    return r;
+}
+
+// dispatch time for 'blocks' input blocks with 'calls' sink calls per block, us
+template <bool templated>
+static uint32_t dispatch(fn_caller_t &caller, std::vector<uint8_t> &out, size_t chunk, size_t blocks, size_t calls){
+    sink_t sink{ out };
+    std::vector<uint8_t> src(chunk, 0x5a);
+    uint32_t t = now_us();
+    for (size_t b = 0; b != blocks; ++b){
+        if (templated)
+            tpl_call(src.data(), chunk, calls, sink);
+        else
+            caller.call(src.data(), chunk, calls, [&sink](size_t index, const uint8_t *data, size_t size, bool final) -> int { return sink(index, data, size, final); });
+    }
+    return now_us() - t;
+}
+
+template <bool templated>
+static uint32_t dispatch_median(fn_caller_t &caller, size_t chunk, size_t blocks, size_t calls){
+    std::vector<uint8_t> out(chunk * calls);
+    uint32_t runs[BENCH_RUNS];
+    for (auto &t : runs)
+        t = dispatch<templated>(caller, out, chunk, blocks, calls);
+    std::sort(runs, runs + BENCH_RUNS);
+    return runs[BENCH_RUNS / 2];
+}
+
+template <bool templated>
+static uint32_t median(const std::vector<uint8_t> &z, const std::vector<uint8_t> &image, size_t chunk, uint32_t &calls, bool &ok){
+    std::vector<uint8_t> out(image.size());
+    uint32_t runs[BENCH_RUNS];
+    for (auto &t : runs){
+        std::fill(out.begin(), out.end(), 0);
+        t = bench<templated>(z, out, chunk, calls);
+        ok = ok && t && out == image;
+    }
+    std::sort(runs, runs + BENCH_RUNS);
+    return runs[BENCH_RUNS / 2];
+}
+
+int main(){
+    int fails = 0;
+
+    // firmware-like image and an almost empty filesystem image, inflate cost per output byte is way lower for the latter
+    std::vector<uint8_t> fs(BENCH_IMAGE, 0xff);
+    auto fw = fz_image(BENCH_IMAGE, 1);
+    std::fill_n(fs.begin(), 64 * 1024, 0);
+    const struct { const char *name; const std::vector<uint8_t> &data; } images[] = { { "firmware", fw }, { "filesystem", fs } };
+
+    printf("image,chunk,callbacks,function_us,template_us,overhead_ns,crc\n");
+    for (const auto &img : images){
+        auto z = fz_deflate(img.data);
+        for (size_t chunk : { 64, 256, 1024, SPI_FLASH_SEC_SIZE }){
+            bool ok = true;
+            uint32_t calls_f = 0, calls_t = 0;
+            uint32_t t_f = median<false>(z, img.data, chunk, calls_f, ok);
+            uint32_t t_t = median<true>(z, img.data, chunk, calls_t, ok);
+            ok = ok && calls_f == calls_t;
+            printf("%s,%zu,%u,%u,%u,%.1f,%s\n", img.name, chunk, calls_t, t_f, t_t,
+                    calls_t ? ((double)t_f - t_t) * 1000 / calls_t : 0, ok ? "ok" : "FAIL");
+            fails += !ok;
+        }
+    }
+
+    // 1436 bytes block inflates to ~6k of firmware image, ~1 sink call per block; up to 16 calls per block for small chunks
+    fn_caller_t caller;
+    size_t blocks = BENCH_IMAGE / BENCH_BLOCK;
+    printf("\nchunk,calls_per_block,callbacks,function_us,template_us,overhead_ns\n");
+    for (size_t chunk : { 64, 1024, SPI_FLASH_SEC_SIZE }){
+        for (size_t calls : { 1, 4, 16 }){
+            uint32_t t_f = dispatch_median<false>(caller, chunk, blocks, calls);
+            uint32_t t_t = dispatch_median<true>(caller, chunk, blocks, calls);
+            printf("%zu,%zu,%zu,%u,%u,%.1f\n", chunk, calls, blocks * calls, t_f, t_t, ((double)t_f - t_t) * 1000 / (blocks * calls));
+        }
+    }
+
+    return fz_result("bench_sink", fails);
+}
@@ -0,0 +1,93 @@
+/*
+    ESP32-FlashZ host tests
+
+    common test helpers
+ */
+
+#pragma once
+#include "flashz.hpp"
+#include "fzhost.h"
+#include <zlib.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <random>
+#include <vector>
+
+/**
+ * @brief make a firmware-like test image
+ * a mix of random bytes, short runs and copies of earlier data at up to 32k distance, so that inflater
+ * has to resolve back-references over the whole window. Starts with app image magic, has a large 0xFF gap
+ */
+inline std::vector<uint8_t> fz_image(size_t size, uint32_t seed){
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> d(size);
+    for (size_t i = 0; i < size; ){
+        size_t n = std::min<size_t>(1 + rng() % 300, size - i);
+        switch (rng() % 4){
+        case 0:
+            for (size_t j = 0; j != n; ++j)
+                d[i + j] = rng();
+            break;
+        case 1:
+            std::fill_n(&d[i], n, (uint8_t)rng());
+            break;
+        default:
+            if (i > n){
+                size_t dist = 1 + rng() % std::min<size_t>(i - 1, 32000);
+                for (size_t j = 0; j != n; ++j)
+                    d[i + j] = d[i + j - dist];
+            }
+        }
+        i += n;
+    }
+    std::fill(d.begin() + size / 2, d.begin() + size / 2 + size / 8, 0xff);
+    d[0] = ESP_IMAGE_HEADER_MAGIC;
+    return d;
+}
+
+/**
+ * @brief compress data with zlib
+ * @param wbits - zlib windowBits, 9..15 for zlib stream, +16 for gzip
+ */
+inline std::vector<uint8_t> fz_deflate(const std::vector<uint8_t> &data, int wbits = 15, int level = 9){
+    z_stream zs{};
+    deflateInit2(&zs, level, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY);
+    std::vector<uint8_t> out(deflateBound(&zs, data.size()) + 64);
+    zs.next_in = (Bytef*)data.data();
+    zs.avail_in = data.size();
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+    deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return out;
+}
+
+/**
+ * @brief run one of python tools/ on data, i.e. to make test fixtures with the same tools used for real images
+ * data is written to a file in build/, tool is called as 'tool args input output' from tests/host dir
+ * @return tool's output, empty if tool has failed, i.e. an optional encoder is not installed
+ */
+inline std::vector<uint8_t> fz_tool(const char *tool, const std::string &args, const std::vector<uint8_t> &data){
+    std::string in = "build/" + std::string(tool) + ".in", out = "build/" + std::string(tool) + ".out";
+    std::ofstream(in, std::ios::binary).write((const char*)data.data(), data.size());
+    std::remove(out.c_str());
+    std::string cmd = "python3 ../../tools/" + std::string(tool) + " " + args + " " + in + " " + out + " >/dev/null 2>&1";
+    if (std::system(cmd.c_str()))
+        return {};
+    std::ifstream f(out, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+inline uint32_t fz_crc(const std::vector<uint8_t> &data){ return crc32(0, data.data(), data.size()); }
+
+inline int fz_result(const char *name, int fails){
+    if (fails)
+        printf("%s: FAILED %d\n", name, fails);
+    else
+        printf("%s: ok\n", name);
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,71 @@
+/*
+    ESP32-FlashZ host tests
+
+    minimal Arduino core API used by the library
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <strings.h>
+#include <string>
+#include <chrono>
+#include <thread>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define LOW     0
+#define HIGH    1
+
+inline uint32_t micros(){
+    using namespace std::chrono;
+    static const auto start = steady_clock::now();
+    return duration_cast<microseconds>(steady_clock::now() - start).count();
+}
+
+inline uint32_t millis(){ return micros() / 1000; }
+inline void delay(uint32_t ms){ std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+inline void yield(){ std::this_thread::yield(); }
+inline uint32_t getCpuFrequencyMhz(){ return 240; }
+
+class String : public std::string {
+public:
+    using std::string::string;
+    String(){}
+    String(const std::string &s) : std::string(s){}
+    String(int v) : std::string(std::to_string(v)){}
+    String(unsigned v) : std::string(std::to_string(v)){}
+    String(unsigned long v) : std::string(std::to_string(v)){}
+    bool equalsIgnoreCase(const char *s) const { return !strcasecmp(c_str(), s); }
+    bool startsWith(const char *s) const { return !compare(0, strlen(s), s); }
+    bool startsWith(const String &s) const { return startsWith(s.c_str()); }
+    bool endsWith(const char *s) const { size_t l = strlen(s); return size() >= l && !compare(size() - l, l, s); }
+};
+
+class Print {
+public:
+    virtual ~Print(){}
+    virtual size_t write(uint8_t) = 0;
+    virtual void flush(){}
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual size_t readBytes(uint8_t *buff, size_t len){
+        size_t n = 0;
+        for (int c; n != len && (c = read()) >= 0; )
+            buff[n++] = c;
+        return n;
+    }
+    size_t readBytes(char *buff, size_t len){ return readBytes((uint8_t*)buff, len); }
+    void setTimeout(unsigned long ms){ _timeout = ms; }
+    unsigned long getTimeout() const { return _timeout; }
+protected:
+    unsigned long _timeout = 1000;
+};
@@ -0,0 +1,57 @@
+/*
+    ESP32-FlashZ host tests
+
+    arduino-esp32 UpdateClass, writes go to simulated flash. Like the original it checks image magic,
+    erases sectors as the writer reaches them and defers the first 16 bytes of app image till end()
+ */
+
+#pragma once
+#include "Arduino.h"
+#include "fzhost.h"
+
+#define UPDATE_SIZE_UNKNOWN         0xFFFFFFFF
+#define ENCRYPTED_BLOCK_SIZE        16
+
+#define U_FLASH     0
+#define U_SPIFFS    100
+#define U_AUTH      200
+
+#define UPDATE_ERROR_OK             0
+#define UPDATE_ERROR_WRITE          1
+#define UPDATE_ERROR_ERASE          2
+#define UPDATE_ERROR_READ           3
+#define UPDATE_ERROR_SPACE          4
+#define UPDATE_ERROR_SIZE           5
+#define UPDATE_ERROR_STREAM         6
+#define UPDATE_ERROR_MD5            7
+#define UPDATE_ERROR_MAGIC_BYTE     8
+#define UPDATE_ERROR_ACTIVATE       9
+#define UPDATE_ERROR_NO_PARTITION   10
+#define UPDATE_ERROR_BAD_ARGUMENT   11
+#define UPDATE_ERROR_ABORT          12
+
+class UpdateClass {
+public:
+    bool begin(size_t size = UPDATE_SIZE_UNKNOWN, int command = U_FLASH, int ledPin = -1, uint8_t ledOn = LOW, const char *label = NULL);
+    size_t write(uint8_t *data, size_t len);
+    size_t writeStream(Stream &data);
+    bool end(bool evenIfRemaining = false);
+    void abort(){ _error = UPDATE_ERROR_ABORT; _size = 0; }
+    bool setMD5(const char *expected_md5){ return expected_md5 && strlen(expected_md5) == 32; }     // MD5 is not checked on host
+
+    bool hasError() const { return _error != UPDATE_ERROR_OK; }
+    uint8_t getError() const { return _error; }
+    const char* errorString() const { return _error ? "Update error" : "No Error"; }
+    size_t progress() const { return _progress; }
+    size_t size() const { return _size; }
+    size_t remaining() const { return _size - _progress; }
+    bool isFinished() const { return _progress == _size; }
+    bool isRunning() const { return _size > 0; }
+
+private:
+    fzhost_part_t *_part = nullptr;
+    int _command = U_FLASH;
+    uint8_t _error = UPDATE_ERROR_OK;
+    size_t _size = 0, _progress = 0;
+    uint8_t _head[ENCRYPTED_BLOCK_SIZE];
+};
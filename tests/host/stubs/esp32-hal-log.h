@@ -0,0 +1,15 @@
+/*
+    ESP32-FlashZ host tests
+
+    ESP log macros, errors and warnings go to stderr, info messages are printed if FZLOG env var is set
+ */
+
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "[E][%s] " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) fprintf(stderr, "[W][%s] " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) do { if (getenv("FZLOG")) fprintf(stderr, "[I][%s] " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGD(tag, fmt, ...) do {} while (0)
+#define ESP_LOGV(tag, fmt, ...) do {} while (0)
@@ -0,0 +1,12 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DEFAULT  (1 << 12)
+inline size_t heap_caps_get_free_size(uint32_t){ return 200000; }
+inline size_t heap_caps_get_largest_free_block(uint32_t){ return 110000; }
+inline void* heap_caps_malloc(size_t size, uint32_t){ return malloc(size); }
+inline void heap_caps_free(void *ptr){ free(ptr); }
@@ -0,0 +1,4 @@
+#pragma once
+#include <zlib.h>
+#include <cstdint>
+inline uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len){ return crc32(crc, buf, len); }
@@ -0,0 +1,22 @@
+/*
+    ESP32-FlashZ host tests
+
+    FreeRTOS API used by the library, tasks are std::threads, queues and semaphores are
+    mutex/condition variable based, tick is 1 ms
+ */
+
+#pragma once
+#include <cstdint>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+
+#define pdTRUE              1
+#define pdFALSE             0
+#define pdPASS              1
+#define portMAX_DELAY       0xffffffff
+#define pdMS_TO_TICKS(ms)   (ms)
+#define portTICK_PERIOD_MS  1
+#define portNUM_PROCESSORS  2
+#define tskNO_AFFINITY      0x7FFFFFFF
@@ -0,0 +1,52 @@
+#pragma once
+#include "FreeRTOS.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+struct QueueDefinition {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::vector<uint8_t>> q;
+    size_t len, item_size;
+};
+typedef QueueDefinition* QueueHandle_t;
+
+inline std::chrono::milliseconds fz_ticks(TickType_t t){ return std::chrono::milliseconds(t == portMAX_DELAY ? 1000000000 : t); }
+
+inline QueueHandle_t xQueueCreate(size_t len, size_t item_size){
+    QueueHandle_t q = new QueueDefinition;
+    q->len = len;
+    q->item_size = item_size;
+    return q;
+}
+
+inline void vQueueDelete(QueueHandle_t q){ delete q; }
+
+inline BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait){
+    std::unique_lock<std::mutex> lock(q->m);
+    if (!q->cv.wait_for(lock, fz_ticks(wait), [q]{ return q->q.size() < q->len; }))
+        return pdFALSE;
+    q->q.emplace_back((const uint8_t*)item, (const uint8_t*)item + (item ? q->item_size : 0));
+    q->cv.notify_all();
+    return pdTRUE;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait){
+    std::unique_lock<std::mutex> lock(q->m);
+    if (!q->cv.wait_for(lock, fz_ticks(wait), [q]{ return !q->q.empty(); }))
+        return pdFALSE;
+    if (item && q->item_size)
+        memcpy(item, q->q.front().data(), q->item_size);
+    q->q.pop_front();
+    q->cv.notify_all();
+    return pdTRUE;
+}
+
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q){
+    std::lock_guard<std::mutex> lock(q->m);
+    return q->q.size();
+}
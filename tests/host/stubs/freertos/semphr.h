@@ -0,0 +1,16 @@
+#pragma once
+#include "queue.h"
+
+typedef QueueHandle_t SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateBinary(){ return xQueueCreate(1, 0); }
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex(){
+    SemaphoreHandle_t s = xQueueCreate(1, 0);
+    xQueueSend(s, nullptr, 0);
+    return s;
+}
+
+inline void vSemaphoreDelete(SemaphoreHandle_t s){ vQueueDelete(s); }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t s){ return xQueueSend(s, nullptr, 0); }
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait){ return xQueueReceive(s, nullptr, wait); }
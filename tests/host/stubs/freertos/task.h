@@ -0,0 +1,46 @@
+#pragma once
+#include "FreeRTOS.h"
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+typedef void (*TaskFunction_t)(void*);
+typedef struct tskTaskControlBlock* TaskHandle_t;
+
+// vTaskDelete(NULL) unwinds task's thread
+struct fz_task_exit {};
+
+// number of tasks created with given name, so tests could tell which workers an update has used
+inline unsigned fzhost_tasks(const char *name, bool created = false){
+    static std::mutex m;
+    static std::map<std::string, unsigned> n;
+    std::lock_guard<std::mutex> lock(m);
+    return created ? ++n[name ? name : ""] : n[name ? name : ""];
+}
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t, void *arg, UBaseType_t, TaskHandle_t *handle, BaseType_t){
+    fzhost_tasks(name, true);
+    std::thread([fn, arg]{
+        try {
+            fn(arg);
+        } catch (fz_task_exit&) {}
+    }).detach();
+    if (handle)
+        *handle = (TaskHandle_t)1;
+    return pdPASS;
+}
+
+inline BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *handle){
+    return xTaskCreatePinnedToCore(fn, name, stack, arg, prio, handle, tskNO_AFFINITY);
+}
+
+inline void vTaskDelete(TaskHandle_t task){
+    if (!task)
+        throw fz_task_exit();
+}
+
+inline void vTaskDelay(TickType_t ticks){ std::this_thread::sleep_for(std::chrono::milliseconds(ticks)); }
+inline UBaseType_t uxTaskPriorityGet(TaskHandle_t){ return 1; }
+inline BaseType_t xPortGetCoreID(){ return 1; }
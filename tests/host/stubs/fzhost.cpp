@@ -0,0 +1,220 @@
+/*
+    ESP32-FlashZ host tests
+
+    simulated flash, partition/OTA API and UpdateClass
+ */
+
+#include "fzhost.h"
+#include "esp_ota_ops.h"
+#include "Update.h"
+#include <algorithm>
+
+#define FZHOST_SECTOR   4096
+
+namespace fzhost {
+    fzhost_part_t running { { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, 0x010000, 0x180000, "app0" }, std::vector<uint8_t>(0x180000, 0xff), std::vector<std::atomic<bool>>(0x180000 / FZHOST_SECTOR) };
+    fzhost_part_t ota { { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, 0x200000, 0x200000, "ota1" }, std::vector<uint8_t>(0x200000, 0xff), std::vector<std::atomic<bool>>(0x200000 / FZHOST_SECTOR) };
+    fzhost_part_t spiffs { { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, 0x400000, 0x100000, "spiffs" }, std::vector<uint8_t>(0x100000, 0xff), std::vector<std::atomic<bool>>(0x100000 / FZHOST_SECTOR) };
+    const esp_partition_t *boot = nullptr;
+
+    std::atomic<unsigned> erased{0};
+    std::atomic<unsigned> writes{0};
+    std::atomic<unsigned> mmaps{0};
+    std::atomic<unsigned> rewiped{0};
+    std::atomic<size_t> lead{0};
+
+    void reset(uint8_t fill){
+        std::fill(ota.mem.begin(), ota.mem.end(), fill);
+        std::fill(spiffs.mem.begin(), spiffs.mem.end(), fill);
+        for (fzhost_part_t *p : { &running, &ota, &spiffs }){
+            for (auto &w : p->written)
+                w = false;
+            p->erased_to = 0;
+        }
+        boot = nullptr;
+        erased = writes = rewiped = 0;
+        lead = 0;
+    }
+
+    fzhost_part_t* find(const esp_partition_t *part){
+        for (fzhost_part_t *p : { &running, &ota, &spiffs }){
+            if (part == &p->part)
+                return p;
+        }
+        return nullptr;
+    }
+
+    bool erase(fzhost_part_t &p, size_t offset, size_t size){
+        if (offset % FZHOST_SECTOR || size % FZHOST_SECTOR || offset + size > p.mem.size())
+            return false;
+        for (size_t s = offset / FZHOST_SECTOR; s != (offset + size) / FZHOST_SECTOR; ++s){
+            if (p.written[s].exchange(false))
+                ++rewiped;
+        }
+        memset(&p.mem[offset], 0xff, size);
+        return true;
+    }
+
+    bool program(fzhost_part_t &p, size_t offset, const uint8_t *data, size_t size){
+        if (offset + size > p.mem.size())
+            return false;
+        for (size_t i = 0; i != size; ++i)
+            p.mem[offset + i] &= data[i];
+        for (size_t s = offset / FZHOST_SECTOR; size && s <= (offset + size - 1) / FZHOST_SECTOR; ++s)
+            p.written[s] = true;
+        return true;
+    }
+}
+
+// partition API
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label){
+    for (fzhost_part_t *p : { &fzhost::ota, &fzhost::spiffs, &fzhost::running }){
+        if (p->part.type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || subtype == p->part.subtype) && (!label || !strcmp(label, p->part.label)))
+            return &p->part;
+    }
+    return nullptr;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t size){
+    fzhost_part_t *p = fzhost::find(part);
+    if (!p || !fzhost::erase(*p, offset, size))
+        return ESP_FAIL;
+    fzhost::erased += size / FZHOST_SECTOR;
+    size_t end = offset + size, to = p->erased_to;
+    while (end > to && !p->erased_to.compare_exchange_weak(to, end));
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t size){
+    fzhost_part_t *p = fzhost::find(part);
+    if (!p || !fzhost::program(*p, offset, (const uint8_t*)src, size))
+        return ESP_FAIL;
+    ++fzhost::writes;
+    size_t ahead = p->erased_to, lead = fzhost::lead;
+    ahead = ahead > offset + size ? ahead - offset - size : 0;
+    while (ahead > lead && !fzhost::lead.compare_exchange_weak(lead, ahead));
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t size){
+    fzhost_part_t *p = fzhost::find(part);
+    if (!p || offset + size > p->mem.size())
+        return ESP_FAIL;
+    memcpy(dst, &p->mem[offset], size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *part, size_t offset, size_t size, esp_partition_mmap_memory_t memory, const void **out_ptr, esp_partition_mmap_handle_t *out_handle){
+    fzhost_part_t *p = fzhost::find(part);
+    if (!p || offset + size > p->mem.size())
+        return ESP_FAIL;
+    *out_ptr = &p->mem[offset];
+    *out_handle = ++fzhost::mmaps;
+    return ESP_OK;
+}
+
+void esp_partition_munmap(esp_partition_mmap_handle_t handle){
+    --fzhost::mmaps;
+}
+
+// OTA API
+const esp_partition_t* esp_ota_get_running_partition(){ return &fzhost::running.part; }
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t *start_from){ return &fzhost::ota.part; }
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *part){
+    if (!fzhost::find(part) || part->type != ESP_PARTITION_TYPE_APP)
+        return ESP_FAIL;
+    fzhost::boot = part;
+    return ESP_OK;
+}
+
+// UpdateClass
+bool UpdateClass::begin(size_t size, int command, int ledPin, uint8_t ledOn, const char *label){
+    if (isRunning())
+        return false;
+
+    _error = UPDATE_ERROR_OK;
+    _progress = 0;
+    _command = command;
+    const esp_partition_t *part = command == U_FLASH ? esp_ota_get_next_update_partition(NULL)
+                                    : esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    _part = fzhost::find(part);
+    if (!_part){
+        _error = UPDATE_ERROR_NO_PARTITION;
+        return false;
+    }
+
+    if (size == UPDATE_SIZE_UNKNOWN)
+        size = _part->part.size;
+    if (!size || size > _part->part.size){
+        _error = UPDATE_ERROR_SIZE;
+        return false;
+    }
+    _size = size;
+    return true;
+}
+
+size_t UpdateClass::write(uint8_t *data, size_t len){
+    if (hasError() || !isRunning())
+        return 0;
+    if (len > remaining()){
+        _error = UPDATE_ERROR_SPACE;
+        return 0;
+    }
+
+    size_t skip = 0;
+    if (!_progress && _command == U_FLASH){
+        if (data[0] != 0xE9){
+            _error = UPDATE_ERROR_MAGIC_BYTE;
+            return 0;
+        }
+        // image header is written on end(), so that an incomplete image is never bootable
+        skip = len < ENCRYPTED_BLOCK_SIZE ? len : ENCRYPTED_BLOCK_SIZE;
+        memcpy(_head, data, skip);
+    }
+
+    for (size_t s = _progress & ~(FZHOST_SECTOR - 1); s < _progress + len; s += FZHOST_SECTOR){
+        if (s >= _progress && !fzhost::erase(*_part, s, FZHOST_SECTOR)){
+            _error = UPDATE_ERROR_ERASE;
+            return 0;
+        }
+    }
+
+    if (!fzhost::program(*_part, _progress + skip, data + skip, len - skip)){
+        _error = UPDATE_ERROR_WRITE;
+        return 0;
+    }
+    _progress += len;
+    return len;
+}
+
+size_t UpdateClass::writeStream(Stream &data){
+    uint8_t buff[FZHOST_SECTOR];
+    size_t written = 0;
+    while (remaining()){
+        size_t n = data.readBytes(buff, std::min(remaining(), sizeof(buff)));
+        if (!n || write(buff, n) != n)
+            break;
+        written += n;
+    }
+    if (remaining() && !hasError())
+        _error = UPDATE_ERROR_STREAM;
+    return written;
+}
+
+bool UpdateClass::end(bool evenIfRemaining){
+    if (hasError() || !isRunning())
+        return false;
+
+    if (!isFinished() && !evenIfRemaining){
+        abort();
+        return false;
+    }
+
+    if (_command == U_FLASH){
+        fzhost::program(*_part, 0, _head, _progress < ENCRYPTED_BLOCK_SIZE ? _progress : ENCRYPTED_BLOCK_SIZE);
+        fzhost::boot = &_part->part;
+    }
+    _size = 0;
+    return true;
+}
@@ -0,0 +1,41 @@
+/*
+    ESP32-FlashZ host tests
+
+    simulated flash, partitions are memory buffers with NOR flash semantics:
+    write could only clear bits, erase sets whole 4k sectors to 0xFF
+ */
+
+#pragma once
+#include "esp_partition.h"
+#include <atomic>
+#include <vector>
+
+struct fzhost_part_t {
+    esp_partition_t part;
+    std::vector<uint8_t> mem;
+    std::vector<std::atomic<bool>> written;     // per sector, programmed since reset()
+    std::atomic<size_t> erased_to;              // end of the farthest esp_partition_erase_range() since reset()
+};
+
+namespace fzhost {
+    extern fzhost_part_t running;           // "app0", currently running firmware
+    extern fzhost_part_t ota;               // "ota1", next update partition
+    extern fzhost_part_t spiffs;            // "spiffs", data partition
+    extern const esp_partition_t *boot;     // partition set by esp_ota_set_boot_partition()
+
+    // esp_partition_* API counters, UpdateClass does not count
+    extern std::atomic<unsigned> erased;    // sectors erased
+    extern std::atomic<unsigned> writes;    // write calls
+    extern std::atomic<unsigned> mmaps;     // active mappings
+    extern std::atomic<unsigned> rewiped;   // erases of sectors that were programmed since reset(), UpdateClass counts too
+    extern std::atomic<size_t> lead;        // max distance esp_partition_erase_range() has been ahead of esp_partition_write()
+
+    // fill target partitions with byte value, reset counters and boot partition
+    void reset(uint8_t fill = 0xff);
+
+    fzhost_part_t* find(const esp_partition_t *part);
+
+    // NOR flash primitives, return false on out of range access
+    bool erase(fzhost_part_t &p, size_t offset, size_t size);
+    bool program(fzhost_part_t &p, size_t offset, const uint8_t *data, size_t size);
+}
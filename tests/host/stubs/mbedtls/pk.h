@@ -0,0 +1,37 @@
+/*
+    ESP32-FlashZ host tests
+
+    public key stub, key is any blob starting with "KEY", signature is sha256(key || hash)
+ */
+
+#pragma once
+#include "sha256.h"
+
+typedef enum { MBEDTLS_MD_SHA256 = 9 } mbedtls_md_type_t;
+
+typedef struct {
+    uint8_t key[64];
+    size_t len;
+} mbedtls_pk_context;
+
+inline void mbedtls_pk_init(mbedtls_pk_context *c){ c->len = 0; }
+inline void mbedtls_pk_free(mbedtls_pk_context *c){ c->len = 0; }
+
+inline int mbedtls_pk_parse_public_key(mbedtls_pk_context *c, const unsigned char *key, size_t len){
+    if (!len || len > sizeof(c->key) || memcmp(key, "KEY", 3))
+        return -0x3D00;     // MBEDTLS_ERR_PK_KEY_INVALID_FORMAT
+    memcpy(c->key, key, len);
+    c->len = len;
+    return 0;
+}
+
+inline int mbedtls_pk_verify(mbedtls_pk_context *c, mbedtls_md_type_t md, const unsigned char *hash, size_t hlen, const unsigned char *sig, size_t slen){
+    mbedtls_sha256_context s;
+    uint8_t d[32];
+    mbedtls_sha256_init(&s);
+    mbedtls_sha256_starts(&s, 0);
+    mbedtls_sha256_update(&s, c->key, c->len);
+    mbedtls_sha256_update(&s, hash, hlen);
+    mbedtls_sha256_finish(&s, d);
+    return (slen == sizeof(d) && !memcmp(d, sig, sizeof(d))) ? 0 : -0x4380;    // MBEDTLS_ERR_RSA_VERIFY_FAILED
+}
@@ -0,0 +1,105 @@
+/*
+    ESP32-FlashZ host tests
+
+    stand-in for ROM miniz tinfl, deflate data is decoded with system zlib
+
+    tinfl has no window of it's own, it resolves back-references in the output ring buffer relative
+    to the position where the previous call stopped. zlib keeps it's own window, so this stub checks
+    that contract instead: output must continue at the ring position tinfl expects, otherwise real
+    decoder would read stale history and the call fails here.
+ */
+
+#pragma once
+#include <zlib.h>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#define TINFL_LZ_DICT_SIZE 32768
+#define TINFL_HOST_MAGIC 0x5a5a5a5a
+
+enum {
+    TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+    TINFL_FLAG_HAS_MORE_INPUT = 2,
+    TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+    TINFL_FLAG_COMPUTE_ADLER32 = 8
+};
+
+typedef enum {
+    TINFL_STATUS_BAD_PARAM = -3,
+    TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2
+} tinfl_status;
+
+typedef uint32_t mz_uint32;
+typedef uint64_t tinfl_bit_buf_t;
+
+struct tinfl_decompressor {
+    mz_uint32 m_state, m_num_bits;
+    tinfl_bit_buf_t m_bit_buf;
+    // host state
+    z_stream zs;
+    uint32_t zs_init;       // TINFL_HOST_MAGIC if zs is initialized, state memory is not zeroed by the callers
+    bool done;
+    size_t ring_pos;        // ring offset where the next output must go
+    uint8_t pad[8192];      // real tinfl state is ~11k, keep allocations of a comparable size
+};
+
+inline void tinfl_init(tinfl_decompressor *r){
+    if (r->zs_init == TINFL_HOST_MAGIC)
+        inflateEnd(&r->zs);
+    r->m_state = r->m_num_bits = 0;
+    r->m_bit_buf = 0;
+    r->zs_init = 0;
+    r->done = false;
+    r->ring_pos = 0;
+}
+
+inline tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *in, size_t *in_sz, uint8_t *out_start, uint8_t *out_next, size_t *out_sz, const uint32_t flags){
+    size_t avail_in = *in_sz, avail_out = *out_sz;
+    *in_sz = *out_sz = 0;
+
+    bool ring = !(flags & TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    size_t pos = out_next - out_start;
+    size_t ring_size = pos + avail_out;
+    if (ring && (ring_size & (ring_size - 1)))
+        return TINFL_STATUS_BAD_PARAM;
+    if (r->done)
+        return TINFL_STATUS_DONE;
+
+    if (r->zs_init != TINFL_HOST_MAGIC){
+        // tinfl rejects zlib window larger than the output ring
+        if (ring && (flags & TINFL_FLAG_PARSE_ZLIB_HEADER) && avail_in && ((size_t)1 << (8 + (in[0] >> 4))) > ring_size)
+            return TINFL_STATUS_FAILED;
+        memset(&r->zs, 0, sizeof(z_stream));
+        inflateInit2(&r->zs, (flags & TINFL_FLAG_PARSE_ZLIB_HEADER) ? MAX_WBITS : -MAX_WBITS);
+        r->zs_init = TINFL_HOST_MAGIC;
+    } else if (ring && pos != r->ring_pos){
+        fprintf(stderr, "tinfl stub: output ring discontinuity at %zu, expected %zu\n", pos, r->ring_pos);
+        return TINFL_STATUS_FAILED;
+    }
+
+    r->zs.next_in = (Bytef*)in;
+    r->zs.avail_in = avail_in;
+    r->zs.next_out = out_next;
+    r->zs.avail_out = avail_out;
+    int ret = avail_out ? inflate(&r->zs, Z_NO_FLUSH) : Z_BUF_ERROR;
+    *in_sz = avail_in - r->zs.avail_in;
+    *out_sz = avail_out - r->zs.avail_out;
+    if (ring)
+        r->ring_pos = (pos + *out_sz) & (ring_size - 1);
+
+    if (ret == Z_STREAM_END){
+        r->done = true;
+        return TINFL_STATUS_DONE;
+    }
+    if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR || ret == Z_STREAM_ERROR)
+        return TINFL_STATUS_FAILED;
+    if (!r->zs.avail_out)
+        return TINFL_STATUS_HAS_MORE_OUTPUT;
+    return (flags & TINFL_FLAG_HAS_MORE_INPUT) ? TINFL_STATUS_NEEDS_MORE_INPUT : TINFL_STATUS_FAILED;
+}
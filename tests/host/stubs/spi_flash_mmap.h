@@ -0,0 +1,3 @@
+#pragma once
+#define SPI_FLASH_SEC_SIZE      4096
+#define SPI_FLASH_BLOCK_SIZE    65536
@@ -0,0 +1,80 @@
+/*
+    ESP32-FlashZ host tests
+
+    compressed format detection: gzip requires both magic bytes, raw data starting with 0x1F is not
+    taken for gzip. Image that inflates to another compressed stream (compressed image gzip encoded
+    once more by a web server) is rejected in rawonly() mode instead of being flashed still compressed.
+ */
+
+#include "fztest.h"
+
+static int check_magic(){
+    int fails = 0;
+    const struct { const char *name; std::vector<uint8_t> data; bool compressed; } cases[] = {
+        { "zlib",        { 0x78, 0xDA, 0x00, 0x00 }, true },
+        { "zlib-w12",    { 0x48, 0x0D, 0x00, 0x00 }, true },
+        { "gzip",        { 0x1F, 0x8B, 0x08, 0x00 }, true },
+        { "gzip-short",  { 0x1F, 0x8B }, true },
+        { "raw-1F",      { 0x1F, 0x00, 0x08, 0x00 }, false },
+        { "raw-1F-byte", { 0x1F }, false },
+        { "app",         { ESP_IMAGE_HEADER_MAGIC, 0x05, 0x02, 0x20 }, false }
+    };
+
+    for (const auto &c : cases){
+        if (FlashZ::iscompressed(c.data.data(), c.data.size()) == c.compressed)
+            continue;
+        printf("FAIL iscompressed %s\n", c.name);
+        ++fails;
+    }
+    return fails;
+}
+
+// run compressed data through FlashZ to spiffs partition, returns true if update has succeeded
+static bool flash_fs(const std::vector<uint8_t> &z, bool rawonly){
+    fzhost::reset();
+    FlashZ &fz = FlashZ::getInstance();
+    fz.rawonly(rawonly);
+    if (!fz.beginz(UPDATE_SIZE_UNKNOWN, U_SPIFFS))
+        return false;
+
+    for (size_t off = 0; off < z.size(); off += 1436){
+        size_t len = std::min<size_t>(1436, z.size() - off);
+        if (fz.writez(z.data() + off, len, off + len == z.size()) != len){
+            fz.abortz();
+            return false;
+        }
+    }
+    return fz.endz();
+}
+
+static bool spiffs_is(const std::vector<uint8_t> &data){
+    return std::equal(data.begin(), data.end(), fzhost::spiffs.mem.begin());
+}
+
+int main(){
+    int fails = check_magic();
+
+    auto image = fz_image(200000, 4);
+    auto gz = fz_deflate(image, 31);
+    auto zz = fz_deflate(image);
+    auto gz_zz = fz_deflate(zz, 31);        // .zz image served with Content-Encoding: gzip
+
+    if (!flash_fs(gz, true) || !spiffs_is(image)){
+        printf("FAIL gzip image in rawonly mode\n");
+        ++fails;
+    }
+
+    if (flash_fs(gz_zz, true)){
+        printf("FAIL double encoded image is accepted in rawonly mode\n");
+        ++fails;
+    }
+
+    // w/o the check inner zlib stream lands on flash as is
+    if (!flash_fs(gz_zz, false) || !spiffs_is(zz)){
+        printf("FAIL double encoded image w/o rawonly mode\n");
+        ++fails;
+    }
+
+    FlashZ::getInstance().rawonly(false);
+    return fz_result("codec", fails);
+}
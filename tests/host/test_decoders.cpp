@@ -0,0 +1,122 @@
+/*
+    ESP32-FlashZ host tests
+
+    LZ4 frame and heatshrink decoders: streams made by tools/fzcompress.py must decode to the original image
+    at any input block and callback chunk size, via Decompressor::create() and via FlashZ format autodetect.
+    Corrupted LZ4 frame must fail content checksum, truncated stream must not report the end of stream.
+    LZ4 cases are skipped if neither python lz4 module nor lz4 CLI is installed
+ */
+
+#include "fztest.h"
+#include <memory>
+
+struct fixture_t {
+    std::string name;
+    std::vector<uint8_t> data;
+};
+
+// decode with given input block and chunk sizes, returns MZ_* code of the last call
+static int decode(const std::vector<uint8_t> &z, size_t block, size_t chunk, std::vector<uint8_t> &out){
+    std::unique_ptr<Decompressor> d(Decompressor::create(z.data(), z.size()));
+    if (!d)
+        return MZ_PARAM_ERROR;
+
+    out.clear();
+    auto cb = [&](size_t index, const uint8_t *data, size_t size, bool final) -> int {
+        if (index != out.size())
+            return 0;
+        out.insert(out.end(), data, data + size);
+        return size;
+    };
+
+    int err = MZ_OK;
+    for (size_t off = 0; off < z.size(); off += block){
+        size_t len = std::min(block, z.size() - off);
+        err = d->inflate_block_to_cb(z.data() + off, len, cb, off + len == z.size(), chunk);
+        if (err < 0)
+            break;
+    }
+    return err;
+}
+
+static int check_decode(const std::vector<uint8_t> &image, const fixture_t &f){
+    int fails = 0;
+    std::vector<uint8_t> out;
+    for (size_t block : { 1, 7, 1436, 65536 }){
+        for (size_t chunk : { 1024, SPI_FLASH_SEC_SIZE, TINFL_LZ_DICT_SIZE }){
+            int err = decode(f.data, block, chunk, out);
+            if (err == MZ_STREAM_END && out == image)
+                continue;
+            printf("FAIL %s block %zu chunk %zu: err %d, out %zu/%zu\n", f.name.c_str(), block, chunk, err, out.size(), image.size());
+            ++fails;
+        }
+    }
+
+    // stream cut short must not be taken for a complete one
+    auto cut = f.data;
+    cut.resize(cut.size() - 16);
+    int err = decode(cut, 1436, SPI_FLASH_SEC_SIZE, out);
+    if (err == MZ_STREAM_END){
+        printf("FAIL %s truncated stream is reported complete\n", f.name.c_str());
+        ++fails;
+    }
+
+    // format autodetect in FlashZ
+    fzhost::reset();
+    FlashZ &fz = FlashZ::getInstance();
+    bool ok = fz.beginz(UPDATE_SIZE_UNKNOWN, U_SPIFFS);
+    for (size_t off = 0; ok && off < f.data.size(); off += 1436){
+        size_t len = std::min<size_t>(1436, f.data.size() - off);
+        ok = fz.writez(f.data.data() + off, len, off + len == f.data.size()) == len;
+    }
+    if (!ok || !fz.endz() || !std::equal(image.begin(), image.end(), fzhost::spiffs.mem.begin())){
+        fz.abortz();
+        printf("FAIL %s FlashZ update\n", f.name.c_str());
+        ++fails;
+    }
+    return fails;
+}
+
+int main(){
+    int fails = 0;
+    auto image = fz_image(200000, 5);
+    std::vector<fixture_t> fixtures;
+
+    for (int level : { 1, 9 }){
+        auto z = fz_tool("fzcompress.py", "-f lz4 -l " + std::to_string(level), image);
+        if (z.empty()){
+            printf("lz4 encoder is not available, LZ4 cases skipped\n");
+            break;
+        }
+        fixtures.push_back({ "lz4-l" + std::to_string(level), z });
+    }
+
+    for (auto wk : { std::make_pair(8, 4), std::make_pair(11, 4), std::make_pair(13, 6) }){
+        auto z = fz_tool("fzcompress.py", "-f hs -w " + std::to_string(wk.first) + " -k " + std::to_string(wk.second), image);
+        if (z.empty()){
+            printf("FAIL heatshrink encoder\n");
+            ++fails;
+            continue;
+        }
+        fixtures.push_back({ "hs-w" + std::to_string(wk.first) + "k" + std::to_string(wk.second), z });
+    }
+
+    for (const auto &f : fixtures)
+        fails += check_decode(image, f);
+
+    // LZ4 frames are made with content checksum, a flipped byte in block data must fail it
+    for (const auto &f : fixtures){
+        if (f.name.compare(0, 3, "lz4"))
+            continue;
+        auto bad = f.data;
+        bad[bad.size() / 2] ^= 0x55;
+        std::vector<uint8_t> out;
+        int err = decode(bad, 1436, SPI_FLASH_SEC_SIZE, out);
+        if (err >= 0){
+            printf("FAIL %s corrupted frame is not detected, err %d\n", f.name.c_str(), err);
+            ++fails;
+        }
+    }
+
+    return fz_result("decoders", fails);
+}
@@ -0,0 +1,127 @@
+/*
+    ESP32-FlashZ host tests
+
+    update accounting with direct partition writer: in direct write, compare-before-write, sparse, flash window
+    and pre-erase modes UpdateClass handles only the first sector of image, so FlashZ must report size and
+    progress of the whole image, fail endz(false) on an image shorter than declared size, reject data past it
+    and reject MD5 check it can't do.
+    Plain direct writer does not probe target partition for blank sectors, those are erased as writer reaches them.
+ */
+
+#include "fztest.h"
+
+struct wmode_t {
+    const char *name;
+    bool direct, cmp, sparse, fwin, ers, pipe;
+};
+
+static void set_mode(const wmode_t &m){
+    FlashZ &fz = FlashZ::getInstance();
+    fz.directwrite(m.direct);
+    fz.cmpwrite(m.cmp);
+    fz.sparse(m.sparse);
+    fz.flashwindow(m.fwin);
+    fz.preerase(m.ers);
+    fz.pipeline(m.pipe);
+}
+
+// feed compressed image in blocks, returns false on write error
+static bool feed(const std::vector<uint8_t> &z){
+    FlashZ &fz = FlashZ::getInstance();
+    for (size_t off = 0; off < z.size(); off += 4096){
+        size_t len = std::min<size_t>(4096, z.size() - off);
+        if (fz.writez(z.data() + off, len, off + len == z.size()) != len)
+            return false;
+    }
+    return true;
+}
+
+static int check_mode(const wmode_t &m, const std::vector<uint8_t> &image, const std::vector<uint8_t> &z){
+    int fails = 0;
+    FlashZ &fz = FlashZ::getInstance();
+    set_mode(m);
+
+    // declared size matches the image
+    fzhost::reset();
+    bool ok = fz.beginz(image.size(), U_FLASH) && fz.size() == image.size() && !fz.progress() && !fz.setMD5("0123456789abcdef0123456789abcdef");
+    size_t half = z.size() / 2;
+    ok = ok && fz.writez(z.data(), half, false) == half && fz.progress() > SPI_FLASH_SEC_SIZE && fz.remaining() && !fz.isFinished();
+    ok = ok && fz.writez(z.data() + half, z.size() - half, true) == z.size() - half;
+    // pipelined writer could still be flushing
+    if (ok && !m.pipe)
+        ok = fz.progress() == image.size() && !fz.remaining() && fz.isFinished();
+    ok = ok && fz.endz(false) && fzhost::boot && std::equal(image.begin(), image.end(), fzhost::ota.mem.begin());
+    if (!ok){
+        printf("FAIL %s: size %zu, progress %zu\n", m.name, fz.size(), fz.progress());
+        fz.abortz();
+        ++fails;
+    }
+
+    // image is shorter than declared size, strict endz() must fail and leave boot partition as is
+    fzhost::reset();
+    ok = fz.beginz(image.size() + 2 * SPI_FLASH_SEC_SIZE, U_FLASH) && feed(z);
+    if (!ok || fz.endz(false) || fzhost::boot){
+        printf("FAIL %s: truncated image is accepted\n", m.name);
+        ++fails;
+    }
+    fz.abortz();
+
+    // but it's fine with default endz()
+    fzhost::reset();
+    ok = fz.beginz(image.size() + 2 * SPI_FLASH_SEC_SIZE, U_FLASH) && feed(z) && fz.endz() && fzhost::boot;
+    if (!ok){
+        printf("FAIL %s: endz(true) on image shorter than declared size\n", m.name);
+        fz.abortz();
+        ++fails;
+    }
+
+    // image is larger than declared size
+    fzhost::reset();
+    ok = fz.beginz(image.size() - 2 * SPI_FLASH_SEC_SIZE, U_FLASH) && feed(z) && fz.endz();
+    if (ok || fzhost::boot){
+        printf("FAIL %s: image larger than declared size is accepted\n", m.name);
+        ++fails;
+    }
+    fz.abortz();
+    return fails;
+}
+
+int main(){
+    int fails = 0;
+    auto image = fz_image(300000, 6);
+    auto z = fz_deflate(image);
+
+    const wmode_t modes[] = {
+        { "direct",         true,  false, false, false, false, false },
+        { "direct-pipe",    true,  false, false, false, false, true },
+        { "cmpwrite",       false, true,  false, false, false, false },
+        { "sparse",         false, false, true,  false, false, false },
+        { "flashwindow",    false, false, false, true,  false, false },
+        { "preerase",       true,  false, false, false, true,  false },
+        { "preerase-pipe",  true,  false, false, false, true,  true }
+    };
+    for (const auto &m : modes)
+        fails += check_mode(m, image, z);
+
+    // blank target partition is still erased by plain direct writer, in 64k blocks once it's past the first one
+    set_mode({ "direct", true });
+    fzhost::reset();
+    FlashZ &fz = FlashZ::getInstance();
+    size_t secs = (image.size() + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+    if (!fz.beginz(image.size(), U_FLASH) || !feed(z) || !fz.endz(false) || fzhost::erased < secs - FZ_ERASE_BLOCK_SIZE / SPI_FLASH_SEC_SIZE){
+        printf("FAIL direct writer has probed blank sectors, erased %u of %zu\n", fzhost::erased.load(), secs);
+        fz.abortz();
+        ++fails;
+    }
+
+    // regular writer leaves it all to UpdateClass
+    set_mode({ "regular" });
+    fzhost::reset();
+    if (!fz.beginz(image.size(), U_FLASH) || !fz.setMD5("0123456789abcdef0123456789abcdef") || !feed(z) || !fz.isFinished() || !fz.endz(false)){
+        printf("FAIL regular writer\n");
+        fz.abortz();
+        ++fails;
+    }
+
+    return fz_result("direct", fails);
+}
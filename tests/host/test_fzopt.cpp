@@ -0,0 +1,51 @@
+/*
+    ESP32-FlashZ host tests
+
+    image optimizer output: whatever encoding tools/fzopt.py picks - zlib level/strategy, zopfli or pigz if
+    installed - plain stream, container or segmented container must flash through FlashZ to the original image.
+    Segmented container must be suitable for parallel decoding.
+ */
+
+#include "fztest.h"
+
+static bool flash(const std::vector<uint8_t> &z, bool par){
+    FlashZ &fz = FlashZ::getInstance();
+    fz.parallel(par);
+    fzhost::reset();
+    if (!fz.beginz(UPDATE_SIZE_UNKNOWN, U_SPIFFS))
+        return false;
+
+    for (size_t off = 0; off < z.size(); off += 1436){
+        size_t len = std::min<size_t>(1436, z.size() - off);
+        if (fz.writez(z.data() + off, len, off + len == z.size()) != len){
+            fz.abortz();
+            return false;
+        }
+    }
+    return fz.endz();
+}
+
+int main(){
+    int fails = 0;
+    auto image = fz_image(400000, 10);
+
+    const struct { const char *args; bool par; } runs[] = {
+        { "-f zz", false },
+        { "-f gz -s 10", false },
+        { "-f zz -c", false },
+        { "-f zz -b 32768", true }
+    };
+
+    for (const auto &r : runs){
+        auto z = fz_tool("fzopt.py", r.args, image);
+        unsigned tasks = fzhost_tasks(FZ_PAR_TASK_NAME);
+        bool ok = !z.empty() && flash(z, r.par) && std::equal(image.begin(), image.end(), fzhost::spiffs.mem.begin());
+        if (!ok || (fzhost_tasks(FZ_PAR_TASK_NAME) != tasks) == !r.par){
+            printf("FAIL fzopt.py %s: %zu bytes\n", r.args, z.size());
+            ++fails;
+        }
+    }
+
+    FlashZ::getInstance().parallel(false);
+    return fz_result("fzopt", fails);
+}
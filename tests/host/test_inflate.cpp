@@ -0,0 +1,80 @@
+/*
+    ESP32-FlashZ host tests
+
+    Inflator output delivery: zlib and gzip images are inflated with different input block sizes,
+    preferred chunk sizes and output alignments, sink consumes either every span in whole or only a part
+    of it. Delivered data must match the original image byte for byte, spans must be contiguous
+    and aligned.
+ */
+
+#include "fztest.h"
+
+struct run_t {
+    size_t block;       // input block size
+    size_t chunk;       // preferred chunk size
+    size_t align;       // output alignment
+    bool partial;       // sink consumes a half of each span
+};
+
+static bool inflate_image(const std::vector<uint8_t> &image, const std::vector<uint8_t> &z, const run_t &r){
+    Inflator deco;
+    deco.aligned(r.align);
+    if (!deco.init())
+        return false;
+
+    std::vector<uint8_t> out;
+    bool spans_ok = true;
+    auto sink = [&](size_t index, const uint8_t *data, size_t size, bool final) -> int {
+        if (index != out.size())
+            spans_ok = false;
+        if (size % r.align && !final && index + size != image.size())
+            spans_ok = false;
+
+        size_t n = size;
+        if (r.partial && size > r.align)
+            n = (size / 2 + r.align - 1) & ~(r.align - 1);
+        out.insert(out.end(), data, data + n);
+        return n;
+    };
+
+    int err = MZ_OK;
+    for (size_t off = 0; off < z.size() && err == MZ_OK; off += r.block){
+        size_t len = std::min(r.block, z.size() - off);
+        err = deco.inflate_block_to_cb(z.data() + off, len, sink, off + len == z.size(), r.chunk);
+    }
+
+    bool ok = err == MZ_STREAM_END && spans_ok && out == image;
+    if (!ok)
+        printf("  err %d, spans %d, got %zu bytes, crc %08x/%08x\n", err, spans_ok, out.size(), fz_crc(out), fz_crc(image));
+    return ok;
+}
+
+int main(){
+    int fails = 0;
+    auto image = fz_image(300000, 1);
+
+    const struct { const char *name; int wbits; } formats[] = {
+        { "zlib", 15 },
+        { "gzip", 31 },
+        { "zlib-w12", 12 }
+    };
+
+    for (const auto &f : formats){
+        auto z = fz_deflate(image, f.wbits);
+        for (size_t block : { 1436, 9000 }){
+            for (size_t chunk : { 1024, 4096, 5000, TINFL_LZ_DICT_SIZE }){
+                for (size_t align : { 1, 4096 }){
+                    for (bool partial : { false, true }){
+                        run_t r{ block, chunk, align, partial };
+                        if (inflate_image(image, z, r))
+                            continue;
+                        printf("FAIL %s block %zu chunk %zu align %zu partial %d\n", f.name, block, chunk, align, partial);
+                        ++fails;
+                    }
+                }
+            }
+        }
+    }
+
+    return fz_result("inflate", fails);
+}
@@ -0,0 +1,85 @@
+/*
+    ESP32-FlashZ host tests
+
+    flash window inflate: MapInflator resolves back-references from target partition instead of a dictionary.
+    Must decode zlib streams of any windowBits and level, gzip streams, stored blocks that follow dynamic Huffman
+    blocks (level changes mid-stream, empty stored blocks of full flushes) and fzpack.py -b segmented containers,
+    to app and data partitions.
+ */
+
+#include "fztest.h"
+
+// deflate first half of data with 'level', the rest with stored blocks, and back to 'level' for the tail
+static std::vector<uint8_t> fz_deflate_mixed(const std::vector<uint8_t> &data, int level){
+    z_stream zs{};
+    deflateInit2(&zs, level, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY);
+    std::vector<uint8_t> out(deflateBound(&zs, data.size()) * 2 + 1024);
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+    size_t parts[] = { data.size() / 2, data.size() * 3 / 4, data.size() };
+    int levels[] = { level, 0, level };
+    size_t from = 0;
+    for (int i = 0; i != 3; ++i){
+        if (i)
+            deflateParams(&zs, levels[i], Z_DEFAULT_STRATEGY);
+        zs.next_in = (Bytef*)data.data() + from;
+        zs.avail_in = parts[i] - from;
+        deflate(&zs, i == 2 ? Z_FINISH : Z_FULL_FLUSH);
+        from = parts[i];
+    }
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return out;
+}
+
+static bool flash(const std::vector<uint8_t> &z, int command){
+    FlashZ &fz = FlashZ::getInstance();
+    fzhost::reset();
+    if (!fz.beginz(UPDATE_SIZE_UNKNOWN, command))
+        return false;
+
+    for (size_t off = 0; off < z.size(); off += 1436){
+        size_t len = std::min<size_t>(1436, z.size() - off);
+        if (fz.writez(z.data() + off, len, off + len == z.size()) != len){
+            fz.abortz();
+            return false;
+        }
+    }
+    return fz.endz();
+}
+
+static int check(const std::vector<uint8_t> &image, const std::vector<uint8_t> &z, const std::string &name){
+    int fails = 0;
+    for (int command : { U_FLASH, U_SPIFFS }){
+        auto &part = command == U_FLASH ? fzhost::ota : fzhost::spiffs;
+        if (!z.empty() && flash(z, command) && std::equal(image.begin(), image.end(), part.mem.begin()))
+            continue;
+        printf("FAIL %s cmd %d\n", name.c_str(), command);
+        ++fails;
+    }
+    return fails;
+}
+
+int main(){
+    int fails = 0;
+    FlashZ &fz = FlashZ::getInstance();
+    fz.flashwindow(true);
+
+    // dynamic block followed by a stored one
+    auto small = fz_image(150777, 1);
+    fails += check(small, fz_deflate(small, 9, 1), "w9 level 1");
+
+    auto image = fz_image(600000, 11);
+    for (int wbits = 9; wbits <= 15; ++wbits)
+        for (int level : { 1, 6, 9 })
+            fails += check(image, fz_deflate(image, wbits, level), "w" + std::to_string(wbits) + " level " + std::to_string(level));
+
+    fails += check(image, fz_deflate(image, 31), "gzip");
+    fails += check(image, fz_deflate_mixed(image, 9), "dynamic-stored-dynamic");
+
+    for (const char *args : { "-f zz -b 32768", "-f gz -b 65536", "-f zz -w 12 -b 4096" })
+        fails += check(image, fz_tool("fzpack.py", args, image), std::string("fzpack.py ") + args);
+
+    fz.flashwindow(false);
+    return fz_result("mapinflator", fails);
+}
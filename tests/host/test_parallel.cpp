@@ -0,0 +1,97 @@
+/*
+    ESP32-FlashZ host tests
+
+    parallel segment decoding: zlib/gzip containers made by tools/fzpack.py -b must be inflated by SegInflator
+    tasks when parallel() mode is on and give the same flash contents as sequential inflate, with regular and
+    direct partition writer and any input block size. Containers with segments larger than FZ_PAR_MAX_SEGMENT
+    fall back to sequential Inflator. Corrupted segment and truncated stream must fail the update.
+ */
+
+#include "fztest.h"
+
+struct pack_t {
+    std::string args;       // fzpack.py arguments
+    bool par;               // suitable for parallel decoding
+};
+
+// returns true if update has succeeded
+static bool flash(const std::vector<uint8_t> &z, bool par, bool direct, size_t block){
+    FlashZ &fz = FlashZ::getInstance();
+    fz.parallel(par);
+    fz.directwrite(direct);
+    fzhost::reset();
+    if (!fz.beginz(UPDATE_SIZE_UNKNOWN, U_SPIFFS))
+        return false;
+
+    for (size_t off = 0; off < z.size(); off += block){
+        size_t len = std::min(block, z.size() - off);
+        if (fz.writez(z.data() + off, len, off + len == z.size()) != len){
+            fz.abortz();
+            return false;
+        }
+    }
+    return fz.endz();
+}
+
+static bool spiffs_is(const std::vector<uint8_t> &image){
+    return std::equal(image.begin(), image.end(), fzhost::spiffs.mem.begin());
+}
+
+int main(){
+    int fails = 0;
+    FlashZ &fz = FlashZ::getInstance();
+    auto image = fz_image(900000, 8);
+
+    const pack_t packs[] = {
+        { "-f zz -b 32768", true },
+        { "-f gz -b 65536", true },
+        { "-f zz -l 6 -w 12 -b 4096", true },
+        { "-f zz -b 131072", false }        // segments are too large, inflated sequentially
+    };
+
+    for (const auto &p : packs){
+        auto z = fz_tool("fzpack.py", p.args, image);
+        if (z.empty()){
+            printf("FAIL fzpack.py %s\n", p.args.c_str());
+            ++fails;
+            continue;
+        }
+
+        for (bool direct : { false, true }){
+            for (size_t block : { 1436, 16384 }){
+                unsigned tasks = fzhost_tasks(FZ_PAR_TASK_NAME);
+                bool ok = flash(z, true, direct, block) && spiffs_is(image);
+                unsigned started = fzhost_tasks(FZ_PAR_TASK_NAME) - tasks;
+                ok = ok && started == (p.par ? FZ_PAR_TASKS : 0);
+                ok = ok && flash(z, false, direct, block) && spiffs_is(image) && fzhost_tasks(FZ_PAR_TASK_NAME) == tasks + started;
+                if (!ok){
+                    printf("FAIL %s direct %d block %zu: %u decoder tasks\n", p.args.c_str(), direct, block, started);
+                    ++fails;
+                }
+            }
+        }
+
+        if (!p.par)
+            continue;
+
+        // a flipped bit in the middle of payload, either segment fails to inflate or it's checksum mismatches
+        auto bad = z;
+        bad[bad.size() / 2] ^= 0x10;
+        if (flash(bad, true, false, 4096)){
+            printf("FAIL %s corrupted segment is not detected\n", p.args.c_str());
+            ++fails;
+        }
+
+        // stream cut at a segment boundary or not, update must not complete
+        auto cut = z;
+        cut.resize(cut.size() * 2 / 3);
+        if (flash(cut, true, false, 4096)){
+            printf("FAIL %s truncated stream is accepted\n", p.args.c_str());
+            ++fails;
+        }
+    }
+
+    fz.parallel(false);
+    fz.directwrite(false);
+    return fz_result("parallel", fails);
+}
@@ -0,0 +1,106 @@
+/*
+    ESP32-FlashZ host tests
+
+    pipelined writer: inflater task queues data to writer task, flash contents and update result must be
+    the same as with synchronous writes, with regular and direct partition writer and any input block size.
+    Writer error must fail the update, update aborted with chunks still queued must leave no writer behind,
+    so that the next one runs clean.
+ */
+
+#include "fztest.h"
+
+struct run_t {
+    int command;
+    bool direct;
+    size_t block;
+};
+
+// flash compressed image, returns true if update has succeeded
+static bool flash(const std::vector<uint8_t> &z, const run_t &r, bool pipe, deco_stat_t &st){
+    FlashZ &fz = FlashZ::getInstance();
+    fz.pipeline(pipe);
+    fz.directwrite(r.direct);
+    fzhost::reset();
+    if (!fz.beginz(UPDATE_SIZE_UNKNOWN, r.command))
+        return false;
+
+    for (size_t off = 0; off < z.size(); off += r.block){
+        size_t len = std::min(r.block, z.size() - off);
+        if (fz.writez(z.data() + off, len, off + len == z.size()) != len){
+            fz.abortz();
+            fz.getstat(st);
+            return false;
+        }
+    }
+    bool ok = fz.endz();
+    fz.getstat(st);
+    return ok;
+}
+
+static int check_equal(const std::vector<uint8_t> &image, const std::vector<uint8_t> &z, const run_t &r, const char *fmt){
+    auto &part = r.command == U_FLASH ? fzhost::ota : fzhost::spiffs;
+    deco_stat_t st_sync, st_pipe;
+
+    bool ok_sync = flash(z, r, false, st_sync);
+    auto mem_sync = part.mem;
+    auto boot_sync = fzhost::boot;
+
+    bool ok_pipe = flash(z, r, true, st_pipe);
+    bool ok = ok_sync && ok_pipe && part.mem == mem_sync && fzhost::boot == boot_sync
+            && std::equal(image.begin(), image.end(), part.mem.begin())
+            && st_pipe.in_bytes == st_sync.in_bytes && st_pipe.out_bytes == st_sync.out_bytes && st_pipe.out_bytes == image.size()
+            && st_pipe.cb_count && st_pipe.chunk_max <= FZ_PIPE_BUFF_SIZE;
+    if (ok)
+        return 0;
+
+    printf("FAIL %s cmd %d direct %d block %zu: sync %d, pipe %d, flash %s, out %zu/%zu, chunks %u max %u\n", fmt, r.command, r.direct, r.block,
+            ok_sync, ok_pipe, part.mem == mem_sync ? "same" : "differs", st_sync.out_bytes, st_pipe.out_bytes, st_pipe.cb_count, st_pipe.chunk_max);
+    return 1;
+}
+
+int main(){
+    int fails = 0;
+    FlashZ &fz = FlashZ::getInstance();
+    auto image = fz_image(700000, 2);
+
+    for (int wbits : { 15, 31 }){
+        const char *fmt = wbits == 15 ? "zlib" : "gzip";
+        auto z = fz_deflate(image, wbits);
+        for (int command : { U_FLASH, U_SPIFFS })
+            for (bool direct : { false, true })
+                for (size_t block : { 1436, 16384 })
+                    fails += check_equal(image, z, { command, direct, block }, fmt);
+    }
+
+    // image larger than spiffs partition, writer task fails and inflater must be stopped once it queues the next chunk,
+    // by then it could have inflated no more than queued buffers and a dictionary of data past the partition end
+    auto big = fz_image(fzhost::spiffs.mem.size() + 200000, 3);
+    auto zbig = fz_deflate(big);
+    for (bool direct : { false, true }){
+        deco_stat_t st;
+        if (flash(zbig, { U_SPIFFS, direct, 4096 }, true, st) || st.out_bytes > fzhost::spiffs.mem.size() + (FZ_PIPE_BUFF_NUM + 1) * FZ_PIPE_BUFF_SIZE + TINFL_LZ_DICT_SIZE){
+            printf("FAIL writer error is not reported, direct %d, out %zu\n", direct, st.out_bytes);
+            ++fails;
+        }
+    }
+
+    // abort with chunks queued to writer, then run a complete update
+    auto z = fz_deflate(image);
+    fzhost::reset();
+    fz.pipeline(true);
+    fz.directwrite(false);
+    if (!fz.beginz(UPDATE_SIZE_UNKNOWN, U_FLASH) || fz.writez(z.data(), z.size() / 2, false) != z.size() / 2){
+        printf("FAIL pipelined update start\n");
+        ++fails;
+    }
+    fz.abortz();
+    if (fzhost::boot){
+        printf("FAIL aborted update has switched boot partition\n");
+        ++fails;
+    }
+    fails += check_equal(image, z, { U_FLASH, false, 4096 }, "zlib after abort");
+
+    fz.pipeline(false);
+    fz.directwrite(false);
+    return fz_result("pipeline", fails);
+}
@@ -0,0 +1,62 @@
+/*
+    ESP32-FlashZ host tests
+
+    background pre-erase: eraser task must run ahead of the writer, up to FZ_ERASE_LEAD bytes, erase each sector of
+    the image exactly once and nothing past image end, and never erase a sector that has been written already.
+    Checked with plain and pipelined writer over a partition filled with garbage, so that any sector programmed
+    w/o erase breaks the image. Aborted update must stop the eraser.
+ */
+
+#include "fztest.h"
+
+static bool feed(const std::vector<uint8_t> &z, size_t upto){
+    FlashZ &fz = FlashZ::getInstance();
+    for (size_t off = 0; off < upto; off += 1436){
+        size_t len = std::min<size_t>(1436, upto - off);
+        if (fz.writez(z.data() + off, len, off + len == z.size()) != len)
+            return false;
+    }
+    return true;
+}
+
+int main(){
+    int fails = 0;
+    FlashZ &fz = FlashZ::getInstance();
+    auto image = fz_image(1200000, 7);
+    auto z = fz_deflate(image);
+    unsigned secs = (image.size() + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+    fz.preerase(true);
+
+    for (bool pipe : { false, true }){
+        fz.pipeline(pipe);
+        fzhost::reset(0x5a);
+        bool ok = fz.beginz(image.size(), U_FLASH) && feed(z, z.size()) && fz.endz(false)
+                    && fzhost::boot && std::equal(image.begin(), image.end(), fzhost::ota.mem.begin());
+        // sector 0 is erased by eraser and once more by UpdateClass before it's written
+        ok = ok && !fzhost::rewiped && fzhost::erased == secs && fzhost::ota.erased_to == (size_t)secs * SPI_FLASH_SEC_SIZE
+                && fzhost::lead >= FZ_ERASE_LEAD;
+        if (!ok){
+            printf("FAIL pipe %d: erased %u/%u sectors up to 0x%zx, %u erased after write, max lead %zu\n", pipe, fzhost::erased.load(), secs,
+                    fzhost::ota.erased_to.load(), fzhost::rewiped.load(), fzhost::lead.load());
+            ++fails;
+        }
+    }
+
+    // abort in the middle, eraser must quit and leave the rest of partition as is
+    fz.pipeline(false);
+    fzhost::reset(0x5a);
+    if (!fz.beginz(image.size(), U_FLASH) || !feed(z, z.size() / 3)){
+        printf("FAIL pre-erased update start\n");
+        ++fails;
+    }
+    fz.abortz();
+    unsigned erased = fzhost::erased;
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    if (fzhost::erased != erased || fzhost::rewiped || erased >= secs || fzhost::boot){
+        printf("FAIL eraser after abort: erased %u -> %u of %u, %u erased after write\n", erased, fzhost::erased.load(), secs, fzhost::rewiped.load());
+        ++fails;
+    }
+
+    fz.preerase(false);
+    return fz_result("preerase", fails);
+}
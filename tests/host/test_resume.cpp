@@ -0,0 +1,106 @@
+/*
+    ESP32-FlashZ host tests
+
+    stalled stream resume: stream that stops in the middle of compressed data leaves update resumable
+    from resumeoffset(), the rest of the stream completes the image. Corrupted or truncated compressed
+    data is a decode error and must not be reported as resumable.
+ */
+
+#include "fztest.h"
+
+// memory stream that stalls once 'limit' bytes have been read
+class mem_stream_t : public Stream {
+    const uint8_t *data;
+    size_t len, pos = 0;
+public:
+    mem_stream_t(const uint8_t *data, size_t len) : data(data), len(len) {}
+    int available() override { return len - pos; }
+    int read() override { return pos < len ? data[pos++] : -1; }
+    int peek() override { return pos < len ? data[pos] : -1; }
+    size_t write(uint8_t) override { return 0; }
+};
+
+// stream wait callback, stalled stream never gets more data
+static bool no_wait(Stream &s, uint32_t timeout){ return s.available() > 0; }
+
+// returns resume offset after the stream has stalled at 'cut' bytes, or 0
+static size_t stall_at(const std::vector<uint8_t> &z, size_t cut){
+    FlashZ &fz = FlashZ::getInstance();
+    mem_stream_t s(z.data(), cut);
+    if (fz.writezStream(s, UPDATE_SIZE_UNKNOWN, no_wait))
+        return 0;
+    return fz.resumeoffset();
+}
+
+static int check_resume(const std::vector<uint8_t> &image, const std::vector<uint8_t> &z, const char *name){
+    fzhost::reset();
+    FlashZ &fz = FlashZ::getInstance();
+    if (!fz.beginz(UPDATE_SIZE_UNKNOWN, U_SPIFFS))
+        return 1;
+
+    size_t off = 0;
+    for (size_t cut : { z.size() / 3, z.size() * 2 / 3 }){
+        mem_stream_t s(z.data() + off, cut - off);
+        if (fz.writezStream(s, UPDATE_SIZE_UNKNOWN, no_wait) || fz.resumeoffset() != cut){
+            printf("FAIL %s: stall at %zu, resume offset %zu\n", name, cut, fz.resumeoffset());
+            fz.abortz();
+            return 1;
+        }
+        off = cut;
+    }
+
+    mem_stream_t s(z.data() + off, z.size() - off);
+    bool ok = fz.writezStream(s, UPDATE_SIZE_UNKNOWN, no_wait) == z.size() && fz.endz();
+    if (!ok || !std::equal(image.begin(), image.end(), fzhost::spiffs.mem.begin())){
+        printf("FAIL %s: resumed image does not match\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+static int check_error(const std::vector<uint8_t> &z, const char *name){
+    fzhost::reset();
+    FlashZ &fz = FlashZ::getInstance();
+    if (!fz.beginz(UPDATE_SIZE_UNKNOWN, U_SPIFFS))
+        return 1;
+
+    size_t off = stall_at(z, z.size());
+    fz.abortz();
+    if (off){
+        printf("FAIL %s: decode error is reported as resumable at %zu\n", name, off);
+        return 1;
+    }
+    return 0;
+}
+
+int main(){
+    int fails = 0;
+    auto image = fz_image(300000, 6);
+
+    for (int wbits : { 15, 31 }){
+        const char *fmt = wbits == 15 ? "zlib" : "gzip";
+        auto z = fz_deflate(image, wbits);
+        fails += check_resume(image, z, fmt);
+
+        // garbage in the middle of deflate data
+        auto bad = z;
+        std::fill_n(bad.begin() + bad.size() / 2, 64, 0xff);
+        fails += check_error(bad, fmt);
+
+        // known size stream, that ends before compressed data does, gzip trailer is cut off
+        for (size_t cut : { z.size() / 2, z.size() - 4 }){
+            fzhost::reset();
+            FlashZ &fz = FlashZ::getInstance();
+            if (!fz.beginz(UPDATE_SIZE_UNKNOWN, U_SPIFFS))
+                continue;
+            mem_stream_t s(z.data(), cut);
+            if (fz.writezStream(s, cut, no_wait) || fz.resumeoffset()){
+                printf("FAIL %s: stream truncated at %zu is reported as resumable\n", fmt, cut);
+                ++fails;
+            }
+            fz.abortz();
+        }
+    }
+
+    return fz_result("resume", fails);
+}
@@ -0,0 +1,139 @@
+/*
+    ESP32-FlashZ host tests
+
+    upload ring: FzRing passes data from AsyncWebServer upload callback (async_tcp task) to upload worker.
+    Producer thread plays async_tcp with a TCP sender, which could have up to a window of unacked data in flight,
+    ACKs are held while ring.hold() says the ring has no room for another window. Consumer thread plays the worker,
+    it reads the ring in spans of various size and wakes up producer's poll hook once ring.release() says so.
+    At any speed ratio data must pass the ring intact, the ring must never overflow and throttled producer
+    must never wait for a wake up that does not come (AsyncTCP's periodic poll here is a 1 s timeout).
+ */
+
+#include "fztest.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#define RING_MSS        1436
+#define RING_POLL_MS    1000
+
+struct wire_t {
+    size_t ring;            // FZ_UPLOAD_RING_SIZE
+    size_t wnd;             // FZ_UPLOAD_TCP_WND
+    unsigned net_us;        // sender delay per segment
+    unsigned flash_us;      // worker delay per span
+};
+
+// worker's wake up of async_tcp poll hook
+struct kick_t {
+    std::mutex m;
+    std::condition_variable cv;
+    bool set = false;
+    unsigned cnt = 0;
+
+    void fire(){
+        std::lock_guard<std::mutex> lock(m);
+        set = true;
+        ++cnt;
+        cv.notify_one();
+    }
+
+    // false on poll timeout
+    bool wait(){
+        std::unique_lock<std::mutex> lock(m);
+        bool ok = cv.wait_for(lock, std::chrono::milliseconds(RING_POLL_MS), [this]{ return set; });
+        set = false;
+        return ok;
+    }
+};
+
+static int wire(const std::vector<uint8_t> &src, const wire_t &w){
+    FzRing ring;
+    kick_t kick;
+    if (!ring.begin(w.ring))
+        return 1;
+
+    bool corrupt = false;
+    std::thread worker([&]{
+        size_t off = 0;
+        unsigned n = 0;
+        while (off < src.size()){
+            const uint8_t *data;
+            size_t len = ring.peek(data);
+            if (!len){
+                std::this_thread::yield();
+                continue;
+            }
+            len = std::min<size_t>(len, 1 + n++ * 997 % 4096);
+            corrupt = corrupt || !std::equal(data, data + len, src.begin() + off);
+            off += len;
+            ring.consume(len);
+            if (w.flash_us)
+                std::this_thread::sleep_for(std::chrono::microseconds(w.flash_us));
+            if (ring.release(w.wnd))
+                kick.fire();
+        }
+    });
+
+    size_t sent = 0, acked = 0, overflow = 0, stalls = 0, holds = 0;
+    while (sent < src.size()){
+        size_t len = std::min<size_t>(RING_MSS, src.size() - sent);
+
+        // window is closed by held ACKs, only poll hook could reopen it
+        if (sent + len - acked > w.wnd){
+            // after the first missed wake up the rest is passed by busy polling, so that test does not hang
+            if (stalls)
+                std::this_thread::yield();
+            else if (!kick.wait())
+                ++stalls;
+            if (!ring.hold(w.wnd))
+                acked = sent;
+            continue;
+        }
+
+        // upload callback, ACK of the segment is held along with the previous ones if the ring is short of room
+        overflow += len - ring.put(src.data() + sent, len);
+        sent += len;
+        if (ring.hold(w.wnd))
+            ++holds;
+        else
+            acked = sent;
+
+        if (w.net_us)
+            std::this_thread::sleep_for(std::chrono::microseconds(w.net_us));
+    }
+    worker.join();
+
+    bool ok = !corrupt && !overflow && !stalls && !ring.used();
+    printf("%s ring %zu wnd %zu net %u us flash %u us: %zu holds, %u kicks, %zu stalls%s%s\n", ok ? "ok  " : "FAIL", w.ring, w.wnd,
+            w.net_us, w.flash_us, holds, kick.cnt, stalls, corrupt ? ", data corrupted" : "", overflow ? ", overflow" : "");
+    return !ok;
+}
+
+int main(){
+    int fails = 0;
+
+    FzRing ring;
+    for (size_t sz : { 0, 3000, 6144 }){
+        if (ring.begin(sz)){
+            printf("FAIL ring of %zu bytes is accepted\n", sz);
+            ++fails;
+        }
+    }
+
+    auto src = fz_image(600000, 12);
+    const wire_t wires[] = {
+        { 16384, 5744, 0, 0 },
+        { 16384, 5744, 0, 50 },         // flash is slower than network
+        { 16384, 5744, 50, 0 },         // network is slower than flash
+        { 16384, 5744, 20, 20 },
+        { 16384, 8192, 0, 20 },         // the largest window a ring could take
+        { 4096, 2048, 0, 0 },
+        { 4096, 2048, 5, 30 }
+    };
+    for (const auto &w : wires)
+        fails += wire(src, w);
+
+    return fz_result("ring", fails);
+}
@@ -0,0 +1,95 @@
+/*
+    ESP32-FlashZ host tests
+
+    sparse write mode on simulated NOR flash: all-0xFF sectors of the image are not programmed, sectors that are
+    already blank on flash are not erased. Checked with plain and pipelined writer, with and without
+    compare-before-write mode. Flash contents must match the image, first sector is written by UpdateClass.
+ */
+
+#include "fztest.h"
+
+// image with most of the sectors past 200k left blank
+static std::vector<uint8_t> sparse_image(){
+    auto image = fz_image(1500000, 9);
+    for (size_t i = 200000; i < image.size(); ++i)
+        if ((i / SPI_FLASH_SEC_SIZE) % 5)
+            image[i] = 0xff;
+    return image;
+}
+
+static size_t blank_sectors(const std::vector<uint8_t> &image){
+    size_t blanks = 0;
+    for (size_t s = SPI_FLASH_SEC_SIZE; s < image.size(); s += SPI_FLASH_SEC_SIZE){
+        size_t n = std::min<size_t>(SPI_FLASH_SEC_SIZE, image.size() - s);
+        if (std::all_of(&image[s], &image[s] + n, [](uint8_t b){ return b == 0xff; }))
+            ++blanks;
+    }
+    return blanks;
+}
+
+static bool flash(const std::vector<uint8_t> &z, deco_stat_t &st){
+    FlashZ &fz = FlashZ::getInstance();
+    if (!fz.beginz(UPDATE_SIZE_UNKNOWN, U_FLASH))
+        return false;
+
+    for (size_t off = 0; off < z.size(); off += 5000){
+        size_t len = std::min<size_t>(5000, z.size() - off);
+        if (fz.writez(z.data() + off, len, off + len == z.size()) != len){
+            fz.abortz();
+            return false;
+        }
+    }
+    bool ok = fz.endz();
+    fz.getstat(st);
+    return ok;
+}
+
+static bool ota_is(const std::vector<uint8_t> &image){
+    return std::equal(image.begin(), image.end(), fzhost::ota.mem.begin());
+}
+
+int main(){
+    int fails = 0;
+    FlashZ &fz = FlashZ::getInstance();
+    fz.sparse(true);
+
+    for (bool pipe : { false, true }){
+        for (bool cmp : { false, true }){
+            fz.pipeline(pipe);
+            fz.cmpwrite(cmp);
+
+            // partition holds some old garbage
+            fzhost::reset();
+            std::mt19937 rng(5);
+            for (auto &b : fzhost::ota.mem)
+                b = rng();
+
+            auto image = sparse_image();
+            size_t blanks = blank_sectors(image);
+            size_t secs = (image.size() + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+            deco_stat_t st;
+
+            bool ok = flash(fz_deflate(image, 15, 6), st) && ota_is(image) && st.sec_blank == blanks && !st.sec_skipped;
+            if (!ok){
+                printf("FAIL pipe %d cmp %d first: blank %u/%zu, skipped %u\n", pipe, cmp, st.sec_blank, blanks, st.sec_skipped);
+                ++fails;
+            }
+
+            // flash it once more with one bit cleared in a non-blank sector, blank sectors must not be erased again
+            // compare mode programs cleared bit w/o erase
+            fzhost::erased = 0;
+            image[300000] ^= 1;
+            unsigned erases = cmp ? 0 : secs - 1 - blanks;
+            ok = flash(fz_deflate(image, 15, 6), st) && ota_is(image) && fzhost::erased == erases && st.sec_skipped >= blanks - 1;
+            if (!ok){
+                printf("FAIL pipe %d cmp %d again: erased %u/%u, skipped %u\n", pipe, cmp, fzhost::erased.load(), erases, st.sec_skipped);
+                ++fails;
+            }
+        }
+    }
+
+    fz.sparse(false);
+    fz.cmpwrite(false);
+    fz.pipeline(false);
+    return fz_result("sparse", fails);
+}
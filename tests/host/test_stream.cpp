@@ -0,0 +1,120 @@
+/*
+    ESP32-FlashZ host tests
+
+    socket stream wait: writezStream() for a stream with fd() blocks on the socket with select() while
+    sender pauses, instead of polling the stream each tick. Connection closed by the peer ends the call
+    at once with update left resumable, the rest of the image could be fed via another connection.
+ */
+
+#include "fztest.h"
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// WiFiClient-alike stream over a local socket
+class sock_stream_t : public Stream {
+    int sock;
+public:
+    unsigned empty_polls = 0;       // available() calls with no data
+
+    explicit sock_stream_t(int fd) : sock(fd) {}
+    ~sock_stream_t(){ close(sock); }
+
+    int fd() const { return sock; }
+    uint8_t connected(){
+        uint8_t c;
+        return recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) != 0;    // 0 is an orderly shutdown, no data is just EAGAIN
+    }
+
+    int available() override {
+        int n = 0;
+        ioctl(sock, FIONREAD, &n);
+        if (!n)
+            ++empty_polls;
+        return n;
+    }
+    int read() override { uint8_t c; return recv(sock, &c, 1, MSG_DONTWAIT) == 1 ? c : -1; }
+    int peek() override { uint8_t c; return recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 1 ? c : -1; }
+    size_t readBytes(uint8_t *buff, size_t len) override {
+        ssize_t n = recv(sock, buff, len, MSG_DONTWAIT);
+        return n > 0 ? n : 0;
+    }
+    size_t write(uint8_t) override { return 0; }
+};
+
+// send data in 'parts' bursts with a pause after each one, close the socket after the last one
+static std::thread sender(int sock, const uint8_t *data, size_t len, int parts, int pause_ms){
+    return std::thread([=]{
+        for (int i = 0; i != parts; ++i){
+            size_t from = len * i / parts, to = len * (i + 1) / parts;
+            for (size_t off = from; off < to; ){
+                ssize_t n = send(sock, data + off, to - off, 0);
+                if (n <= 0)
+                    break;
+                off += n;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(pause_ms));
+        }
+        close(sock);
+    });
+}
+
+int main(){
+    int fails = 0;
+    FlashZ &fz = FlashZ::getInstance();
+    auto image = fz_image(300000, 4);
+    auto z = fz_deflate(image);
+
+    // the whole image in three bursts, 300 ms apart
+    fzhost::reset();
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    if (!fz.beginz(UPDATE_SIZE_UNKNOWN, U_SPIFFS))
+        return fz_result("stream", 1);
+    {
+        sock_stream_t s(sv[0]);
+        auto t = sender(sv[1], z.data(), z.size(), 3, 300);
+        size_t n = fz.writezStream(s, z.size());
+        t.join();
+        bool ok = n == z.size() && fz.endz() && std::equal(image.begin(), image.end(), fzhost::spiffs.mem.begin());
+        // stream is polled once per wait, not once per tick
+        if (!ok || s.empty_polls > 10){
+            printf("FAIL socket stream: %zu/%zu bytes, empty polls %u\n", n, z.size(), s.empty_polls);
+            ++fails;
+        }
+    }
+
+    // peer closes connection in the middle of the image, then the rest comes via a new one
+    fzhost::reset();
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    if (!fz.beginz(UPDATE_SIZE_UNKNOWN, U_SPIFFS))
+        return fz_result("stream", 1);
+    size_t half = z.size() / 2;
+    {
+        sock_stream_t s(sv[0]);
+        auto t = sender(sv[1], z.data(), half, 1, 0);
+        uint32_t start = millis();
+        size_t n = fz.writezStream(s, UPDATE_SIZE_UNKNOWN);
+        uint32_t elapsed = millis() - start;
+        t.join();
+        if (n || fz.resumeoffset() != half || elapsed > INFLATOR_STREAM_TIMEOUT_MS / 10){
+            printf("FAIL closed socket: %zu bytes, resume offset %zu/%zu, %u ms\n", n, fz.resumeoffset(), half, elapsed);
+            ++fails;
+        }
+    }
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    {
+        sock_stream_t s(sv[0]);
+        auto t = sender(sv[1], z.data() + half, z.size() - half, 2, 100);
+        size_t n = fz.writezStream(s, z.size() - half);
+        t.join();
+        bool ok = n == z.size() && fz.endz() && std::equal(image.begin(), image.end(), fzhost::spiffs.mem.begin());
+        if (!ok){
+            printf("FAIL resumed socket stream: %zu/%zu bytes\n", n, z.size());
+            ++fails;
+        }
+    }
+
+    return fz_result("stream", fails);
+}
@@ -0,0 +1,90 @@
+#!/usr/bin/python
+
+# ESP32-FlashZ bundle packer
+#
+# packs firmware and filesystem images into one bundle file, that FlashZ flashes in one pass, see FlashZ::beginbundle()
+#
+# usage: fzbundle.py [-f zz|gz|lz4|hs|raw] [-k private_key.pem] -a firmware.bin[@label] -d littlefs.bin[@label] bundle.fzb
+#
+# -a adds an app image, it's flashed to the next OTA partition or to the app partition with given label,
+# -d adds a data image, it's flashed to the SPIFFS subtype partition or to the data partition with given label.
+# Images are compressed with fzcompress.py, each image is checked against it's SHA-256 digest before switching boot partition.
+# If private key is given, manifest is signed with 'openssl' CLI tool: ECDSA (DER encoded) or RSA PKCS#1 v1.5, depending on key type.
+#
+# Bundle format, all fields are little-endian:
+#   header:    "FZB1" magic, u8 number of images, u8 flags (reserved, 0), u16 signature length,
+#              u32 crc32 of manifest entries, u32 reserved
+#   manifest:  64 bytes entry per image - u8 target (0 - app, 1 - data), u8 flags (bit 0 - compressed), u16 reserved,
+#              16 bytes partition label (zero padded), u32 payload size, u32 image size, 32 bytes SHA-256 of image, u32 reserved
+#   signature: signature of header and manifest, if any
+#   payloads of all images in manifest order
+
+import argparse, hashlib, os, struct, sys, zlib
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import fzcompress, fzsign
+
+FZ_BUNDLE_MAGIC = b'FZB1'
+FZ_BUNDLE_MAX_IMAGES = 4
+FZ_BUNDLE_APP = 0
+FZ_BUNDLE_DATA = 1
+FZ_BUNDLE_COMPRESSED = 0x01
+
+def image_arg(arg):
+    path, _, label = arg.partition('@')
+    if len(label) > 16:
+        raise argparse.ArgumentTypeError("partition label is too long: %s" % label)
+    return (path, label)
+
+def bundle(images, fmt, level, keyfile = None):
+    entries = b''
+    payloads = b''
+    for target, path, label in images:
+        with open(path, 'rb') as f:
+            data = f.read()
+        payload = data if fmt == 'raw' else fzcompress.compress(data, fmt, level)
+        flags = 0 if fmt == 'raw' else FZ_BUNDLE_COMPRESSED
+        entries += struct.pack('<BBH16sII32sI', target, flags, 0, label.encode(), len(payload), len(data), hashlib.sha256(data).digest(), 0)
+        payloads += payload
+        print("%s: %s '%s', %d -> %d bytes" % (path, 'app' if target == FZ_BUNDLE_APP else 'data', label or 'default', len(data), len(payload)))
+
+    # signature length is a part of signed header, so signing is done for a header with expected signature length
+    sig = b''
+    if keyfile:
+        probe = fzsign.sign(b'', keyfile)
+        for _ in range(8):
+            hdr = FZ_BUNDLE_MAGIC + struct.pack('<BBHII', len(images), 0, len(probe), zlib.crc32(entries) & 0xffffffff, 0)
+            sig = fzsign.sign(hdr + entries, keyfile)
+            if len(sig) == len(probe):
+                break
+            probe = sig         # DER encoded ECDSA signature length varies, retry
+        else:
+            sys.exit("can't make a signature of stable length")
+
+    hdr = FZ_BUNDLE_MAGIC + struct.pack('<BBHII', len(images), 0, len(sig), zlib.crc32(entries) & 0xffffffff, 0)
+    return hdr + entries + sig + payloads
+
+def main():
+    parser = argparse.ArgumentParser(description='ESP32-FlashZ bundle packer')
+    parser.add_argument('output', help='bundle file')
+    parser.add_argument('-a', '--app', type = image_arg, action = 'append', default = [], help='app image file, optionally followed by @partition_label')
+    parser.add_argument('-d', '--data', type = image_arg, action = 'append', default = [], help='data image file, optionally followed by @partition_label')
+    parser.add_argument('-f', '--format', choices = ['zz', 'gz', 'lz4', 'hs', 'raw'], default = 'zz', help='compression format')
+    parser.add_argument('-l', '--level', type = int, default = 9, help='compression level for zlib/gzip/lz4')
+    parser.add_argument('-k', '--key', help='private key file (PEM) to sign bundle manifest with')
+    args = parser.parse_args()
+
+    images = [(FZ_BUNDLE_APP, p, l) for p, l in args.app] + [(FZ_BUNDLE_DATA, p, l) for p, l in args.data]
+    if not images or len(images) > FZ_BUNDLE_MAX_IMAGES:
+        sys.exit("bundle must contain 1 to %d images" % FZ_BUNDLE_MAX_IMAGES)
+    if len(args.app) > 1:
+        sys.exit("bundle could contain only one app image")
+
+    out = bundle(images, args.format, args.level, args.key)
+    with open(args.output, 'wb') as f:
+        f.write(out)
+
+    print("%s: %d images, %d bytes, %s" % (args.output, len(images), len(out), "signed" if args.key else "not signed"))
+
+if __name__ == '__main__':
+    main()
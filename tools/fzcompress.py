@@ -0,0 +1,136 @@
+#!/usr/bin/python
+
+# ESP32-FlashZ image compressor
+#
+# compresses firmware/filesystem image into one of the formats FlashZ could decompress on the fly:
+#   zz  - zlib (default), gz - gzip, lz4 - LZ4 frame, hs - heatshrink stream with FlashZ header
+#
+# usage: fzcompress.py [-f zz|gz|lz4|hs] [-l level] [-w bits] [-k bits] image.bin [output]
+#
+# zlib window size (-w 9..15) sets Inflator's dictionary size on device, 4k window image inflates with ~15k of RAM
+# instead of ~43k at some compression ratio cost. gzip header does not carry window size, so it always takes 32k.
+# LZ4 compression uses python's 'lz4' module if installed, otherwise 'lz4' CLI tool.
+# heatshrink encoder is built-in, stream is prefixed with 8 bytes header:
+#   "HSZ", u8 (window_bits << 4 | lookahead_bits), u32 LE decompressed size
+
+import argparse, shutil, struct, subprocess, sys, zlib
+
+HS_HEADER = b'HSZ'
+HS_DEPTH = 64       # max candidates to check per position for heatshrink match
+
+def compress_zlib(data, level, wbits = 15):
+    c = zlib.compressobj(level, zlib.DEFLATED, wbits)
+    return c.compress(data) + c.flush()
+
+def compress_lz4(data, level):
+    try:
+        import lz4.frame
+        return lz4.frame.compress(data, compression_level = level, block_size = lz4.frame.BLOCKSIZE_MAX64KB, content_checksum = True, store_size = True)
+    except ImportError:
+        pass
+    if not shutil.which('lz4'):
+        sys.exit("LZ4 compression requires python 'lz4' module or 'lz4' CLI tool")
+    return subprocess.run(['lz4', '-%d' % min(level, 12), '-B4', '--content-size', '-c'], input = data, stdout = subprocess.PIPE, check = True).stdout
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.n = 0
+
+    def put(self, value, bits):
+        # MSB first
+        self.acc = (self.acc << bits) | value
+        self.n += bits
+        while self.n >= 8:
+            self.n -= 8
+            self.out.append((self.acc >> self.n) & 0xff)
+        self.acc &= (1 << self.n) - 1
+
+    def flush(self):
+        if self.n:
+            self.out.append((self.acc << (8 - self.n)) & 0xff)
+            self.n = 0
+        return bytes(self.out)
+
+def compress_hs(data, window_bits, lookahead_bits):
+    window = 1 << window_bits
+    max_len = 1 << lookahead_bits
+    backref_bits = 1 + window_bits + lookahead_bits
+    bw = BitWriter()
+    chains = {}
+    i = 0
+    n = len(data)
+    while i < n:
+        best_len = best_dist = 0
+        key = data[i:i + 2]
+        cand = chains.get(key)
+        if cand:
+            lim = min(max_len, n - i)
+            for p in reversed(cand[-HS_DEPTH:]):
+                if i - p > window:
+                    break
+                l = 2
+                while l < lim and data[p + l] == data[i + l]:
+                    l += 1
+                if l > best_len:
+                    best_len, best_dist = l, i - p
+                    if l == lim:
+                        break
+        # use backref only if it is shorter than literals
+        if best_len * 9 > backref_bits:
+            bw.put(0, 1)
+            bw.put(best_dist - 1, window_bits)
+            bw.put(best_len - 1, lookahead_bits)
+            step = best_len
+        else:
+            bw.put(0x100 | data[i], 9)
+            step = 1
+        for k in range(i, min(i + step, n - 1)):
+            chains.setdefault(data[k:k + 2], []).append(k)
+        i += step
+    return HS_HEADER + bytes([window_bits << 4 | lookahead_bits]) + struct.pack('<I', n) + bw.flush()
+
+def compress(data, fmt, level = 9, window_bits = None, lookahead_bits = 4):
+    if fmt == 'zz':
+        return compress_zlib(data, level, window_bits or 15)
+    if fmt == 'gz':
+        return compress_zlib(data, level, 31)
+    if fmt == 'lz4':
+        return compress_lz4(data, level)
+    if fmt == 'hs':
+        return compress_hs(data, window_bits or 11, lookahead_bits)
+    raise ValueError("unknown format: %s" % fmt)
+
+def check_window(fmt, window_bits, lookahead_bits):
+    if fmt == 'hs' and not (4 <= (window_bits or 11) <= 15 and 3 <= lookahead_bits < (window_bits or 11)):
+        sys.exit("bad heatshrink parameters")
+    if fmt == 'zz' and window_bits and not 9 <= window_bits <= 15:
+        sys.exit("zlib window size bits must be 9..15")
+    if fmt in ('gz', 'lz4') and window_bits:
+        sys.exit("window size could be set for zlib and heatshrink formats only")
+
+def main():
+    parser = argparse.ArgumentParser(description='ESP32-FlashZ image compressor')
+    parser.add_argument('image', help='image file to compress')
+    parser.add_argument('output', nargs='?', help='output file, default is image file name with format suffix')
+    parser.add_argument('-f', '--format', choices = ['zz', 'gz', 'lz4', 'hs'], default = 'zz', help='compression format')
+    parser.add_argument('-l', '--level', type = int, default = 9, help='compression level for zlib/gzip/lz4')
+    parser.add_argument('-w', '--window', type = int, help='window size bits, zlib 9..15 (default 15), heatshrink 4..15 (default 11)')
+    parser.add_argument('-k', '--lookahead', type = int, default = 4, help='heatshrink lookahead size bits, 3..window-1')
+    args = parser.parse_args()
+
+    check_window(args.format, args.window, args.lookahead)
+
+    with open(args.image, 'rb') as f:
+        data = f.read()
+
+    out = compress(data, args.format, args.level, args.window, args.lookahead)
+    dst = args.output or '%s.%s' % (args.image, args.format)
+    with open(dst, 'wb') as f:
+        f.write(out)
+
+    print("%s: %s, %d -> %d bytes, ratio %.1f%%" % (dst, args.format, len(data), len(out), (1 - float(len(out)) / len(data)) * 100))
+
+if __name__ == '__main__':
+    main()
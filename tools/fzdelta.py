@@ -0,0 +1,167 @@
+#!/usr/bin/python
+
+# ESP32-FlashZ delta patch generator
+#
+# builds a compressed delta patch that rebuilds 'new' firmware image from the 'old' one,
+# the one that is currently running on a board. Patch is uploaded same way as a compressed
+# image and applied with FlashZ::beginpatch() on the device
+#
+# usage: fzdelta.py [--gzip] [--level N] [--builtin] [--check] old.bin new.bin patch.zz
+#
+# If python's 'bsdiff4' module is installed, it is used to find matches (best results),
+# otherwise a simple built-in block matcher is used.
+#
+# Patch format (before compression), all fields are little-endian:
+#   header: u32 magic "FZD1", u32 new image size, u32 old image size, u32 crc32 of old image
+#   records: u32 diff_len, u32 extra_len, i32 seek, diff_len bytes of diff data, extra_len bytes of extra data
+#   - diff bytes are added bytewise (mod 256) to old image bytes starting at old image pointer
+#   - extra bytes are copied to the new image as-is
+#   - old image pointer is moved by seek bytes after the record
+
+import argparse, struct, sys, zlib
+
+FZ_PATCH_MAGIC = b'FZD1'
+BLOCK = 16          # anchor size for built-in matcher
+STEP = 4            # old image indexing step
+FUZZ = 32           # stop approximate match extension after this score drop
+
+def extend_fwd(old, new, i, j, limit):
+    # bsdiff-alike approximate extension, maximize 2*matches - length
+    score = best = best_len = 0
+    k = 0
+    n = min(len(old) - i, limit - j)
+    while k < n:
+        score += 1 if old[i + k] == new[j + k] else -1
+        k += 1
+        if score > best:
+            best, best_len = score, k
+        elif best - score > FUZZ:
+            break
+    return best_len
+
+def extend_back(old, new, i, j, limit):
+    score = best = best_len = 0
+    k = 1
+    n = min(i, j - limit)
+    while k <= n:
+        score += 1 if old[i - k] == new[j - k] else -1
+        if score > best:
+            best, best_len = score, k
+        elif best - score > FUZZ:
+            break
+        k += 1
+    return best_len
+
+def builtin_diff(old, new):
+    """ returns a list of (old_pos, new_pos, length) approximate matches, ordered by new_pos """
+    index = {}
+    for i in range(0, len(old) - BLOCK + 1, STEP):
+        index.setdefault(old[i:i + BLOCK], i)
+
+    matches = []
+    last_new = 0        # end of the last match in new
+    last_old = 0
+    j = 0
+    while j <= len(new) - BLOCK:
+        key = new[j:j + BLOCK]
+        i = index.get(key)
+        # prefer continuing in place, it gives zero seek and good diff runs
+        if old[last_old + j - last_new : last_old + j - last_new + BLOCK] == key:
+            i = last_old + j - last_new
+        if i is None:
+            j += 1
+            continue
+        back = extend_back(old, new, i, j, last_new)
+        fwd = extend_fwd(old, new, i, j, len(new))
+        matches.append((i - back, j - back, back + fwd))
+        last_new, last_old = j + fwd, i + fwd
+        j = last_new
+    return matches
+
+def bsdiff4_diff(old, new):
+    import bsdiff4.core
+    ctrl, bdiff, bextra = bsdiff4.core.diff(bytes(old), bytes(new))
+    matches = []
+    o = n = 0
+    for x, y, z in ctrl:
+        matches.append((o, n, x))
+        o += x + z
+        n += x + y
+    return matches
+
+def make_patch(old, new, matches):
+    out = bytearray(FZ_PATCH_MAGIC + struct.pack('<III', len(new), len(old), zlib.crc32(old) & 0xffffffff))
+    # each record is a diff over the current match followed by extra data up to the next match,
+    # the first record has an empty diff for leading extra data
+    co, cn, cl = 0, 0, 0
+    for o, n, l in matches + [(None, len(new), 0)]:
+        if o is None:
+            o = co + cl                     # last record, no seek
+        out += struct.pack('<IIi', cl, n - cn - cl, o - co - cl)
+        out += bytes((new[cn + t] - old[co + t]) & 0xff for t in range(cl))
+        out += new[cn + cl : n]
+        co, cn, cl = o, n, l
+    return bytes(out)
+
+def apply_patch(old, patch):
+    magic, new_size, old_size, crc = struct.unpack_from('<4sIII', patch)
+    assert magic == FZ_PATCH_MAGIC and old_size == len(old) and crc == zlib.crc32(old) & 0xffffffff
+    new = bytearray()
+    p, o = 16, 0
+    while len(new) < new_size:
+        d, e, s = struct.unpack_from('<IIi', patch, p)
+        p += 12
+        new += bytes((patch[p + t] + old[o + t]) & 0xff for t in range(d))
+        p += d
+        o += d
+        new += patch[p:p + e]
+        p += e
+        o += s
+        assert 0 <= o <= old_size
+    assert p == len(patch)
+    return bytes(new)
+
+def main():
+    parser = argparse.ArgumentParser(description='ESP32-FlashZ delta patch generator')
+    parser.add_argument('old', help='image currently running on a board')
+    parser.add_argument('new', help='new image')
+    parser.add_argument('patch', help='output compressed patch file')
+    parser.add_argument('--gzip', action='store_true', help='use gzip container instead of zlib')
+    parser.add_argument('--level', type=int, default=9, help='compression level')
+    parser.add_argument('--builtin', action='store_true', help='do not use bsdiff4 module even if it is available')
+    parser.add_argument('--check', action='store_true', help='verify patch after creation')
+    args = parser.parse_args()
+
+    with open(args.old, 'rb') as f:
+        old = f.read()
+    with open(args.new, 'rb') as f:
+        new = f.read()
+
+    matches = None
+    if not args.builtin:
+        try:
+            matches = bsdiff4_diff(old, new)
+        except ImportError:
+            pass
+    if matches is None:
+        matches = builtin_diff(old, new)
+
+    patch = make_patch(old, new, matches)
+
+    if args.check and apply_patch(old, patch) != new:
+        sys.exit("patch verification FAILED")
+
+    if args.gzip:
+        c = zlib.compressobj(args.level, zlib.DEFLATED, 31)
+        data = c.compress(patch) + c.flush()
+    else:
+        data = zlib.compress(patch, args.level)
+
+    with open(args.patch, 'wb') as f:
+        f.write(data)
+
+    full = len(zlib.compress(new, args.level))
+    print("%s: %d -> patch %d bytes (full compressed image %d bytes), %.1fx smaller" % (args.new, len(new), len(data), full, float(full) / len(data)))
+
+if __name__ == '__main__':
+    main()
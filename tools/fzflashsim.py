@@ -0,0 +1,98 @@
+#!/usr/bin/python
+
+# ESP32-FlashZ OTA flash timing simulator
+#
+# estimates OTA update time with inline sector erase (UpdateClass or direct writer) against background pre-erase,
+# see FlashZ::preerase(). Network, decompression and SPI NOR flash are modeled as resources with fixed throughput/latency,
+# flash is a single shared bus: erase and program operations never overlap. Receive stalls once TCP window is full.
+# "saved" column compares pre-erase with the faster of inline erase modes.
+#
+# usage: fzflashsim.py [-s image_size] [-r ratio] [-n net_kbps] [-i inflate_kbps] [-w window] [-a lead] [--pipeline] [--sweep]
+#
+# Default erase/program timings are typical values from GD25Q32/W25Q32 datasheets (ESP32 modules' flash):
+#   4K sector erase 45 ms, 64K block erase 150 ms, 256 bytes page program 0.6 ms
+
+import argparse
+
+SEC = 4096
+BLOCK = 65536
+
+def simulate(size, ratio, net, inflate, t_sec, t_block, t_page, window, preerase, pipeline, inline_block, lead = 1):
+    """ returns total update time, s """
+    nsec = (size + SEC - 1) // SEC
+    t_prog = t_page * SEC / 256
+    csec = SEC * ratio              # compressed bytes per inflated sector
+
+    bus = 0.0                       # flash bus is busy until
+    erased = 0                      # sectors erased by pre-eraser
+    cpu = 0.0                       # inflator is busy until
+    arrived = 0.0                   # the last compressed sector has been received at
+    consumed = []                   # inflater has consumed compressed sector at
+    wr = 0.0                        # writer is done with the previous sector at
+    written = []                    # writer is done with sector at
+    depth = 6 if pipeline else 1    # sectors inflater could run ahead of writer, FZ_PIPE_BUFF_NUM * FZ_PIPE_BUFF_SIZE
+
+    def run_eraser(until, need):
+        """ eraser takes the bus whenever it is free before 'until' and it's lead over writer is less than 'lead' blocks,
+            writer waits for it if sector 'need' is not erased yet """
+        nonlocal bus, erased
+        while erased < nsec and ((bus < until and erased < need + lead * BLOCK // SEC) or erased < need):
+            n = min(BLOCK // SEC - erased % (BLOCK // SEC), nsec - erased)
+            dur = t_block if n == BLOCK // SEC else n * t_sec
+            bus += dur
+            erased += n
+
+    for i in range(nsec):
+        # compressed data arrives at network rate, but sender stalls once receive window is full
+        w = i - max(1, int(window / csec))
+        arrived = max(arrived, consumed[w] if w >= 0 else 0) + csec / net
+        # inflate waits for data and for a free buffer
+        cpu = max(cpu, arrived, written[i - depth] if i >= depth else 0) + SEC / inflate
+        consumed.append(cpu)
+        start = cpu if not pipeline else max(cpu, wr)
+
+        if preerase:
+            run_eraser(start, i + 1)
+            dur = t_prog + (t_sec if not i else 0)      # UpdateClass erases the first sector once again
+        elif inline_block:
+            # UpdateClass erases a 64K block when writer crosses block boundary
+            dur = t_prog + (t_block if i % (BLOCK // SEC) == 0 else 0)
+        else:
+            dur = t_prog + t_sec
+
+        start = max(start, bus)
+        bus = start + dur
+        wr = bus
+        written.append(wr)
+
+    return wr
+
+def main():
+    parser = argparse.ArgumentParser(description='ESP32-FlashZ OTA flash timing simulator')
+    parser.add_argument('-s', '--size', type = int, default = 1572864, help='inflated image size, bytes')
+    parser.add_argument('-r', '--ratio', type = float, default = 0.55, help='compressed/inflated size ratio')
+    parser.add_argument('-n', '--net', type = float, default = 400, help='network throughput, KiB/s')
+    parser.add_argument('-i', '--inflate', type = float, default = 1500, help='inflate throughput, KiB/s of output')
+    parser.add_argument('--sector-ms', type = float, default = 45, help='4K sector erase time, ms')
+    parser.add_argument('--block-ms', type = float, default = 150, help='64K block erase time, ms')
+    parser.add_argument('--page-ms', type = float, default = 0.6, help='256 bytes page program time, ms')
+    parser.add_argument('-w', '--window', type = int, default = 11488, help='TCP receive window plus stream buffer, bytes')
+    parser.add_argument('-a', '--lead', type = int, default = 1, help='pre-eraser lead over writer, 64K blocks, FZ_ERASE_LEAD')
+    parser.add_argument('--pipeline', action = 'store_true', help='inflate and flash writes run in separate tasks')
+    parser.add_argument('--sweep', action = 'store_true', help='run over a range of network rates')
+    args = parser.parse_args()
+
+    def run(net):
+        p = (args.size, args.ratio, net * 1024, args.inflate * 1024, args.sector_ms / 1000, args.block_ms / 1000, args.page_ms / 1000, args.window)
+        sec = simulate(*p, preerase = False, pipeline = args.pipeline, inline_block = False)
+        blk = simulate(*p, preerase = False, pipeline = args.pipeline, inline_block = True)
+        pre = simulate(*p, preerase = True, pipeline = args.pipeline, inline_block = False, lead = args.lead)
+        print("%8.0f KiB/s  %8.2f s  %8.2f s  %8.2f s  %6.2f s (%4.1f%%)" % (net, sec, blk, pre, min(sec, blk) - pre, (min(sec, blk) - pre) / min(sec, blk) * 100))
+
+    print("image %d bytes, ratio %.2f, inflate %.0f KiB/s, %s" % (args.size, args.ratio, args.inflate, "pipelined" if args.pipeline else "single task"))
+    print("     network  sector erase   block erase     pre-erase     saved")
+    for net in ([50, 100, 150, 200, 400, 800, 1600] if args.sweep else [args.net]):
+        run(net)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,286 @@
+#!/usr/bin/python
+
+# ESP32-FlashZ flash window inflate simulator
+#
+# inflates a zlib/gzip image the way MapInflator (FlashZ::flashwindow()) does: output is collected in a small
+# write-combining buffer and written to "flash", back-references that reach past the buffer are read back from flash.
+# Flash is a file-backed mmap, reads go through a model of ESP32 flash cache (LRU of cache lines, whole cache
+# is invalidated on each flash write, like esp_partition_write() does on ESP32), so the number of cache misses
+# caused by history reads could be counted.
+#
+# The same image is inflated with a regular in-RAM dictionary, and both paths are compared:
+#  - host throughput of this decoder with history in RAM vs history in mmaped file
+#  - predicted throughput on target, RAM dictionary decode time is taken from fzopt.py model, flash window adds
+#    miss_us per cache line miss and byte_us per byte of history read from flash. Both paths are assumed
+#    to have the same symbol decode speed, only the history access cost differs
+#
+# usage: fzmapsim.py [-b buff_size] [--cache size] [--line size] [--miss-us us] [--byte-us us] [-m model] [-o flash.bin] stream [image]
+#
+# stream is a zlib/gzip image or a container with zlib/gzip payload (fzpack.py), if image is given, inflated data
+# is checked against it. With -o the simulated flash file is kept.
+
+import argparse, collections, mmap, os, struct, sys, tempfile, time, zlib
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import fzopt, fzpack
+
+# flash history read cost on target, us: per cache line miss, per byte
+FZ_MAP_MODEL = (1.2, 0.01)
+
+class FlashCache:
+    """ fully associative LRU approximation of flash cache """
+    def __init__(self, size, line, flush_all = True):
+        self.line = line
+        self.cap = size // line
+        self.flush_all = flush_all
+        self.lines = collections.OrderedDict()
+        self.hits = self.misses = 0
+
+    def read(self, off, n):
+        for l in range(off // self.line, (off + n - 1) // self.line + 1):
+            if l in self.lines:
+                self.lines.move_to_end(l)
+                self.hits += 1
+            else:
+                self.misses += 1
+                self.lines[l] = True
+                if len(self.lines) > self.cap:
+                    self.lines.popitem(last = False)
+
+    def write(self, off, n):
+        if self.flush_all:
+            self.lines.clear()
+            return
+        for l in range(off // self.line, (off + n - 1) // self.line + 1):
+            self.lines.pop(l, None)
+
+def deflate_start(stream):
+    """ offset of deflate data in zlib/gzip stream or container """
+    pos = 0
+    if stream[:4] == fzpack.FZ_CNT_MAGIC:
+        if stream[4] not in (fzpack.FZ_CODECS['zz'], fzpack.FZ_CODECS['gz']):
+            sys.exit("container payload is not zlib/gzip")
+        pos = 60 + 4 * struct.unpack_from('<H', stream, 6)[0]     # container header and segment index
+
+    if stream[pos:pos + 2] != b'\x1f\x8b':
+        if (stream[pos] & 0x0F) != 8 or ((stream[pos] << 8) | stream[pos + 1]) % 31:
+            sys.exit("not a zlib/gzip stream")
+        return pos + 2
+
+    # gzip header with optional fields
+    flags = stream[pos + 3]
+    pos += 10
+    if flags & 0x04:
+        pos += 2 + struct.unpack_from('<H', stream, pos)[0]
+    for f in (0x08, 0x10):
+        if flags & f:
+            pos = stream.index(b'\0', pos) + 1
+    if flags & 0x02:
+        pos += 2
+    return pos
+
+def lz_copy(buf, start, n):
+    """ append n bytes starting at buf[start], source could overlap destination """
+    d = len(buf) - start
+    if d >= n:
+        buf += buf[start:start + n]
+    else:
+        buf += (buf[start:] * (n // d + 1))[:n]
+
+def inflate(stream, pos, flash = None, buff_size = 4096, cache = None):
+    """
+    inflate raw deflate data, returns (output, stats)
+    with flash mmap given, only buff_size bytes of output are kept in RAM, the rest is written to flash and read back
+    """
+    st = dict(blocks = 0, literals = 0, matches = 0, out = 0, flash_matches = 0, flash_bytes = 0)
+    buf = bytearray()
+    base = 0                # image offset of buf, everything below is on flash
+    bits = nbits = 0
+
+    def get(n):
+        nonlocal bits, nbits, pos
+        while nbits < n:
+            bits |= stream[pos] << nbits
+            pos += 1
+            nbits += 8
+        v = bits & ((1 << n) - 1)
+        bits >>= n
+        nbits -= n
+        return v
+
+    def flush():
+        nonlocal base
+        while flash is not None and len(buf) >= buff_size:
+            flash[base:base + buff_size] = bytes(buf[:buff_size])
+            cache.write(base, buff_size)
+            del buf[:buff_size]
+            base += buff_size
+
+    final = 0
+    while not final:
+        final = get(1)
+        btype = get(2)
+        st['blocks'] += 1
+        if btype == 0:
+            pos -= nbits // 8
+            bits = nbits = 0
+            n, nn = struct.unpack_from('<HH', stream, pos)
+            if n != nn ^ 0xffff:
+                raise ValueError("stored block length mismatch")
+            buf += stream[pos + 4:pos + 4 + n]
+            pos += 4 + n
+            flush()
+            continue
+        if btype == 1:
+            lt, dt = fzopt.FIXED_LIT, fzopt.FIXED_DIST
+        elif btype == 2:
+            hlit, hdist, hclen = get(5) + 257, get(5) + 1, get(4) + 4
+            cl = [0] * 19
+            for i in range(hclen):
+                cl[fzopt.CL_ORDER[i]] = get(3)
+            ct, cn = fzopt.huff_table(cl)
+            lens = []
+            while len(lens) < hlit + hdist:
+                while nbits < cn:
+                    bits |= stream[pos] << nbits
+                    pos += 1
+                    nbits += 8
+                sym, l = ct[bits & ((1 << cn) - 1)]
+                bits >>= l
+                nbits -= l
+                if sym < 16:
+                    lens.append(sym)
+                elif sym == 16:
+                    lens += [lens[-1]] * (3 + get(2))
+                elif sym == 17:
+                    lens += [0] * (3 + get(3))
+                else:
+                    lens += [0] * (11 + get(7))
+            lt, dt = fzopt.huff_table(lens[:hlit]), fzopt.huff_table(lens[hlit:hlit + hdist])
+        else:
+            raise ValueError("invalid block type")
+
+        ltab, lmask = lt[0], (1 << lt[1]) - 1
+        dtab, dmask = dt[0], (1 << dt[1]) - 1
+        while True:
+            if nbits < 48:
+                while nbits < 56:
+                    bits |= (stream[pos] if pos < len(stream) else 0) << nbits
+                    pos += 1
+                    nbits += 8
+            sym, l = ltab[bits & lmask]
+            bits >>= l
+            nbits -= l
+            if sym < 256:
+                buf.append(sym)
+                st['literals'] += 1
+                if len(buf) >= buff_size:
+                    flush()
+                continue
+            if sym == 256:
+                break
+            sym -= 257
+            e = fzopt.LEN_EXTRA[sym]
+            length = fzopt.LEN_BASE[sym] + (bits & ((1 << e) - 1))
+            bits >>= e
+            nbits -= e
+            d, l = dtab[bits & dmask]
+            bits >>= l
+            nbits -= l
+            e = fzopt.DIST_EXTRA[d]
+            dist = fzopt.DIST_BASE[d] + (bits & ((1 << e) - 1))
+            bits >>= e
+            nbits -= e
+            st['matches'] += 1
+
+            frm = base + len(buf) - dist
+            if frm < 0:
+                raise ValueError("distance too far back")
+            if frm < base:
+                # history is on flash, the part up to buffer start is read back through flash cache
+                n = min(length, base - frm)
+                buf += flash[frm:frm + n]
+                cache.read(frm, n)
+                st['flash_matches'] += 1
+                st['flash_bytes'] += n
+                frm += n
+                length -= n
+            if length:
+                lz_copy(buf, frm - base, length)
+            if len(buf) >= buff_size:
+                flush()
+
+    # the rest of bit buffer is not deflate data
+    pos -= nbits // 8
+    if flash is not None and buf:
+        flash[base:base + len(buf)] = bytes(buf)
+        base += len(buf)
+        buf = bytearray()
+    st['out'] = base + len(buf)
+    st['in'] = pos
+    return buf, st
+
+def main():
+    parser = argparse.ArgumentParser(description='ESP32-FlashZ flash window inflate simulator')
+    parser.add_argument('stream', help='zlib/gzip compressed image or container')
+    parser.add_argument('image', nargs='?', help='original image to check inflated data against')
+    parser.add_argument('-b', '--buffer', type = int, default = 4096, help='write-combining buffer size, FZ_MAP_BUFF_SIZE')
+    parser.add_argument('--cache', type = int, default = 32768, help='flash cache size, bytes')
+    parser.add_argument('--line', type = int, default = 32, help='flash cache line size, bytes')
+    parser.add_argument('--range-flush', action = 'store_true', help='flash write invalidates only written lines, not the whole cache')
+    parser.add_argument('--miss-us', type = float, default = FZ_MAP_MODEL[0], help='cache line fill time on target, us')
+    parser.add_argument('--byte-us', type = float, default = FZ_MAP_MODEL[1], help='extra cost of a history byte read via cache, us')
+    parser.add_argument('-m', '--model', help='RAM dictionary decode model coefficients, us: byte,literal,match,block, see fzopt.py')
+    parser.add_argument('-o', '--output', help='keep simulated flash file')
+    args = parser.parse_args()
+
+    model = tuple(float(c) for c in args.model.split(',')) if args.model else fzopt.FZ_MODEL
+    if len(model) != len(fzopt.FZ_MODEL):
+        sys.exit("model takes %d coefficients" % len(fzopt.FZ_MODEL))
+
+    with open(args.stream, 'rb') as f:
+        stream = f.read()
+    pos = deflate_start(stream)
+
+    try:
+        t = time.perf_counter()
+        ram, st = inflate(stream, pos, buff_size = 1 << 62)
+        ram_s = time.perf_counter() - t
+    except (IndexError, ValueError) as e:
+        sys.exit("corrupted deflate stream: %s" % e)
+
+    if bytes(ram) != zlib.decompressobj(-15).decompress(stream[pos:]):
+        sys.exit("simulator output does not match zlib")
+    if args.image:
+        with open(args.image, 'rb') as f:
+            if f.read() != ram:
+                sys.exit("inflated data does not match image")
+
+    size = (len(ram) + args.buffer - 1) // args.buffer * args.buffer
+    out = open(args.output, 'w+b') if args.output else tempfile.TemporaryFile()
+    with out:
+        out.truncate(size)
+        with mmap.mmap(out.fileno(), size) as flash:
+            flash[:] = b'\xff' * size           # blank flash
+            cache = FlashCache(args.cache, args.line, not args.range_flush)
+            t = time.perf_counter()
+            _, fst = inflate(stream, pos, flash, args.buffer, cache)
+            flash_s = time.perf_counter() - t
+            if flash[:len(ram)] != ram:
+                sys.exit("flash window output does not match RAM dictionary output")
+        if args.output:
+            out.truncate(len(ram))
+
+    n = len(ram)
+    print("%s: %d -> %d bytes, %d blocks, %d literals, %d matches" % (args.stream, len(stream), n, st['blocks'], st['literals'], st['matches']))
+    print("buffer %d, cache %d/%d: %d matches (%.1f%%) read %d bytes (%.1f%% of output) from flash, %d cache misses, %d hits" % (
+          args.buffer, args.cache, args.line, fst['flash_matches'], 100.0 * fst['flash_matches'] / max(st['matches'], 1),
+          fst['flash_bytes'], 100.0 * fst['flash_bytes'] / max(n, 1), cache.misses, cache.hits))
+    print("host:   RAM dictionary %.2f MB/s, flash window %.2f MB/s, %+.1f%%" % (n / ram_s / 1e6, n / flash_s / 1e6, (ram_s / flash_s - 1) * 100))
+
+    ram_us = fzopt.decode_us(st, model)
+    flash_us = ram_us + cache.misses * args.miss_us + fst['flash_bytes'] * args.byte_us
+    print("target: RAM dictionary %.2f MB/s, flash window %.2f MB/s, %+.1f%% (predicted)" % (n / ram_us, n / flash_us, (ram_us / flash_us - 1) * 100))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,333 @@
+#!/usr/bin/python
+
+# ESP32-FlashZ image optimizer
+#
+# searches for the smallest zlib/gzip encoding of an image that still decodes fast on target.
+# Each candidate is walked by a built-in deflate parser that counts blocks, literals and matches, and decode time
+# on ESP32's ROM tinfl is predicted from these counts with a linear model
+#   t = out_bytes * byte_us + literals * lit_us + matches * match_us + blocks * block_us
+# Default coefficients are rough estimates for ESP32 at 240 MHz, they could be fitted to Inflator benchmark results
+# (examples/inflate-benchmark) of your board with --calibrate option.
+#
+# usage: fzopt.py [-f zz|gz] [-b block_size] [-c] [-s max_slowdown] [-m model] image.bin [output]
+#        fzopt.py --calibrate bench.csv data_dir
+#
+# Candidates are zlib levels/strategies and, if installed, zopfli (python 'zopfli' module or 'zopfli' CLI tool)
+# and 'pigz -11'. The smallest candidate which predicted decode time is no more than max_slowdown percent above
+# zlib level 9 is picked. Deflate window never exceeds 32k, so any candidate fits tinfl's dictionary.
+# With -b option image is split into independently decodable segments of block_size bytes (sector aligned flush
+# points), only zlib candidates could do that. Output is prefixed with container header with -c or -b, see fzpack.py
+#
+# It's a python script like the rest of tools, the encoders it runs are external, the host build in tests/host is
+# a test harness for the library and is not used to build tools. tests/host/test_fzopt.cpp flashes it's output
+# through the library's decoders.
+
+import argparse, csv, os, shutil, struct, subprocess, sys, tempfile, zlib
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import fzpack
+
+# decode time model coefficients, us: per output byte, literal, match, deflate block
+FZ_MODEL = (0.45, 0.3, 0.6, 200.0)
+
+# deflate length/distance codes, RFC1951
+LEN_BASE = [3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258]
+LEN_EXTRA = [0] * 8 + [1] * 4 + [2] * 4 + [3] * 4 + [4] * 4 + [5] * 4 + [0]
+DIST_BASE = [1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577]
+DIST_EXTRA = [0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13]
+CL_ORDER = [16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15]
+
+def huff_table(lengths):
+    """ decode table indexed by the next max_len bits of LSB-first stream, entries are (symbol, code length) """
+    max_len = max(lengths)
+    if not max_len:
+        return [None], 0
+    count = [0] * (max_len + 1)
+    for l in lengths:
+        if l:
+            count[l] += 1
+    code, next_code = 0, [0] * (max_len + 1)
+    for b in range(1, max_len + 1):
+        code = (code + count[b - 1]) << 1
+        next_code[b] = code
+    table = [None] * (1 << max_len)
+    for sym, l in enumerate(lengths):
+        if not l:
+            continue
+        rev = int(format(next_code[l], '0%db' % l)[::-1], 2)     # deflate codes are packed starting from MSB
+        next_code[l] += 1
+        for i in range(rev, 1 << max_len, 1 << l):
+            table[i] = (sym, l)
+    return table, max_len
+
+FIXED_LIT = huff_table([8] * 144 + [9] * 112 + [7] * 24 + [8] * 8)
+FIXED_DIST = huff_table([5] * 30)
+
+def deflate_stats(data, pos = 0):
+    """ walk raw deflate stream, returns a dict of it's stats: blocks, literals, matches, out and in bytes, max distance """
+    st = dict(blocks = 0, literals = 0, matches = 0, out = 0, max_dist = 0)
+    size = len(data)
+    bits = nbits = 0
+
+    def get(n):
+        nonlocal bits, nbits, pos
+        while nbits < n:
+            bits |= (data[pos] if pos < size else 0) << nbits
+            pos += 1
+            nbits += 8
+        v = bits & ((1 << n) - 1)
+        bits >>= n
+        nbits -= n
+        return v
+
+    def code(table):
+        nonlocal bits, nbits, pos
+        t, n = table
+        while nbits < n:
+            bits |= (data[pos] if pos < size else 0) << nbits
+            pos += 1
+            nbits += 8
+        sym, l = t[bits & ((1 << n) - 1)]
+        bits >>= l
+        nbits -= l
+        return sym
+
+    try:
+        final = 0
+        while not final:
+            final = get(1)
+            btype = get(2)
+            st['blocks'] += 1
+            if btype == 0:
+                # stored block, drop bits up to byte boundary
+                pos -= nbits // 8
+                bits = nbits = 0
+                n, nn = struct.unpack_from('<HH', data, pos)
+                if n != nn ^ 0xffff:
+                    raise ValueError
+                pos += 4 + n
+                st['out'] += n
+                continue
+            if btype == 1:
+                lt, dt = FIXED_LIT, FIXED_DIST
+            elif btype == 2:
+                hlit, hdist, hclen = get(5) + 257, get(5) + 1, get(4) + 4
+                cl = [0] * 19
+                for i in range(hclen):
+                    cl[CL_ORDER[i]] = get(3)
+                ct = huff_table(cl)
+                lens = []
+                while len(lens) < hlit + hdist:
+                    sym = code(ct)
+                    if sym < 16:
+                        lens.append(sym)
+                    elif sym == 16:
+                        lens += [lens[-1]] * (3 + get(2))
+                    elif sym == 17:
+                        lens += [0] * (3 + get(3))
+                    else:
+                        lens += [0] * (11 + get(7))
+                lt, dt = huff_table(lens[:hlit]), huff_table(lens[hlit:hlit + hdist])
+            else:
+                raise ValueError
+
+            # symbols loop, bit buffer is refilled once for a whole literal/length/distance sequence
+            ltab, lmask = lt[0], (1 << lt[1]) - 1
+            dtab, dmask = dt[0], (1 << dt[1]) - 1
+            lits = matches = out = 0
+            max_dist = st['max_dist']
+            while True:
+                if nbits < 48:
+                    while nbits < 56:
+                        bits |= (data[pos] if pos < size else 0) << nbits
+                        pos += 1
+                        nbits += 8
+                sym, l = ltab[bits & lmask]
+                bits >>= l
+                nbits -= l
+                if sym < 256:
+                    lits += 1
+                    continue
+                if sym == 256:
+                    break
+                sym -= 257
+                e = LEN_EXTRA[sym]
+                length = LEN_BASE[sym] + (bits & ((1 << e) - 1))
+                bits >>= e
+                nbits -= e
+                d, l = dtab[bits & dmask]
+                bits >>= l
+                nbits -= l
+                e = DIST_EXTRA[d]
+                dist = DIST_BASE[d] + (bits & ((1 << e) - 1))
+                bits >>= e
+                nbits -= e
+                matches += 1
+                out += length
+                if dist > max_dist:
+                    max_dist = dist
+            st['literals'] += lits
+            st['matches'] += matches
+            st['out'] += lits + out
+            st['max_dist'] = max_dist
+    except (TypeError, IndexError, ValueError, struct.error):
+        raise ValueError("corrupted deflate stream")
+
+    st['in'] = pos - nbits // 8
+    return st
+
+def decode_us(st, model):
+    return st['out'] * model[0] + st['literals'] * model[1] + st['matches'] * model[2] + st['blocks'] * model[3]
+
+def wrap(data, raw, fmt):
+    """ raw deflate data to zlib/gzip stream """
+    if fmt == 'gz':
+        return b'\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\xff' + raw + struct.pack('<II', zlib.crc32(data) & 0xffffffff, len(data) & 0xffffffff)
+    return b'\x78\xda' + raw + struct.pack('>I', zlib.adler32(data) & 0xffffffff)
+
+def stream_start(fmt):
+    """ offset of deflate data in zlib/gzip stream, w/o optional gzip header fields """
+    return 10 if fmt == 'gz' else 2
+
+def zopfli_raw(data, iterations):
+    try:
+        import zopfli
+        c = zopfli.ZopfliCompressor(zopfli.ZOPFLI_FORMAT_DEFLATE, iterations = iterations)
+        return c.compress(data) + c.flush()
+    except ImportError:
+        pass
+    if not shutil.which('zopfli'):
+        return None
+    with tempfile.TemporaryDirectory() as d:
+        f = os.path.join(d, 'image')
+        with open(f, 'wb') as img:
+            img.write(data)
+        return subprocess.run(['zopfli', '--deflate', '--i%d' % iterations, '-c', f], stdout = subprocess.PIPE, check = True).stdout
+
+def pigz_raw(data):
+    if not shutil.which('pigz'):
+        return None
+    z = subprocess.run(['pigz', '-11', '-z', '-c'], input = data, stdout = subprocess.PIPE, check = True).stdout
+    return z[2:-4]
+
+def candidates(data, fmt, block_size):
+    """ yields (name, stream, index) """
+    strategies = [('', zlib.Z_DEFAULT_STRATEGY), ('-filtered', zlib.Z_FILTERED)]
+    for level in (6, 9):
+        for sname, strategy in strategies:
+            name = 'zlib-%d%s' % (level, sname)
+            if block_size:
+                stream, index = fzpack.compress_segments(data, fmt, level, block_size, 9, strategy)
+                yield name, stream, index
+            else:
+                c = zlib.compressobj(level, zlib.DEFLATED, -15, 9, strategy)
+                yield name, wrap(data, c.compress(data) + c.flush(), fmt), []
+
+    if block_size:
+        return
+    for name, raw in (('zopfli-15', lambda: zopfli_raw(data, 15)), ('pigz-11', lambda: pigz_raw(data))):
+        r = raw()
+        if r is not None:
+            yield name, wrap(data, r, fmt), []
+
+def search(data, fmt, block_size, slowdown, model):
+    results = []
+    for name, stream, index in candidates(data, fmt, block_size):
+        st = deflate_stats(stream, stream_start(fmt))
+        if st['out'] != len(data) or st['max_dist'] > 32768:
+            sys.exit("%s: candidate does not decode to the image" % name)
+        results.append(dict(name = name, stream = stream, index = index, st = st, us = decode_us(st, model)))
+
+    base = next(r for r in results if r['name'] == 'zlib-9')
+    limit = base['us'] * (1 + slowdown / 100.0)
+    best = min((r for r in results if r['us'] <= limit), key = lambda r: (len(r['stream']), r['us']))
+    return results, best
+
+def calibrate(bench, data_dir):
+    """ fit model coefficients to Inflator benchmark 'block' mode results """
+    rows, y = [], []
+    with open(bench) as f:
+        for r in csv.reader(f):
+            if len(r) < 7 or r[1] != 'block' or r[2] != '4096' or r[3] != '32768':
+                continue
+            if not (r[0].endswith('.zz') or r[0].endswith('.fzc')):
+                continue
+            with open(os.path.join(data_dir, r[0]), 'rb') as img:
+                stream = img.read()
+            start = stream_start('zz')
+            if stream[:4] == fzpack.FZ_CNT_MAGIC:
+                if stream[4] not in (fzpack.FZ_CODECS['zz'], fzpack.FZ_CODECS['gz']):
+                    continue
+                # container header, 60 bytes, and segment index
+                blocks = struct.unpack_from('<H', stream, 6)[0]
+                start = 60 + 4 * blocks + stream_start('gz' if stream[4] == fzpack.FZ_CODECS['gz'] else 'zz')
+            st = deflate_stats(stream, start)
+            rows.append([st['out'], st['literals'], st['matches'], st['blocks']])
+            y.append(float(r[6]))
+
+    n = len(FZ_MODEL)
+    if len(rows) < n:
+        sys.exit("need at least %d benchmark results of zlib images, got %d" % (n, len(rows)))
+
+    # least squares via normal equations, solved with Gauss-Jordan elimination
+    a = [[sum(x[i] * x[j] for x in rows) for j in range(n)] + [sum(x[i] * v for x, v in zip(rows, y))] for i in range(n)]
+    for c in range(n):
+        p = max(range(c, n), key = lambda i: abs(a[i][c]))
+        if abs(a[p][c]) < 1e-9:
+            sys.exit("benchmark results are not diverse enough to fit the model, add more images")
+        a[c], a[p] = a[p], a[c]
+        for i in range(n):
+            if i != c:
+                k = a[i][c] / a[c][c]
+                a[i] = [u - k * v for u, v in zip(a[i], a[c])]
+    return [a[i][n] / a[i][i] for i in range(n)], len(rows)
+
+def main():
+    parser = argparse.ArgumentParser(description='ESP32-FlashZ image optimizer')
+    parser.add_argument('image', nargs='?', help='image file to compress')
+    parser.add_argument('output', nargs='?', help='output file, default is image file name with format suffix')
+    parser.add_argument('-f', '--format', choices = ['zz', 'gz'], default = 'zz', help='compression format')
+    parser.add_argument('-b', '--block', type = int, default = 0, help='segment size for indexed container, multiple of 4096')
+    parser.add_argument('-c', '--container', action = 'store_true', help='prefix output with container header')
+    parser.add_argument('-s', '--slowdown', type = float, default = 5, help='max predicted decode slowdown against zlib level 9, percent')
+    parser.add_argument('-m', '--model', help='decode model coefficients, us: byte,literal,match,block')
+    parser.add_argument('--calibrate', nargs = 2, metavar = ('BENCH_CSV', 'DATA_DIR'), help='fit decode model to Inflator benchmark results')
+    args = parser.parse_args()
+
+    if args.calibrate:
+        model, n = calibrate(*args.calibrate)
+        print("fitted to %d results, use: -m %s" % (n, ','.join('%.4g' % c for c in model)))
+        return
+
+    if not args.image:
+        parser.error("image file is required")
+    if args.block and args.block % 4096:
+        sys.exit("block size must be a multiple of 4096")
+
+    model = tuple(float(c) for c in args.model.split(',')) if args.model else FZ_MODEL
+    if len(model) != len(FZ_MODEL):
+        sys.exit("model takes %d coefficients" % len(FZ_MODEL))
+
+    with open(args.image, 'rb') as f:
+        data = f.read()
+    if args.block and (len(data) + args.block - 1) // args.block > fzpack.FZ_CNT_MAX_BLOCKS:
+        sys.exit("too many segments, max is %d, increase block size" % fzpack.FZ_CNT_MAX_BLOCKS)
+
+    results, best = search(data, args.format, args.block, args.slowdown, model)
+
+    print("%-20s %10s %7s %7s %9s %9s %10s %7s" % ('candidate', 'size', 'ratio', 'blocks', 'literals', 'matches', 'decode ms', 'MB/s'))
+    for r in results:
+        st = r['st']
+        print("%-20s %10d %6.1f%% %7d %9d %9d %10.1f %7.2f %s" % (r['name'], len(r['stream']), (1 - float(len(r['stream'])) / len(data)) * 100,
+              st['blocks'], st['literals'], st['matches'], r['us'] / 1000, len(data) / r['us'], '*' if r is best else ''))
+
+    out = best['stream']
+    if args.container or args.block:
+        out = fzpack.container(data, out, args.format, best['index'], args.block)
+    dst = args.output or '%s.%s' % (args.image, 'fzc' if args.container or args.block else args.format)
+    with open(dst, 'wb') as f:
+        f.write(out)
+    print("%s: %s, %d -> %d bytes" % (dst, best['name'], len(data), len(out)))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,93 @@
+#!/usr/bin/python
+
+# ESP32-FlashZ container packer
+#
+# compresses an image and prefixes it with a container header, so that FlashZ knows inflated image size
+# before any data is flashed, could reject oversized images and check image digest, see FlashZ::imagesize()
+#
+# usage: fzpack.py [-f zz|gz|lz4|hs] [-l level] [-b block_size] [-w bits] image.bin [output]
+#
+# With -b option zlib/gzip stream is built of independently decodable segments: deflate state is fully flushed
+# every block_size bytes of image, and an index of segment offsets is added to the header.
+# Images are compressed with fzcompress.py, signature trailer could be appended to the output with fzsign.py as usual.
+#
+# Container header format, all fields are little-endian:
+#   "FZC1" magic, u8 codec (1 - zlib, 2 - gzip, 3 - lz4, 4 - heatshrink), u8 flags (reserved, 0), u16 number of index entries,
+#   u32 image size, u32 payload size, u32 index block size (0 - no index), u32 crc32 of index,
+#   32 bytes SHA-256 of image, u32 crc32 of all the preceding header bytes
+#   index: u32 payload offset of each segment, segment i inflates to image offset i * block_size
+#   compressed payload
+
+import argparse, hashlib, os, struct, sys, zlib
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import fzcompress
+
+FZ_CNT_MAGIC = b'FZC1'
+FZ_CNT_MAX_BLOCKS = 512
+FZ_CODECS = {'zz': 1, 'gz': 2, 'lz4': 3, 'hs': 4}
+
+def compress_segments(data, fmt, level, block_size, mem_level = 8, strategy = zlib.Z_DEFAULT_STRATEGY, window_bits = 15):
+    """ deflate stream with a full flush every block_size bytes, returns payload and segment offsets """
+    c = zlib.compressobj(level, zlib.DEFLATED, 31 if fmt == 'gz' else window_bits, mem_level, strategy)
+    out = c.compress(b'')
+    index = []
+    for pos in range(0, len(data), block_size):
+        index.append(len(out) if pos else (10 if fmt == 'gz' else 2))      # stream header is emitted with the first data
+        out += c.compress(data[pos:pos + block_size])
+        out += c.flush(zlib.Z_FULL_FLUSH if pos + block_size < len(data) else zlib.Z_FINISH)
+
+    # each segment must inflate on it's own
+    for i, off in enumerate(index):
+        seg = zlib.decompressobj(-15).decompress(out[off:], block_size)
+        if seg != data[i * block_size:(i + 1) * block_size]:
+            sys.exit("segment %d can't be decoded independently" % i)
+    return out, index
+
+def container(data, payload, fmt, index = [], block_size = 0):
+    """ prefix compressed payload with container header and segment index """
+    idx = b''.join(struct.pack('<I', off) for off in index)
+    hdr = FZ_CNT_MAGIC + struct.pack('<BBHIIII', FZ_CODECS[fmt], 0, len(index), len(data), len(payload), block_size if index else 0, zlib.crc32(idx) & 0xffffffff)
+    hdr += hashlib.sha256(data).digest()
+    hdr += struct.pack('<I', zlib.crc32(hdr) & 0xffffffff)
+    return hdr + idx + payload
+
+def pack(data, fmt, level = 9, block_size = 0, window_bits = None, lookahead_bits = 4):
+    index = []
+    if block_size:
+        payload, index = compress_segments(data, fmt, level, block_size, window_bits = window_bits or 15)
+    else:
+        payload = fzcompress.compress(data, fmt, level, window_bits, lookahead_bits)
+
+    return container(data, payload, fmt, index, block_size), len(index)
+
+def main():
+    parser = argparse.ArgumentParser(description='ESP32-FlashZ container packer')
+    parser.add_argument('image', help='image file to compress')
+    parser.add_argument('output', nargs='?', help='output file, default is image file name with .fzc suffix')
+    parser.add_argument('-f', '--format', choices = ['zz', 'gz', 'lz4', 'hs'], default = 'zz', help='compression format')
+    parser.add_argument('-l', '--level', type = int, default = 9, help='compression level for zlib/gzip/lz4')
+    parser.add_argument('-b', '--block', type = int, default = 0, help='segment size for indexed zlib/gzip stream, multiple of 4096')
+    parser.add_argument('-w', '--window', type = int, help='window size bits, zlib 9..15 (default 15), heatshrink 4..15 (default 11)')
+    parser.add_argument('-k', '--lookahead', type = int, default = 4, help='heatshrink lookahead size bits, 3..window-1')
+    args = parser.parse_args()
+
+    if args.block and (args.format not in ('zz', 'gz') or args.block % 4096):
+        sys.exit("segment index requires zlib/gzip format and a block size multiple of 4096")
+    fzcompress.check_window(args.format, args.window, args.lookahead)
+
+    with open(args.image, 'rb') as f:
+        data = f.read()
+
+    if args.block and (len(data) + args.block - 1) // args.block > FZ_CNT_MAX_BLOCKS:
+        sys.exit("too many segments, max is %d, increase block size" % FZ_CNT_MAX_BLOCKS)
+
+    out, blocks = pack(data, args.format, args.level, args.block, args.window, args.lookahead)
+    dst = args.output or '%s.fzc' % args.image
+    with open(dst, 'wb') as f:
+        f.write(out)
+
+    print("%s: %s, %d -> %d bytes, ratio %.1f%%, %d segments" % (dst, args.format, len(data), len(out), (1 - float(len(out)) / len(data)) * 100, blocks))
+
+if __name__ == '__main__':
+    main()
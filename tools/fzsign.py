@@ -0,0 +1,55 @@
+#!/usr/bin/python
+
+# ESP32-FlashZ image signer
+#
+# appends a signature trailer to a compressed image (or delta patch), so that FlashZ could verify
+# inflated image before switching boot partition, see FlashZ::verify() and FlashZ::verifykey()
+#
+# usage: fzsign.py [-k private_key.pem] image.bin compressed_image [output]
+#
+# image.bin is the uncompressed image that compressed data inflates to (for delta patches - the new firmware image).
+# Trailer carries SHA-256 digest of image.bin and, if private key is given, it's signature made with
+# 'openssl' CLI tool: ECDSA (DER encoded) or RSA PKCS#1 v1.5, depending on key type.
+#
+# Trailer format, all fields are little-endian:
+#   "FZS1" magic, u16 signature length, u16 flags (reserved, 0), 32 bytes SHA-256 of image, signature
+#
+# Public key for the device could be extracted with
+#   openssl pkey -in private_key.pem -pubout -out public_key.pem
+
+import argparse, hashlib, struct, subprocess, sys
+
+FZ_TRAILER_MAGIC = b'FZS1'
+FZ_SIG_MAX_LEN = 512
+
+def sign(data, keyfile):
+    return subprocess.run(['openssl', 'dgst', '-sha256', '-sign', keyfile], input = data, stdout = subprocess.PIPE, check = True).stdout
+
+def trailer(image, keyfile = None):
+    sig = sign(image, keyfile) if keyfile else b''
+    if len(sig) > FZ_SIG_MAX_LEN:
+        sys.exit("signature is too long: %d bytes" % len(sig))
+    return FZ_TRAILER_MAGIC + struct.pack('<HH', len(sig), 0) + hashlib.sha256(image).digest() + sig
+
+def main():
+    parser = argparse.ArgumentParser(description='ESP32-FlashZ image signer')
+    parser.add_argument('image', help='uncompressed image')
+    parser.add_argument('compressed', help='compressed image or delta patch')
+    parser.add_argument('output', nargs='?', help='output file, default is to append trailer to compressed image')
+    parser.add_argument('-k', '--key', help='private key file (PEM) to sign image with, only digest is added if omitted')
+    args = parser.parse_args()
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+    with open(args.compressed, 'rb') as f:
+        data = f.read()
+
+    t = trailer(image, args.key)
+    dst = args.output or args.compressed
+    with open(dst, 'wb') as f:
+        f.write(data + t)
+
+    print("%s: sha256 %s, %s" % (dst, hashlib.sha256(image).hexdigest(), "signature %d bytes" % (len(t) - 40) if args.key else "not signed"))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,115 @@
+#!/usr/bin/python
+
+# ESP32-FlashZ AsyncWebServer upload simulator
+#
+# models file upload over AsyncWebServer with data inflated and flashed right in the upload callback (async_tcp task)
+# against upload worker, see FlashZhttp::upload_worker(). Sender is limited by TCP receive window, each segment
+# takes a window slot until receiver acks it. In callback mode segment is acked once callback returns, so async_tcp
+# is blocked for inflate/flash time and every other connection waits. With upload worker callback only copies data
+# to the ring, segment is acked on arrival if the ring has room for a window of data, otherwise it's ACK is held. Held ACKs
+# are sent by the next segment's callback once the ring has room, or by connection's poll hook if window has been closed.
+# Worker fires the poll hook as soon as it has drained the ring, it takes a trip via lwip and async_tcp task queues.
+# Upload reply is sent by the poll hook too, worker fires it once it has finished, if the last segment arrived earlier.
+# Consumer (inflate + flash) runs at fixed throughput of compressed input, plus 64K block erase each time writer
+# crosses block boundary.
+#
+# Reports total upload time, share of time async_tcp is busy with the upload, the longest async_tcp stall
+# on one segment and max ring fill. Ring fill above ring size means async_tcp has to wait for the worker.
+#
+# usage: fzuploadsim.py [-s image_size] [-r ratio] [-n net_kbps] [-c consumer_kbps] [-w window] [--ring size] [--kick-ms ms] [--sweep]
+
+import argparse
+
+BLOCK = 65536
+
+def simulate(size, ratio, net, deco, t_block, window, mss, rtt, cb, ring, kick, worker):
+    """ returns (total time s, async_tcp busy share, max async_tcp stall s, max ring fill bytes) """
+    csize = int(size * ratio)
+    n = (csize + mss - 1) // mss
+    win = max(2, window // mss)     # segments in flight
+
+    def consume(i):
+        """ inflate/flash time of segment i, includes block erase if it's output crosses block boundary """
+        b0 = int(i * mss / ratio) // BLOCK
+        b1 = int(min((i + 1) * mss, csize) / ratio) // BLOCK
+        return mss / deco + (b1 - b0 + (1 if not i else 0)) * t_block
+
+    upd = []                        # window update for segment i reaches sender at, None while it's ACK is held
+    done = []                       # worker is done with segment i at
+    held = []                       # segments with held ACKs
+    link = tcp = wrk = 0.0
+    busy = stall = 0.0
+    fill = 0
+
+    def queued(t):
+        """ ring fill at time t """
+        return sum(1 for d in done if d > t) * mss
+
+    for i in range(n):
+        k = i - win
+        if k >= 0 and upd[k] is None:
+            # window is closed by held ACKs, worker fires the poll hook once the ring has room for a window
+            t = next((d for d in done if d >= tcp and ring - queued(d) >= window), tcp) + kick
+            for j in held:
+                upd[j] = t + rtt / 2
+            held = []
+
+        link = max(link, upd[k] if k >= 0 else 0) + mss / net
+        start = max(link + rtt / 2, tcp)
+
+        if not worker:
+            tcp = start + cb + consume(i)
+            upd.append(tcp + rtt / 2)
+            busy += tcp - start
+            stall = max(stall, tcp - start)
+            continue
+
+        tcp = start + cb
+        busy += cb
+        stall = max(stall, cb)
+        wrk = max(wrk, tcp) + consume(i)
+        done.append(wrk)
+        fill = max(fill, queued(tcp))
+
+        held.append(i)
+        upd.append(None)
+        if ring - queued(tcp) >= window:
+            for j in held:
+                upd[j] = tcp + rtt / 2
+            held = []
+
+    # reply is sent by the poll hook, if worker is still busy when the last segment arrives
+    total = tcp if not worker or wrk <= tcp else wrk + kick
+    return total, busy / total, stall, fill
+
+def main():
+    parser = argparse.ArgumentParser(description='ESP32-FlashZ AsyncWebServer upload simulator')
+    parser.add_argument('-s', '--size', type = int, default = 1572864, help='inflated image size, bytes')
+    parser.add_argument('-r', '--ratio', type = float, default = 0.55, help='compressed/inflated size ratio')
+    parser.add_argument('-n', '--net', type = float, default = 400, help='network throughput, KiB/s')
+    parser.add_argument('-c', '--consumer', type = float, default = 300, help='inflate and flash throughput, KiB/s of compressed input')
+    parser.add_argument('--block-ms', type = float, default = 150, help='64K block erase time, ms')
+    parser.add_argument('-w', '--window', type = int, default = 5744, help='TCP receive window, bytes')
+    parser.add_argument('--mss', type = int, default = 1436, help='TCP segment size, bytes')
+    parser.add_argument('--rtt', type = float, default = 5, help='round trip time, ms')
+    parser.add_argument('--cb-us', type = float, default = 30, help='upload callback time w/o inflate, us')
+    parser.add_argument('--ring', type = int, default = 16384, help='upload ring size, FZ_UPLOAD_RING_SIZE')
+    parser.add_argument('--kick-ms', type = float, default = 1, help='latency of poll hook fired by worker, ms')
+    parser.add_argument('--sweep', action = 'store_true', help='run over a range of network/consumer speed ratios')
+    args = parser.parse_args()
+
+    def run(net):
+        p = (args.size, args.ratio, net * 1024, args.consumer * 1024, args.block_ms / 1000, args.window, args.mss, args.rtt / 1000, args.cb_us / 1e6, args.ring, args.kick_ms / 1000)
+        cb = simulate(*p, worker = False)
+        wk = simulate(*p, worker = True)
+        print("%8.0f KiB/s %5.2f  %7.2f s %5.1f%% %7.1f ms   %7.2f s %5.1f%% %7.2f ms %6d%s" % (net, net / args.consumer,
+              cb[0], cb[1] * 100, cb[2] * 1000, wk[0], wk[1] * 100, wk[2] * 1000, wk[3], " ring overflow" if wk[3] > args.ring else ""))
+
+    print("image %d bytes, ratio %.2f, consumer %.0f KiB/s, window %d, ring %d" % (args.size, args.ratio, args.consumer, args.window, args.ring))
+    print("                      |       upload callback       |            upload worker")
+    print("     network  ratio   |    time  busy     stall     |    time  busy     stall   ring")
+    for net in ([args.consumer * r for r in (0.25, 0.5, 1, 2, 4, 8)] if args.sweep else [args.net]):
+        run(net)
+
+if __name__ == '__main__':
+    main()